@@ -0,0 +1,255 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "image.h"
+
+
+#define BLOCK_CACHE_MIN     64              //  Slots for any block size
+#define BLOCK_NONE          -1
+
+#ifndef err_exit
+#define err_exit(msg)    do {                    \
+                             perror(msg);        \
+                             exit(EXIT_FAILURE); \
+                         } while (0)
+#endif
+
+
+//  Cached block. Pinned slots are out of LRU list, so they are never
+//  evicted; data of a slot being loaded is not ready yet. A slot whose
+//  read failed is out of the hash and is reused when unpinned.
+struct cache_slot {
+    unsigned long block;
+    int pins;
+    int loading;
+    int failed;
+    int cold;                               //  File data, evicted first
+    int prev;
+    int next;
+    int hash_next;
+};
+
+
+//  Blocks of one size at base + block * block_size of the image, shared
+//  by all readers of a filesystem: FAT clusters, ext2 blocks. Mapped
+//  images are not cached, their blocks are read in the mapping.
+struct block_cache {
+    struct image *img;
+    off_t base;
+    unsigned block_size;
+
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;
+    struct cache_slot *slots;
+    int *hash;
+    unsigned char *data;                    //  Slot i holds data[i * block_size]
+    int count;
+    int hash_size;
+    int used;
+    int lru_head;
+    int lru_tail;
+
+    unsigned long hits;
+    unsigned long misses;
+};
+
+
+static inline void block_cache_init(struct block_cache *cache, struct image *img, off_t base,
+                                    unsigned block_size, size_t budget) {
+    memset(cache, 0, sizeof(struct block_cache));
+    cache->img = img;
+    cache->base = base;
+    cache->block_size = block_size;
+    if(img->map)
+        return;
+
+    cache->count = budget / block_size;
+    if(cache->count < BLOCK_CACHE_MIN)
+        cache->count = BLOCK_CACHE_MIN;
+
+    cache->hash_size = 2 * cache->count;
+    cache->slots = (struct cache_slot *)calloc(cache->count, sizeof(struct cache_slot));
+    cache->hash = (int *)malloc(cache->hash_size * sizeof(int));
+    cache->data = (unsigned char *)image_alloc(img, (size_t)cache->count * block_size);
+    if(!cache->slots || !cache->hash)
+        err_exit("Can't allocate memory for block cache");
+
+    for(int i = 0; i < cache->hash_size; ++i)
+        cache->hash[i] = BLOCK_NONE;
+
+    cache->lru_head = BLOCK_NONE;
+    cache->lru_tail = BLOCK_NONE;
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->loaded, NULL);
+}
+
+
+static inline void block_cache_fini(struct block_cache *cache) {
+    if(!cache->slots)
+        return;
+
+    free(cache->slots);
+    free(cache->hash);
+    free(cache->data);
+    cache->slots = NULL;
+    pthread_cond_destroy(&cache->loaded);
+    pthread_mutex_destroy(&cache->lock);
+}
+
+
+static inline void block_lru_unlink(struct block_cache *cache, int slot) {
+    struct cache_slot *entry = &cache->slots[slot];
+    if(entry->prev != BLOCK_NONE)
+        cache->slots[entry->prev].next = entry->next;
+    else
+        cache->lru_head = entry->next;
+
+    if(entry->next != BLOCK_NONE)
+        cache->slots[entry->next].prev = entry->prev;
+    else
+        cache->lru_tail = entry->prev;
+}
+
+
+//  Cold slots go to the tail, so file data is evicted before metadata
+static inline void block_lru_push(struct block_cache *cache, int slot) {
+    struct cache_slot *entry = &cache->slots[slot];
+    if(entry->cold) {
+        entry->next = BLOCK_NONE;
+        entry->prev = cache->lru_tail;
+        if(cache->lru_tail != BLOCK_NONE)
+            cache->slots[cache->lru_tail].next = slot;
+        else
+            cache->lru_head = slot;
+        cache->lru_tail = slot;
+        return;
+    }
+
+    entry->prev = BLOCK_NONE;
+    entry->next = cache->lru_head;
+    if(cache->lru_head != BLOCK_NONE)
+        cache->slots[cache->lru_head].prev = slot;
+    else
+        cache->lru_tail = slot;
+    cache->lru_head = slot;
+}
+
+
+static inline void block_hash_remove(struct block_cache *cache, int slot) {
+    int *link = &cache->hash[cache->slots[slot].block % cache->hash_size];
+    while(*link != slot)
+        link = &cache->slots[*link].hash_next;
+
+    *link = cache->slots[slot].hash_next;
+}
+
+
+//  Returns data of the block and pins it until block_unpin(*slot), NULL
+//  with errno if it can't be read. Block is read without the lock, other
+//  threads wait for it on loaded. Cold blocks are file data, which is
+//  rarely read twice.
+static inline void *block_pin(struct block_cache *cache, unsigned long block, int cold, int *slot) {
+    off_t offset = cache->base + (off_t)block * cache->block_size;
+    *slot = BLOCK_NONE;
+    if(cache->img->map)
+        return image_get(cache->img, NULL, cache->block_size, offset);
+
+    pthread_mutex_lock(&cache->lock);
+    int found = cache->hash[block % cache->hash_size];
+    while(found != BLOCK_NONE && cache->slots[found].block != block)
+        found = cache->slots[found].hash_next;
+
+    if(found != BLOCK_NONE) {
+        struct cache_slot *entry = &cache->slots[found];
+        cache->hits++;
+        if(!entry->pins++)
+            block_lru_unlink(cache, found);
+        entry->cold &= cold;
+
+        while(entry->loading)
+            pthread_cond_wait(&cache->loaded, &cache->lock);
+
+        if(entry->failed) {
+            if(!--entry->pins)
+                block_lru_push(cache, found);
+            pthread_mutex_unlock(&cache->lock);
+            errno = EIO;
+            return NULL;
+        }
+        pthread_mutex_unlock(&cache->lock);
+
+        *slot = found;
+        return cache->data + (size_t)found * cache->block_size;
+    }
+
+    cache->misses++;
+    if(cache->used < cache->count)
+        found = cache->used++;
+    else if(cache->lru_tail != BLOCK_NONE) {
+        found = cache->lru_tail;
+        block_lru_unlink(cache, found);
+        if(!cache->slots[found].failed)
+            block_hash_remove(cache, found);
+    } else {
+        pthread_mutex_unlock(&cache->lock);
+        errno = ENOBUFS;                    //  All cached blocks are pinned
+        return NULL;
+    }
+
+    struct cache_slot *entry = &cache->slots[found];
+    entry->block = block;
+    entry->pins = 1;
+    entry->loading = 1;
+    entry->failed = 0;
+    entry->cold = cold;
+    entry->hash_next = cache->hash[block % cache->hash_size];
+    cache->hash[block % cache->hash_size] = found;
+    pthread_mutex_unlock(&cache->lock);
+
+    unsigned char *data = cache->data + (size_t)found * cache->block_size;
+    int failed = image_pread(cache->img, data, cache->block_size, offset) != (ssize_t)cache->block_size;
+
+    pthread_mutex_lock(&cache->lock);
+    entry->loading = 0;
+    pthread_cond_broadcast(&cache->loaded);
+    if(failed) {
+        //  Cold, so the slot is taken again first
+        entry->failed = 1;
+        entry->cold = 1;
+        block_hash_remove(cache, found);
+        if(!--entry->pins)
+            block_lru_push(cache, found);
+        pthread_mutex_unlock(&cache->lock);
+        errno = EIO;
+        return NULL;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    *slot = found;
+    return data;
+}
+
+
+static inline void block_unpin(struct block_cache *cache, int slot) {
+    if(slot == BLOCK_NONE)
+        return;
+
+    pthread_mutex_lock(&cache->lock);
+    if(!--cache->slots[slot].pins)
+        block_lru_push(cache, slot);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+
+static inline double cache_hit_rate(unsigned long hits, unsigned long misses) {
+    return hits + misses ? 100.0 * hits / (hits + misses) : 0.0;
+}
+
+#endif  //  CACHE_H
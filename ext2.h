@@ -0,0 +1,394 @@
+#ifndef EXT2_H
+#define EXT2_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <ext2fs/ext2_fs.h>
+
+#include "image.h"
+#include "cache.h"
+
+
+#define SUPERBLOCK_OFFSET   1024
+#define EXT2_CACHE_BUDGET   (4 * 1024 * 1024)   //  Bytes of cached metadata blocks
+#define EXT2_S_IFMT         0xF000
+#define EXT2_S_IFDIR        0x4000
+#define EXT2_S_IFREG        0x8000
+#define EXT2_S_IFLNK        0xA000
+#define EXT2_MODE_BITS      07777
+#define FAST_SYMLINK_MAX    (EXT2_N_BLOCKS * sizeof(__u32))  //  Target is kept in i_block
+#define DENTRY_HEADER       8               //  Directory entry without its name
+#define EXT2_NO_BLOCK       0xFFFFFFFFu     //  Pointer block can't be read
+
+#ifndef err_exit
+#define err_exit(msg)    do {                    \
+                             perror(msg);        \
+                             exit(EXIT_FAILURE); \
+                         } while (0)
+#endif
+
+
+struct ext2_info {
+    struct image *img;
+
+    // It is superblock number
+    // Really first data block = first_data_block + 1
+    unsigned first_data_block;
+
+    unsigned inodes_per_group;
+    unsigned inodes_count;
+    unsigned blocks_count;
+    unsigned inode_size;
+    unsigned block_size;
+    unsigned ptrs_per_block;
+
+    //  Group descriptors, bitmaps, inode tables, indirect and directory
+    //  blocks; file data is read past it
+    struct block_cache blocks;
+};
+
+
+//  Entries of one directory. Returned entry stays valid until the next
+//  call, its block is pinned.
+struct ext2_dir_iter {
+    struct ext2_info *info;
+    struct ext2_inode inode;
+    off_t size;
+    off_t offset;                           //  Of the next entry
+    int slot;
+    unsigned char *data;                    //  Block holding offset
+};
+
+
+//  Superblock fields the reader divides by, shifts by or steps through
+//  blocks with. Inodes are at least the revision 0 size and tile blocks.
+static inline int ext2_super_ok(struct ext2_super_block *SB) {
+    if(SB->s_magic != EXT2_SUPER_MAGIC || !SB->s_inodes_per_group || SB->s_log_block_size > 6)
+        return 0;
+
+    unsigned block_size = 1 << (SB->s_log_block_size + 10);
+    unsigned inode_size = SB->s_rev_level ? SB->s_inode_size : sizeof(struct ext2_inode);
+    return inode_size >= sizeof(struct ext2_inode) && !(inode_size & (inode_size - 1)) && inode_size <= block_size;
+}
+
+
+//  Checks the superblock without failing, so other filesystems can be tried
+static inline int ext2_probe(struct image *img) {
+    struct ext2_super_block SB;
+    if(image_pread(img, &SB, sizeof(struct ext2_super_block), SUPERBLOCK_OFFSET) != sizeof(struct ext2_super_block))
+        return 0;
+
+    return ext2_super_ok(&SB);
+}
+
+
+//  Returns NULL with EIO if the superblock can't be read, with EINVAL if
+//  it is wrong
+static inline struct ext2_info *ext2_get_info(struct image *img) {
+    struct ext2_super_block SB;
+    ssize_t ret = image_pread(img, &SB, sizeof(struct ext2_super_block), SUPERBLOCK_OFFSET);
+    if(ret != sizeof(struct ext2_super_block)) {
+        if(ret != -1)
+            errno = EIO;
+        return NULL;
+    }
+
+    if(!ext2_super_ok(&SB)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct ext2_info *info = (struct ext2_info *)calloc(1, sizeof(struct ext2_info));
+    if(!info)
+        err_exit("Can't allocate memory for filesystem info");
+
+    info->img               = img;
+    info->first_data_block  = SB.s_first_data_block;
+    info->inodes_per_group  = SB.s_inodes_per_group;
+    info->inodes_count      = SB.s_inodes_count;
+    info->blocks_count      = SB.s_blocks_count;
+    info->inode_size        = SB.s_rev_level ? SB.s_inode_size : sizeof(struct ext2_inode);
+    info->block_size        = 1 << (SB.s_log_block_size + 10);
+    info->ptrs_per_block    = info->block_size / sizeof(__u32);
+
+    block_cache_init(&info->blocks, img, 0, info->block_size, EXT2_CACHE_BUDGET);
+    return info;
+}
+
+
+static inline void ext2_free_info(struct ext2_info *info) {
+    block_cache_fini(&info->blocks);
+    free(info);
+}
+
+
+//  Copies len bytes at offset of the block through the cache. Returns 0
+//  with EIO for blocks out of the filesystem and ranges out of the block.
+static inline int ext2_read_block(struct ext2_info *info, unsigned block, unsigned offset, void *buf, size_t len) {
+    if(!block || block >= info->blocks_count || offset > info->block_size || len > info->block_size - offset) {
+        errno = EIO;
+        return 0;
+    }
+
+    int slot;
+    unsigned char *data = (unsigned char *)block_pin(&info->blocks, block, 0, &slot);
+    if(!data)
+        return 0;
+
+    memcpy(buf, data + offset, len);
+    block_unpin(&info->blocks, slot);
+    return 1;
+}
+
+
+//  Copies the inode, so it stays valid while other inodes are read.
+//  Returns 0 with ENOENT for numbers out of range and free inodes, with
+//  EIO if its blocks can't be read.
+static inline int ext2_read_inode(struct ext2_info *info, unsigned inode_number, struct ext2_inode *inode) {
+    if(inode_number == 0 || inode_number > info->inodes_count) {
+        errno = ENOENT;
+        return 0;
+    }
+
+    //  Descriptors of all groups are one table after the superblock,
+    //  block numbers in them are absolute
+    unsigned inumb_base_0 = inode_number - 1;
+    unsigned group = inumb_base_0 / info->inodes_per_group;
+    off_t gdesc_offset = (off_t)group * sizeof(struct ext2_group_desc);
+    struct ext2_group_desc gdesc;
+    if(!ext2_read_block(info, info->first_data_block + 1 + gdesc_offset / info->block_size,
+                        gdesc_offset % info->block_size, &gdesc, sizeof(struct ext2_group_desc)))
+        return 0;
+
+    //  Only the byte holding inode bit is needed
+    unsigned inode_in_group = inumb_base_0 % info->inodes_per_group;
+    unsigned char bitmap_byte;
+    if(!ext2_read_block(info, gdesc.bg_inode_bitmap + inode_in_group / CHAR_BIT / info->block_size,
+                        inode_in_group / CHAR_BIT % info->block_size, &bitmap_byte, 1))
+        return 0;
+
+    if(!(bitmap_byte & (1 << (inode_in_group % CHAR_BIT)))) {
+        errno = ENOENT;
+        return 0;
+    }
+
+    off_t inode_offset = (off_t)inode_in_group * info->inode_size;
+    if(!ext2_read_block(info, gdesc.bg_inode_table + inode_offset / info->block_size,
+                        inode_offset % info->block_size, inode, sizeof(struct ext2_inode)))
+        return 0;
+
+    return 1;
+}
+
+
+static inline off_t ext2_inode_size(struct ext2_inode *inode) {
+    if((inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFREG)
+        return inode->i_size | (off_t)inode->i_size_high << 32;
+
+    return inode->i_size;
+}
+
+
+//  EXT2_NO_BLOCK with errno if the pointer block can't be read
+static inline unsigned read_ptr_from_block(struct ext2_info *info, unsigned block_number, unsigned ptr_idx) {
+    __u32 ptr;
+    if(!ext2_read_block(info, block_number, ptr_idx * sizeof(__u32), &ptr, sizeof(__u32)))
+        return EXT2_NO_BLOCK;
+
+    return ptr;
+}
+
+
+//  Returns number of idx block of the inode, 0 for holes and blocks
+//  past the last level of indirection. EXT2_NO_BLOCK is past any block
+//  count, so callers checking against blocks_count see read errors too.
+static inline unsigned ext2_get_block(struct ext2_info *info, struct ext2_inode *inode, unsigned long idx) {
+    unsigned long ppb = info->ptrs_per_block;
+    if(idx < EXT2_NDIR_BLOCKS)
+        return inode->i_block[idx];
+
+    idx -= EXT2_NDIR_BLOCKS;
+    if(idx < ppb) {
+        unsigned ind = inode->i_block[EXT2_IND_BLOCK];
+        return ind ? read_ptr_from_block(info, ind, idx) : 0;
+    }
+
+    idx -= ppb;
+    if(idx < ppb * ppb) {
+        unsigned dind = inode->i_block[EXT2_DIND_BLOCK];
+        unsigned ptr1 = dind ? read_ptr_from_block(info, dind, idx / ppb) : 0;
+        if(ptr1 == EXT2_NO_BLOCK)
+            return EXT2_NO_BLOCK;
+        return ptr1 ? read_ptr_from_block(info, ptr1, idx % ppb) : 0;
+    }
+
+    idx -= ppb * ppb;
+    if(idx / ppb / ppb < ppb) {
+        unsigned tind = inode->i_block[EXT2_TIND_BLOCK];
+        unsigned ptr1 = tind ? read_ptr_from_block(info, tind, idx / ppb / ppb) : 0;
+        if(ptr1 == EXT2_NO_BLOCK)
+            return EXT2_NO_BLOCK;
+        unsigned ptr2 = ptr1 ? read_ptr_from_block(info, ptr1, idx / ppb % ppb) : 0;
+        if(ptr2 == EXT2_NO_BLOCK)
+            return EXT2_NO_BLOCK;
+        return ptr2 ? read_ptr_from_block(info, ptr2, idx % ppb) : 0;
+    }
+
+    return 0;
+}
+
+
+//  Reads up to len bytes of the file at offset like pread. Holes read as
+//  zeroes, adjacent blocks are read at once past the block cache.
+static inline ssize_t ext2_pread(struct ext2_info *info, struct ext2_inode *inode, void *buf, size_t len, off_t offset) {
+    off_t size = ext2_inode_size(inode);
+    if(offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(offset >= size)
+        return 0;
+    if(len > (size_t)(size - offset))
+        len = size - offset;
+
+    unsigned char *out = (unsigned char *)buf;
+    if((inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFLNK && size < (off_t)FAST_SYMLINK_MAX && !inode->i_blocks) {
+        memcpy(out, (unsigned char *)inode->i_block + offset, len);
+        return len;
+    }
+
+    size_t done = 0;
+    while(done < len) {
+        unsigned long idx = (offset + done) / info->block_size;
+        size_t in_block = (offset + done) % info->block_size;
+        unsigned first = ext2_get_block(info, inode, idx);
+
+        //  Extend the run while next blocks follow the last one on disk
+        size_t run = info->block_size - in_block;
+        unsigned last = first;
+        while(first && done + run < len && ext2_get_block(info, inode, idx + 1) == last + 1) {
+            run += info->block_size;
+            idx++;
+            last++;
+        }
+        if(run > len - done)
+            run = len - done;
+
+        if(!first)
+            memset(out + done, 0, run);
+        else if(last >= info->blocks_count ||
+                image_pread(info->img, out + done, run, (off_t)first * info->block_size + in_block) != (ssize_t)run) {
+            errno = EIO;
+            break;
+        }
+        done += run;
+    }
+
+    return done ? (ssize_t)done : -1;
+}
+
+
+static inline struct ext2_dir_iter *ext2_open_dir(struct ext2_info *info, unsigned inode_number) {
+    struct ext2_dir_iter *dir = (struct ext2_dir_iter *)calloc(1, sizeof(struct ext2_dir_iter));
+    if(!dir)
+        err_exit("Can't allocate memory for dir iterator");
+
+    if(!ext2_read_inode(info, inode_number, &dir->inode)) {
+        free(dir);
+        return NULL;
+    }
+
+    if((dir->inode.i_mode & EXT2_S_IFMT) != EXT2_S_IFDIR) {
+        free(dir);
+        errno = ENOTDIR;
+        return NULL;
+    }
+
+    dir->info = info;
+    dir->size = ext2_inode_size(&dir->inode);
+    dir->slot = BLOCK_NONE;
+    return dir;
+}
+
+
+//  Skips unused entries. Entries never cross block boundary, so an entry
+//  that does ends the directory.
+static inline struct ext2_dir_entry_2 *ext2_next_dentry(struct ext2_dir_iter *dir) {
+    struct ext2_info *info = dir->info;
+
+    while(dir->offset < dir->size) {
+        unsigned block_offset = dir->offset % info->block_size;
+        if(block_offset == 0) {
+            block_unpin(&info->blocks, dir->slot);
+            dir->slot = BLOCK_NONE;
+
+            unsigned block = ext2_get_block(info, &dir->inode, dir->offset / info->block_size);
+            if(!block || block >= info->blocks_count)
+                return NULL;
+            dir->data = (unsigned char *)block_pin(&info->blocks, block, 0, &dir->slot);
+            if(!dir->data)
+                return NULL;
+        }
+
+        struct ext2_dir_entry_2 *dentry = (struct ext2_dir_entry_2 *)(dir->data + block_offset);
+        if(dentry->rec_len < DENTRY_HEADER || block_offset + dentry->rec_len > info->block_size ||
+           DENTRY_HEADER + dentry->name_len > dentry->rec_len)
+            return NULL;
+
+        dir->offset += dentry->rec_len;
+        if(dentry->inode)
+            return dentry;
+    }
+
+    return NULL;
+}
+
+
+static inline void ext2_close_dir(struct ext2_dir_iter *dir) {
+    block_unpin(&dir->info->blocks, dir->slot);
+    free(dir);
+}
+
+
+//  Returns inode number of the name in the directory, 0 if there is none
+static inline unsigned ext2_lookup(struct ext2_info *info, unsigned dir_inode, const char *name, size_t len) {
+    struct ext2_dir_iter *dir = ext2_open_dir(info, dir_inode);
+    if(!dir)
+        return 0;
+
+    //  Names are not null terminated on disk (and in mapped image)
+    unsigned found = 0;
+    struct ext2_dir_entry_2 *dentry;
+    while((dentry = ext2_next_dentry(dir)))
+        if(dentry->name_len == len && !memcmp(dentry->name, name, len)) {
+            found = dentry->inode;
+            break;
+        }
+
+    ext2_close_dir(dir);
+    return found;
+}
+
+
+//  Path is taken from the root, empty components of "/" and trailing
+//  slashes are skipped. Returns 0 if there is no such path.
+static inline unsigned ext2_lookup_path(struct ext2_info *info, const char *path) {
+    unsigned inode_number = EXT2_ROOT_INO;
+    while(*path && inode_number) {
+        size_t len = strcspn(path, "/");
+        if(len)
+            inode_number = ext2_lookup(info, inode_number, path, len);
+
+        path += len;
+        path += *path == '/';
+    }
+
+    return inode_number;
+}
+
+#endif  //  EXT2_H
@@ -1,395 +1,220 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
-#include <ext2fs/ext2_fs.h>
-
-
-#define EXT_FILEPATH "../../ext2_img"
-
-#define SUPERBLOCK_OFFSET   1024
-#define FIRST_BYTE_MASK     0xFF
-#define EXT2_S_IFDIR        0x4000
-#define BPB                 8               //  Bits per byte
-
-
-#define err_exit(msg)    do {                    \
-                             perror(msg);        \
-                             exit(EXIT_FAILURE); \
-                         } while (0)
-
-
-struct fs_info {
-    int fd;
-
-    // It is superblock number
-    // Really first data block = first_data_block + 1
-    unsigned first_data_block;
+#include <limits.h>
+#include <stdint.h>
 
-    unsigned inodes_per_group;
-    unsigned inodes_count;
-    unsigned inode_size;
-    unsigned block_size;
-    unsigned group_size;
-};
+#include "ext2.h"
+#include "extract.h"
 
 
-struct block_iter {
-    struct fs_info *info;
-    struct ext2_inode *inode;
-    void *curr_block_data;
-    unsigned next_block_idx;
-};
-
-
-struct dentry_iter {
-    struct block_iter *biter;
-    struct ext2_dir_entry_2 *curr_dentry;   //  Current dir entry (dentry)
-    unsigned dir_size;                      //  Dir size in bytes (for stopping)
-    unsigned curr_offset;                   //  Current offset in dir (in bytes)
-};
-
+#define EXT_FILEPATH "../../ext2_img"
+#define WORD_BITS 64
 
-struct block_iter *block_iter_init(struct ext2_inode *inode, struct fs_info *info);
-void block_iter_fini(struct block_iter *biter);
-void *get_next_block(struct block_iter *biter);
-unsigned read_ptr_from_block(unsigned block_number, unsigned ptr_idx, struct fs_info *info);
-struct dentry_iter *dentry_iter_init(struct ext2_inode *inode, struct fs_info *info);
-void dentry_iter_fini(struct dentry_iter *diter);
-struct ext2_dir_entry_2 *get_next_dentry(struct dentry_iter *diter);
 
-struct fs_info *get_fs_info(int fd);
-void free_fs_info(struct fs_info *info);
-void print_directory_by_inode_number(unsigned inode_number, struct fs_info *info);
-struct ext2_inode *get_inode_by_number(unsigned inode_number, struct fs_info *info);
+void print_directory_by_path(char *path, struct ext2_info *info);
+void print_directory_by_inode_number(unsigned inode_number, struct ext2_info *info);
 
-void print_directory_by_path(char *path, struct fs_info *info);
-unsigned get_inode_number_by_name(unsigned base_inode_number, char *name, struct fs_info *info);
-unsigned get_inode_number_by_path(char *path, struct fs_info *info);
+unsigned long extract_directory_by_path(char *path, const char *dest, int threads, struct ext2_info *info);
+void extract_tree(unsigned inode_number, const char *path, struct extract_list *list, uint64_t *visited,
+                  struct ext2_info *info);
 
 char *read_path();
-char *get_curr_dir(char *path);
-char *cut_path(char *path);
 
 
-int main(void)
+//  With -x DEST the directory is extracted into DEST instead of printing
+int main(int argc, char *argv[])
 {
-    int ext_fd = open(EXT_FILEPATH, O_RDONLY);
-    if(ext_fd == -1)
+    char *dest = NULL;
+    int threads = EXTRACT_THREADS;
+
+    int opt;
+    while((opt = getopt(argc, argv, "x:j:")) != -1) {
+        if(opt == 'x')
+            dest = optarg;
+        else if(opt == 'j')
+            threads = atoi(optarg);
+        else {
+            fprintf(stderr, "Usage: %s [-x DEST [-j THREADS]]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    struct image *img = image_open(EXT_FILEPATH, get_image_mode());
+    if(!img)
         err_exit("Can't open ext2 image file");
 
-    struct fs_info *info = get_fs_info(ext_fd);
+    struct ext2_info *info = ext2_get_info(img);
+    if(!info)
+        err_exit("Can't read ext2 superblock");
+    image_advise(img, 0, 0, IMAGE_RANDOM);
 
     char *path = read_path();
 
-    //print_directory_by_inode_number(14, info);
-    print_directory_by_path(path, info);
-    close(ext_fd);
-
-    return 0;
-}
-
-
-void print_directory_by_path(char *path, struct fs_info *info) {
-    unsigned inode_number = get_inode_number_by_path(path, info);
-    print_directory_by_inode_number(inode_number, info);
-}
-
+    unsigned long errors = 0;
+    if(dest)
+        errors = extract_directory_by_path(path, dest, threads, info);
+    else
+        print_directory_by_path(path, info);
 
-unsigned get_inode_number_by_path(char *path, struct fs_info *info) {
-    unsigned curr_inode_number = get_inode_number_by_name(EXT2_ROOT_INO,
-                                                          get_curr_dir(path),
-                                                          info);
-    path = cut_path(path);
-    while(path && curr_inode_number != 0) {
-        curr_inode_number = get_inode_number_by_name(curr_inode_number,
-                                                     get_curr_dir(path),
-                                                     info);
-        path = cut_path(path);
-    }
+    free(path);
+    ext2_free_info(info);
+    image_close(img);
 
-    return curr_inode_number;
+    return errors ? EXIT_FAILURE : 0;
 }
 
 
-unsigned get_inode_number_by_name(unsigned base_inode_number, char *name, struct fs_info *info) {
-    struct ext2_inode *base_inode = get_inode_by_number(base_inode_number, info);
-    struct dentry_iter *diter = dentry_iter_init(base_inode, info);
-
-    struct ext2_dir_entry_2 *curr_dentry = get_next_dentry(diter);
-    while(curr_dentry && curr_dentry->inode != 0) {
-        if(strcmp(curr_dentry->name, name) == 0) {
-            unsigned inode = curr_dentry->inode;
-            dentry_iter_fini(diter);
-            return inode;
-        }
-
-        curr_dentry = get_next_dentry(diter);
-    }
-
-    dentry_iter_fini(diter);
-    return 0;
+void print_directory_by_path(char *path, struct ext2_info *info) {
+    unsigned inode_number = ext2_lookup_path(info, path);
+    print_directory_by_inode_number(inode_number, info);
 }
 
 
-void print_directory_by_inode_number(unsigned inode_number, struct fs_info *info) {
-    struct ext2_inode *dir_inode = get_inode_by_number(inode_number, info);
-    if(!dir_inode)
-        err_exit("Can't get inode");
-
-    if(!(dir_inode->i_mode & EXT2_S_IFDIR))
+void print_directory_by_inode_number(unsigned inode_number, struct ext2_info *info) {
+    struct ext2_dir_iter *dir = ext2_open_dir(info, inode_number);
+    if(!dir)
         err_exit("It is not a directory");
 
-    struct dentry_iter *diter = dentry_iter_init(dir_inode, info);
-    struct ext2_dir_entry_2 *curr_dentry = get_next_dentry(diter);
+    struct ext2_dir_entry_2 *curr_dentry;
     printf("(inode #%d)\n", inode_number);
-    while(curr_dentry && curr_dentry->inode != 0) {
-        printf("%s\n", curr_dentry->name);
-        curr_dentry = get_next_dentry(diter);
-    }
-}
-
-
-struct ext2_inode *get_inode_by_number(unsigned inode_number, struct fs_info *info) {
-    if(inode_number >= info->inodes_count)  //  Inode by this number can't exist
-        return NULL;
-
-    unsigned inumb_base_0 = inode_number - 1;
-    unsigned zero_group_offset = (info->first_data_block + 1) * info->block_size;
-    unsigned group_offset = (inumb_base_0 / info->inodes_per_group) * info->group_size;
-    struct ext2_group_desc *gdesc = (struct ext2_group_desc *)calloc(1, sizeof(struct ext2_group_desc));
-    if(!gdesc)
-        err_exit("Can't allocate memory for group description");
-
-    if(pread(info->fd, gdesc, sizeof(struct ext2_group_desc), group_offset + zero_group_offset) == -1)
-        err_exit("Can't read group description");
-
-    unsigned inode_bitmap_offset = group_offset + gdesc->bg_inode_bitmap * info->block_size;
-    char *inode_bitmap = (char *)calloc(info->inodes_count / sizeof(char), sizeof(char));
-    if(pread(info->fd, inode_bitmap, info->inodes_count / BPB, inode_bitmap_offset) == -1)
-        err_exit("Can't read inode bitmap");
+    while((curr_dentry = ext2_next_dentry(dir)))
+        printf("%.*s\n", curr_dentry->name_len, curr_dentry->name);
 
-    if(!(inode_bitmap[inumb_base_0 / BPB] & (1 << (inumb_base_0 % BPB))))
-        return NULL;
-
-    unsigned inode_table_offset = group_offset + gdesc->bg_inode_table * info->block_size;
-    unsigned inode_offset = inode_table_offset + (inumb_base_0 % info->inodes_per_group) * info->inode_size;
-
-    struct ext2_inode *inode = (struct ext2_inode *)calloc(1, sizeof(struct ext2_inode));
-    if(!inode)
-        err_exit("Can't allocate memory for inode");
-
-    if(pread(info->fd, inode, sizeof(struct ext2_inode), inode_offset) == -1)
-        err_exit("Can't read inode");
-
-    return inode;
+    ext2_close_dir(dir);
 }
 
 
-struct fs_info *get_fs_info(int fd) {
-    struct ext2_super_block SB;
-    if(pread(fd, &SB, sizeof(struct ext2_super_block), SUPERBLOCK_OFFSET) == -1)
-        err_exit("Can't read super block");
-
-    struct fs_info *info = (struct fs_info *)calloc(1, sizeof(struct fs_info));
-    if(!info)
-        err_exit("Can't allocate memory for filesystem info");
-
-    info->fd                = fd;
-    info->first_data_block  = SB.s_first_data_block;
-    info->inodes_per_group  = SB.s_inodes_per_group;
-    info->inodes_count      = SB.s_inodes_count;
-    info->inode_size        = SB.s_inode_size;
-    info->block_size        = 1 << (SB.s_log_block_size + 10);
-    info->group_size        = info->block_size * SB.s_blocks_per_group;
-
-    return info;
-}
-
+unsigned long extract_directory_by_path(char *path, const char *dest, int threads, struct ext2_info *info) {
+    unsigned inode_number = ext2_lookup_path(info, path);
+    if(inode_number == 0)
+        err_exit("Can't find inode by this path");
 
-void free_fs_info(struct fs_info *info) {
-    
-}
+    if(mkdir(dest, 0755) == -1 && errno != EEXIST)
+        err_exit("Can't create destination directory");
 
+    //  Directory inodes already extracted, a hard linked directory is not
+    //  extracted twice and a looped one not forever
+    uint64_t *visited = (uint64_t *)calloc(info->inodes_count / WORD_BITS + 1, sizeof(uint64_t));
+    if(!visited)
+        err_exit("Can't allocate memory for inode bitmap");
+    visited[inode_number / WORD_BITS] |= (uint64_t)1 << inode_number % WORD_BITS;
 
-struct block_iter *block_iter_init(struct ext2_inode *inode, struct fs_info *info) {
-    struct block_iter *biter = (struct block_iter *)calloc(1, sizeof(struct block_iter));
-    if(!biter)
-        err_exit("Can't allocate memory for block iterator");
+    struct extract_list list;
+    extract_init(&list, info->img);
+    extract_tree(inode_number, dest, &list, visited, info);
 
-    biter->info = info;
-    biter->inode = inode;
-    biter->curr_block_data = calloc(1, info->block_size);
-    biter->next_block_idx = 0;
+    unsigned long errors = extract_run_jobs(&list, threads);
+    printf("%zu files, %zu directories, %lld bytes, %lu errors\n",
+           list.file_count, list.dir_count, (long long)list.bytes, errors);
 
-    return biter;
+    extract_fini(&list);
+    free(visited);
+    return errors;
 }
 
 
-void block_iter_fini(struct block_iter *biter) {    
-    biter->next_block_idx = 0;
-    free(biter->curr_block_data);    
-    free(biter);    
-}
-
+void extract_symlink(struct ext2_inode *inode, const char *path, struct extract_list *list, struct ext2_info *info) {
+    char target[PATH_MAX];
+    size_t len = inode->i_size;
 
-void *get_next_block(struct block_iter *biter) {
-    struct fs_info *info = biter->info;
-    struct ext2_inode *inode = biter->inode;
-    unsigned next_block = biter->next_block_idx;
-
-    if(next_block >= inode->i_blocks)
-        return NULL;
-
-    unsigned block_offset = 0;
-    unsigned ppb = info->block_size / sizeof(unsigned); //  Pointers per block
-    if(next_block < EXT2_NDIR_BLOCKS) {
-        block_offset = inode->i_block[next_block] * info->block_size;
-
-    //  It needs to be changed
-    } else if(next_block < EXT2_NDIR_BLOCKS + ppb) {
-        if(!inode->i_block[EXT2_IND_BLOCK])
-            err_exit("Bad pointer to indirect blocks");
-
-        unsigned ptr1 = read_ptr_from_block(inode->i_block[EXT2_IND_BLOCK],
-                                            next_block - EXT2_IND_BLOCK,
-                                            info);
-        if(!ptr1)
-            err_exit("Bad pointer in indirect pointers");
-
-        block_offset = ptr1 * info->block_size;
-    } else if(next_block < EXT2_NDIR_BLOCKS + ppb + ppb * ppb) {
-        if(!inode->i_block[EXT2_DIND_BLOCK])
-            err_exit("Bad pointer to double indirect blocks");
-
-        unsigned ptr1 = read_ptr_from_block(inode->i_block[EXT2_DIND_BLOCK],
-                                            (next_block - EXT2_IND_BLOCK - ppb) / ppb,
-                                            info);
-        if(!ptr1)
-            err_exit("Bad pointer in the first level of double indirect pointers");
-
-        unsigned ptr2 = read_ptr_from_block(ptr1,
-                                            (next_block - EXT2_IND_BLOCK - ppb) % ppb,
-                                            info);
-        if(!ptr2)
-            err_exit("Bad pointer in the second level of double indirect pointers");
-
-        block_offset = ptr2 * info->block_size;
-    } else if(next_block < EXT2_NDIR_BLOCKS + ppb + ppb * ppb + ppb * ppb * ppb) {
-        if(!inode->i_block[EXT2_TIND_BLOCK])
-            err_exit("Bad pointer to triple indirect blocks");
-
-        unsigned ptr1 = read_ptr_from_block(inode->i_block[EXT2_TIND_BLOCK],
-                                            (next_block - EXT2_IND_BLOCK - ppb - ppb * ppb) / (ppb * ppb),
-                                            info);
-        if(!ptr1)
-            err_exit("Bad pointer in the first level of triple indirect pointers");
-
-        unsigned ptr2 = read_ptr_from_block(ptr1,
-                                            (next_block - EXT2_IND_BLOCK - ppb - ppb * ppb) % (ppb * ppb),
-                                            info);
-        if(!ptr2)
-            err_exit("Bad pointer in the second level of triple indirect pointers");
-
-        unsigned ptr3 = read_ptr_from_block(ptr2,
-                                            (next_block - EXT2_IND_BLOCK - ppb - ppb * ppb) % ppb,
-                                            info);
-        if(!ptr3)
-            err_exit("Bad pointer in the third level of triple indirect pointers");
-
-
-        block_offset = ptr3 * info->block_size;
-    } else {
-        return NULL;
+    //  A cut target would point somewhere else
+    if(len >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        extract_error(list, path, "Can't extract symlink");
+        return;
     }
 
-    if(pread(info->fd, biter->curr_block_data, info->block_size, block_offset) == -1)
-        err_exit("Can't read next block");
-
-    biter->next_block_idx++;
-
-    return biter->curr_block_data;
-}
-
-
-unsigned read_ptr_from_block(unsigned block_number,
-                             unsigned ptr_idx, struct fs_info *info) {
-    unsigned *ptrs = (unsigned *)calloc(info->block_size / sizeof(unsigned),
-                                        sizeof(unsigned));
-
-    if(pread(info->fd, ptrs, info->block_size, block_number * info->block_size) == -1)
-        err_exit("Can't read ptr from block");
-
-    unsigned ptr = ptrs[ptr_idx];
-    free(ptrs);
-    return ptr;
-}
-
-
-struct dentry_iter *dentry_iter_init(struct ext2_inode *inode, struct fs_info *info) {
-    struct block_iter *biter = block_iter_init(inode, info);
-    struct dentry_iter *diter = (struct dentry_iter *)calloc(1, sizeof(struct dentry_iter));
-    if(!diter)
-        err_exit("Can't allocate memory for dentry iterator");
-
-    diter->biter = biter;
-    diter->curr_dentry = (struct ext2_dir_entry_2 *)calloc(1, sizeof(struct ext2_dir_entry_2));
-    diter->dir_size = biter->inode->i_size;
-    diter->curr_offset = 0;
-
-    return diter;
-}
-
+    if(ext2_pread(info, inode, target, len, 0) != (ssize_t)len) {
+        extract_error(list, path, "Can't read symlink");
+        return;
+    }
 
-void dentry_iter_fini(struct dentry_iter *diter) {
-    block_iter_fini(diter->biter);
-    diter->curr_offset = 0;
-    free(diter->curr_dentry);
-    free(diter);
+    target[len] = '\0';
+    extract_add_link(list, path, target);
 }
 
 
-struct ext2_dir_entry_2 *get_next_dentry(struct dentry_iter *diter) {
-    if(diter->curr_offset >= diter->dir_size)
-        return NULL;
-
-    if(diter->curr_offset >= diter->biter->info->block_size ||
-       diter->curr_offset == 0) {
-        if(!get_next_block(diter->biter))
-            return NULL;
+//  Creates directories at once and queues files with their blocks. Holes
+//  get no runs and stay holes in the output file.
+void extract_tree(unsigned inode_number, const char *path, struct extract_list *list, uint64_t *visited,
+                  struct ext2_info *info) {
+    struct ext2_dir_iter *dir = ext2_open_dir(info, inode_number);
+    if(!dir) {
+        extract_error(list, path, "Can't read directory for");
+        return;
     }
 
-    diter->curr_dentry = (struct ext2_dir_entry_2 *)(diter->biter->curr_block_data + diter->curr_offset);
-    diter->curr_offset += diter->curr_dentry->rec_len;
-
-    return diter->curr_dentry;
-}
-
-
-char *get_curr_dir(char *path) {
-    int i = 1;
-    while(path[i] != '/' && path[i] != '\0')
-        i++;
+    struct ext2_dir_entry_2 *curr_dentry;
+    while((curr_dentry = ext2_next_dentry(dir))) {
+        if((curr_dentry->name_len == 1 && curr_dentry->name[0] == '.') ||
+           (curr_dentry->name_len == 2 && !strncmp(curr_dentry->name, "..", 2)))
+            continue;
 
-    char *curr_dir_name = (char *)calloc(i + 1, sizeof(char));
-    strncpy(curr_dir_name, &path[1], i - 1);
-    curr_dir_name[i] = '\0';
+        if(!extract_name_ok(curr_dentry->name, curr_dentry->name_len)) {
+            errno = EINVAL;
+            extract_error(list, path, "Can't extract entry of");
+            continue;
+        }
 
-    return curr_dir_name;
-}
+        char child_path[PATH_MAX];
+        if(snprintf(child_path, sizeof(child_path), "%s/%.*s", path,
+                    curr_dentry->name_len, curr_dentry->name) >= (int)sizeof(child_path)) {
+            errno = ENAMETOOLONG;
+            extract_error(list, path, "Can't extract entry of");
+            continue;
+        }
 
-char *cut_path(char *path) {
-    int i = 1;
-    while(path[i] != '/' && path[i] != '\0')
-        i++;
+        struct ext2_inode inode;
+        unsigned child = curr_dentry->inode;
+        if(!ext2_read_inode(info, child, &inode)) {
+            extract_error(list, child_path, "Can't read inode of");
+            continue;
+        }
 
-    if(path[i] == '\0')
-        return NULL;
+        mode_t mode = inode.i_mode & EXT2_MODE_BITS;
+        unsigned type = inode.i_mode & EXT2_S_IFMT;
+        if(type == EXT2_S_IFDIR) {
+            uint64_t bit = (uint64_t)1 << child % WORD_BITS;
+            if(visited[child / WORD_BITS] & bit) {
+                fprintf(stderr, "%s is a directory extracted already, skipped\n", child_path);
+                list->errors++;
+                continue;
+            }
+
+            visited[child / WORD_BITS] |= bit;
+            if(extract_add_dir(list, child_path, mode, inode.i_atime, inode.i_mtime) == 0)
+                extract_tree(child, child_path, list, visited, info);
+        } else if(type == EXT2_S_IFREG) {
+            off_t size = ext2_inode_size(&inode);
+            extract_add_file(list, child_path, size, mode, inode.i_atime, inode.i_mtime);
+
+            off_t blocks = (size + info->block_size - 1) / info->block_size;
+            for(off_t idx = 0; idx < blocks; ++idx) {
+                unsigned block = ext2_get_block(info, &inode, idx);
+                off_t done = idx * info->block_size;
+                if(block >= info->blocks_count) {
+                    errno = EIO;
+                    extract_error(list, child_path, "Can't map blocks of");
+                    break;
+                }
+                if(block)
+                    extract_add_run(list, (off_t)block * info->block_size, done,
+                                    size - done < info->block_size ? size - done : info->block_size);
+            }
+        } else if(type == EXT2_S_IFLNK) {
+            extract_symlink(&inode, child_path, list, info);
+        } else {
+            fprintf(stderr, "Skipping special file %s\n", child_path);
+        }
+    }
 
-    strcpy(path, &path[i]);
-    return path;
+    ext2_close_dir(dir);
 }
 
 
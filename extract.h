@@ -0,0 +1,368 @@
+#ifndef EXTRACT_H
+#define EXTRACT_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE                         //  copy_file_range
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "image.h"
+
+
+#define EXTRACT_THREADS     4
+#define EXTRACT_MAX_THREADS 64
+#define EXTRACT_CHUNK       (1024 * 1024)   //  Copy size without copy_file_range
+#define EXTRACT_INIT        64
+
+
+//  Bytes of the image that make part of an output file
+struct extract_run {
+    off_t src;
+    off_t dst;
+    off_t len;
+};
+
+
+//  File, directory or symlink to restore. Files are written by workers,
+//  directories are created at once and get their times at the end,
+//  symlinks are created after all files.
+struct extract_job {
+    char *path;
+    char *target;                           //  Of a symlink
+    off_t size;
+    mode_t mode;
+    struct timespec times[2];               //  Access and modification
+    size_t first_run;
+    size_t runs;
+};
+
+
+struct extract_list {
+    struct image *img;
+
+    struct extract_job *files;
+    size_t file_count;
+    size_t file_cap;
+
+    struct extract_job *dirs;               //  Parents come before children
+    size_t dir_count;
+    size_t dir_cap;
+
+    struct extract_job *links;
+    size_t link_count;
+    size_t link_cap;
+
+    struct extract_run *runs;
+    size_t run_count;
+    size_t run_cap;
+
+    size_t next;                            //  Next file for workers
+    unsigned long errors;
+    off_t bytes;
+    int no_copy_range;                      //  Kernel or filesystems can't do it, atomic
+};
+
+
+static inline void extract_init(struct extract_list *list, struct image *img) {
+    memset(list, 0, sizeof(struct extract_list));
+    list->img = img;
+    //  Direct images would fill the page cache, memory images are copied from memory
+    list->no_copy_range = img->direct_fd != -1 || img->mode == IMAGE_MEMORY;
+}
+
+
+static inline void extract_fini(struct extract_list *list) {
+    for(size_t i = 0; i < list->file_count; ++i)
+        free(list->files[i].path);
+    for(size_t i = 0; i < list->dir_count; ++i)
+        free(list->dirs[i].path);
+    for(size_t i = 0; i < list->link_count; ++i) {
+        free(list->links[i].path);
+        free(list->links[i].target);
+    }
+
+    free(list->files);
+    free(list->dirs);
+    free(list->links);
+    free(list->runs);
+}
+
+
+static inline void extract_error(struct extract_list *list, const char *path, const char *what) {
+    __atomic_add_fetch(&list->errors, 1, __ATOMIC_RELAXED);
+    fprintf(stderr, "%s %s: %s\n", what, path, strerror(errno));
+}
+
+
+static inline struct extract_job *extract_new_job(struct extract_job **jobs, size_t *count, size_t *cap,
+                                                  const char *path, mode_t mode, time_t atime, time_t mtime) {
+    if(*count == *cap) {
+        *cap = *cap ? *cap * 2 : EXTRACT_INIT;
+        *jobs = (struct extract_job *)realloc(*jobs, *cap * sizeof(struct extract_job));
+        if(!*jobs)
+            err_exit("Can't allocate memory for extract jobs");
+    }
+
+    struct extract_job *job = &(*jobs)[(*count)++];
+    memset(job, 0, sizeof(struct extract_job));
+    job->path = strdup(path);
+    if(!job->path)
+        err_exit("Can't allocate memory for extract path");
+
+    job->mode = mode;
+    job->times[0].tv_sec = atime;
+    job->times[1].tv_sec = mtime;
+    return job;
+}
+
+
+//  Names come from the image: one with '/' or NUL, "." or ".." would put
+//  the entry out of its directory
+static inline int extract_name_ok(const char *name, size_t len) {
+    if(!len || memchr(name, '/', len) || memchr(name, '\0', len))
+        return 0;
+
+    return !(len == 1 && name[0] == '.') && !(len == 2 && name[0] == '.' && name[1] == '.');
+}
+
+
+//  Directory that is there already is used only if it is not a symlink
+static inline int extract_is_dir(const char *path) {
+    struct stat st;
+    if(lstat(path, &st) == -1)
+        return 0;
+
+    if(!S_ISDIR(st.st_mode)) {
+        errno = EEXIST;
+        return 0;
+    }
+    return 1;
+}
+
+
+//  Creates the directory now, so files can be added under it. Returns -1
+//  if it can't, then nothing may be extracted under it.
+static inline int extract_add_dir(struct extract_list *list, const char *path, mode_t mode, time_t atime, time_t mtime) {
+    if(mkdir(path, 0700) == -1 && (errno != EEXIST || !extract_is_dir(path))) {
+        extract_error(list, path, "Can't create directory");
+        return -1;
+    }
+
+    extract_new_job(&list->dirs, &list->dir_count, &list->dir_cap, path, mode, atime, mtime);
+    return 0;
+}
+
+
+static inline void extract_add_link(struct extract_list *list, const char *path, const char *target) {
+    struct extract_job *job = extract_new_job(&list->links, &list->link_count, &list->link_cap, path, 0, 0, 0);
+    job->target = strdup(target);
+    if(!job->target)
+        err_exit("Can't allocate memory for symlink target");
+}
+
+
+//  Runs of the file are added with extract_add_run right after it
+static inline void extract_add_file(struct extract_list *list, const char *path, off_t size, mode_t mode,
+                                    time_t atime, time_t mtime) {
+    struct extract_job *job = extract_new_job(&list->files, &list->file_count, &list->file_cap,
+                                              path, mode, atime, mtime);
+    job->size = size;
+    job->first_run = list->run_count;
+}
+
+
+//  Adjacent runs are merged, so a contiguous file is copied at once
+static inline void extract_add_run(struct extract_list *list, off_t src, off_t dst, off_t len) {
+    struct extract_job *job = &list->files[list->file_count - 1];
+    if(job->runs) {
+        struct extract_run *last = &list->runs[list->run_count - 1];
+        if(last->src + last->len == src && last->dst + last->len == dst) {
+            last->len += len;
+            return;
+        }
+    }
+
+    if(list->run_count == list->run_cap) {
+        list->run_cap = list->run_cap ? list->run_cap * 2 : EXTRACT_INIT;
+        list->runs = (struct extract_run *)realloc(list->runs, list->run_cap * sizeof(struct extract_run));
+        if(!list->runs)
+            err_exit("Can't allocate memory for extract runs");
+    }
+
+    struct extract_run *run = &list->runs[list->run_count++];
+    run->src = src;
+    run->dst = dst;
+    run->len = len;
+    job->runs++;
+}
+
+
+static struct extract_list *sort_list;
+
+
+//  Files are written in order of their first byte in the image, so
+//  workers read the image mostly forward. Empty files go first.
+static inline int extract_cmp(const void *a, const void *b) {
+    const struct extract_job *x = (const struct extract_job *)a;
+    const struct extract_job *y = (const struct extract_job *)b;
+    off_t xs = x->runs ? sort_list->runs[x->first_run].src : -1;
+    off_t ys = y->runs ? sort_list->runs[y->first_run].src : -1;
+    return (xs > ys) - (xs < ys);
+}
+
+
+//  copy_file_range keeps data in the kernel; pread and pwrite are used
+//  when it is not supported for these files
+static inline int extract_copy(struct extract_list *list, int fd, struct extract_run *run, void **buffer) {
+    off_t src = run->src;
+    off_t dst = run->dst;
+    off_t left = run->len;
+
+    while(left && !__atomic_load_n(&list->no_copy_range, __ATOMIC_RELAXED)) {
+        ssize_t ret = copy_file_range(list->img->fd, &src, fd, &dst, left, 0);
+        if(ret > 0) {
+            left -= ret;
+            continue;
+        }
+        if(ret == 0) {
+            errno = EIO;                    //  Image is shorter than the run
+            return -1;
+        }
+        if(errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP)
+            return -1;
+
+        __atomic_store_n(&list->no_copy_range, 1, __ATOMIC_RELAXED);
+    }
+
+    if(left && !*buffer)
+        *buffer = image_buffer(list->img, EXTRACT_CHUNK);
+
+    while(left) {
+        size_t len = left < EXTRACT_CHUNK ? left : EXTRACT_CHUNK;
+        void *data = image_get(list->img, *buffer, len, src);
+        if(!data)
+            return -1;
+
+        ssize_t ret = pwrite(fd, data, len, dst);
+        if(ret <= 0)
+            return -1;
+
+        src += ret;
+        dst += ret;
+        left -= ret;
+    }
+
+    return 0;
+}
+
+
+//  Parent is opened without following a symlink and the file must be
+//  new, so nothing out of DEST is written through a link
+static inline int extract_create(char *path) {
+    char *slash = strrchr(path, '/');
+    if(!slash)
+        return open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+
+    *slash = '\0';
+    int dir = open(slash == path ? "/" : path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    *slash = '/';
+    if(dir == -1)
+        return -1;
+
+    int fd = openat(dir, slash + 1, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+    int saved = errno;
+    close(dir);
+    errno = saved;
+    return fd;
+}
+
+
+static inline void extract_file(struct extract_list *list, struct extract_job *job, void **buffer) {
+    int fd = extract_create(job->path);
+    if(fd == -1) {
+        extract_error(list, job->path, "Can't create file");
+        return;
+    }
+
+    for(size_t i = 0; i < job->runs; ++i)
+        if(extract_copy(list, fd, &list->runs[job->first_run + i], buffer) == -1) {
+            extract_error(list, job->path, "Can't copy data of");
+            break;
+        }
+
+    //  Sparse parts of the file are holes
+    if(ftruncate(fd, job->size) == -1)
+        extract_error(list, job->path, "Can't set size of");
+    if(fchmod(fd, job->mode) == -1)
+        extract_error(list, job->path, "Can't set mode of");
+    if(futimens(fd, job->times) == -1)
+        extract_error(list, job->path, "Can't set times of");
+
+    close(fd);
+    __atomic_add_fetch(&list->bytes, job->size, __ATOMIC_RELAXED);
+}
+
+
+static inline void *extract_worker(void *arg) {
+    struct extract_list *list = (struct extract_list *)arg;
+    void *buffer = NULL;
+
+    while(1) {
+        size_t i = __atomic_fetch_add(&list->next, 1, __ATOMIC_RELAXED);
+        if(i >= list->file_count)
+            break;
+
+        extract_file(list, &list->files[i], &buffer);
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+
+//  Writes all files with threads workers, creates symlinks, then sets
+//  directory modes and times, children first, as writing files changes
+//  them. Returns errors.
+static inline unsigned long extract_run_jobs(struct extract_list *list, int threads) {
+    if(threads < 1)
+        threads = 1;
+    if(threads > EXTRACT_MAX_THREADS)
+        threads = EXTRACT_MAX_THREADS;
+
+    sort_list = list;
+    qsort(list->files, list->file_count, sizeof(struct extract_job), extract_cmp);
+    image_advise(list->img, 0, 0, IMAGE_SEQUENTIAL);
+
+    pthread_t workers[EXTRACT_MAX_THREADS];
+    for(int i = 0; i < threads; ++i)
+        if(pthread_create(&workers[i], NULL, extract_worker, list))
+            err_exit("Can't create extract worker");
+
+    for(int i = 0; i < threads; ++i)
+        pthread_join(workers[i], NULL);
+
+    for(size_t i = 0; i < list->link_count; ++i)
+        if(symlink(list->links[i].target, list->links[i].path) == -1)
+            extract_error(list, list->links[i].path, "Can't create symlink");
+
+    for(size_t i = list->dir_count; i-- > 0; ) {
+        struct extract_job *dir = &list->dirs[i];
+        if(chmod(dir->path, dir->mode) == -1)
+            extract_error(list, dir->path, "Can't set mode of");
+        if(utimensat(AT_FDCWD, dir->path, dir->times, 0) == -1)
+            extract_error(list, dir->path, "Can't set times of");
+    }
+
+    return list->errors;
+}
+
+#endif  //  EXTRACT_H
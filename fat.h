@@ -0,0 +1,997 @@
+#ifndef FAT_H
+#define FAT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <linux/msdos_fs.h>
+
+#include "image.h"
+#include "cache.h"
+
+
+#define FAT_PAGE_SIZE       4096            //  Bytes of FAT held by one page
+#define FAT_PAGES           512             //  Pages kept in memory (2 MB)
+#define FAT_HASH_SIZE       (2 * FAT_PAGES)
+#define FAT_NO_PAGE         -1
+
+#define CLUSTER_CACHE_BUDGET    (8 * 1024 * 1024)   //  Bytes of cached data clusters
+
+#define CHAIN_INDEXES       32              //  Files with a cluster index
+#define CHAIN_INDEX_FULL    (1024 * 1024)   //  Longer chains are sampled (4 MB per index)
+#define CHAIN_INDEX_INIT    64
+
+#define FAT16_MIN_CLUSTERS  4085            //  Less clusters means FAT12
+#define FAT32_MIN_CLUSTERS  65525           //  Less clusters means FAT16
+#define FAT32_ENT_MASK      0x0FFFFFFF      //  Upper 4 bits are reserved
+#define FAT32_MIRROR_OFF    0x80            //  Only one FAT is active
+#define FAT32_ACTIVE_MASK   0x0F
+#define FSINFO_UNKNOWN      0xFFFFFFFF
+
+#define INIT_OFFSET        -1
+#define DIR_MAX_SIZE       (65536 * 32)     //  Directories hold at most 65536 entries
+
+#define FAT_NAME_MAX        (FAT_LFN_LEN * 3 + 1)   //  UTF-8 long name
+#define LFN_CHARS           13                      //  UCS-2 chars per slot
+#define LFN_SEQ_MASK        0x3F
+#define LFN_LAST_SLOT       0x40
+
+#define SEC_MASK        0b0000000000011111
+#define MIN_MASK        0b0000011111100000
+#define HOUR_MASK       0b1111100000000000
+#define DAY_MASK        0b0000000000011111
+#define MONTH_MASK      0b0000000111100000
+#define YEAR_MASK       0b1111111000000000
+
+#define BOOT_SIGNATURE_OFFSET   510
+
+#ifndef err_exit
+#define err_exit(msg)    do {                    \
+                             perror(msg);        \
+                             exit(EXIT_FAILURE); \
+                         } while (0)
+#endif
+
+
+enum fat_type {
+    FAT_TYPE_16,
+    FAT_TYPE_32
+};
+
+
+//  One FAT window, linked into LRU list and hash chain by slot index
+struct fat_page {
+    long index;
+    int prev;
+    int next;
+    int hash_next;
+    unsigned char *data;
+};
+
+
+struct fat_cache {
+    pthread_mutex_t lock;
+    struct fat_page pages[FAT_PAGES];
+    int hash[FAT_HASH_SIZE];
+    int lru_head;                           //  Most recently used page
+    int lru_tail;                           //  Page to evict
+    int used;
+
+    unsigned long hits;
+    unsigned long misses;
+};
+
+
+//  Clusters of one chain from its start to the farthest position read.
+//  Entry i is cluster i * step of the chain, step is 1 unless the chain
+//  is longer than CHAIN_INDEX_FULL clusters.
+struct chain_index {
+    unsigned start;                         //  0 if the index is free
+    unsigned step;
+    unsigned *clusters;
+    unsigned long count;
+    unsigned long capacity;
+
+    unsigned last;                          //  Farthest cluster walked
+    unsigned long last_pos;                 //  and its position in the chain
+    int ended;                              //  Chain end is reached
+    unsigned long used;                     //  Lookup tick, for eviction
+};
+
+
+//  Indexes of recently seeked files, found by their start cluster
+struct chain_cache {
+    pthread_mutex_t lock;
+    struct chain_index indexes[CHAIN_INDEXES];
+    unsigned long tick;
+
+    unsigned long lookups;
+    unsigned long walked;                   //  FAT entries read to build indexes
+};
+
+
+struct fs_info {
+    struct image *img;
+    enum fat_type type;
+
+    unsigned sector_size;
+    unsigned cluster_size;
+    unsigned cluster_count;                 //  Data clusters, first one is #2
+    unsigned entry_size;                    //  2 for FAT16, 4 for FAT32
+
+    off_t fat_start;                        //  First FAT
+    off_t fat_length;                       //  Distance between FAT copies
+    off_t fat_offset;                       //  Active FAT
+    off_t fat_size;                         //  Used bytes of one FAT
+    unsigned fats;
+    int mirrored;                           //  All FATs are kept equal
+    off_t data_offset;
+
+    //  FAT16 root is a fixed region, FAT32 root is a cluster chain
+    off_t root_offset;
+    unsigned dir_entries;
+    unsigned root_cluster;
+    void *root_buffer;                      //  FAT16 root is read once
+    void *root_data;
+
+    //  FSInfo hints, FSINFO_UNKNOWN if absent
+    unsigned free_clusters;
+    unsigned next_free;
+
+    struct fat_cache FAT;
+    struct block_cache clusters;            //  Block n is cluster n
+    struct chain_cache chains;
+};
+
+
+struct dir_iter {
+    struct fs_info *info;
+
+    int slot;                               //  Pinned cluster, BLOCK_NONE if mapped
+    void *data;                             //  Current cluster
+    long offset;
+
+    unsigned cluster;                       //  0 is FAT16 fixed root
+    unsigned int dentry_in_cluster;
+    unsigned *chain;                        //  Clusters read, stops looped chains
+    unsigned chain_length;
+    unsigned chain_cap;
+};
+
+
+struct file_iter {
+    struct fs_info *info;
+    int slot;
+    void *data;
+    unsigned next_cluster;
+    unsigned chain_length;
+
+    unsigned start;                         //  For fat_pread
+    off_t size;
+};
+
+
+static inline void fat_cache_init(struct fat_cache *cache) {
+    memset(cache, 0, sizeof(struct fat_cache));
+    for(int i = 0; i < FAT_HASH_SIZE; ++i)
+        cache->hash[i] = FAT_NO_PAGE;
+
+    cache->lru_head = FAT_NO_PAGE;
+    cache->lru_tail = FAT_NO_PAGE;
+    pthread_mutex_init(&cache->lock, NULL);
+}
+
+
+static inline void fat_cache_fini(struct fat_cache *cache) {
+    for(int i = 0; i < cache->used; ++i)
+        free(cache->pages[i].data);
+
+    cache->used = 0;
+    pthread_mutex_destroy(&cache->lock);
+}
+
+
+static inline void fat_lru_unlink(struct fat_cache *cache, int slot) {
+    struct fat_page *page = &cache->pages[slot];
+    if(page->prev != FAT_NO_PAGE)
+        cache->pages[page->prev].next = page->next;
+    else
+        cache->lru_head = page->next;
+
+    if(page->next != FAT_NO_PAGE)
+        cache->pages[page->next].prev = page->prev;
+    else
+        cache->lru_tail = page->prev;
+}
+
+
+static inline void fat_lru_push(struct fat_cache *cache, int slot) {
+    struct fat_page *page = &cache->pages[slot];
+    page->prev = FAT_NO_PAGE;
+    page->next = cache->lru_head;
+    if(cache->lru_head != FAT_NO_PAGE)
+        cache->pages[cache->lru_head].prev = slot;
+
+    cache->lru_head = slot;
+    if(cache->lru_tail == FAT_NO_PAGE)
+        cache->lru_tail = slot;
+}
+
+
+static inline void fat_hash_remove(struct fat_cache *cache, int slot) {
+    int *link = &cache->hash[cache->pages[slot].index % FAT_HASH_SIZE];
+    while(*link != slot)
+        link = &cache->pages[*link].hash_next;
+
+    *link = cache->pages[slot].hash_next;
+}
+
+
+//  Returns FAT window by its number, reading it from the image on miss,
+//  NULL with errno if it can't be read. Cache lock must be held while
+//  the page is used.
+static inline unsigned char *get_fat_page(struct fs_info *info, long index) {
+    struct fat_cache *cache = &info->FAT;
+
+    int slot = cache->hash[index % FAT_HASH_SIZE];
+    while(slot != FAT_NO_PAGE && cache->pages[slot].index != index)
+        slot = cache->pages[slot].hash_next;
+
+    if(slot != FAT_NO_PAGE) {
+        cache->hits++;
+        if(cache->lru_head != slot) {
+            fat_lru_unlink(cache, slot);
+            fat_lru_push(cache, slot);
+        }
+        return cache->pages[slot].data;
+    }
+
+    cache->misses++;
+    if(cache->used < FAT_PAGES) {
+        slot = cache->used++;
+        cache->pages[slot].data = (unsigned char *)image_alloc(info->img, FAT_PAGE_SIZE);
+    } else {
+        slot = cache->lru_tail;
+        fat_lru_unlink(cache, slot);
+        if(cache->pages[slot].index != FAT_NO_PAGE)
+            fat_hash_remove(cache, slot);
+    }
+
+    struct fat_page *page = &cache->pages[slot];
+    off_t page_offset = (off_t)index * FAT_PAGE_SIZE;
+    size_t len = FAT_PAGE_SIZE;
+    if(page_offset + (off_t)len > info->fat_size) {
+        len = info->fat_size > page_offset ? info->fat_size - page_offset : 0;
+        memset(page->data + len, 0, FAT_PAGE_SIZE - len);
+    }
+
+    if(image_pread(info->img, page->data, len, info->fat_offset + page_offset) != (ssize_t)len) {
+        page->index = FAT_NO_PAGE;          //  Not hashed, only reused
+        fat_lru_push(cache, slot);
+        errno = EIO;
+        return NULL;
+    }
+
+    page->index = index;
+    page->hash_next = cache->hash[index % FAT_HASH_SIZE];
+    cache->hash[index % FAT_HASH_SIZE] = slot;
+    fat_lru_push(cache, slot);
+
+    return page->data;
+}
+
+
+//  Returns FAT entry of the cluster, EOF_FAT32 for clusters out of FAT.
+//  A FAT that can't be read ends the chain there with errno set.
+static inline unsigned get_fat_entry(struct fs_info *info, unsigned cluster) {
+    if(cluster >= info->cluster_count + FAT_START_ENT)
+        return EOF_FAT32;
+
+    off_t entry_offset = (off_t)cluster * info->entry_size;
+    unsigned value;
+    if(info->img->map) {
+        unsigned char *entry = (unsigned char *)image_get(info->img, NULL, info->entry_size,
+                                                          info->fat_offset + entry_offset);
+        if(!entry)
+            return EOF_FAT32;
+
+        value = info->type == FAT_TYPE_16 ? __le16_to_cpu(*(__le16 *)entry) : __le32_to_cpu(*(__le32 *)entry);
+    } else {
+        pthread_mutex_lock(&info->FAT.lock);
+        unsigned char *page = get_fat_page(info, entry_offset / FAT_PAGE_SIZE);
+        if(!page) {
+            pthread_mutex_unlock(&info->FAT.lock);
+            errno = EIO;
+            return EOF_FAT32;
+        }
+
+        unsigned char *entry = page + entry_offset % FAT_PAGE_SIZE;
+        value = info->type == FAT_TYPE_16 ? __le16_to_cpu(*(__le16 *)entry) : __le32_to_cpu(*(__le32 *)entry);
+        pthread_mutex_unlock(&info->FAT.lock);
+    }
+
+    if(info->type == FAT_TYPE_32)
+        value &= FAT32_ENT_MASK;
+
+    return value;
+}
+
+
+//  Free, bad, reserved and end of chain values all terminate the chain
+static inline int fat_is_last(struct fs_info *info, unsigned cluster) {
+    return cluster < FAT_START_ENT || cluster >= info->cluster_count + FAT_START_ENT;
+}
+
+
+static inline off_t get_cluster_offset(struct fs_info *info, unsigned cluster) {
+    return info->data_offset + (off_t)(cluster - FAT_START_ENT) * info->cluster_size;
+}
+
+
+//  Returns data of the cluster and pins it until unpin_cluster(*slot),
+//  NULL with errno if it can't be read. Cold clusters are file data,
+//  which is rarely read twice.
+static inline void *pin_cluster(struct fs_info *info, unsigned cluster, int cold, int *slot) {
+    return block_pin(&info->clusters, cluster, cold, slot);
+}
+
+
+static inline void unpin_cluster(struct fs_info *info, int slot) {
+    block_unpin(&info->clusters, slot);
+}
+
+
+static inline void print_cache_stats(struct fs_info *info, FILE *out) {
+    struct fat_cache *fat = &info->FAT;
+    struct block_cache *clusters = &info->clusters;
+    struct chain_cache *chains = &info->chains;
+    if(info->img->map)
+        fprintf(out, "Image is mapped, FAT and clusters are not cached\n");
+    else {
+        fprintf(out, "FAT pages: %lu hits, %lu misses (%.1f%% hit rate)\n",
+                fat->hits, fat->misses, cache_hit_rate(fat->hits, fat->misses));
+        fprintf(out, "Clusters:  %lu hits, %lu misses (%.1f%% hit rate), %d of %d slots used\n",
+                clusters->hits, clusters->misses, cache_hit_rate(clusters->hits, clusters->misses),
+                clusters->used, clusters->count);
+    }
+
+    fprintf(out, "Chains:    %lu seeks, %lu FAT entries walked\n", chains->lookups, chains->walked);
+}
+
+
+static inline void chain_cache_init(struct chain_cache *cache) {
+    memset(cache, 0, sizeof(struct chain_cache));
+    pthread_mutex_init(&cache->lock, NULL);
+}
+
+
+static inline void chain_cache_fini(struct chain_cache *cache) {
+    for(int i = 0; i < CHAIN_INDEXES; ++i)
+        free(cache->indexes[i].clusters);
+    pthread_mutex_destroy(&cache->lock);
+}
+
+
+static inline void chain_index_add(struct chain_index *index, unsigned cluster) {
+    if(index->count == index->capacity) {
+        index->capacity = index->capacity ? index->capacity * 2 : CHAIN_INDEX_INIT;
+        index->clusters = (unsigned *)realloc(index->clusters, index->capacity * sizeof(unsigned));
+        if(!index->clusters)
+            err_exit("Can't allocate memory for chain index");
+    }
+
+    index->clusters[index->count++] = cluster;
+}
+
+
+//  Returns index of the chain, the least recently used one is reset
+//  for a new chain. Called with the chain cache lock held.
+static inline struct chain_index *get_chain_index(struct chain_cache *cache, unsigned start, unsigned long length) {
+    struct chain_index *index = &cache->indexes[0];
+    for(int i = 0; i < CHAIN_INDEXES; ++i) {
+        if(cache->indexes[i].start == start) {
+            index = &cache->indexes[i];
+            index->used = ++cache->tick;
+            return index;
+        }
+        if(cache->indexes[i].used < index->used)
+            index = &cache->indexes[i];
+    }
+
+    index->start = start;
+    index->step = length / CHAIN_INDEX_FULL + 1;
+    index->count = 0;
+    index->last = start;
+    index->last_pos = 0;
+    index->ended = 0;
+    index->used = ++cache->tick;
+    chain_index_add(index, start);
+
+    return index;
+}
+
+
+//  Returns cluster number pos of the chain starting at start, or 0 if the
+//  chain is shorter. length is the expected chain length, it only sets
+//  density of the index. Walks less than one index step once the chain
+//  was read as far as pos.
+static inline unsigned get_chain_cluster(struct fs_info *info, unsigned start, unsigned long length, unsigned long pos) {
+    struct chain_cache *cache = &info->chains;
+    if(fat_is_last(info, start))
+        return 0;
+
+    pthread_mutex_lock(&cache->lock);
+    cache->lookups++;
+    struct chain_index *index = get_chain_index(cache, start, length);
+    unsigned long entry = pos / index->step;
+
+    //  No chain is longer than the data area, a longer one is looped
+    while(entry >= index->count && !index->ended) {
+        unsigned next = get_fat_entry(info, index->last);
+        cache->walked++;
+        if(fat_is_last(info, next) || index->last_pos >= info->cluster_count) {
+            index->ended = 1;
+            break;
+        }
+
+        index->last = next;
+        if(++index->last_pos % index->step == 0)
+            chain_index_add(index, next);
+    }
+
+    if(entry >= index->count || (index->ended && pos > index->last_pos)) {
+        pthread_mutex_unlock(&cache->lock);
+        return 0;
+    }
+
+    unsigned cluster = index->clusters[entry];
+    unsigned long walk = pos - entry * index->step;
+    cache->walked += walk;
+    pthread_mutex_unlock(&cache->lock);
+
+    while(walk-- && !fat_is_last(info, cluster))
+        cluster = get_fat_entry(info, cluster);
+
+    return fat_is_last(info, cluster) ? 0 : cluster;
+}
+
+
+static inline unsigned get_dentry_start(struct msdos_dir_entry *dentry, struct fs_info *info) {
+    unsigned start = __le16_to_cpu(dentry->start);
+    if(info->type == FAT_TYPE_32)
+        start |= (unsigned)__le16_to_cpu(dentry->starthi) << 16;
+
+    return start;
+}
+
+
+//  FAT keeps local time, access time has only date
+static inline time_t get_fat_time(unsigned date, unsigned time) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(struct tm));
+
+    tm.tm_sec  = (time & SEC_MASK) * 2;
+    tm.tm_min  = (time & MIN_MASK) >> 5;
+    tm.tm_hour = (time & HOUR_MASK) >> 11;
+    tm.tm_mday = (date & DAY_MASK);
+    tm.tm_mon  = ((date & MONTH_MASK) >> 5) - 1;
+    tm.tm_year = ((date & YEAR_MASK) >> 9) + 80;
+    tm.tm_isdst = -1;
+
+    return mktime(&tm);
+}
+
+
+//  Long name collected from LFN slots preceding the short entry
+struct lfn_buf {
+    unsigned short chars[FAT_LFN_LEN + LFN_CHARS];
+    unsigned char checksum;
+    int next_seq;                           //  Expected slot, 0 if no name
+    int len;
+};
+
+
+static inline void lfn_reset(struct lfn_buf *lfn) {
+    lfn->next_seq = 0;
+    lfn->len = 0;
+}
+
+
+//  Slots are stored last one first, each keeps 13 chars of the name
+static inline void lfn_add_slot(struct lfn_buf *lfn, struct msdos_dir_slot *slot) {
+    int seq = slot->id & LFN_SEQ_MASK;
+    if(slot->id & LFN_LAST_SLOT) {
+        if(seq == 0 || seq * LFN_CHARS > FAT_LFN_LEN + LFN_CHARS) {
+            lfn_reset(lfn);
+            return;
+        }
+        lfn->checksum = slot->alias_checksum;
+        lfn->len = seq * LFN_CHARS;
+    } else if(seq != lfn->next_seq || slot->alias_checksum != lfn->checksum) {
+        lfn_reset(lfn);
+        return;
+    }
+
+    unsigned short *chars = lfn->chars + (seq - 1) * LFN_CHARS;
+    memcpy(chars, slot->name0_4, sizeof(slot->name0_4));
+    memcpy(chars + 5, slot->name5_10, sizeof(slot->name5_10));
+    memcpy(chars + 11, slot->name11_12, sizeof(slot->name11_12));
+
+    lfn->next_seq = seq - 1;
+}
+
+
+static inline unsigned char get_short_checksum(struct msdos_dir_entry *dentry) {
+    unsigned char sum = 0;
+    for(int i = 0; i < MSDOS_NAME; ++i)
+        sum = ((sum & 1) << 7) + (sum >> 1) + dentry->name[i];
+
+    return sum;
+}
+
+
+//  8.3 name without padding, lower case flags are applied
+static inline int get_short_name(struct msdos_dir_entry *dentry, char *name) {
+    int len = 0;
+    for(int i = 0; i < 8 && dentry->name[i] != ' '; ++i) {
+        char c = i == 0 && dentry->name[0] == 0x05 ? (char)DELETED_FLAG : dentry->name[i];
+        name[len++] = dentry->lcase & CASE_LOWER_BASE && c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+    }
+
+    if(dentry->name[8] != ' ') {
+        name[len++] = '.';
+        for(int i = 8; i < MSDOS_NAME && dentry->name[i] != ' '; ++i) {
+            char c = dentry->name[i];
+            name[len++] = dentry->lcase & CASE_LOWER_EXT && c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+        }
+    }
+
+    name[len] = '\0';
+    return len;
+}
+
+
+//  Writes UTF-8 long name if it belongs to the entry, short name otherwise.
+//  Name buffer must hold FAT_NAME_MAX bytes. Returns name length.
+static inline int get_dentry_name(struct msdos_dir_entry *dentry, struct lfn_buf *lfn, char *name) {
+    if(lfn->len == 0 || lfn->next_seq != 0 || lfn->checksum != get_short_checksum(dentry)) {
+        lfn_reset(lfn);
+        return get_short_name(dentry, name);
+    }
+
+    int len = 0;
+    for(int i = 0; i < lfn->len && len < FAT_NAME_MAX - 4; ++i) {
+        unsigned c = __le16_to_cpu(lfn->chars[i]);
+        if(c == 0x0000 || c == 0xFFFF)
+            break;
+
+        //  Surrogate pairs
+        if(c >= 0xD800 && c < 0xDC00 && i + 1 < lfn->len) {
+            unsigned low = __le16_to_cpu(lfn->chars[i + 1]);
+            if(low >= 0xDC00 && low < 0xE000) {
+                c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+                i++;
+            }
+        }
+
+        if(c < 0x80) {
+            name[len++] = c;
+        } else if(c < 0x800) {
+            name[len++] = 0xC0 | (c >> 6);
+            name[len++] = 0x80 | (c & 0x3F);
+        } else if(c < 0x10000) {
+            name[len++] = 0xE0 | (c >> 12);
+            name[len++] = 0x80 | ((c >> 6) & 0x3F);
+            name[len++] = 0x80 | (c & 0x3F);
+        } else {
+            name[len++] = 0xF0 | (c >> 18);
+            name[len++] = 0x80 | ((c >> 12) & 0x3F);
+            name[len++] = 0x80 | ((c >> 6) & 0x3F);
+            name[len++] = 0x80 | (c & 0x3F);
+        }
+    }
+
+    name[len] = '\0';
+    lfn_reset(lfn);
+    return len;
+}
+
+
+//  Free cluster hints are advisory, an unreadable FSInfo leaves them unknown
+static inline void read_fsinfo(struct fs_info *info, unsigned fsinfo_sector) {
+    info->free_clusters = FSINFO_UNKNOWN;
+    info->next_free = FSINFO_UNKNOWN;
+    if(fsinfo_sector == 0 || fsinfo_sector == 0xFFFF)
+        return;
+
+    struct fat_boot_fsinfo fsinfo;
+    off_t offset = (off_t)fsinfo_sector * info->sector_size;
+    if(image_pread(info->img, &fsinfo, sizeof(struct fat_boot_fsinfo), offset) != sizeof(struct fat_boot_fsinfo) ||
+       __le32_to_cpu(fsinfo.signature1) != FAT_FSINFO_SIG1 ||
+       __le32_to_cpu(fsinfo.signature2) != FAT_FSINFO_SIG2)
+        return;
+
+    info->free_clusters = __le32_to_cpu(fsinfo.free_clusters);
+    info->next_free = __le32_to_cpu(fsinfo.next_cluster);
+}
+
+
+//  Data clusters of the boot sector geometry, 0 if it is impossible: sizes
+//  out of range, or the reserved area, FATs and root directory leave no
+//  data area, or the FAT is too short for the clusters
+static inline unsigned long fat_geometry(struct fat_boot_sector *BS) {
+    unsigned sector_size = __le16_to_cpu(*(__le16 *)BS->sector_size);
+    unsigned reserved = __le16_to_cpu(BS->reserved);
+    unsigned dir_entries = __le16_to_cpu(*(__le16 *)BS->dir_entries);
+    unsigned total_sectors = __le16_to_cpu(*(__le16 *)BS->sectors);
+    if(!total_sectors)
+        total_sectors = __le32_to_cpu(BS->total_sect);
+
+    unsigned fat_length = __le16_to_cpu(BS->fat_length);
+    if(!fat_length)
+        fat_length = __le32_to_cpu(BS->fat32.length);
+
+    if(sector_size < 512 || sector_size > 4096 || (sector_size & (sector_size - 1)) ||
+       !BS->sec_per_clus || (BS->sec_per_clus & (BS->sec_per_clus - 1)) ||
+       !BS->fats || !reserved || !fat_length)
+        return 0;
+
+    unsigned root_sectors = (dir_entries * sizeof(struct msdos_dir_entry) + sector_size - 1) / sector_size;
+    unsigned long meta_sectors = reserved + (unsigned long)BS->fats * fat_length + root_sectors;
+    if(total_sectors <= meta_sectors)
+        return 0;
+
+    unsigned long clusters = (total_sectors - meta_sectors) / BS->sec_per_clus;
+    unsigned entry_size = clusters < FAT32_MIN_CLUSTERS ? sizeof(__le16) : sizeof(__le32);
+    if((unsigned long long)fat_length * sector_size < (clusters + FAT_START_ENT) * entry_size)
+        return 0;
+
+    return clusters;
+}
+
+
+//  Checks the boot sector without failing, so other filesystems can be
+//  tried: signature, geometry and the cluster count of FAT16 or FAT32
+static inline int fat_probe(struct image *img) {
+    unsigned char sector[BOOT_SIGNATURE_OFFSET + 2];
+    if(image_pread(img, sector, sizeof(sector), 0) != sizeof(sector))
+        return 0;
+
+    if(sector[BOOT_SIGNATURE_OFFSET] != 0x55 || sector[BOOT_SIGNATURE_OFFSET + 1] != 0xAA)
+        return 0;
+
+    return fat_geometry((struct fat_boot_sector *)sector) >= FAT16_MIN_CLUSTERS;
+}
+
+
+static inline void free_fs_info(struct fs_info *info) {
+    fat_cache_fini(&info->FAT);
+    block_cache_fini(&info->clusters);
+    chain_cache_fini(&info->chains);
+    free(info->root_buffer);
+    free(info);
+}
+
+
+//  Parses boot sector only, FAT pages are read on demand. Returns NULL
+//  with EIO if the boot sector or the FAT16 root directory can't be read,
+//  EINVAL if the geometry is wrong and ENOTSUP for FAT12.
+static inline struct fs_info *get_fs_info(struct image *img) {
+    struct fat_boot_sector BS;
+    ssize_t ret = image_pread(img, &BS, sizeof(struct fat_boot_sector), 0);
+    if(ret != sizeof(struct fat_boot_sector)) {
+        if(ret != -1)
+            errno = EIO;
+        return NULL;
+    }
+
+    unsigned long clusters = fat_geometry(&BS);
+    if(!clusters) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if(clusters < FAT16_MIN_CLUSTERS) {
+        errno = ENOTSUP;
+        return NULL;
+    }
+
+    struct fs_info *info = (struct fs_info *)calloc(1, sizeof(struct fs_info));
+    if(!info)
+        err_exit("Can't allocate memory for fs info");
+
+    unsigned sector_size = __le16_to_cpu(*(__le16 *)BS.sector_size);
+    unsigned dir_entries = __le16_to_cpu(*(__le16 *)BS.dir_entries);
+    unsigned fat_length = __le16_to_cpu(BS.fat_length);
+    if(!fat_length)
+        fat_length = __le32_to_cpu(BS.fat32.length);
+
+    off_t reserved_size = (off_t)__le16_to_cpu(BS.reserved) * sector_size;
+    off_t root_size = (off_t)dir_entries * sizeof(struct msdos_dir_entry);
+    unsigned root_sectors = (root_size + sector_size - 1) / sector_size;
+
+    info->img = img;
+    info->sector_size = sector_size;
+    info->cluster_size = BS.sec_per_clus * sector_size;
+    info->cluster_count = clusters;
+    info->fat_size = (off_t)fat_length * sector_size;
+    info->fats = BS.fats;
+    info->root_offset = reserved_size + info->fat_size * BS.fats;
+    info->dir_entries = dir_entries;
+    info->data_offset = info->root_offset + (off_t)root_sectors * sector_size;
+    info->fat_start = reserved_size;
+    info->fat_length = info->fat_size;
+    info->fat_offset = reserved_size;
+
+    if(info->cluster_count < FAT32_MIN_CLUSTERS) {
+        info->type = FAT_TYPE_16;
+        info->entry_size = sizeof(__le16);
+        info->free_clusters = FSINFO_UNKNOWN;
+        info->next_free = FSINFO_UNKNOWN;
+        info->mirrored = 1;
+    } else {
+        unsigned flags = __le16_to_cpu(BS.fat32.flags);
+        info->type = FAT_TYPE_32;
+        info->entry_size = sizeof(__le32);
+        info->root_cluster = __le32_to_cpu(BS.fat32.root_cluster);
+        info->mirrored = !(flags & FAT32_MIRROR_OFF);
+
+        //  An active FAT past the last copy is damage, FAT 0 is read then
+        unsigned active = flags & FAT32_ACTIVE_MASK;
+        if(!info->mirrored && active < info->fats)
+            info->fat_offset += active * info->fat_size;
+
+        read_fsinfo(info, __le16_to_cpu(BS.fat32.info_sector));
+    }
+
+    //  FAT may be longer than needed, fat_geometry rules out shorter
+    off_t used_fat = (off_t)(info->cluster_count + FAT_START_ENT) * info->entry_size;
+    if(used_fat < info->fat_size)
+        info->fat_size = used_fat;
+
+    fat_cache_init(&info->FAT);
+    image_advise(img, info->fat_offset, info->fat_size, IMAGE_RANDOM);
+
+    //  Clusters are numbered from 2, so base is before the data area
+    block_cache_init(&info->clusters, img, info->data_offset - (off_t)FAT_START_ENT * info->cluster_size,
+                     info->cluster_size, CLUSTER_CACHE_BUDGET);
+    chain_cache_init(&info->chains);
+
+    if(info->type == FAT_TYPE_16) {
+        info->root_buffer = image_buffer(img, root_size);
+        info->root_data = image_get(img, info->root_buffer, root_size, info->root_offset);
+        if(!info->root_data) {
+            int error = errno;
+            free_fs_info(info);
+            errno = error;
+            return NULL;
+        }
+    }
+
+    return info;
+}
+
+
+static inline struct dir_iter *open_dir_cluster(unsigned cluster, unsigned dentries, struct fs_info *info) {
+    struct dir_iter *new_diter = (struct dir_iter *)calloc(1, sizeof(struct dir_iter));
+    if(!new_diter)
+        err_exit("Can't allocate memory for dir iterator");
+
+    new_diter->info = info;
+    new_diter->dentry_in_cluster = dentries;
+    new_diter->cluster = cluster;
+    new_diter->offset = INIT_OFFSET;
+    new_diter->slot = BLOCK_NONE;
+
+    return new_diter;
+}
+
+
+static inline struct dir_iter *open_root_dir(struct fs_info *info) {
+    if(info->type == FAT_TYPE_16)
+        return open_dir_cluster(0, info->dir_entries, info);
+
+    return open_dir_cluster(info->root_cluster, info->cluster_size / sizeof(struct msdos_dir_entry), info);
+}
+
+
+static inline struct dir_iter *open_dir(struct msdos_dir_entry *dentry, struct fs_info *info) {
+    unsigned cluster = get_dentry_start(dentry, info);
+    if(cluster == 0)    //  ".." of the first level directories
+        return open_root_dir(info);
+
+    return open_dir_cluster(cluster, info->cluster_size / sizeof(struct msdos_dir_entry), info);
+}
+
+
+static inline struct msdos_dir_entry *get_next_dentry(struct dir_iter *dir) {
+    if(dir->offset != INIT_OFFSET && ++dir->offset < dir->dentry_in_cluster)
+        return ((struct msdos_dir_entry *)dir->data) + dir->offset;
+
+    if(dir->offset != INIT_OFFSET) {
+        if(dir->cluster == 0)
+            return NULL;
+
+        dir->cluster = get_fat_entry(dir->info, dir->cluster);
+        if(fat_is_last(dir->info, dir->cluster))
+            return NULL;
+    }
+
+    //  A looped chain ends at its first repeated cluster. Directories are
+    //  short, so the clusters read are searched in a row.
+    if(dir->cluster) {
+        for(unsigned i = 0; i < dir->chain_length; ++i)
+            if(dir->chain[i] == dir->cluster) {
+                errno = ELOOP;
+                return NULL;
+            }
+
+        if((unsigned long)(dir->chain_length + 1) * dir->info->cluster_size > DIR_MAX_SIZE) {
+            errno = EFBIG;
+            return NULL;
+        }
+
+        if(dir->chain_length == dir->chain_cap) {
+            dir->chain_cap = dir->chain_cap ? dir->chain_cap * 2 : 8;
+            dir->chain = (unsigned *)realloc(dir->chain, dir->chain_cap * sizeof(unsigned));
+            if(!dir->chain)
+                err_exit("Can't allocate memory for dir iterator");
+        }
+        dir->chain[dir->chain_length++] = dir->cluster;
+    }
+
+    unpin_cluster(dir->info, dir->slot);
+    dir->slot = BLOCK_NONE;
+    if(dir->cluster)
+        dir->data = pin_cluster(dir->info, dir->cluster, 0, &dir->slot);
+    else
+        dir->data = dir->info->root_data;
+    if(!dir->data)
+        return NULL;
+
+    dir->offset = 0;
+    return (struct msdos_dir_entry *)dir->data;
+}
+
+
+static inline void close_dir(struct dir_iter *dir) {
+    unpin_cluster(dir->info, dir->slot);
+    free(dir->chain);
+    free(dir);
+}
+
+
+static inline void *get_next_cluster(struct file_iter *fiter) {
+    if(fat_is_last(fiter->info, fiter->next_cluster))
+        return NULL;
+
+    if(++fiter->chain_length > fiter->info->cluster_count) {
+        errno = ELOOP;
+        return NULL;
+    }
+
+    unpin_cluster(fiter->info, fiter->slot);
+    fiter->slot = BLOCK_NONE;
+    fiter->data = pin_cluster(fiter->info, fiter->next_cluster, 1, &fiter->slot);
+    if(!fiter->data)
+        return NULL;
+
+    fiter->next_cluster = get_fat_entry(fiter->info, fiter->next_cluster);
+
+    return (void *)fiter->data;
+}
+
+
+static inline struct file_iter *open_file(struct msdos_dir_entry *dentry, struct fs_info *info) {
+    struct file_iter *new_fiter = (struct file_iter *)calloc(1, sizeof(struct file_iter));
+    if(!new_fiter)
+        err_exit("Can't allocate memory for file iterator");
+
+    new_fiter->info = info;
+    new_fiter->next_cluster = get_dentry_start(dentry, info);
+    new_fiter->slot = BLOCK_NONE;
+    new_fiter->start = new_fiter->next_cluster;
+    new_fiter->size = __le32_to_cpu(dentry->size);
+
+    return new_fiter;
+}
+
+
+static inline void close_file(struct file_iter *fiter) {
+    unpin_cluster(fiter->info, fiter->slot);
+    free(fiter);
+}
+
+
+//  Reads up to len bytes of the file at offset like pread, the iterator
+//  position is not changed. The first cluster is found in the chain index,
+//  so random reads deep into big files don't walk the FAT from its start.
+//  Runs of adjacent whole clusters are read straight into buf.
+static inline ssize_t fat_pread(struct file_iter *fiter, void *buf, size_t len, off_t offset) {
+    struct fs_info *info = fiter->info;
+    if(offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(offset >= fiter->size)
+        return 0;
+    if(len > (size_t)(fiter->size - offset))
+        len = fiter->size - offset;
+
+    unsigned long length = (fiter->size + info->cluster_size - 1) / info->cluster_size;
+    unsigned cluster = get_chain_cluster(info, fiter->start, length, offset / info->cluster_size);
+    unsigned char *out = (unsigned char *)buf;
+    size_t done = 0;
+
+    while(done < len) {
+        if(fat_is_last(info, cluster)) {
+            errno = EIO;                    //  Chain is shorter than the file
+            break;
+        }
+
+        size_t in_cluster = (offset + done) % info->cluster_size;
+        size_t part = info->cluster_size - in_cluster;
+        if(part > len - done)
+            part = len - done;
+
+        if(part < info->cluster_size) {
+            int slot;
+            unsigned char *data = (unsigned char *)pin_cluster(info, cluster, 1, &slot);
+            if(!data)
+                break;
+
+            memcpy(out + done, data + in_cluster, part);
+            unpin_cluster(info, slot);
+            done += part;
+            cluster = get_fat_entry(info, cluster);
+            continue;
+        }
+
+        unsigned first = cluster;
+        size_t run = 0;
+        do {
+            run += info->cluster_size;
+            cluster = get_fat_entry(info, cluster);
+        } while(len - done - run >= info->cluster_size && !fat_is_last(info, cluster) &&
+                cluster == first + run / info->cluster_size);
+
+        if(image_pread(info->img, out + done, run, get_cluster_offset(info, first)) != (ssize_t)run) {
+            errno = EIO;
+            break;
+        }
+        done += run;
+    }
+
+    return done || len == 0 ? (ssize_t)done : -1;
+}
+
+
+//  Returns whole FAT number fat_number (0 is the first one) for full table
+//  scans. *buffer must be freed by caller, it stays NULL if image is mapped.
+static inline void *get_fat_table(struct fs_info *info, unsigned fat_number, void **buffer) {
+    off_t offset = info->fat_start + (off_t)fat_number * info->fat_length;
+
+    *buffer = image_buffer(info->img, info->fat_size);
+    void *table = image_get(info->img, *buffer, info->fat_size, offset);
+    if(!table)
+        err_exit("Can't read FAT table");
+
+    return table;
+}
+
+
+//  Entry of a table returned by get_fat_table
+static inline unsigned get_table_entry(struct fs_info *info, void *table, unsigned long cluster) {
+    if(info->type == FAT_TYPE_16)
+        return __le16_to_cpu(((__le16 *)table)[cluster]);
+
+    return __le32_to_cpu(((__le32 *)table)[cluster]) & FAT32_ENT_MASK;
+}
+
+#endif  //  FAT_H
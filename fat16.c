@@ -1,9 +1,12 @@
+#define _GNU_SOURCE
+
 #include <linux/msdos_fs.h>
 #include <linux/kernel.h>
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -14,22 +17,11 @@
 #include <errno.h>
 #include <wchar.h>
 
-#define MIN(x,y) (x<y ? x : y)
-
-struct fat_info{
-	unsigned short *fat_table;
-	int fd;
-	unsigned short cluster_size;
-	unsigned short data_offset;
-};
+#include "fat.h"
+#include "fat_walk.h"
+#include "pattern.h"
 
-struct fat_dirent{
-	struct fat_info fat_info;
-	void *buffer;
-	long current_offset;
-	unsigned short cluster;
-	unsigned int cluster_count;
-};
+#define MIN(x,y) (x<y ? x : y)
 
 char *get_name(struct msdos_dir_entry dir_entry){
 	char *filename = (char *) calloc(13, 1);
@@ -86,198 +78,189 @@ struct tm get_access_time(struct msdos_dir_entry dir_entry){
 	return time;
 }
 
-int print_file(struct msdos_dir_entry dir_entry, struct fat_info fat_info){
-	unsigned short *fat_table = fat_info.fat_table;
-	int fd = fat_info.fd;
-	unsigned short cluster_size = fat_info.cluster_size;
-	unsigned short data_offset = fat_info.data_offset;
-
-	unsigned short cluster = 0xFFFF;
-
-	void *buffer = malloc(cluster_size);
+int print_file(struct msdos_dir_entry dir_entry, struct fs_info *info){
+	struct file_iter *file = open_file(&dir_entry, info);
+	void *buffer = NULL;
 	ssize_t ret = -1;
 
 	ssize_t file_size = __le32_to_cpu(dir_entry.size);
-	for (cluster = __le16_to_cpu(dir_entry.start); cluster != 0xFFFF && file_size != 0; cluster = fat_table[cluster]){
-		unsigned cluster_offset = data_offset + (cluster - 2) * cluster_size;
-		lseek(fd, cluster_offset, SEEK_SET);
-		ret = read(fd, buffer, cluster_size);
-		if (ret != cluster_size) return ret;
-
-		ssize_t write_size = MIN(cluster_size, file_size);
+	while (file_size != 0 && (buffer = get_next_cluster(file)) != NULL){
+		ssize_t write_size = MIN(info -> cluster_size, file_size);
 		ret = write(STDOUT_FILENO, buffer, write_size);
 		file_size -= write_size;
-		if (ret != write_size) return ret;
+		if (ret != write_size) {
+			close_file(file);
+			return ret;
+		}
 	}
-	free(buffer);
-	if (cluster != 0xFFFF) return -1;
+	close_file(file);
 	if (file_size != 0) return -2;
 	return 0;
 }
 
-int fat_open_dirent(struct msdos_dir_entry base_dir_entry, struct fat_dirent *new_dir, struct fat_info fat_info){
-	unsigned short cluster_size = fat_info.cluster_size;
+struct list_options{
+	enum walk_order order;
+};
 
-	new_dir -> fat_info = fat_info;
-	new_dir -> buffer = malloc(cluster_size);
-	if (!new_dir -> buffer) return -1;
-	new_dir -> current_offset = -1;
-	new_dir -> cluster = base_dir_entry.start;
-	new_dir -> cluster_count = cluster_size / sizeof(struct msdos_dir_entry);
+//Called by the walker for every entry, directories are followed by their content
+void print_dirent(struct walk_entry *entry, void *arg){
+	struct list_options *options = (struct list_options *) arg;
+	struct msdos_dir_entry dir_entry = *entry -> dentry;
+	if (dir_entry.attr & 0x40) return; //Wrong file
+	if (dir_entry.attr & 0x80) return; //Wrong file
 
-	return 0;
-}
+	char *filename = get_name(dir_entry);
 
-int fat_close_dirent(struct fat_dirent dirent){
-	free(dirent.buffer);
-	return 0;
-}
+	if (options -> order == WALK_ORDERED){
+		for (int i = 0; i < entry -> depth; i++) putchar('\t');
+		printf("%-12s | ", filename);
+	}else{
+		//Entries of different directories are mixed, so print full path
+		printf("%s/%-12s | ", entry -> path, filename);
+	}
+	free(filename);
 
-//Returns next dir_entry or NULL if failed
-//If called after NULL returned, behaviour is unexpected
-struct msdos_dir_entry *fat_next_dir_entry(struct fat_dirent *dirent){
-	//Check if offset is available
-
-	if (dirent -> current_offset != -1) {
-		//Offset is available, but is there any more stuff in offset?
-		dirent -> current_offset++;
-		if (dirent -> current_offset < dirent -> cluster_count) {
-			//There more records in current buffer -- returning it
-			return (struct msdos_dir_entry *) (dirent -> buffer) + dirent -> current_offset;
-		}
-		//Setting up new cluster
-		dirent -> cluster = dirent -> fat_info.fat_table[dirent -> cluster];
-		if (dirent -> cluster == 0xFFFF) return NULL;
+	if (dir_entry.attr & 0x10){
+		putchar('\n');
+		return;
 	}
 
-	//No records available, generate new ones
-	unsigned short cluster_size = dirent -> fat_info.cluster_size;
-	int fd = dirent -> fat_info.fd;
-	unsigned short data_offset = dirent -> fat_info.data_offset;
+	if (dir_entry.attr & 0x01) putchar('R'); else putchar(' ');
+	if (dir_entry.attr & 0x02) putchar('H'); else putchar(' ');
+	if (dir_entry.attr & 0x04) putchar('S'); else putchar(' ');
+	if (dir_entry.attr & 0x08) putchar('Y'); else putchar(' ');
+	if (dir_entry.attr & 0x20) putchar('M'); else putchar(' ');
+	printf(" | ");
+
+	struct tm creation_time = get_creation_time(dir_entry);
+	printf("%.24s | ", asctime(&creation_time));
+	struct tm access_time = get_access_time(dir_entry);
+	printf("%.24s\n", asctime(&access_time));
+}
+
+struct find_options{
+	struct pattern_set patterns;
+	unsigned long matches;
+};
 
-	unsigned cluster_offset = data_offset + (dirent -> cluster - 2) * cluster_size;
-	lseek(fd, cluster_offset, SEEK_SET);
-	int ret = read(fd, dirent -> buffer, cluster_size);
-	if (ret != cluster_size) return NULL;
+//Called by the walker for every entry, prints full paths of entries matching any pattern
+//Long and short names are both tried
+void find_dirent(struct walk_entry *entry, void *arg){
+	struct find_options *options = (struct find_options *) arg;
+	if (entry -> dentry -> attr & ATTR_VOLUME) return;
 
-	dirent -> current_offset = 0;
-	return (struct msdos_dir_entry *) dirent -> buffer;
+	char path[PATH_MAX];
+	char short_name[MSDOS_NAME + 2];
+	int len = snprintf(path, sizeof(path), "%s/%s", entry -> path, entry -> name);
+	if (len >= (int) sizeof(path)) return;
+
+	get_short_name(entry -> dentry, short_name);
+	const char *alias = strcmp(short_name, entry -> name) ? short_name : NULL;
+	if (!pattern_match(&options -> patterns, path, path + len - strlen(entry -> name), alias)) return;
+
+	options -> matches++;
+	printf("%s%s\n", path, entry -> dentry -> attr & ATTR_DIR ? "/" : "");
 }
 
-void traverse_dirent(struct fat_dirent* dirent, char *needle, char *prefix, struct fat_info fat_info){
+//Looks for the file named needle and prints it
+//Returns 1 if file was found
+int traverse_dirent(struct dir_iter *dirent, char *needle, struct fs_info *info){
 	struct msdos_dir_entry *dir_entry_ptr;
-	for (dir_entry_ptr = fat_next_dir_entry(dirent); dir_entry_ptr != NULL && dir_entry_ptr -> name[0] != 0x00; dir_entry_ptr = fat_next_dir_entry(dirent)){
-		//printf("---%ld---", dirent -> current_offset);
+	for (dir_entry_ptr = get_next_dentry(dirent); dir_entry_ptr != NULL && dir_entry_ptr -> name[0] != 0x00; dir_entry_ptr = get_next_dentry(dirent)){
 		struct msdos_dir_entry dir_entry = *dir_entry_ptr;
-		//struct msdos_dir_entry dir_entry = dir_entries[dir_num];
 		if (dir_entry.name[0] == 0x2e) continue;
 		if (dir_entry.name[0] == 0xe5) continue; //File was deleted
 		if (dir_entry.attr & 0x40) continue; //Wrong file
 		if (dir_entry.attr & 0x80) continue; //Wrong file
 		if (dir_entry.attr == 0xF) continue; //TODO: Process files with strange attributes
 
-		char *filename = get_name(dir_entry);
-
-		if (needle == NULL)
-			printf("%s%-12s | ", prefix, filename);
 		if (dir_entry.attr & 0x10){
-			putchar('\n');
-			struct fat_dirent *dir = (struct fat_dirent*) malloc(sizeof(struct fat_dirent));
-			fat_open_dirent(dir_entry, dir, fat_info);
-
-			int prefix_len = strlen(prefix);
-			char *new_prefix = (char *) calloc(prefix_len + 2, 1);
-			strcpy(new_prefix, prefix);
-			new_prefix[prefix_len] = '\t';
-			traverse_dirent(dir, needle, new_prefix, fat_info);
-			fat_close_dirent(*dir);
-			free(new_prefix);
-			free(dir);
-			free(filename);
+			struct dir_iter *dir = open_dir(&dir_entry, info);
+			int found = traverse_dirent(dir, needle, info);
+			close_dir(dir);
+			if (found) return 1;
 			continue;
 		}
-		if (needle == NULL){
-			if (dir_entry.attr & 0x01) putchar('R'); else putchar(' ');
-			if (dir_entry.attr & 0x02) putchar('H'); else putchar(' ');
-			if (dir_entry.attr & 0x04) putchar('S'); else putchar(' ');
-			if (dir_entry.attr & 0x08) putchar('Y'); else putchar(' ');
-			if (dir_entry.attr & 0x20) putchar('M'); else putchar(' ');
-			printf(" | ");
-
-			struct tm creation_time = get_creation_time(dir_entry);
-			printf("%.24s | ", asctime(&creation_time));
-			struct tm access_time = get_access_time(dir_entry);
-			printf("%.24s\n", asctime(&access_time));
+
+		char *filename = get_name(dir_entry);
+		if (!strcmp(filename, needle)) {
+			int ret = print_file(dir_entry, info);
+			if (ret) fprintf(stderr, "Error while reading file: %s (%d)\n", strerror(errno), ret);
 			free(filename);
-		}else{
-			if (!strcmp(filename, needle)) {
-				int ret = print_file(dir_entry, fat_info);
-				if (ret) fprintf(stderr, "Error while reading file: %s (%d)\n", strerror(errno), ret);
-				free(filename);
-				return;
-			}
+			return 1;
 		}
+		free(filename);
 	}
+	return 0;
+}
+
+void usage(char *name){
+	printf("Usage: %s [-j THREADS] [-u] [-e PATTERN]... [-f PATTERN_FILE] IMAGE [FILE]\n", name);
+	puts("    IMAGE - FAT16 or FAT32 image\n");
+	puts("    Not providing argument FILE, program will print out all files\n");
+	puts("    File attributes are printed after file\n");
+	puts("    R - Read Only, H - hidden file, S - system file\n");
+	puts("    Y - Special Entry, D - Directory, M - Modified Flag\n");
+	puts("    -j THREADS - number of threads reading directories\n");
+	puts("    -u - print entries as soon as they are read, with full paths\n");
+	puts("    -e PATTERN - print paths of all entries matching the name or glob, may be repeated\n");
+	puts("    -f PATTERN_FILE - same for patterns listed one per line, - is stdin\n");
+	puts("    Patterns with / match full paths, * doesn't match / there, ** does\n");
+	puts("    Set IMAGE_BACKEND=mmap to read the image through mmap\n");
+	exit(1);
 }
 
 int main(int argc, char *argv[]){
-	if (argc < 2){
-		printf("Usage: %s IMAGE [FILE]\n", argv[0]);
-		puts("    IMAGE - FAT16 image\n");
-		puts("    Not providing argument FILE, program will print out all files\n");
-		puts("    File attributes are printed after file\n");
-		puts("    R - Read Only, H - hidden file, S - system file\n");
-		puts("    Y - Special Entry, D - Directory, M - Modified Flag\n");
-		printf("Usage: %s IMAGE [FILE]", argv[0]);
-		printf("Usage: %s IMAGE [FILE]", argv[0]);
-		exit(1);
+	int threads = WALK_THREADS;
+	struct list_options options = { .order = WALK_ORDERED };
+	struct find_options find = { .matches = 0 };
+	pattern_set_init(&find.patterns);
+
+	int opt;
+	while ((opt = getopt(argc, argv, "j:ue:f:")) != -1){
+		if (opt == 'j') threads = atoi(optarg);
+		else if (opt == 'u') options.order = WALK_UNORDERED;
+		else if (opt == 'e'){
+			if (pattern_add(&find.patterns, optarg) == -1) err_exit(optarg);
+		}else if (opt == 'f'){
+			if (pattern_add_file(&find.patterns, optarg) == -1) err_exit(optarg);
+		}
+		else usage(argv[0]);
+	}
+	if (optind >= argc) usage(argv[0]);
+
+	char *needle = optind + 1 < argc ? argv[optind + 1] : NULL;
+	struct image *img = image_open(argv[optind], get_image_mode());
+	if (img == NULL) err_exit("Can't open image");
+
+	struct fs_info *info = get_fs_info(img);
+	if (info == NULL) err_exit("Can't mount image");
+	image_advise(img, info -> data_offset, 0, needle == NULL ? IMAGE_SEQUENTIAL : IMAGE_RANDOM);
+
+	int ret = 0;
+	unsigned long looped = 0;
+	if (find.patterns.count){
+		//All patterns are matched in one walk, missing ones are reported after it
+		looped = walk_tree(info, threads, options.order, find_dirent, &find);
+		for (int i = 0; i < find.patterns.count; i++){
+			if (find.patterns.patterns[i].found) continue;
+			fprintf(stderr, "Not found: %s\n", find.patterns.patterns[i].text);
+			ret = 1;
+		}
+	}else if (needle == NULL){
+		looped = walk_tree(info, threads, options.order, print_dirent, &options);
+	}else{
+		struct dir_iter *root_dirent = open_root_dir(info);
+		traverse_dirent(root_dirent, needle, info);
+		close_dir(root_dirent);
+	}
+	if (looped){
+		fprintf(stderr, "%lu looped directories skipped\n", looped);
+		ret = 1;
 	}
-	int fd = open(argv[1], O_RDONLY);
-
-	struct fat_boot_sector boot_sector;
-	read(fd, &boot_sector, sizeof(boot_sector));
-
-	unsigned short sector_size = __le16_to_cpu(*(__le16 *)boot_sector.sector_size);
-	unsigned short dir_entries_count = __le16_to_cpu(*(__le16 *)boot_sector.dir_entries);
-	unsigned short cluster_size = boot_sector.sec_per_clus * sector_size;
-	unsigned short reserved_size = boot_sector.reserved * sector_size;
-
-	unsigned short FAT_table_size = boot_sector.fat_length * boot_sector.fats * sector_size;
-	unsigned short root_directory_size = dir_entries_count * sizeof(struct msdos_dir_entry);
-
-	unsigned short data_offset = reserved_size + FAT_table_size + root_directory_size;
-
-	lseek(fd, reserved_size, SEEK_SET);
-	unsigned short *fat_table = (unsigned short *) malloc(FAT_table_size);
-	read(fd, fat_table, FAT_table_size);
-
-	struct msdos_dir_entry *dir_entries = (struct msdos_dir_entry *) malloc(root_directory_size);
-	read(fd, dir_entries, root_directory_size);
-
-	struct fat_info fat_info = {
-		.fat_table = fat_table,
-		.fd = fd,
-		.cluster_size = cluster_size,
-		.data_offset = data_offset
-	};
-
-	//Setup root directory by hands, it is not required for FAT32, only FAT16
-	struct fat_dirent root_dirent = {
-		.fat_info = fat_info,
-		.buffer = dir_entries,
-		.current_offset = 0,
-		.cluster = 0,
-		.cluster_count = dir_entries_count
-	};
-
-	if (argc < 3)
-		traverse_dirent(&root_dirent, NULL, (char *)"", fat_info);
-	else
-		traverse_dirent(&root_dirent, argv[2], (char *)"", fat_info);
-
-	free(fat_table);
-	free(dir_entries);
 
-	if (argc < 2)
-	return 0;
+	pattern_set_fini(&find.patterns);
+	free_fs_info(info);
+	image_close(img);
+	return ret;
 }
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
@@ -5,261 +7,481 @@
 #include <time.h>
 #include <linux/msdos_fs.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "fat.h"
+#include "fat_walk.h"
 
-#define FAT_FILEPATH "../../fat16_img"
-
-#define SEC_MASK        0b0000000000011111
-#define MIN_MASK        0b0000011111100000
-#define HOUR_MASK       0b1111100000000000
-#define DAY_MASK        0b0000000000011111
-#define MONTH_MASK      0b0000000111100000
-#define YEAR_MASK       0b1111111000000000
 
-#define FILENAME_LENGTH     8
-#define EXTENSION_LENGTH    3
-#define END_OF_CAT          0x00
-#define DENTRY_IS_DIR       0x2E
-#define INIT_OFFSET        -1
+#define FAT_FILEPATH "../../fat16_img"
 
 #define INDENT_1    16
 #define INDENT_2    9
 #define INDENT_3    27
 
-#define err_exit(msg)    do {                    \
-                             perror(msg);        \
-                             exit(EXIT_FAILURE); \
-                         } while (0)
-
-
-struct fs_info {
-    FILE *file;
-
-    unsigned short cluster_size;
-    unsigned short data_offset;
+#define ATTR_LENGTH     6
+#define ASCTIME_LENGTH  24
+#define ASCDATE_LENGTH  15                  //  Sun Jan  1 2017
+#define OUT_BUF_SIZE    (64 * 1024)
+#define DATE_WORDS      65536               //  Every value of a 16 bit date or time
+#define LIST_MAGIC      "FATLIST1"
 
-    unsigned short *FAT_table;
 
-    struct msdos_dir_entry *root_dir;
-    unsigned short dir_entries;
+enum list_format {
+    LIST_TEXT,
+    LIST_JSONL,
+    LIST_CSV,
+    LIST_BIN
 };
 
 
-struct dir_iter {
+struct list_options {
+    enum walk_order order;
+    enum list_format format;
     struct fs_info *info;
-
-    void *data;
-    long offset;
-
-    unsigned short cluster;
-    unsigned int dentry_in_cluster;
 };
 
 
-struct fs_info *get_fs_info(FILE *file);
+//  Binary listing is LIST_MAGIC followed by records. Fields are little endian
+//  and keep raw on disk values; path_len bytes of path follow each record.
+struct list_record {
+    __le32 size;
+    __le32 cluster;
+    __le16 ctime;
+    __le16 cdate;
+    __le16 time;
+    __le16 date;
+    __le16 adate;
+    __u8 attr;
+    __u8 depth;                 //  UINT8_MAX for deeper entries, their path is exact
+    __le32 path_len;
+} __attribute__((packed));
+
+
+//  Output is collected here and written by large chunks. Callbacks of the
+//  walker are serialized, so one buffer is enough.
+struct out_buf {
+    char data[OUT_BUF_SIZE];
+    size_t len;
+};
 
-char *get_attributes(unsigned char attr);
-char *get_filename(char *name);
-struct tm *get_ctime(struct msdos_dir_entry *dentry);
-struct tm *get_atime(struct msdos_dir_entry *dentry);
 
-struct msdos_dir_entry *get_next_dentry(struct dir_iter *dir);
-struct dir_iter *open_dir(struct msdos_dir_entry *dentry, struct fs_info *info);
+//  Decoded date word. Images have few distinct dates and times,
+//  so each of them is formatted once.
+struct date_text {
+    char iso[10];                           //  1980-01-01
+    char day[10];                           //  Tue Jan  1
+    char year[4];
+};
 
-void print_dir_entry(struct msdos_dir_entry *dentry, struct fs_info *info, int dir_level);
-void print_dir(struct dir_iter *dir, int dir_level);
 
+static struct out_buf out;
+
+static struct date_text dates[DATE_WORDS];
+static char times[DATE_WORDS][8];           //  12:00:00
+static unsigned char date_known[DATE_WORDS / 8];
+static unsigned char time_known[DATE_WORDS / 8];
+
+static const char *week_days[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+static const char *months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                               "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+
+void out_flush();
+void print_header(enum list_format format);
+void print_dir_entry(struct walk_entry *entry, void *arg);
+
+
+int main(int argc, char *argv[]) {
+    struct list_options options = { .order = WALK_ORDERED, .format = LIST_TEXT };
+    int threads = WALK_THREADS;
+
+    int opt;
+    while((opt = getopt(argc, argv, "j:uf:")) != -1) {
+        if(opt == 'j')
+            threads = atoi(optarg);
+        else if(opt == 'u')
+            options.order = WALK_UNORDERED;
+        else if(opt == 'f' && !strcmp(optarg, "text"))
+            options.format = LIST_TEXT;
+        else if(opt == 'f' && !strcmp(optarg, "jsonl"))
+            options.format = LIST_JSONL;
+        else if(opt == 'f' && !strcmp(optarg, "csv"))
+            options.format = LIST_CSV;
+        else if(opt == 'f' && !strcmp(optarg, "bin"))
+            options.format = LIST_BIN;
+        else {
+            fprintf(stderr, "Usage: %s [-j THREADS] [-u] [-f text|jsonl|csv|bin]\n", argv[0]);
+            return 1;
+        }
+    }
 
-int main() {
-    FILE *file = fopen(FAT_FILEPATH, "r");
-    if(!file)
-        err_exit("Can't open fat 16 file");
+    struct image *img = image_open(FAT_FILEPATH, get_image_mode());
+    if(!img)
+        err_exit("Can't open fat file");
 
-    struct fs_info *info = get_fs_info(file);
-    //printf("%d\n", info->FAT_table);
+    options.info = get_fs_info(img);
+    if(!options.info)
+        err_exit("Can't mount fat file");
+    image_advise(img, options.info->data_offset, 0, IMAGE_SEQUENTIAL);
 
-    printf("%-*s%-*s%-*s%-*s\n\n", INDENT_1, "FILE", INDENT_2, "ATTRIB", INDENT_3, "CREATION_TIME", INDENT_3, "ACCESS_TIME");
-    struct dir_iter root_iter = { info, info->root_dir, 0, 0, info->dir_entries };
-    print_dir(&root_iter, 0);
+    print_header(options.format);
+    unsigned long looped = walk_tree(options.info, threads, options.order, print_dir_entry, &options);
+    out_flush();
+    if(looped)
+        fprintf(stderr, "%lu looped directories skipped\n", looped);
 
-    return 0;
+    free_fs_info(options.info);
+    image_close(img);
+    return looped != 0;
 }
 
 
-void print_dir(struct dir_iter *dir, int dir_level) {
-    struct msdos_dir_entry *curr_dentry = get_next_dentry(dir);
-
-    while(curr_dentry && curr_dentry->name[0] != END_OF_CAT) {
-        if(curr_dentry->name[0] == DELETED_FLAG|| curr_dentry->name[0] == DENTRY_IS_DIR) {
-            curr_dentry = get_next_dentry(dir);
+void out_flush() {
+    size_t done = 0;
+    while(done < out.len) {
+        ssize_t ret = write(STDOUT_FILENO, out.data + done, out.len - done);
+        if(ret < 0 && errno == EINTR)
             continue;
-        }
+        if(ret < 0)
+            err_exit("Can't write listing");
+        done += ret;
+    }
+    out.len = 0;
+}
 
-        print_dir_entry(curr_dentry, dir->info, dir_level);
 
-        curr_dentry = get_next_dentry(dir);
+void out_mem(const void *data, size_t len) {
+    while(out.len + len > OUT_BUF_SIZE) {
+        size_t part = OUT_BUF_SIZE - out.len;
+        memcpy(out.data + out.len, data, part);
+        out.len = OUT_BUF_SIZE;
+        out_flush();
+        data = (const char *)data + part;
+        len -= part;
     }
+
+    memcpy(out.data + out.len, data, len);
+    out.len += len;
 }
 
 
-struct msdos_dir_entry *get_next_dentry(struct dir_iter *dir) {
-    if(dir->offset == INIT_OFFSET) {
-        long offset = dir->info->data_offset + (dir->cluster - FAT_START_ENT) * dir->info->cluster_size;
-        if(fseek(dir->info->file, offset, SEEK_SET) == -1)
-            err_exit("Can't seek cluster offset");
+void out_char(char c) {
+    if(out.len == OUT_BUF_SIZE)
+        out_flush();
+    out.data[out.len++] = c;
+}
 
-        if(!fread(dir->data, sizeof(struct msdos_dir_entry), dir->dentry_in_cluster, dir->info->file))
-            err_exit("Can't read cluster");
 
-        dir->offset = 0;
-        return (struct msdos_dir_entry *)dir->data;
-    }
+void out_str(const char *str) {
+    out_mem(str, strlen(str));
+}
 
-    dir->offset++;
-    if(dir->offset < dir->dentry_in_cluster)
-        return ((struct msdos_dir_entry *)dir->data) + dir->offset;
-    else {
-        dir->cluster = dir->info->FAT_table[dir->cluster];
-        if(dir->cluster == dir->info->FAT_table[1])
-            return NULL;
 
-        dir->offset = INIT_OFFSET;
-        return get_next_dentry(dir);
-    }
+void out_pad(int count) {
+    while(count-- > 0)
+        out_char(' ');
 }
 
 
-struct dir_iter *open_dir(struct msdos_dir_entry *dentry, struct fs_info *info) {
-    struct dir_iter *new_diter = (struct dir_iter *)calloc(1, sizeof(struct dir_iter));
+void out_uint(unsigned long value) {
+    char digits[20];
+    int len = 0;
+    do {
+        digits[sizeof(digits) - ++len] = '0' + value % 10;
+        value /= 10;
+    } while(value);
+
+    out_mem(digits + sizeof(digits) - len, len);
+}
+
 
-    new_diter->info = info;
-    new_diter->dentry_in_cluster = info->cluster_size / sizeof(struct msdos_dir_entry);
-    new_diter->cluster = dentry->start;
-    new_diter->offset = INIT_OFFSET;
-    new_diter->data = (void *)calloc(new_diter->dentry_in_cluster, sizeof(struct msdos_dir_entry));
+//  Length of the valid UTF-8 sequence at str, 0 if it is not one:
+//  overlong forms, surrogates and code points past U+10FFFF are not
+int utf8_sequence(const unsigned char *str) {
+    int len = str[0] >= 0xF5 ? 0 : str[0] >= 0xF0 ? 4 : str[0] >= 0xE0 ? 3 : str[0] >= 0xC2 ? 2 : 0;
+    if((str[0] == 0xE0 && str[1] < 0xA0) || (str[0] == 0xED && str[1] >= 0xA0) ||
+       (str[0] == 0xF0 && str[1] < 0x90) || (str[0] == 0xF4 && str[1] >= 0x90))
+        return 0;
 
-    return new_diter;
+    for(int i = 1; i < len; ++i)
+        if((str[i] & 0xC0) != 0x80)
+            return 0;
+    return len;
 }
 
 
-struct fs_info *get_fs_info(FILE *file) {
-    struct fat_boot_sector BS;
-    if(!fread(&BS, sizeof(struct fat_boot_sector), 1, file))
-        err_exit("Can't read the boot sector");
+//  Writes string body without quotes. Long names are UTF-8, while short
+//  names keep bytes of the OEM code page: bytes that are not UTF-8 are
+//  taken as Latin-1 and written as \u00XX, so every line is valid JSON.
+void out_json_str(const char *str) {
+    const char *run = str;
+    for(; *str; ++str) {
+        unsigned char c = *str;
+        if(c >= 0x80) {
+            int len = utf8_sequence((const unsigned char *)str);
+            if(len) {
+                str += len - 1;
+                continue;
+            }
+        }
+        else if(c >= 0x20 && c != '"' && c != '\\')
+            continue;
 
-    unsigned short sector_size = __le16_to_cpu(*(__le16 *)BS.sector_size);
-    unsigned short dir_entries = __le16_to_cpu(*(__le16 *)BS.dir_entries);
+        out_mem(run, str - run);
+        run = str + 1;
+        if(c == '"' || c == '\\') {
+            out_char('\\');
+            out_char(c);
+        }
+        else {
+            char escape[7];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            out_mem(escape, 6);
+        }
+    }
+    out_mem(run, str - run);
+}
 
-    unsigned short reserved_size = BS.reserved * sector_size;
-    if(fseek(file, reserved_size, SEEK_SET) == -1)
-        err_exit("Can't seek FAT table offset");
 
-    unsigned short FAT_table_size = BS.fat_length * sector_size;
-    unsigned short *FAT_table = (unsigned short *)calloc(1, sizeof(FAT_table_size));
-    if(!FAT_table)
-        err_exit("Can't allocate memory for FAT table");
+//  Writes string body without quotes, quotes inside are doubled
+void out_csv_str(const char *str) {
+    const char *quote;
+    while((quote = strchr(str, '"'))) {
+        out_mem(str, quote - str + 1);
+        out_char('"');
+        str = quote + 1;
+    }
+    out_str(str);
+}
 
-    if(!fread(FAT_table, sizeof(FAT_table_size), 1, file))
-        err_exit("Can't read FAT table");
 
-    if(fseek(file, BS.fats * FAT_table_size + reserved_size, SEEK_SET) == -1)
-        err_exit("Can't seek root offset");
+int week_day(int year, int month, int day) {
+    static const int shift[] = {0, 3, 2, 5, 0, 3, 5, 1, 4, 6, 2, 4};
+    year -= month < 3;
+    return (year + year / 4 - year / 100 + year / 400 + shift[month - 1] + day) % 7;
+}
 
-    struct msdos_dir_entry *root_dir_entries = (struct msdos_dir_entry *)calloc(dir_entries, sizeof(struct msdos_dir_entry));
-    if(!root_dir_entries)
-        err_exit("Can't allocate memory for root dir reading");
 
-    if(!fread(root_dir_entries, sizeof(struct msdos_dir_entry), dir_entries, file))
-        err_exit("Can't read the root directory");
+struct date_text *get_date(unsigned word) {
+    struct date_text *text = &dates[word];
+    if(date_known[word / 8] & (1 << word % 8))
+        return text;
 
-    struct fs_info *info = (struct fs_info *)calloc(1, sizeof(struct fs_info));
-    if(!info)
-        err_exit("Can't allocate memory for fs info");    
+    int day = word & DAY_MASK;
+    int month = (word & MONTH_MASK) >> 5;
+    int year = ((word & YEAR_MASK) >> 9) + 1980;
+    int valid = month >= 1 && month <= 12 && day >= 1;
 
-    info->file = file;
-    info->cluster_size = BS.sec_per_clus * sector_size;
-    info->data_offset = reserved_size + FAT_table_size * BS.fats + dir_entries * sizeof(struct msdos_dir_entry);
-    info->FAT_table = FAT_table;
-    info->root_dir = root_dir_entries;    
-    info->dir_entries = dir_entries;
+    char buffer[16];
+    snprintf(buffer, sizeof(buffer), "%04d-%02d-%02d", year, month, day);
+    memcpy(text->iso, buffer, sizeof(text->iso));
+    snprintf(buffer, sizeof(buffer), "%.3s %.3s%3d", valid ? week_days[week_day(year, month, day)] : "???",
+                                                     valid ? months[month - 1] : "???", day);
+    memcpy(text->day, buffer, sizeof(text->day));
+    snprintf(buffer, sizeof(buffer), "%04d", year);
+    memcpy(text->year, buffer, sizeof(text->year));
 
-    return info;
+    date_known[word / 8] |= 1 << word % 8;
+    return text;
 }
 
 
-void print_dir_entry(struct msdos_dir_entry *dentry, struct fs_info *info, int dir_level) {
-    int lvl_indent = dir_level * 2;
-    if(dentry->attr & ATTR_DIR)
-        printf("%-*s%-*.8s", lvl_indent, "", INDENT_1 - lvl_indent, dentry->name);
-    else
-        printf("%-*s%-*s", lvl_indent, "", INDENT_1 - lvl_indent, get_filename((char *)dentry->name));
+const char *get_time(unsigned word) {
+    if(time_known[word / 8] & (1 << word % 8))
+        return times[word];
 
-    printf("%-*s", INDENT_2, get_attributes(dentry->attr));
-    printf("%-*.24s%-*.24s\n", INDENT_3, asctime(get_ctime(dentry)),
-                               INDENT_3, asctime(get_ctime(dentry)));
+    char buffer[16];
+    snprintf(buffer, sizeof(buffer), "%02u:%02u:%02u", (word & HOUR_MASK) >> 11,
+                                                       (word & MIN_MASK) >> 5,
+                                                       (word & SEC_MASK) * 2);
+    memcpy(times[word], buffer, sizeof(times[word]));
 
-    if(dentry->attr & ATTR_DIR)
-        print_dir(open_dir(dentry, info), dir_level + 1);
+    time_known[word / 8] |= 1 << word % 8;
+    return times[word];
 }
 
 
-char *get_filename(char *name) {
-    char *filename = (char *)calloc(13, sizeof(char));
-    if(!filename)
-        err_exit("Can't allocate memory for filename");
-
-    for(int i = 0; i < 8; ++i) {
-        if(name[i] != ' ')
-            strncpy(filename, &name[i], 1);
-    }
+//  Same layout as asctime: Tue Jan  1 12:00:00 1980
+void out_asctime(unsigned date, unsigned time) {
+    struct date_text *text = get_date(date);
+    out_mem(text->day, sizeof(text->day));
+    out_char(' ');
+    out_mem(get_time(time), sizeof(times[0]));
+    out_char(' ');
+    out_mem(text->year, sizeof(text->year));
+}
 
-    strncat(filename, ".", 1);
-    strncat(filename, &name[8], 3);
 
-    return filename;
+void out_ascdate(unsigned date) {
+    struct date_text *text = get_date(date);
+    out_mem(text->day, sizeof(text->day));
+    out_char(' ');
+    out_mem(text->year, sizeof(text->year));
 }
 
 
-char *get_attributes(unsigned char attr) {
-    char *output = (char *)calloc(7, sizeof(char));
+//  ISO 8601 without zone: 1980-01-01T12:00:00
+void out_isotime(unsigned date, unsigned time) {
+    out_mem(get_date(date)->iso, sizeof(dates[0].iso));
+    out_char('T');
+    out_mem(get_time(time), sizeof(times[0]));
+}
 
-    strcat(output, attr & ATTR_RO ? "R" : "-");
-    strcat(output, attr & ATTR_HIDDEN ? "H" : "-");
-    strcat(output, attr & ATTR_SYS ? "S" : "-");
-    strcat(output, attr & ATTR_VOLUME ? "V" : "-");
-    strcat(output, attr & ATTR_DIR ? "D" : "-");
-    strcat(output, attr & ATTR_ARCH ? "A" : "-");
 
-    return output;
+void get_attributes(unsigned char attr, char *output) {
+    output[0] = attr & ATTR_RO ? 'R' : '-';
+    output[1] = attr & ATTR_HIDDEN ? 'H' : '-';
+    output[2] = attr & ATTR_SYS ? 'S' : '-';
+    output[3] = attr & ATTR_VOLUME ? 'V' : '-';
+    output[4] = attr & ATTR_DIR ? 'D' : '-';
+    output[5] = attr & ATTR_ARCH ? 'A' : '-';
 }
 
 
-struct tm *get_atime(struct msdos_dir_entry *dentry) {
-    struct tm *dt = (struct tm *)calloc(1, sizeof(struct tm));
+void print_header(enum list_format format) {
+    if(format == LIST_TEXT) {
+        out_str("FILE");
+        out_pad(INDENT_1 - 4);
+        out_str("ATTRIB");
+        out_pad(INDENT_2 - 6);
+        out_str("CREATION_TIME");
+        out_pad(INDENT_3 - 13);
+        out_str("ACCESS_DATE");
+        out_pad(INDENT_3 - 11);
+        out_str("\n\n");
+    }
+    else if(format == LIST_CSV)
+        out_str("path,name,attr,size,cluster,ctime,mtime,adate\n");
+    else if(format == LIST_BIN)
+        out_mem(LIST_MAGIC, strlen(LIST_MAGIC));
+}
 
-    dt->tm_sec  = (dentry->time & SEC_MASK) * 2;
-    dt->tm_min  = (dentry->time & MIN_MASK) >> 5;
-    dt->tm_hour = (dentry->time & HOUR_MASK) >> 11;
 
-    dt->tm_mday = (dentry->adate & DAY_MASK);
-    dt->tm_mon  = ((dentry->adate & MONTH_MASK) >> 5) - 1;
-    dt->tm_year = ((dentry->adate & YEAR_MASK) >> 9) + 80;
+//  Unordered text entries are printed with the path of their directory,
+//  as entries of different directories are mixed. FAT keeps no access
+//  time of day, so only the access date is shown.
+void print_text(struct walk_entry *entry, struct list_options *options) {
+    struct msdos_dir_entry *dentry = entry->dentry;
+    char attr[ATTR_LENGTH];
+    get_attributes(dentry->attr, attr);
 
-    return dt;
+    int lvl_indent = 0;
+    if(options->order == WALK_UNORDERED) {
+        out_str(entry->path);
+        out_char('/');
+    }
+    else
+        lvl_indent = entry->depth * 2;
+
+    out_pad(lvl_indent);
+    out_str(entry->name);
+    out_pad(INDENT_1 - lvl_indent - (int)strlen(entry->name));
+    out_mem(attr, ATTR_LENGTH);
+    out_pad(INDENT_2 - ATTR_LENGTH);
+    out_asctime(__le16_to_cpu(dentry->cdate), __le16_to_cpu(dentry->ctime));
+    out_pad(INDENT_3 - ASCTIME_LENGTH);
+    out_ascdate(__le16_to_cpu(dentry->adate));
+    out_pad(INDENT_3 - ASCDATE_LENGTH);
+    out_char('\n');
 }
 
 
-struct tm *get_ctime(struct msdos_dir_entry *dentry) {
-    struct tm *dt = (struct tm *)calloc(1, sizeof(struct tm));
+void print_jsonl(struct walk_entry *entry, struct list_options *options) {
+    struct msdos_dir_entry *dentry = entry->dentry;
+    char attr[ATTR_LENGTH];
+    get_attributes(dentry->attr, attr);
+
+    out_str("{\"path\":\"");
+    out_json_str(entry->path);
+    out_char('/');
+    out_json_str(entry->name);
+    out_str("\",\"name\":\"");
+    out_json_str(entry->name);
+    out_str("\",\"attr\":\"");
+    out_mem(attr, ATTR_LENGTH);
+    out_str("\",\"size\":");
+    out_uint(__le32_to_cpu(dentry->size));
+    out_str(",\"cluster\":");
+    out_uint(get_dentry_start(dentry, options->info));
+    out_str(",\"ctime\":\"");
+    out_isotime(__le16_to_cpu(dentry->cdate), __le16_to_cpu(dentry->ctime));
+    out_str("\",\"mtime\":\"");
+    out_isotime(__le16_to_cpu(dentry->date), __le16_to_cpu(dentry->time));
+    out_str("\",\"adate\":\"");
+    out_mem(get_date(__le16_to_cpu(dentry->adate))->iso, sizeof(dates[0].iso));
+    out_str("\"}\n");
+}
+
 
-    dt->tm_sec  = (dentry->ctime & SEC_MASK) * 2;
-    dt->tm_min  = (dentry->ctime & MIN_MASK) >> 5;
-    dt->tm_hour = (dentry->ctime & HOUR_MASK) >> 11;
+void print_csv(struct walk_entry *entry, struct list_options *options) {
+    struct msdos_dir_entry *dentry = entry->dentry;
+    char attr[ATTR_LENGTH];
+    get_attributes(dentry->attr, attr);
+
+    //  Path contains the name, so one check covers both fields
+    int quoted = strpbrk(entry->path, ",\"\r\n") || strpbrk(entry->name, ",\"\r\n");
+    const char *quote = quoted ? "\"" : "";
+
+    out_str(quote);
+    out_csv_str(entry->path);
+    out_char('/');
+    out_csv_str(entry->name);
+    out_str(quote);
+    out_char(',');
+    out_str(quote);
+    out_csv_str(entry->name);
+    out_str(quote);
+    out_char(',');
+    out_mem(attr, ATTR_LENGTH);
+    out_char(',');
+    out_uint(__le32_to_cpu(dentry->size));
+    out_char(',');
+    out_uint(get_dentry_start(dentry, options->info));
+    out_char(',');
+    out_isotime(__le16_to_cpu(dentry->cdate), __le16_to_cpu(dentry->ctime));
+    out_char(',');
+    out_isotime(__le16_to_cpu(dentry->date), __le16_to_cpu(dentry->time));
+    out_char(',');
+    out_mem(get_date(__le16_to_cpu(dentry->adate))->iso, sizeof(dates[0].iso));
+    out_char('\n');
+}
 
-    dt->tm_mday = (dentry->cdate & DAY_MASK);
-    dt->tm_mon  = ((dentry->cdate & MONTH_MASK) >> 5) - 1;
-    dt->tm_year = ((dentry->cdate & YEAR_MASK) >> 9) + 80;
 
-    return dt;
+void print_bin(struct walk_entry *entry, struct list_options *options) {
+    struct msdos_dir_entry *dentry = entry->dentry;
+    size_t path_len = strlen(entry->path);
+    size_t name_len = strlen(entry->name);
+
+    struct list_record record = {
+        .size = dentry->size,
+        .cluster = __cpu_to_le32(get_dentry_start(dentry, options->info)),
+        .ctime = dentry->ctime,
+        .cdate = dentry->cdate,
+        .time = dentry->time,
+        .date = dentry->date,
+        .adate = dentry->adate,
+        .attr = dentry->attr,
+        .depth = entry->depth < UINT8_MAX ? entry->depth : UINT8_MAX,
+        .path_len = __cpu_to_le32(path_len + 1 + name_len)
+    };
+
+    out_mem(&record, sizeof(record));
+    out_mem(entry->path, path_len);
+    out_char('/');
+    out_mem(entry->name, name_len);
 }
 
+
+void print_dir_entry(struct walk_entry *entry, void *arg) {
+    struct list_options *options = (struct list_options *)arg;
+
+    if(options->format == LIST_TEXT)
+        print_text(entry, options);
+    else if(options->format == LIST_JSONL)
+        print_jsonl(entry, options);
+    else if(options->format == LIST_CSV)
+        print_csv(entry, options);
+    else
+        print_bin(entry, options);
+}
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
@@ -7,140 +9,155 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "fat.h"
 
-#define FAT_FILEPATH "../../fat16_img"
 
-#define SEC_MASK        0b0000000000011111
-#define MIN_MASK        0b0000011111100000
-#define HOUR_MASK       0b1111100000000000
-#define DAY_MASK        0b0000000000011111
-#define MONTH_MASK      0b0000000111100000
-#define YEAR_MASK       0b1111111000000000
+#define FAT_FILEPATH "../../fat16_img"
 
 #define FILENAME_LENGTH     8
 #define EXTENSION_LENGTH    3
 #define END_OF_CAT          0x00
 #define DENTRY_IS_DIR       0x2E
-#define INIT_OFFSET        -1
+
+#define READ_CHUNK  (64 * 1024)
 
 #define INDENT_1    16
 #define INDENT_2    9
 #define INDENT_3    27
 
-#define err_exit(msg)    do {                    \
-                             perror(msg);        \
-                             exit(EXIT_FAILURE); \
-                         } while (0)
-
-
-struct fs_info {
-    int fat_fd;
-
-    unsigned short cluster_size;
-    unsigned short data_offset;
-
-    unsigned short *FAT_table;
-
-    struct msdos_dir_entry *root_dir;
-    unsigned short dir_entries;
-};
-
-
-struct dir_iter {
-    struct fs_info *info;
-
-    void *data;
-    long offset;
-
-    unsigned short cluster;
-    unsigned int dentry_in_cluster;
-};
-
-
-struct file_iter {
-    struct fs_info *info;
-    void *data;
-    unsigned short next_cluster;
-};
-
-
-struct fs_info *get_fs_info(int fd);
-struct msdos_dir_entry *get_next_dentry(struct dir_iter *dir);
-struct dir_iter *open_dir(struct msdos_dir_entry *dentry, struct fs_info *info);
-struct msdos_dir_entry *find_dir_entry(struct dir_iter *dir_iter, char *dentry_name);
-struct msdos_dir_entry *find_file(char *filepath, struct fs_info *info);
-void *get_next_cluster(struct file_iter *fiter);
-struct file_iter *open_file(struct msdos_dir_entry *dentry, struct fs_info *info);
+int find_dir_entry(struct dir_iter *dir_iter, char *dentry_name, struct msdos_dir_entry *dentry);
+int find_file(char *filepath, struct fs_info *info, struct msdos_dir_entry *dentry);
 
 char *get_filename(char *name);
 char *read_filepath();
 char *cut_filepath(char *filepath);
 char *get_curr_dir_name(char *filepath);
 int names_cmp(char *str1, char *str2);
-void print_file(char *filepath, struct fs_info *info);
+int print_file(char *filepath, struct fs_info *info, off_t offset, off_t length);
+
+
+//  Paths are read one per line until EOF, directory clusters shared
+//  by them are read from the image once. -s prints cache hit rates,
+//  -o and -n print only length bytes of every file from offset.
+int main(int argc, char *argv[]) {
+    int print_stats = 0;
+    off_t offset = 0;
+    off_t length = -1;
+    int opt;
+    while((opt = getopt(argc, argv, "so:n:")) != -1) {
+        switch(opt) {
+        case 's':
+            print_stats = 1;
+            break;
+        case 'o':
+            offset = strtoll(optarg, NULL, 0);
+            break;
+        case 'n':
+            length = strtoll(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-s] [-o OFFSET] [-n LENGTH]\n", argv[0]);
+            return 1;
+        }
+    }
 
+    struct image *img = image_open(FAT_FILEPATH, get_image_mode());
+    if(!img)
+        err_exit("Can't open fat file");
 
-int main() {
-    int fat_fd = open(FAT_FILEPATH, O_RDONLY);
-    if(fat_fd == -1)
-        err_exit("Can't open fat 16 file");
+    struct fs_info *info = get_fs_info(img);
+    if(!info)
+        err_exit("Can't mount fat file");
+    image_advise(img, info->data_offset, 0, IMAGE_RANDOM);
 
-    struct fs_info *info = get_fs_info(fat_fd);
+    printf("Enter path of file to print in format:\n/dir_1/dir_2/file.txt\n");
 
-    char *filepath = read_filepath();
+    int missed = 0;
+    char *filepath;
+    while((filepath = read_filepath())) {
+        missed |= print_file(filepath, info, offset, length);
+        free(filepath);
+    }
 
-    print_file(filepath, info);
+    if(print_stats)
+        print_cache_stats(info, stderr);
 
-    return 0;
+    free_fs_info(info);
+    image_close(img);
+    return missed;
 }
 
 
-void print_file(char *filepath, struct fs_info *info) {
-    struct msdos_dir_entry *fdentry = find_file(filepath, info);
-    if(!fdentry)
-        err_exit("Can't find file");
+int print_file(char *filepath, struct fs_info *info, off_t offset, off_t length) {
+    struct msdos_dir_entry fdentry;
+    char *path = strdup(filepath);
+    if(!path)
+        err_exit("Can't allocate memory for filepath");
 
-    struct file_iter *file_iter = open_file(fdentry, info);
+    int found = find_file(path, info, &fdentry);
+    free(path);
+    if(!found) {
+        fprintf(stderr, "Can't find file %s\n", filepath);
+        return 1;
+    }
 
-    printf("%s:\n", filepath);
-    char *curr_data = (char *)(get_next_cluster(file_iter));
+    struct file_iter *file_iter = open_file(&fdentry, info);
+    static char chunk[READ_CHUNK];
+    int failed = 0;
 
-    while(curr_data) {
-        int i = 0;
-        for(i = 0; i < info->cluster_size; ++i) {
-            putchar(curr_data[i]);
+    printf("%s:\n", filepath);
+    off_t end = length < 0 ? file_iter->size : offset + length;
+    while(offset < end) {
+        size_t len = end - offset < READ_CHUNK ? end - offset : READ_CHUNK;
+        ssize_t read = fat_pread(file_iter, chunk, len, offset);
+        if(read == -1) {
+            fprintf(stderr, "Can't read %s: %s\n", filepath, strerror(errno));
+            failed = 1;
         }
+        if(read <= 0)
+            break;
 
-        curr_data = (char *)get_next_cluster(file_iter);
+        fwrite(chunk, 1, read, stdout);
+        offset += read;
     }
     printf("\n");
+
+    close_file(file_iter);
+    return failed;
 }
 
 
-struct msdos_dir_entry *find_file(char *filepath, struct fs_info *info) {
+//  Copies entry of the file to dentry. Returns 0 if there is no such file.
+int find_file(char *filepath, struct fs_info *info, struct msdos_dir_entry *dentry) {
     char *curr_dir_name = get_curr_dir_name(filepath);
-    struct dir_iter root_iter = { info, info->root_dir, 0, 0, info->dir_entries };
-    struct dir_iter *curr_dir_iter = &root_iter;
-    struct msdos_dir_entry *curr_dentry;
+    struct dir_iter *curr_dir_iter = open_root_dir(info);
 
     while(curr_dir_name) {
         if(filepath[0] != '/')
             err_exit("Wrong filepath format");
 
-        curr_dentry = find_dir_entry(curr_dir_iter, curr_dir_name);
-        curr_dir_iter = open_dir(curr_dentry, info);
+        int found = find_dir_entry(curr_dir_iter, curr_dir_name, dentry);
+        close_dir(curr_dir_iter);
+        free(curr_dir_name);
+        if(!found || !(dentry->attr & ATTR_DIR))
+            return 0;
+
+        curr_dir_iter = open_dir(dentry, info);
 
         filepath = cut_filepath(filepath);
         curr_dir_name = get_curr_dir_name(filepath);
     }
 
     char *filename = get_filename(filepath);
-    curr_dentry = find_dir_entry(curr_dir_iter, filename);
-    return curr_dentry;
+    int found = find_dir_entry(curr_dir_iter, filename, dentry);
+    close_dir(curr_dir_iter);
+    free(filename);
+    return found;
 }
 
 
-struct msdos_dir_entry *find_dir_entry(struct dir_iter *dir_iter, char *dentry_name) {
+//  Entry is copied, as its cluster may be evicted once dir_iter is closed
+int find_dir_entry(struct dir_iter *dir_iter, char *dentry_name, struct msdos_dir_entry *dentry) {
     struct msdos_dir_entry *curr_dentry = get_next_dentry(dir_iter);
 
     while(curr_dentry && curr_dentry->name[0] != END_OF_CAT) {
@@ -149,38 +166,15 @@ struct msdos_dir_entry *find_dir_entry(struct dir_iter *dir_iter, char *dentry_n
             continue;
         }
 
-        if(!names_cmp(curr_dentry->name, dentry_name))
-            return curr_dentry;
+        if(!names_cmp((char *)curr_dentry->name, dentry_name)) {
+            *dentry = *curr_dentry;
+            return 1;
+        }
 
         curr_dentry = get_next_dentry(dir_iter);
     }
 
-    return NULL;
-}
-
-
-void *get_next_cluster(struct file_iter *fiter) {
-    if(fiter->next_cluster == EOF_FAT16 || fiter->next_cluster == FAT_ENT_FREE)
-        return NULL;
-
-    long offset = fiter->info->data_offset + (fiter->next_cluster - FAT_START_ENT) * fiter->info->cluster_size;
-    if(pread(fiter->info->fat_fd, fiter->data, fiter->info->cluster_size, offset) == -1)
-            err_exit("Can't read cluster");    
-
-    fiter->next_cluster = fiter->info->FAT_table[fiter->next_cluster];
-
-    return (void *)fiter->data;
-}
-
-
-struct file_iter *open_file(struct msdos_dir_entry *dentry, struct fs_info *info) {
-    struct file_iter *new_fiter = (struct file_iter *)calloc(1, sizeof(struct file_iter));
-
-    new_fiter->info = info;
-    new_fiter->next_cluster = dentry->start;
-    new_fiter->data = (void *)calloc(1, info->cluster_size);
-
-    return new_fiter;
+    return 0;
 }
 
 
@@ -208,7 +202,7 @@ char *cut_filepath(char *filepath) {
     while(filepath[i] != '/' && filepath[i] != '\0')
         i++;
 
-    strcpy(filepath, &filepath[i]);
+    memmove(filepath, &filepath[i], strlen(&filepath[i]) + 1);
     return filepath;
 }
 
@@ -228,84 +222,8 @@ char *get_curr_dir_name(char *filepath) {
     return curr_dir_name;
 }
 
-struct msdos_dir_entry *get_next_dentry(struct dir_iter *dir) {
-    if(dir->offset == INIT_OFFSET) {
-        long offset = dir->info->data_offset + (dir->cluster - FAT_START_ENT) * dir->info->cluster_size;
-        if(pread(dir->info->fat_fd, dir->data, sizeof(struct msdos_dir_entry) * dir->dentry_in_cluster, offset) == -1)
-                err_exit("Can't read cluster");        
-
-        dir->offset = 0;
-        return (struct msdos_dir_entry *)dir->data;
-    }
-
-    dir->offset++;
-    if(dir->offset < dir->dentry_in_cluster)
-        return ((struct msdos_dir_entry *)dir->data) + dir->offset;
-    else {
-        dir->cluster = dir->info->FAT_table[dir->cluster];
-        if(dir->cluster == dir->info->FAT_table[1])
-            return NULL;
-
-        dir->offset = INIT_OFFSET;
-        return get_next_dentry(dir);
-    }
-}
-
-
-struct dir_iter *open_dir(struct msdos_dir_entry *dentry, struct fs_info *info) {
-    struct dir_iter *new_diter = (struct dir_iter *)calloc(1, sizeof(struct dir_iter));
-
-    new_diter->info = info;
-    new_diter->dentry_in_cluster = info->cluster_size / sizeof(struct msdos_dir_entry);
-    new_diter->cluster = dentry->start;
-    new_diter->offset = INIT_OFFSET;
-    new_diter->data = (void *)calloc(new_diter->dentry_in_cluster, sizeof(struct msdos_dir_entry));
-
-    return new_diter;
-}
-
-
-struct fs_info *get_fs_info(int fd) {
-    struct fat_boot_sector BS;
-    if(pread(fd, &BS, sizeof(struct fat_boot_sector), 0) == -1)
-        err_exit("Can't read the boot sector");
-
-    unsigned short sector_size = __le16_to_cpu(*(__le16 *)BS.sector_size);
-    unsigned short dir_entries = __le16_to_cpu(*(__le16 *)BS.dir_entries);
-
-    unsigned short reserved_size = BS.reserved * sector_size;
-    unsigned short FAT_table_size = BS.fat_length * sector_size;
-    unsigned short *FAT_table = (unsigned short *)calloc(1, FAT_table_size);
-    if(!FAT_table)
-        err_exit("Can't allocate memory for FAT table");
-
-    if(pread(fd, FAT_table, FAT_table_size, reserved_size) == -1)
-        err_exit("Can't read FAT table");
-
-    struct msdos_dir_entry *root_dir_entries = (struct msdos_dir_entry *)calloc(dir_entries, sizeof(struct msdos_dir_entry));
-    if(!root_dir_entries)
-        err_exit("Can't allocate memory for root dir reading");
-
-    if(pread(fd, root_dir_entries, sizeof(struct msdos_dir_entry) * dir_entries, reserved_size + BS.fats * FAT_table_size) == -1)
-        err_exit("Can't read the root directory");
-
-    struct fs_info *info = (struct fs_info *)calloc(1, sizeof(struct fs_info));
-    if(!info)
-        err_exit("Can't allocate memory for fs info");
-
-    info->fat_fd = fd;
-    info->cluster_size = BS.sec_per_clus * sector_size;
-    info->data_offset = reserved_size + FAT_table_size * BS.fats + dir_entries * sizeof(struct msdos_dir_entry);
-    info->FAT_table = FAT_table;
-    info->root_dir = root_dir_entries;
-    info->dir_entries = dir_entries;
-
-    return info;
-}
-
-
 char *get_filename(char *name) {
-    char *filename = (char *)calloc(11, sizeof(char));
+    char *filename = (char *)calloc(12, sizeof(char));
     if(!filename)
         err_exit("Can't allocate memory for filename");
 
@@ -320,7 +238,8 @@ char *get_filename(char *name) {
         strncat(filename, " ", 1);
 
     int ex_len = 0;
-    if(name[len] == '.') {
+    if(name[len + 1] == '.') {
+        len++;
         for(ex_len = 0; ex_len < 3; ++ex_len)
             if(name[len + 1 + ex_len] == '\0')
                 break;
@@ -335,16 +254,15 @@ char *get_filename(char *name) {
 }
 
 
+//  Returns NULL at the end of input
 char *read_filepath() {
-    printf("Enter path of file to print in format:\n/dir_1/dir_2/file.txt\n");
-
     int path_size = 32;
     char *filepath = (char *)calloc(path_size, sizeof(char));
 
-    char c;
+    int c;
     int i = 0;
     while((c = getchar()) != '\n' && c != EOF) {
-        if(i >= path_size) {
+        if(i + 1 >= path_size) {
             path_size *= 2;
             char *new_filepath = (char *)calloc(path_size, sizeof(char));
             memcpy(new_filepath, filepath, path_size / 2);
@@ -354,6 +272,11 @@ char *read_filepath() {
         filepath[i++] = c;
     }
 
+    if(c == EOF && i == 0) {
+        free(filepath);
+        return NULL;
+    }
+
     filepath[i] = '\0';
     return filepath;
 }
@@ -0,0 +1,208 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <time.h>
+
+#include "fat.h"
+#include "fat_walk.h"
+#include "extract.h"
+
+
+#define DIR_MODE        0755
+#define FILE_MODE       0644
+#define WRITE_BITS      0222
+
+
+struct fat_extract {
+    struct fs_info *info;
+    void *table;                            //  Active FAT
+    struct extract_list list;
+
+    const char *dest;
+    const char *subtree;                    //  "" for the whole image
+    size_t subtree_len;
+    unsigned long skipped;
+
+    char **dropped;                         //  Image paths of directories not created
+    size_t dropped_count;
+};
+
+
+void extract_entry(struct walk_entry *entry, void *arg);
+
+
+int main(int argc, char *argv[]) {
+    int threads = EXTRACT_THREADS;
+
+    int opt;
+    while((opt = getopt(argc, argv, "j:")) != -1) {
+        if(opt != 'j')
+            break;
+        threads = atoi(optarg);
+    }
+
+    if(optind + 2 > argc) {
+        printf("Usage: %s [-j THREADS] IMAGE DEST [PATH]\n", argv[0]);
+        puts("    Extracts files of FAT16 or FAT32 image under PATH (all by default) into DEST");
+        puts("    with their modification times and read only attribute");
+        exit(EXIT_FAILURE);
+    }
+
+    struct image *img = image_open(argv[optind], get_image_mode());
+    if(!img)
+        err_exit("Can't open image");
+
+    struct fat_extract extract;
+    memset(&extract, 0, sizeof(struct fat_extract));
+    extract.info = get_fs_info(img);
+    if(!extract.info)
+        err_exit("Can't mount image");
+    extract.dest = argv[optind + 1];
+    extract.subtree = optind + 2 < argc ? argv[optind + 2] : "";
+    extract.subtree_len = strlen(extract.subtree);
+    while(extract.subtree_len && extract.subtree[extract.subtree_len - 1] == '/')
+        extract.subtree_len--;
+
+    void *buffer;
+    extract.table = get_fat_table(extract.info, (extract.info->fat_offset - extract.info->fat_start) / extract.info->fat_length, &buffer);
+
+    extract_init(&extract.list, img);
+    if(mkdir(extract.dest, DIR_MODE) == -1 && errno != EEXIST)
+        err_exit("Can't create destination directory");
+    walk_tree(extract.info, threads, WALK_ORDERED, extract_entry, &extract);
+
+    unsigned long errors = extract_run_jobs(&extract.list, threads);
+    printf("%zu files, %zu directories, %lld bytes, %lu errors\n",
+           extract.list.file_count, extract.list.dir_count, (long long)extract.list.bytes, errors);
+
+    extract_fini(&extract.list);
+    for(size_t i = 0; i < extract.dropped_count; ++i)
+        free(extract.dropped[i]);
+    free(extract.dropped);
+    free(buffer);
+    free_fs_info(extract.info);
+    image_close(img);
+
+    return errors || extract.skipped ? EXIT_FAILURE : 0;
+}
+
+
+//  Returns path of the entry relative to the subtree, "" for the subtree
+//  itself and NULL if it is out of the subtree. Names are compared as FAT
+//  does, ignoring case.
+const char *get_relative_path(struct fat_extract *extract, const char *path) {
+    size_t len = extract->subtree_len;
+    if(strncasecmp(path, extract->subtree, len))
+        return NULL;
+
+    if(path[len] == '/' || path[len] == '\0')
+        return path + len;
+
+    return NULL;
+}
+
+
+//  Nothing is extracted under a directory that wasn't created
+void drop_dir(struct fat_extract *extract, const char *path) {
+    extract->dropped = (char **)realloc(extract->dropped, (extract->dropped_count + 1) * sizeof(char *));
+    if(!extract->dropped || !(extract->dropped[extract->dropped_count++] = strdup(path)))
+        err_exit("Can't allocate memory for dropped directories");
+}
+
+
+int is_dropped(struct fat_extract *extract, const char *path) {
+    for(size_t i = 0; i < extract->dropped_count; ++i) {
+        size_t len = strlen(extract->dropped[i]);
+        if(!strncmp(path, extract->dropped[i], len) && (path[len] == '/' || path[len] == '\0'))
+            return 1;
+    }
+    return 0;
+}
+
+
+//  Clusters are turned into runs of the image, stopping at file size
+void add_file_runs(struct fat_extract *extract, const char *path, unsigned cluster, off_t size) {
+    struct fs_info *info = extract->info;
+    off_t done = 0;
+
+    while(done < size && !fat_is_last(info, cluster)) {
+        off_t len = size - done < info->cluster_size ? size - done : info->cluster_size;
+        extract_add_run(&extract->list, get_cluster_offset(info, cluster), done, len);
+
+        done += len;
+        cluster = get_table_entry(info, extract->table, cluster);
+    }
+
+    if(done < size) {
+        fprintf(stderr, "Chain of %s is shorter than its size, rest is zeroes\n", path);
+        extract->skipped++;
+    }
+}
+
+
+//  Called by the walker in depth first order, so parents are created first
+void extract_entry(struct walk_entry *entry, void *arg) {
+    struct fat_extract *extract = (struct fat_extract *)arg;
+    struct msdos_dir_entry *dentry = entry->dentry;
+    if(dentry->attr & ATTR_VOLUME || is_dropped(extract, entry->path))
+        return;
+
+    char path[PATH_MAX];
+    char image_path[PATH_MAX];
+    if(snprintf(image_path, sizeof(image_path), "%s/%s", entry->path, entry->name) >= (int)sizeof(image_path)) {
+        fprintf(stderr, "Path is too long: %s/%s\n", entry->path, entry->name);
+        extract->skipped++;
+        return;
+    }
+
+    const char *relative = get_relative_path(extract, image_path);
+    if(!relative)
+        return;
+
+    //  Long names may hold '/' or be "." or ".."
+    if(!extract_name_ok(entry->name, strlen(entry->name))) {
+        errno = EINVAL;
+        extract_error(&extract->list, image_path, "Can't extract entry");
+        if(dentry->attr & ATTR_DIR)
+            drop_dir(extract, image_path);
+        return;
+    }
+
+    //  Subtree directory is DEST itself, a file goes into DEST
+    if(!*relative) {
+        if(dentry->attr & ATTR_DIR)
+            return;
+        relative = strrchr(image_path, '/');
+    }
+
+    if(snprintf(path, sizeof(path), "%s%s", extract->dest, relative) >= (int)sizeof(path)) {
+        fprintf(stderr, "Path is too long: %s\n", image_path);
+        extract->skipped++;
+        return;
+    }
+
+    time_t mtime = get_fat_time(__le16_to_cpu(dentry->date), __le16_to_cpu(dentry->time));
+    time_t atime = get_fat_time(__le16_to_cpu(dentry->adate), 0);
+    mode_t mode = dentry->attr & ATTR_DIR ? DIR_MODE : FILE_MODE;
+    if(dentry->attr & ATTR_RO)
+        mode &= ~WRITE_BITS;
+
+    if(dentry->attr & ATTR_DIR) {
+        if(entry->looped) {
+            fprintf(stderr, "%s points back at a directory that is already extracted, skipped\n", image_path);
+            extract->skipped++;
+            return;
+        }
+        if(extract_add_dir(&extract->list, path, mode, atime, mtime) == -1)
+            drop_dir(extract, image_path);
+        return;
+    }
+
+    off_t size = __le32_to_cpu(dentry->size);
+    extract_add_file(&extract->list, path, size, mode, atime, mtime);
+    add_file_runs(extract, image_path, get_dentry_start(dentry, extract->info), size);
+}
@@ -0,0 +1,361 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include "fat.h"
+#include "fat_walk.h"
+
+
+#define WORD_BITS       64
+#define MAX_REPORTS     20              //  Printed problems of each kind
+
+#define INDENT_1        24
+
+
+enum problem {
+    BAD_START,
+    BROKEN_CHAIN,
+    LOOPED_CHAIN,
+    CROSS_LINK,
+    SIZE_MISMATCH,
+    LOST_CHAIN,
+    MIRROR_MISMATCH,
+    FSINFO_MISMATCH,
+    PROBLEM_KINDS
+};
+
+
+static const char *problem_names[] = {
+    "Bad start clusters",
+    "Broken chains",
+    "Looped chains",
+    "Cross-links",
+    "Size mismatches",
+    "Lost chains",
+    "FAT mirror mismatches",
+    "FSInfo mismatches"
+};
+
+
+//  Shared by walker threads. Counters and the ownership bitmap are
+//  updated with atomics, only printing is serialized.
+struct fsck {
+    struct fs_info *info;
+    void *table;                        //  Active FAT
+    unsigned last;                      //  Entries from here end a chain
+
+    unsigned long words;
+    uint64_t *owned;                    //  Clusters reached from directories
+
+    unsigned long problems[PROBLEM_KINDS];
+    unsigned long files;
+    unsigned long dirs;
+    unsigned long owned_clusters;
+    unsigned long lost_clusters;
+    unsigned long free_clusters;
+
+    pthread_mutex_t report;
+};
+
+
+void check_entry(struct walk_entry *entry, void *arg);
+unsigned long check_chain(struct fsck *fsck, unsigned start, const char *path, const char *name);
+void check_lost(struct fsck *fsck);
+void check_mirrors(struct fsck *fsck, unsigned active);
+void print_summary(struct fsck *fsck, long check_us);
+
+
+int main(int argc, char *argv[]) {
+    int threads = WALK_THREADS;
+
+    int opt;
+    while((opt = getopt(argc, argv, "j:")) != -1) {
+        if(opt != 'j')
+            break;
+        threads = atoi(optarg);
+    }
+
+    if(optind >= argc) {
+        printf("Usage: %s [-j THREADS] IMAGE\n", argv[0]);
+        puts("    Checks FAT chains of FAT16 or FAT32 image: cycles, cross-links,");
+        puts("    lost chains, file sizes and FAT copies");
+        exit(EXIT_FAILURE);
+    }
+
+    struct image *img = image_open(argv[optind], get_image_mode());
+    if(!img)
+        err_exit("Can't open image");
+
+    struct fs_info *info = get_fs_info(img);
+    if(!info)
+        err_exit("Can't mount image");
+    unsigned active = (info->fat_offset - info->fat_start) / info->fat_length;
+
+    struct fsck fsck;
+    memset(&fsck, 0, sizeof(struct fsck));
+    fsck.info = info;
+    fsck.last = info->type == FAT_TYPE_16 ? EOF_FAT16 - 7 : EOF_FAT32 - 7;
+    fsck.words = (info->cluster_count + FAT_START_ENT + WORD_BITS - 1) / WORD_BITS;
+    fsck.owned = (uint64_t *)calloc(fsck.words, sizeof(uint64_t));
+    if(!fsck.owned)
+        err_exit("Can't allocate memory for cluster bitmap");
+    pthread_mutex_init(&fsck.report, NULL);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    void *buffer;
+    fsck.table = get_fat_table(info, active, &buffer);
+
+    if(info->type == FAT_TYPE_32)
+        check_chain(&fsck, info->root_cluster, "", "");
+    walk_tree(info, threads, WALK_CONCURRENT, check_entry, &fsck);
+
+    check_lost(&fsck);
+    check_mirrors(&fsck, active);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long check_us = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+
+    print_summary(&fsck, check_us);
+
+    int found = 0;
+    for(int i = 0; i < PROBLEM_KINDS; ++i)
+        found |= fsck.problems[i] != 0;
+
+    pthread_mutex_destroy(&fsck.report);
+    free(fsck.owned);
+    free(buffer);
+    free_fs_info(info);
+    image_close(img);
+
+    return found;
+}
+
+
+//  Counts the problem and prints first MAX_REPORTS of each kind
+void report(struct fsck *fsck, enum problem kind, const char *format, ...) {
+    if(__atomic_add_fetch(&fsck->problems[kind], 1, __ATOMIC_RELAXED) > MAX_REPORTS)
+        return;
+
+    va_list args;
+    va_start(args, format);
+    pthread_mutex_lock(&fsck->report);
+    vprintf(format, args);
+    pthread_mutex_unlock(&fsck->report);
+    va_end(args);
+}
+
+
+//  Marks cluster as owned. Returns 1 if somebody owned it already.
+static int claim_cluster(struct fsck *fsck, unsigned cluster) {
+    uint64_t bit = (uint64_t)1 << cluster % WORD_BITS;
+    return (__atomic_fetch_or(&fsck->owned[cluster / WORD_BITS], bit, __ATOMIC_RELAXED) & bit) != 0;
+}
+
+
+static int is_data_cluster(struct fs_info *info, unsigned cluster) {
+    return cluster >= FAT_START_ENT && cluster < info->cluster_count + FAT_START_ENT;
+}
+
+
+//  Floyd cycle search in the table, the chain is not claimed
+static int chain_loops(struct fsck *fsck, unsigned start) {
+    struct fs_info *info = fsck->info;
+    unsigned slow = start;
+    unsigned fast = start;
+
+    while(1) {
+        for(int i = 0; i < 2; ++i) {
+            fast = get_table_entry(info, fsck->table, fast);
+            if(!is_data_cluster(info, fast))
+                return 0;
+        }
+
+        slow = get_table_entry(info, fsck->table, slow);
+        if(slow == fast)
+            return 1;
+    }
+}
+
+
+//  Claims clusters of the chain and returns its length. Chain ends at
+//  the first cluster owned by somebody else or by the chain itself.
+unsigned long check_chain(struct fsck *fsck, unsigned start, const char *path, const char *name) {
+    struct fs_info *info = fsck->info;
+    unsigned long length = 0;
+    unsigned cluster = start;
+
+    if(!is_data_cluster(info, start)) {
+        report(fsck, BAD_START, "%s/%s: start cluster %u is out of data area\n", path, name, start);
+        return 0;
+    }
+
+    while(1) {
+        if(claim_cluster(fsck, cluster)) {
+            if(chain_loops(fsck, start))
+                report(fsck, LOOPED_CHAIN, "%s/%s: chain loops at cluster %u\n", path, name, cluster);
+            else
+                report(fsck, CROSS_LINK, "%s/%s: cluster %u is used by another chain\n", path, name, cluster);
+            break;
+        }
+
+        length++;
+        unsigned next = get_table_entry(info, fsck->table, cluster);
+        if(next >= fsck->last)
+            break;
+
+        if(!is_data_cluster(info, next)) {
+            report(fsck, BROKEN_CHAIN, "%s/%s: cluster %u points to %s %#x\n", path, name, cluster,
+                   next == FAT_ENT_FREE ? "free entry" : "invalid entry", next);
+            break;
+        }
+
+        cluster = next;
+    }
+
+    __atomic_add_fetch(&fsck->owned_clusters, length, __ATOMIC_RELAXED);
+    return length;
+}
+
+
+//  Called by walker threads at the same time
+void check_entry(struct walk_entry *entry, void *arg) {
+    struct fsck *fsck = (struct fsck *)arg;
+    struct fs_info *info = fsck->info;
+    struct msdos_dir_entry *dentry = entry->dentry;
+
+    if(dentry->attr & ATTR_VOLUME)
+        return;
+
+    unsigned start = get_dentry_start(dentry, info);
+    unsigned long size = __le32_to_cpu(dentry->size);
+
+    if(dentry->attr & ATTR_DIR) {
+        __atomic_add_fetch(&fsck->dirs, 1, __ATOMIC_RELAXED);
+        if(entry->looped)
+            report(fsck, CROSS_LINK, "%s/%s: directory cluster %u is already a walked directory\n",
+                   entry->path, entry->name, start);
+        else
+            check_chain(fsck, start, entry->path, entry->name);
+        return;
+    }
+
+    __atomic_add_fetch(&fsck->files, 1, __ATOMIC_RELAXED);
+    unsigned long expected = (size + info->cluster_size - 1) / info->cluster_size;
+    if(!start) {
+        if(size)
+            report(fsck, SIZE_MISMATCH, "%s/%s: size is %lu, but there are no clusters\n",
+                   entry->path, entry->name, size);
+        return;
+    }
+
+    unsigned long length = check_chain(fsck, start, entry->path, entry->name);
+    if(length && length != expected)
+        report(fsck, SIZE_MISMATCH, "%s/%s: size is %lu (%lu clusters), chain has %lu clusters\n",
+               entry->path, entry->name, size, expected, length);
+}
+
+
+//  Used clusters nobody owns. The walk has no depth limit, so these are
+//  reached by no entry at all. Chain heads are lost clusters no other
+//  lost cluster points to; looped lost chains have no head.
+void check_lost(struct fsck *fsck) {
+    struct fs_info *info = fsck->info;
+    unsigned bad = info->type == FAT_TYPE_16 ? BAD_FAT16 : BAD_FAT32;
+    unsigned long end = info->cluster_count + FAT_START_ENT;
+
+    uint64_t *lost = (uint64_t *)calloc(fsck->words, sizeof(uint64_t));
+    uint64_t *ref = (uint64_t *)calloc(fsck->words, sizeof(uint64_t));
+    if(!lost || !ref)
+        err_exit("Can't allocate memory for cluster bitmaps");
+
+    for(unsigned long cluster = FAT_START_ENT; cluster < end; ++cluster) {
+        unsigned entry = get_table_entry(info, fsck->table, cluster);
+        uint64_t bit = (uint64_t)1 << cluster % WORD_BITS;
+
+        if(entry == FAT_ENT_FREE) {
+            fsck->free_clusters++;
+            continue;
+        }
+
+        if(entry == bad || (fsck->owned[cluster / WORD_BITS] & bit))
+            continue;
+
+        lost[cluster / WORD_BITS] |= bit;
+        fsck->lost_clusters++;
+        if(is_data_cluster(info, entry))
+            ref[entry / WORD_BITS] |= (uint64_t)1 << entry % WORD_BITS;
+    }
+
+    for(unsigned long w = 0; w < fsck->words; ++w) {
+        uint64_t heads = lost[w] & ~ref[w];
+        while(heads) {
+            unsigned long cluster = w * WORD_BITS + __builtin_ctzll(heads);
+            heads &= heads - 1;
+            report(fsck, LOST_CHAIN, "Lost chain starts at cluster %lu\n", cluster);
+        }
+    }
+
+    if(info->free_clusters != FSINFO_UNKNOWN && info->free_clusters != fsck->free_clusters)
+        report(fsck, FSINFO_MISMATCH, "FSInfo has %u free clusters, FAT has %lu\n",
+               info->free_clusters, fsck->free_clusters);
+
+    free(lost);
+    free(ref);
+}
+
+
+//  Every FAT copy is compared with the active one
+void check_mirrors(struct fsck *fsck, unsigned active) {
+    struct fs_info *info = fsck->info;
+    if(!info->mirrored)
+        return;
+
+    unsigned long end = info->cluster_count + FAT_START_ENT;
+    for(unsigned n = 0; n < info->fats; ++n) {
+        if(n == active)
+            continue;
+
+        void *buffer;
+        void *table = get_fat_table(info, n, &buffer);
+        if(memcmp(table, fsck->table, info->fat_size)) {
+            unsigned long differ = 0;
+            unsigned long first = 0;
+            for(unsigned long cluster = FAT_START_ENT; cluster < end; ++cluster)
+                if(get_table_entry(info, table, cluster) != get_table_entry(info, fsck->table, cluster))
+                    if(!differ++)
+                        first = cluster;
+
+            if(differ)
+                report(fsck, MIRROR_MISMATCH, "FAT %u differs from FAT %u in %lu entries, first is cluster %lu\n",
+                       n, active, differ, first);
+        }
+        free(buffer);
+    }
+}
+
+
+void print_summary(struct fsck *fsck, long check_us) {
+    unsigned long found = 0;
+    for(int i = 0; i < PROBLEM_KINDS; ++i)
+        found += fsck->problems[i];
+    if(found)
+        putchar('\n');
+
+    printf("%-*s%lu\n", INDENT_1, "Files", fsck->files);
+    printf("%-*s%lu\n", INDENT_1, "Directories", fsck->dirs);
+    printf("%-*s%lu\n", INDENT_1, "Owned clusters", fsck->owned_clusters);
+    printf("%-*s%lu\n", INDENT_1, "Free clusters", fsck->free_clusters);
+    printf("%-*s%lu\n", INDENT_1, "Lost clusters", fsck->lost_clusters);
+
+    for(int i = 0; i < PROBLEM_KINDS; ++i)
+        printf("%-*s%lu\n", INDENT_1, problem_names[i], fsck->problems[i]);
+
+    printf("%-*s%ld us\n", INDENT_1, "Check time", check_us);
+}
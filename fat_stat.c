@@ -0,0 +1,376 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "fat.h"
+
+
+#define WORD_BITS       64              //  Clusters per bitmap word
+#define HIST_BUCKETS    29              //  Power of two buckets up to 2^28
+
+#define INDENT_1        24
+#define INDENT_2        12
+
+
+struct fat_stat {
+    unsigned long free_clusters;
+    unsigned long bad_clusters;
+    unsigned long used_clusters;
+    unsigned long chains;
+    unsigned long fragments;
+    unsigned long fragmented_chains;
+    unsigned long wild_pointers;        //  Point out of data area
+
+    unsigned long chain_hist[HIST_BUCKETS];     //  Fragments per chain
+    unsigned long free_hist[HIST_BUCKETS];      //  Free run lengths
+};
+
+
+//  Per 64 clusters: what the entries are and whether each one points
+//  to the very next cluster. Bit i is cluster (word * 64 + i).
+struct fat_bits {
+    uint64_t free;
+    uint64_t bad;
+    uint64_t last;
+    uint64_t seq;
+};
+
+
+struct fat_bitmaps {
+    unsigned long words;
+    uint64_t *free;
+    uint64_t *seq;
+    uint64_t *head;                     //  Used and not continuing previous
+    uint64_t *ref;                      //  Targets of non sequential links
+};
+
+
+void scan_table(struct fs_info *info, void *table, struct fat_bitmaps *maps, struct fat_stat *stat);
+void scan_chains(struct fs_info *info, void *table, struct fat_bitmaps *maps, struct fat_stat *stat);
+void scan_free_runs(struct fat_bitmaps *maps, struct fat_stat *stat);
+void print_stat(struct fs_info *info, struct fat_stat *stat, long scan_us);
+void print_hist(const char *title, unsigned long *hist);
+
+
+int main(int argc, char *argv[]) {
+    if(argc < 2) {
+        printf("Usage: %s IMAGE\n", argv[0]);
+        puts("    Prints free space and fragmentation of FAT16 or FAT32 image");
+        exit(EXIT_FAILURE);
+    }
+
+    struct image *img = image_open(argv[1], get_image_mode());
+    if(!img)
+        err_exit("Can't open image");
+
+    struct fs_info *info = get_fs_info(img);
+    if(!info)
+        err_exit("Can't mount image");
+
+    void *buffer;
+    void *table = get_fat_table(info, 0, &buffer);
+
+    struct fat_bitmaps maps;
+    maps.words = (info->cluster_count + FAT_START_ENT + WORD_BITS - 1) / WORD_BITS;
+    maps.free = (uint64_t *)calloc(maps.words, sizeof(uint64_t));
+    maps.seq = (uint64_t *)calloc(maps.words + 1, sizeof(uint64_t));
+    maps.head = (uint64_t *)calloc(maps.words, sizeof(uint64_t));
+    maps.ref = (uint64_t *)calloc(maps.words, sizeof(uint64_t));
+    if(!maps.free || !maps.seq || !maps.head || !maps.ref)
+        err_exit("Can't allocate memory for cluster bitmaps");
+
+    struct fat_stat stat;
+    memset(&stat, 0, sizeof(struct fat_stat));
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    scan_table(info, table, &maps, &stat);
+    scan_chains(info, table, &maps, &stat);
+    scan_free_runs(&maps, &stat);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long scan_us = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+
+    print_stat(info, &stat, scan_us);
+
+    free(maps.free);
+    free(maps.seq);
+    free(maps.head);
+    free(maps.ref);
+    free(buffer);
+    free_fs_info(info);
+    image_close(img);
+
+    return 0;
+}
+
+
+static unsigned hist_bucket(unsigned long value) {
+    return WORD_BITS - 1 - __builtin_clzl(value);
+}
+
+
+//  Reference version, used for the table tail and non SSE2 builds
+static struct fat_bits scan_word_scalar(struct fs_info *info, void *table, unsigned long base, unsigned count) {
+    struct fat_bits bits = { 0, 0, 0, 0 };
+    unsigned bad = info->type == FAT_TYPE_16 ? BAD_FAT16 : BAD_FAT32;
+    unsigned last = info->type == FAT_TYPE_16 ? EOF_FAT16 - 7 : EOF_FAT32 - 7;
+
+    for(unsigned i = 0; i < count; ++i) {
+        unsigned entry = get_table_entry(info, table, base + i);
+        uint64_t bit = (uint64_t)1 << i;
+
+        if(entry == FAT_ENT_FREE)
+            bits.free |= bit;
+        if(entry == bad)
+            bits.bad |= bit;
+        if(entry >= last)
+            bits.last |= bit;
+        if(entry == base + i + 1)
+            bits.seq |= bit;
+    }
+
+    return bits;
+}
+
+
+#ifdef __SSE2__
+//  8 entries per vector, 8 vectors per word
+static struct fat_bits scan_word16(__le16 *table, unsigned long base) {
+    struct fat_bits bits = { 0, 0, 0, 0 };
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bad = _mm_set1_epi16((short)BAD_FAT16);
+    const __m128i before_last = _mm_set1_epi16((short)(EOF_FAT16 - 8));
+    const __m128i step = _mm_set1_epi16(8);
+    __m128i next = _mm_setr_epi16(1, 2, 3, 4, 5, 6, 7, 8);
+    next = _mm_add_epi16(next, _mm_set1_epi16((short)base));
+
+    for(unsigned i = 0; i < WORD_BITS; i += 8) {
+        __m128i entries = _mm_loadu_si128((__m128i *)(table + base + i));
+
+        //  Unsigned entry > EOF - 8 is the same as saturated difference != 0
+        __m128i last = _mm_cmpeq_epi16(_mm_subs_epu16(entries, before_last), zero);
+
+        bits.free |= (uint64_t)_mm_movemask_epi8(_mm_packs_epi16(_mm_cmpeq_epi16(entries, zero), zero)) << i;
+        bits.bad  |= (uint64_t)_mm_movemask_epi8(_mm_packs_epi16(_mm_cmpeq_epi16(entries, bad), zero)) << i;
+        bits.last |= (uint64_t)(~_mm_movemask_epi8(_mm_packs_epi16(last, zero)) & 0xFF) << i;
+        bits.seq  |= (uint64_t)_mm_movemask_epi8(_mm_packs_epi16(_mm_cmpeq_epi16(entries, next), zero)) << i;
+
+        next = _mm_add_epi16(next, step);
+    }
+
+    return bits;
+}
+
+
+//  4 entries per vector, 16 vectors per word. Masked entries fit in 28 bits,
+//  so signed compare is fine for them.
+static struct fat_bits scan_word32(__le32 *table, unsigned long base) {
+    struct fat_bits bits = { 0, 0, 0, 0 };
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i mask = _mm_set1_epi32(FAT32_ENT_MASK);
+    const __m128i bad = _mm_set1_epi32(BAD_FAT32);
+    const __m128i before_last = _mm_set1_epi32(EOF_FAT32 - 8);
+    const __m128i step = _mm_set1_epi32(4);
+    __m128i next = _mm_setr_epi32(1, 2, 3, 4);
+    next = _mm_add_epi32(next, _mm_set1_epi32((int)base));
+
+    for(unsigned i = 0; i < WORD_BITS; i += 4) {
+        __m128i entries = _mm_and_si128(_mm_loadu_si128((__m128i *)(table + base + i)), mask);
+
+        bits.free |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(entries, zero))) << i;
+        bits.bad  |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(entries, bad))) << i;
+        bits.last |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(entries, before_last))) << i;
+        bits.seq  |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(entries, next))) << i;
+
+        next = _mm_add_epi32(next, step);
+    }
+
+    return bits;
+}
+#endif
+
+
+//  Single pass over FAT: classifies entries into bitmaps 64 clusters at a
+//  time and resolves only non sequential links one by one
+void scan_table(struct fs_info *info, void *table, struct fat_bitmaps *maps, struct fat_stat *stat) {
+    unsigned long entries = info->cluster_count + FAT_START_ENT;
+    uint64_t prev_seq = 0;
+
+    for(unsigned long w = 0; w < maps->words; ++w) {
+        unsigned long base = w * WORD_BITS;
+        unsigned count = entries - base < WORD_BITS ? entries - base : WORD_BITS;
+
+        struct fat_bits bits;
+#ifdef __SSE2__
+        if(count == WORD_BITS && info->type == FAT_TYPE_16)
+            bits = scan_word16((__le16 *)table, base);
+        else if(count == WORD_BITS)
+            bits = scan_word32((__le32 *)table, base);
+        else
+#endif
+            bits = scan_word_scalar(info, table, base, count);
+
+        uint64_t valid = count == WORD_BITS ? ~(uint64_t)0 : ((uint64_t)1 << count) - 1;
+        if(w == 0)
+            valid &= ~(uint64_t)((1 << FAT_START_ENT) - 1);
+
+        //  Last data cluster can't be continued by the next one
+        if(count < WORD_BITS || base + WORD_BITS == entries)
+            bits.seq &= ~((uint64_t)1 << (count - 1));
+
+        uint64_t used = valid & ~bits.free & ~bits.bad;
+        uint64_t seq = used & bits.seq;
+        uint64_t links = used & ~seq & ~bits.last;
+
+        maps->free[w] = valid & bits.free;
+        maps->seq[w] = seq;
+        maps->head[w] = used & ~(seq << 1 | prev_seq >> (WORD_BITS - 1));
+        prev_seq = seq;
+
+        stat->free_clusters += __builtin_popcountl(valid & bits.free);
+        stat->bad_clusters += __builtin_popcountl(valid & bits.bad);
+        stat->used_clusters += __builtin_popcountl(used);
+
+        while(links) {
+            unsigned long cluster = base + __builtin_ctzl(links);
+            unsigned target = get_table_entry(info, table, cluster);
+            if(fat_is_last(info, target))
+                stat->wild_pointers++;
+            else
+                maps->ref[target / WORD_BITS] |= (uint64_t)1 << (target % WORD_BITS);
+
+            links &= links - 1;
+        }
+    }
+}
+
+
+//  Returns last cluster of sequential run starting at cluster
+static unsigned long run_end(struct fat_bitmaps *maps, unsigned long cluster) {
+    unsigned long w = cluster / WORD_BITS;
+    uint64_t breaks = ~maps->seq[w] & (~(uint64_t)0 << (cluster % WORD_BITS));
+    while(!breaks)
+        breaks = ~maps->seq[++w];
+
+    return w * WORD_BITS + __builtin_ctzl(breaks);
+}
+
+
+//  Walks chains fragment by fragment, sequential runs are skipped by bitmap
+void scan_chains(struct fs_info *info, void *table, struct fat_bitmaps *maps, struct fat_stat *stat) {
+    unsigned long max_fragments = stat->used_clusters;
+
+    for(unsigned long w = 0; w < maps->words; ++w) {
+        uint64_t heads = maps->head[w] & ~maps->ref[w];
+        while(heads) {
+            unsigned long cluster = w * WORD_BITS + __builtin_ctzl(heads);
+            unsigned long fragments = 1;
+
+            while(fragments <= max_fragments) {
+                unsigned long end = run_end(maps, cluster);
+                unsigned next = get_table_entry(info, table, end);
+                if(fat_is_last(info, next))
+                    break;
+
+                cluster = next;
+                fragments++;
+            }
+
+            stat->chains++;
+            stat->fragments += fragments;
+            if(fragments > 1)
+                stat->fragmented_chains++;
+            stat->chain_hist[hist_bucket(fragments)]++;
+
+            heads &= heads - 1;
+        }
+    }
+}
+
+
+void scan_free_runs(struct fat_bitmaps *maps, struct fat_stat *stat) {
+    unsigned long run = 0;
+
+    for(unsigned long w = 0; w < maps->words; ++w) {
+        uint64_t free = maps->free[w];
+        if(free == ~(uint64_t)0) {
+            run += WORD_BITS;
+            continue;
+        }
+
+        //  Runs ending at the top bit continue into the next word
+        unsigned bit = 0;
+        while(bit < WORD_BITS && (free >> bit)) {
+            unsigned zeros = __builtin_ctzl(free >> bit);
+            if(zeros && run) {
+                stat->free_hist[hist_bucket(run)]++;
+                run = 0;
+            }
+            bit += zeros;
+
+            unsigned ones = __builtin_ctzl(~(free >> bit));
+            run += ones;
+            bit += ones;
+        }
+
+        if(bit < WORD_BITS && run) {
+            stat->free_hist[hist_bucket(run)]++;
+            run = 0;
+        }
+    }
+
+    if(run)
+        stat->free_hist[hist_bucket(run)]++;
+}
+
+
+void print_hist(const char *title, unsigned long *hist) {
+    printf("\n%s\n", title);
+    for(unsigned i = 0; i < HIST_BUCKETS; ++i) {
+        if(!hist[i])
+            continue;
+
+        char range[32];
+        unsigned long from = 1UL << i;
+        if(from == 1)
+            snprintf(range, sizeof(range), "1");
+        else
+            snprintf(range, sizeof(range), "%lu-%lu", from, 2 * from - 1);
+
+        printf("    %-*s%lu\n", INDENT_1 - 4, range, hist[i]);
+    }
+}
+
+
+void print_stat(struct fs_info *info, struct fat_stat *stat, long scan_us) {
+    printf("%-*s%s\n", INDENT_1, "Type", info->type == FAT_TYPE_16 ? "FAT16" : "FAT32");
+    printf("%-*s%u x %u bytes\n", INDENT_1, "Clusters", info->cluster_count, info->cluster_size);
+    printf("%-*s%lu\n", INDENT_1, "Used clusters", stat->used_clusters);
+    printf("%-*s%lu\n", INDENT_1, "Free clusters", stat->free_clusters);
+    if(info->free_clusters != FSINFO_UNKNOWN && info->free_clusters != stat->free_clusters)
+        printf("%-*s%u (stale)\n", INDENT_1, "FSInfo free clusters", info->free_clusters);
+    printf("%-*s%lu\n", INDENT_1, "Bad clusters", stat->bad_clusters);
+    printf("%-*s%lu\n", INDENT_1, "Chains", stat->chains);
+    printf("%-*s%lu\n", INDENT_1, "Fragmented chains", stat->fragmented_chains);
+    printf("%-*s%lu", INDENT_1, "Fragments", stat->fragments);
+    if(stat->chains)
+        printf(" (%.2f per chain)", (double)stat->fragments / stat->chains);
+    putchar('\n');
+    if(stat->wild_pointers)
+        printf("%-*s%lu\n", INDENT_1, "Wild pointers", stat->wild_pointers);
+
+    print_hist("Fragments per chain", stat->chain_hist);
+    print_hist("Free runs (clusters)", stat->free_hist);
+
+    printf("\n%-*s%ld us\n", INDENT_1, "Scan time", scan_us);
+}
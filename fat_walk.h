@@ -0,0 +1,364 @@
+#ifndef FAT_WALK_H
+#define FAT_WALK_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "fat.h"
+
+
+#define WALK_THREADS        4               //  Default worker count
+#define WALK_MAX_THREADS    64
+#define WALK_ENTRIES_INIT   16
+#define WALK_WORD_BITS      64
+#define WALK_LOOPED         ((struct walk_node *)1)     //  Child already walked elsewhere
+
+
+enum walk_order {
+    WALK_ORDERED,               //  Entries come in depth first order
+    WALK_UNORDERED,             //  Entries come as soon as directory is read
+    WALK_CONCURRENT             //  Same, but workers call fn at the same time
+};
+
+
+struct walk_entry {
+    struct msdos_dir_entry *dentry;
+    const char *name;                       //  Long name if present
+    const char *path;                       //  Parent directory, "" for root
+    int depth;
+    int looped;                             //  Directory already walked, not descended
+};
+
+
+typedef void (*walk_fn)(struct walk_entry *entry, void *arg);
+
+
+//  One directory scanned by a worker. Entries keep copies of dentries
+//  and names, so the node outlives the cluster buffers.
+struct walk_node {
+    char *path;
+    int depth;
+    unsigned cluster;                       //  0 is the root directory
+
+    struct msdos_dir_entry *dentries;
+    size_t *name_offsets;
+    struct walk_node **children;            //  NULL for non directories, WALK_LOOPED
+    unsigned count;
+    unsigned capacity;
+
+    char *names;
+    size_t names_len;
+    size_t names_cap;
+
+    int done;
+    struct walk_node *next;                 //  Work stack link
+};
+
+
+//  Directory being emitted in order and its next entry
+struct walk_frame {
+    struct walk_node *node;
+    unsigned next;
+};
+
+
+struct walker {
+    struct fs_info *info;
+    enum walk_order order;
+    walk_fn fn;
+    void *arg;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work;                    //  Stack is not empty or all done
+    pthread_cond_t done;                    //  Some node is scanned
+    pthread_mutex_t output;                 //  Serializes unordered callbacks
+
+    struct walk_node *stack;
+    unsigned long pending;                  //  Nodes queued or being scanned
+
+    uint64_t *queued;                       //  Start clusters of queued directories
+    unsigned long looped;
+};
+
+
+static inline struct walk_node *walk_node_new(const char *parent, const char *name, int depth, unsigned cluster) {
+    struct walk_node *node = (struct walk_node *)calloc(1, sizeof(struct walk_node));
+    if(!node)
+        err_exit("Can't allocate memory for walk node");
+
+    size_t parent_len = strlen(parent);
+    size_t name_len = strlen(name);
+    node->path = (char *)malloc(parent_len + name_len + 2);
+    if(!node->path)
+        err_exit("Can't allocate memory for walk path");
+
+    memcpy(node->path, parent, parent_len);
+    node->path[parent_len] = '/';
+    memcpy(node->path + parent_len + 1, name, name_len + 1);
+    if(!cluster)
+        node->path[0] = '\0';
+
+    node->depth = depth;
+    node->cluster = cluster;
+
+    return node;
+}
+
+
+static inline void walk_node_free(struct walk_node *node) {
+    free(node->path);
+    free(node->dentries);
+    free(node->name_offsets);
+    free(node->children);
+    free(node->names);
+    free(node);
+}
+
+
+static inline void walk_node_add(struct walk_node *node, struct msdos_dir_entry *dentry, const char *name, int len) {
+    if(node->count == node->capacity) {
+        node->capacity = node->capacity ? node->capacity * 2 : WALK_ENTRIES_INIT;
+        node->dentries = (struct msdos_dir_entry *)realloc(node->dentries, node->capacity * sizeof(struct msdos_dir_entry));
+        node->name_offsets = (size_t *)realloc(node->name_offsets, node->capacity * sizeof(size_t));
+        node->children = (struct walk_node **)realloc(node->children, node->capacity * sizeof(struct walk_node *));
+        if(!node->dentries || !node->name_offsets || !node->children)
+            err_exit("Can't allocate memory for walk entries");
+    }
+
+    if(node->names_len + len + 1 > node->names_cap) {
+        node->names_cap = (node->names_len + len + 1) * 2;
+        node->names = (char *)realloc(node->names, node->names_cap);
+        if(!node->names)
+            err_exit("Can't allocate memory for walk names");
+    }
+
+    node->dentries[node->count] = *dentry;
+    node->name_offsets[node->count] = node->names_len;
+    node->children[node->count] = NULL;
+    node->count++;
+
+    memcpy(node->names + node->names_len, name, len + 1);
+    node->names_len += len + 1;
+}
+
+
+static inline int walk_is_subdir(struct msdos_dir_entry *dentry, struct fs_info *info) {
+    return (dentry->attr & ATTR_DIR) && !(dentry->attr & ATTR_VOLUME) &&
+           !fat_is_last(info, get_dentry_start(dentry, info));
+}
+
+
+//  Marks the start cluster of a directory as queued. Returns 1 if it was
+//  queued already: the entry points back at an ancestor or is cross-linked
+//  with another directory, so it isn't walked again.
+static inline int walk_queued(struct walker *walker, unsigned cluster) {
+    uint64_t bit = (uint64_t)1 << cluster % WALK_WORD_BITS;
+    return (__atomic_fetch_or(&walker->queued[cluster / WALK_WORD_BITS], bit, __ATOMIC_RELAXED) & bit) != 0;
+}
+
+
+static inline void walk_emit(struct walker *walker, struct walk_node *node, unsigned i) {
+    struct walk_entry entry = {
+        .dentry = &node->dentries[i],
+        .name = node->names + node->name_offsets[i],
+        .path = node->path,
+        .depth = node->depth,
+        .looped = node->children[i] == WALK_LOOPED
+    };
+    walker->fn(&entry, walker->arg);
+}
+
+
+//  Reads whole directory with positional reads and creates its children
+static inline void walk_scan(struct walker *walker, struct walk_node *node) {
+    struct fs_info *info = walker->info;
+    struct dir_iter *dir = node->cluster ? open_dir_cluster(node->cluster, info->cluster_size / sizeof(struct msdos_dir_entry), info)
+                                         : open_root_dir(info);
+    struct lfn_buf lfn;
+    char name[FAT_NAME_MAX];
+    lfn_reset(&lfn);
+
+    struct msdos_dir_entry *dentry;
+    for(dentry = get_next_dentry(dir); dentry && dentry->name[0] != 0x00; dentry = get_next_dentry(dir)) {
+        if(dentry->name[0] == DELETED_FLAG) {
+            lfn_reset(&lfn);
+            continue;
+        }
+
+        if(dentry->attr == ATTR_EXT) {
+            lfn_add_slot(&lfn, (struct msdos_dir_slot *)dentry);
+            continue;
+        }
+
+        if(dentry->name[0] == '.') {
+            lfn_reset(&lfn);
+            continue;
+        }
+
+        int len = get_dentry_name(dentry, &lfn, name);
+        walk_node_add(node, dentry, name, len);
+
+        if(!walk_is_subdir(dentry, info))
+            continue;
+
+        unsigned start = get_dentry_start(dentry, info);
+        if(walk_queued(walker, start)) {
+            node->children[node->count - 1] = WALK_LOOPED;
+            __atomic_add_fetch(&walker->looped, 1, __ATOMIC_RELAXED);
+        } else {
+            node->children[node->count - 1] = walk_node_new(node->path, name, node->depth + 1, start);
+        }
+    }
+
+    close_dir(dir);
+
+    if(walker->order == WALK_CONCURRENT) {
+        for(unsigned i = 0; i < node->count; ++i)
+            walk_emit(walker, node, i);
+    } else if(walker->order == WALK_UNORDERED) {
+        pthread_mutex_lock(&walker->output);
+        for(unsigned i = 0; i < node->count; ++i)
+            walk_emit(walker, node, i);
+        pthread_mutex_unlock(&walker->output);
+    }
+}
+
+
+static inline void *walk_worker(void *arg) {
+    struct walker *walker = (struct walker *)arg;
+
+    pthread_mutex_lock(&walker->lock);
+    while(1) {
+        while(!walker->stack && walker->pending)
+            pthread_cond_wait(&walker->work, &walker->lock);
+
+        if(!walker->stack)
+            break;
+
+        struct walk_node *node = walker->stack;
+        walker->stack = node->next;
+        pthread_mutex_unlock(&walker->lock);
+
+        walk_scan(walker, node);
+
+        pthread_mutex_lock(&walker->lock);
+        //  Pushed in reverse, so the first subdirectory is scanned first,
+        //  as ordered output will need it first
+        for(unsigned i = node->count; i-- > 0; )
+            if(node->children[i] && node->children[i] != WALK_LOOPED) {
+                node->children[i]->next = walker->stack;
+                walker->stack = node->children[i];
+                walker->pending++;
+            }
+
+        walker->pending--;
+        node->done = 1;
+        if(walker->order != WALK_ORDERED)
+            walk_node_free(node);
+
+        pthread_cond_broadcast(&walker->done);
+        pthread_cond_broadcast(&walker->work);
+    }
+    pthread_mutex_unlock(&walker->lock);
+
+    return NULL;
+}
+
+
+//  Emits node entries, each directory followed by its subtree. The stack
+//  is on the heap, trees are as deep as the image makes them.
+static inline void walk_emit_tree(struct walker *walker, struct walk_node *root) {
+    struct walk_frame *stack = (struct walk_frame *)malloc(WALK_ENTRIES_INIT * sizeof(struct walk_frame));
+    size_t capacity = WALK_ENTRIES_INIT;
+    size_t top = 0;
+    if(!stack)
+        err_exit("Can't allocate memory for walk stack");
+    stack[top++] = (struct walk_frame){root, 0};
+
+    while(top) {
+        struct walk_node *node = stack[top - 1].node;
+        unsigned i = stack[top - 1].next++;
+        if(i == 0) {
+            pthread_mutex_lock(&walker->lock);
+            while(!node->done)
+                pthread_cond_wait(&walker->done, &walker->lock);
+            pthread_mutex_unlock(&walker->lock);
+        }
+
+        if(i == node->count) {
+            walk_node_free(node);
+            top--;
+            continue;
+        }
+
+        walk_emit(walker, node, i);
+        struct walk_node *child = node->children[i];
+        if(!child || child == WALK_LOOPED)
+            continue;
+
+        if(top == capacity) {
+            capacity *= 2;
+            stack = (struct walk_frame *)realloc(stack, capacity * sizeof(struct walk_frame));
+            if(!stack)
+                err_exit("Can't allocate memory for walk stack");
+        }
+        stack[top++] = (struct walk_frame){child, 0};
+    }
+
+    free(stack);
+}
+
+
+//  Calls fn for every live entry of the tree. Directories are scanned by
+//  threads workers; WALK_ORDERED calls fn from the caller thread in depth
+//  first order, WALK_UNORDERED calls it from workers one at a time and
+//  WALK_CONCURRENT lets workers call it in parallel. Every directory is
+//  walked once; returns the number of entries skipped as looped.
+static inline unsigned long walk_tree(struct fs_info *info, int threads, enum walk_order order, walk_fn fn, void *arg) {
+    struct walker walker;
+    memset(&walker, 0, sizeof(struct walker));
+    walker.info = info;
+    walker.order = order;
+    walker.fn = fn;
+    walker.arg = arg;
+    pthread_mutex_init(&walker.lock, NULL);
+    pthread_mutex_init(&walker.output, NULL);
+    pthread_cond_init(&walker.work, NULL);
+    pthread_cond_init(&walker.done, NULL);
+
+    if(threads < 1)
+        threads = 1;
+    if(threads > WALK_MAX_THREADS)
+        threads = WALK_MAX_THREADS;
+
+    unsigned long words = (info->cluster_count + FAT_START_ENT + WALK_WORD_BITS - 1) / WALK_WORD_BITS;
+    walker.queued = (uint64_t *)calloc(words, sizeof(uint64_t));
+    if(!walker.queued)
+        err_exit("Can't allocate memory for walk bitmap");
+    if(info->type == FAT_TYPE_32 && !fat_is_last(info, info->root_cluster))
+        walk_queued(&walker, info->root_cluster);
+
+    struct walk_node *root = walk_node_new("", "", 0, 0);
+    walker.stack = root;
+    walker.pending = 1;
+
+    pthread_t workers[WALK_MAX_THREADS];
+    for(int i = 0; i < threads; ++i)
+        if(pthread_create(&workers[i], NULL, walk_worker, &walker))
+            err_exit("Can't create walk worker");
+
+    if(order == WALK_ORDERED)
+        walk_emit_tree(&walker, root);
+
+    for(int i = 0; i < threads; ++i)
+        pthread_join(workers[i], NULL);
+
+    pthread_cond_destroy(&walker.done);
+    pthread_cond_destroy(&walker.work);
+    pthread_mutex_destroy(&walker.output);
+    pthread_mutex_destroy(&walker.lock);
+    free(walker.queued);
+    return walker.looped;
+}
+
+#endif  //  FAT_WALK_H
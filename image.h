@@ -0,0 +1,590 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+
+#define IMAGE_BACKEND_ENV   "IMAGE_BACKEND"     //  "pread" (default), "mmap", "direct" or "memory"
+#define IMAGE_MAPPED_MIN    64                  //  First size of the table of mappings watched for SIGBUS
+#define IMAGE_DIRECT_ALIGN  4096                //  Safe for any logical block size of files
+#define IMAGE_DIRECT_CHUNK  (1024 * 1024)       //  Bytes of one pool buffer
+#define IMAGE_DIRECT_BUFFERS 16                 //  Pool buffers per image
+#define IMAGE_HUGE_PAGE     (2 * 1024 * 1024)
+#define IMAGE_LOAD_CHUNK    (64 * 1024 * 1024)  //  Bytes one loader takes at a time
+#define IMAGE_LOAD_THREADS  8
+
+#ifndef err_exit
+#define err_exit(msg)    do {                    \
+                             perror(msg);        \
+                             exit(EXIT_FAILURE); \
+                         } while (0)
+#endif
+
+
+enum image_mode {
+    IMAGE_PREAD,                //  Copy through pread into caller's buffers
+    IMAGE_MMAP,                 //  Hand out pointers into read only mapping
+    IMAGE_DIRECT,               //  pread with O_DIRECT, bypassing the page cache
+    IMAGE_MEMORY                //  Whole image in anonymous memory, used as a mapping
+};
+
+
+enum image_advice {
+    IMAGE_NORMAL,
+    IMAGE_SEQUENTIAL,           //  Tree walks and file reads
+    IMAGE_RANDOM                //  Path lookups and FAT/inode probes
+};
+
+
+struct image {
+    int fd;
+    enum image_mode mode;
+    off_t size;
+
+    unsigned char *map;
+    volatile sig_atomic_t truncated;    //  Set if mapping faulted past EOF
+
+    //  O_DIRECT reads go through aligned buffers of the pool, unless
+    //  the caller's buffer, offset and length are all aligned
+    int direct_fd;                      //  -1 if not in direct mode
+    unsigned align;
+    pthread_mutex_t pool_lock;
+    pthread_cond_t pool_free;
+    void *pool[IMAGE_DIRECT_BUFFERS];
+    int pool_count;                     //  Free buffers in pool
+    int pool_allocated;
+};
+
+
+//  Mapped ranges sorted by start, for the SIGBUS handler to search.
+//  Tables are never freed, the handler may still be reading a replaced one.
+struct image_range {
+    unsigned char *start;
+    unsigned char *end;
+    struct image *img;
+};
+
+struct image_ranges {
+    int count;
+    int capacity;
+    struct image_range ranges[];
+};
+
+static struct image_ranges *mapped_ranges;
+static unsigned mapped_seq;                 //  Odd while the table changes
+static pthread_mutex_t mapped_lock = PTHREAD_MUTEX_INITIALIZER;
+static long image_page_size;
+
+
+//  Lock free, so it is safe in the handler: retries while a writer
+//  changes the table, the faulting thread is never the writer
+static inline struct image *image_find_mapped(unsigned char *addr) {
+    while(1) {
+        unsigned seq = __atomic_load_n(&mapped_seq, __ATOMIC_ACQUIRE);
+        if(seq & 1)
+            continue;
+
+        struct image_ranges *table = __atomic_load_n(&mapped_ranges, __ATOMIC_ACQUIRE);
+        struct image *img = NULL;
+        if(table) {
+            int count = table->count < table->capacity ? table->count : table->capacity;
+            int low = 0, high = count;
+            while(low < high) {
+                int middle = (low + high) / 2;
+                if(table->ranges[middle].start <= addr)
+                    low = middle + 1;
+                else
+                    high = middle;
+            }
+            if(low > 0 && addr < table->ranges[low - 1].end)
+                img = table->ranges[low - 1].img;
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&mapped_seq, __ATOMIC_RELAXED) == seq)
+            return img;
+    }
+}
+
+
+//  Pages past the end of a truncated file are replaced with zero pages,
+//  so readers see zeroes and the next image_get() reports an error.
+static inline void image_sigbus(int sig, siginfo_t *si, void *ctx) {
+    unsigned char *addr = (unsigned char *)si->si_addr;
+    (void)ctx;
+
+    struct image *img = image_find_mapped(addr);
+    if(img) {
+        void *page = (void *)((unsigned long)addr & ~(image_page_size - 1));
+        if(mmap(page, image_page_size, PROT_READ,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+            img->truncated = 1;
+            return;
+        }
+    }
+
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+
+//  Called with mapped_lock held, between the two sequence increments
+static inline void image_ranges_begin() {
+    __atomic_store_n(&mapped_seq, mapped_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+
+static inline void image_ranges_end() {
+    __atomic_store_n(&mapped_seq, mapped_seq + 1, __ATOMIC_RELEASE);
+}
+
+
+//  Returns -1 if the table can't grow, the image is then not watched
+static inline int image_watch(struct image *img) {
+    pthread_mutex_lock(&mapped_lock);
+    if(!image_page_size) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(struct sigaction));
+        sa.sa_sigaction = image_sigbus;
+        sa.sa_flags = SA_SIGINFO;
+        sigemptyset(&sa.sa_mask);
+        if(sigaction(SIGBUS, &sa, NULL) == -1)
+            err_exit("Can't install SIGBUS handler");
+
+        image_page_size = sysconf(_SC_PAGESIZE);
+    }
+
+    struct image_ranges *table = mapped_ranges;
+    if(!table || table->count == table->capacity) {
+        int capacity = table ? table->capacity * 2 : IMAGE_MAPPED_MIN;
+        struct image_ranges *grown = (struct image_ranges *)malloc(sizeof(struct image_ranges) +
+                                                                   capacity * sizeof(struct image_range));
+        if(!grown) {
+            pthread_mutex_unlock(&mapped_lock);
+            errno = ENOMEM;
+            return -1;
+        }
+
+        grown->count = table ? table->count : 0;
+        grown->capacity = capacity;
+        if(table)
+            memcpy(grown->ranges, table->ranges, table->count * sizeof(struct image_range));
+        __atomic_store_n(&mapped_ranges, grown, __ATOMIC_RELEASE);
+        table = grown;
+    }
+
+    int index = 0;
+    while(index < table->count && table->ranges[index].start < img->map)
+        index++;
+
+    image_ranges_begin();
+    memmove(&table->ranges[index + 1], &table->ranges[index], (table->count - index) * sizeof(struct image_range));
+    table->ranges[index].start = img->map;
+    table->ranges[index].end = img->map + img->size;
+    table->ranges[index].img = img;
+    table->count++;
+    image_ranges_end();
+
+    pthread_mutex_unlock(&mapped_lock);
+    return 0;
+}
+
+
+static inline void image_unwatch(struct image *img) {
+    pthread_mutex_lock(&mapped_lock);
+    struct image_ranges *table = mapped_ranges;
+    for(int i = 0; table && i < table->count; ++i)
+        if(table->ranges[i].img == img) {
+            image_ranges_begin();
+            memmove(&table->ranges[i], &table->ranges[i + 1], (table->count - i - 1) * sizeof(struct image_range));
+            table->count--;
+            image_ranges_end();
+            break;
+        }
+    pthread_mutex_unlock(&mapped_lock);
+}
+
+
+static inline enum image_mode get_image_mode() {
+    char *backend = getenv(IMAGE_BACKEND_ENV);
+    if(backend && !strcmp(backend, "mmap"))
+        return IMAGE_MMAP;
+    if(backend && !strcmp(backend, "direct"))
+        return IMAGE_DIRECT;
+    if(backend && !strcmp(backend, "memory"))
+        return IMAGE_MEMORY;
+
+    return IMAGE_PREAD;
+}
+
+
+//  Keeps the buffered fd for fstat, sendfile and copy_file_range users.
+//  Filesystems without O_DIRECT (tmpfs) fall back to plain pread.
+static inline void image_open_direct(struct image *img, const char *path, struct stat *st) {
+#ifdef O_DIRECT
+    img->direct_fd = open(path, O_RDONLY | O_DIRECT);
+#else
+    errno = EINVAL;
+#endif
+    if(img->direct_fd == -1) {
+        fprintf(stderr, "%s: O_DIRECT is not supported (%s), using pread\n", path, strerror(errno));
+        img->mode = IMAGE_PREAD;
+        return;
+    }
+
+    int logical;
+    img->align = IMAGE_DIRECT_ALIGN;
+    if(S_ISBLK(st->st_mode) && ioctl(img->fd, BLKSSZGET, &logical) == 0 && logical > 0)
+        img->align = logical;
+
+    pthread_mutex_init(&img->pool_lock, NULL);
+    pthread_cond_init(&img->pool_free, NULL);
+}
+
+
+//  Buffers are allocated on demand up to IMAGE_DIRECT_BUFFERS, then
+//  readers wait for one to be returned
+static inline void *image_pool_get(struct image *img) {
+    pthread_mutex_lock(&img->pool_lock);
+    while(!img->pool_count && img->pool_allocated == IMAGE_DIRECT_BUFFERS)
+        pthread_cond_wait(&img->pool_free, &img->pool_lock);
+
+    void *buffer = NULL;
+    if(img->pool_count)
+        buffer = img->pool[--img->pool_count];
+    else
+        img->pool_allocated++;
+    pthread_mutex_unlock(&img->pool_lock);
+
+    if(!buffer && posix_memalign(&buffer, img->align, IMAGE_DIRECT_CHUNK))
+        err_exit("Can't allocate aligned buffer");
+
+    return buffer;
+}
+
+
+static inline void image_pool_put(struct image *img, void *buffer) {
+    pthread_mutex_lock(&img->pool_lock);
+    img->pool[img->pool_count++] = buffer;
+    pthread_cond_signal(&img->pool_free);
+    pthread_mutex_unlock(&img->pool_lock);
+}
+
+
+static inline ssize_t image_pread_fd(int fd, void *buf, size_t len, off_t offset) {
+    size_t done = 0;
+    while(done < len) {
+        ssize_t ret = pread(fd, (char *)buf + done, len - done, offset + done);
+        if(ret == -1 && errno == EINTR)
+            continue;
+        if(ret == -1)
+            return -1;
+        if(ret == 0)
+            break;
+
+        done += ret;
+    }
+
+    return done;
+}
+
+
+//  Aligned requests are read straight into buf. Others are rounded out to
+//  whole logical blocks and read through pool buffers chunk by chunk.
+static inline ssize_t image_pread_direct(struct image *img, void *buf, size_t len, off_t offset) {
+    size_t mask = img->align - 1;
+    if(!((unsigned long)buf & mask) && !(offset & mask) && !(len & mask))
+        return image_pread_fd(img->direct_fd, buf, len, offset);
+
+    void *buffer = image_pool_get(img);
+    size_t done = 0;
+    while(done < len) {
+        off_t pos = offset + done;
+        off_t start = pos & ~(off_t)mask;
+        size_t skip = pos - start;
+        size_t part = len - done < IMAGE_DIRECT_CHUNK - skip ? len - done : IMAGE_DIRECT_CHUNK - skip;
+        size_t span = (skip + part + mask) & ~mask;
+
+        ssize_t ret = image_pread_fd(img->direct_fd, buffer, span, start);
+        if(ret == -1) {
+            image_pool_put(img, buffer);
+            return -1;
+        }
+        if((size_t)ret <= skip)
+            break;
+
+        if(part > ret - skip)
+            part = ret - skip;
+        memcpy((char *)buf + done, (char *)buffer + skip, part);
+        done += part;
+        if((size_t)ret < span)
+            break;
+    }
+
+    image_pool_put(img, buffer);
+    return done;
+}
+
+
+//  Whole huge pages, so that the tail of the image is backed by one too
+static inline size_t image_memory_size(struct image *img) {
+    return (img->size + IMAGE_HUGE_PAGE - 1) & ~(size_t)(IMAGE_HUGE_PAGE - 1);
+}
+
+
+struct image_loader {
+    struct image *img;
+    off_t next;                             //  Chunk to read, taken atomically
+    int failed;
+};
+
+
+static inline void *image_load_worker(void *arg) {
+    struct image_loader *loader = (struct image_loader *)arg;
+    struct image *img = loader->img;
+
+    while(1) {
+        off_t offset = __atomic_fetch_add(&loader->next, IMAGE_LOAD_CHUNK, __ATOMIC_RELAXED);
+        if(offset >= img->size)
+            break;
+
+        size_t len = img->size - offset < IMAGE_LOAD_CHUNK ? img->size - offset : IMAGE_LOAD_CHUNK;
+        if(image_pread_fd(img->fd, img->map + offset, len, offset) != (ssize_t)len) {
+            __atomic_store_n(&loader->failed, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+
+//  Reads the whole file into anonymous memory backed by transparent huge
+//  pages, chunks are read by several threads. The image then works as a
+//  mapping that never faults past its end.
+static inline void image_load(struct image *img) {
+    size_t size = image_memory_size(img);
+    img->map = (unsigned char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(img->map == MAP_FAILED)
+        err_exit("Can't allocate memory for image");
+
+    madvise(img->map, size, MADV_HUGEPAGE);
+
+    struct image_loader loader = {.img = img, .next = 0, .failed = 0};
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    long chunks = (img->size + IMAGE_LOAD_CHUNK - 1) / IMAGE_LOAD_CHUNK;
+    int threads = cpus < IMAGE_LOAD_THREADS ? cpus : IMAGE_LOAD_THREADS;
+    if(threads > chunks)
+        threads = chunks;
+
+    pthread_t workers[IMAGE_LOAD_THREADS];
+    int started = 0;
+    for(; started < threads - 1; ++started)
+        if(pthread_create(&workers[started], NULL, image_load_worker, &loader))
+            break;
+
+    image_load_worker(&loader);
+    for(int i = 0; i < started; ++i)
+        pthread_join(workers[i], NULL);
+
+    if(loader.failed)
+        err_exit("Can't load image");
+
+    mprotect(img->map, size, PROT_READ);
+}
+
+
+//  Image over size bytes of caller's memory, which must outlive it: for
+//  fixtures built from byte arrays. There is no file, so fd is -1.
+static inline struct image *image_from_memory(const void *data, size_t size) {
+    struct image *img = (struct image *)calloc(1, sizeof(struct image));
+    if(!img)
+        err_exit("Can't allocate memory for image");
+
+    img->fd = -1;
+    img->direct_fd = -1;
+    img->size = size;
+    img->mode = IMAGE_MEMORY;
+    img->map = (unsigned char *)data;
+    return img;
+}
+
+
+static inline struct image *image_open(const char *path, enum image_mode mode) {
+    int fd = open(path, O_RDONLY);
+    if(fd == -1)
+        return NULL;
+
+    struct stat st;
+    if(fstat(fd, &st) == -1)
+        err_exit("Can't stat image");
+
+    struct image *img = (struct image *)calloc(1, sizeof(struct image));
+    if(!img)
+        err_exit("Can't allocate memory for image");
+
+    img->fd = fd;
+    img->size = st.st_size;
+    img->mode = mode;
+    img->direct_fd = -1;
+
+    if(mode == IMAGE_DIRECT) {
+        image_open_direct(img, path, &st);
+        return img;
+    }
+
+    //  Empty files can't be mapped, they will fail on the first read anyway
+    if(mode == IMAGE_MMAP && img->size > 0) {
+        img->map = (unsigned char *)mmap(NULL, img->size, PROT_READ, MAP_SHARED, fd, 0);
+        if(img->map == MAP_FAILED)
+            err_exit("Can't map image");
+
+        //  Unwatched, a truncated file would kill the process, so read it instead
+        if(image_watch(img) == -1) {
+            fprintf(stderr, "%s: can't watch mapping (%s), using pread\n", path, strerror(errno));
+            munmap(img->map, img->size);
+            img->map = NULL;
+            img->mode = IMAGE_PREAD;
+        }
+    } else if(mode == IMAGE_MEMORY && img->size > 0) {
+        image_load(img);
+    } else {
+        img->mode = IMAGE_PREAD;
+    }
+
+    return img;
+}
+
+
+static inline void image_close(struct image *img) {
+    if(img->mode == IMAGE_MEMORY && img->fd != -1)
+        munmap(img->map, image_memory_size(img));
+    else if(img->map && img->mode == IMAGE_MMAP) {
+        image_unwatch(img);
+        munmap(img->map, img->size);
+    }
+
+    if(img->direct_fd != -1) {
+        for(int i = 0; i < img->pool_count; ++i)
+            free(img->pool[i]);
+        pthread_cond_destroy(&img->pool_free);
+        pthread_mutex_destroy(&img->pool_lock);
+        close(img->direct_fd);
+    }
+
+    if(img->fd != -1)
+        close(img->fd);
+    free(img);
+}
+
+
+//  Copies len bytes at offset into buf, returns number of bytes copied
+static inline ssize_t image_pread(struct image *img, void *buf, size_t len, off_t offset) {
+    if(img->map) {
+        if(offset >= img->size)
+            return 0;
+
+        if(offset + (off_t)len > img->size)
+            len = img->size - offset;
+
+        memcpy(buf, img->map + offset, len);
+        if(img->truncated) {
+            errno = EIO;
+            return -1;
+        }
+        return len;
+    }
+
+    if(img->direct_fd != -1)
+        return image_pread_direct(img, buf, len, offset);
+
+    return image_pread_fd(img->fd, buf, len, offset);
+}
+
+
+//  Returns pointer to len bytes at offset: straight into the mapping,
+//  or into buf filled by pread. NULL if the range is not in the image.
+static inline void *image_get(struct image *img, void *buf, size_t len, off_t offset) {
+    if(img->map) {
+        if(img->truncated || offset < 0 || offset + (off_t)len > img->size) {
+            errno = EIO;
+            return NULL;
+        }
+        return img->map + offset;
+    }
+
+    ssize_t ret = img->direct_fd != -1 ? image_pread_direct(img, buf, len, offset)
+                                       : image_pread_fd(img->fd, buf, len, offset);
+    if(ret != (ssize_t)len) {
+        if(ret >= 0)
+            errno = EIO;
+        return NULL;
+    }
+
+    return buf;
+}
+
+
+//  Memory for reads of the image, aligned for direct reads so they go
+//  straight into it
+static inline void *image_alloc(struct image *img, size_t len) {
+    void *buf = NULL;
+    if(img->direct_fd == -1)
+        buf = malloc(len);
+    else if(posix_memalign(&buf, img->align, len))
+        buf = NULL;
+
+    if(!buf)
+        err_exit("Can't allocate memory for image buffer");
+
+    return buf;
+}
+
+
+//  Buffer for image_get(), NULL when image is mapped and needs no copy
+static inline void *image_buffer(struct image *img, size_t len) {
+    if(img->map)
+        return NULL;
+
+    void *buf = image_alloc(img, len);
+    memset(buf, 0, len);
+    return buf;
+}
+
+
+//  Memory images are resident, advice is for mappings and the page cache
+static inline void image_advise(struct image *img, off_t offset, off_t len, enum image_advice advice) {
+    if(img->mode == IMAGE_MEMORY)
+        return;
+
+    if(img->map) {
+        int madv[] = { MADV_NORMAL, MADV_SEQUENTIAL, MADV_RANDOM };
+        off_t start = offset & ~(off_t)(image_page_size - 1);
+        if(start >= img->size)
+            return;
+        if(!len || start + len + (offset - start) > img->size)
+            len = img->size - start;
+        else
+            len += offset - start;
+
+        madvise(img->map + start, len, madv[advice]);
+    } else if(img->direct_fd == -1) {
+        int fadv[] = { POSIX_FADV_NORMAL, POSIX_FADV_SEQUENTIAL, POSIX_FADV_RANDOM };
+        posix_fadvise(img->fd, offset, len, fadv[advice]);
+    }
+}
+
+#endif  //  IMAGE_H
@@ -0,0 +1,410 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vfs.h"
+#include "index.h"
+#include "imgfsd.h"
+
+
+#define READ_CHUNK  (64 * 1024)
+
+
+int build_index(const char *path);
+int run_command(const char *command, const char *path, struct vfs *vfs);
+int run_remote(int sock, const char *command, const char *path, const char *image);
+
+int print_directory(struct vfs *vfs, vfs_node node);
+int print_tree(struct vfs *vfs, vfs_node node, const char *path);
+int print_file(struct vfs *vfs, vfs_node node);
+int print_stat(struct vfs *vfs, vfs_node node, const char *path);
+
+int remote_request(int sock, enum imgfsd_op op, const char *image, const char *path,
+                   uint64_t length, struct imgfsd_response *response);
+void *remote_call(int sock, enum imgfsd_op op, const char *image, const char *path, uint64_t *length);
+int remote_directory(int sock, const char *image, const char *path, int recursive);
+int remote_file(int sock, const char *image, const char *path);
+int remote_stat(int sock, const char *image, const char *path);
+
+void print_entry(struct vfs_stat *st, const char *name);
+void remote_to_stat(struct imgfsd_stat *in, struct vfs_stat *st);
+void print_stat_fields(struct vfs_stat *st, const char *fs, const char *path);
+char get_type_char(mode_t mode);
+
+
+//  Same commands work for any image, filesystem of each one is detected
+//  on its own, so FAT and ext2 images can be mixed in one call. With -i
+//  the sidecar index written by "index" is used when it is up to date,
+//  with -s SOCKET images are served by imgfsd and named as it was given.
+int main(int argc, char *argv[])
+{
+    int use_index = 0;
+    const char *socket_path = NULL;
+
+    int opt;
+    while((opt = getopt(argc, argv, "is:")) != -1) {
+        if(opt == 'i')
+            use_index = 1;
+        else if(opt == 's')
+            socket_path = optarg;
+        else
+            optind = argc + 1;
+    }
+
+    int errors = 0;
+    if(optind < argc && !strcmp(argv[optind], "index") && optind + 1 < argc) {
+        for(int i = optind + 1; i < argc; ++i)
+            errors += build_index(argv[i]) == -1;
+        return errors ? EXIT_FAILURE : 0;
+    }
+
+    if(optind + 3 > argc) {
+        fprintf(stderr, "Usage: %s [-i | -s SOCKET] ls|tree|cat|stat PATH IMAGE...\n"
+                        "       %s index IMAGE...\n", argv[0], argv[0]);
+        return 1;
+    }
+
+    int sock = -1;
+    if(socket_path && (sock = imgfsd_connect(socket_path)) == -1)
+        err_exit("Can't connect to imgfsd");
+
+    const char *command = argv[optind];
+    const char *path = argv[optind + 1];
+    for(int i = optind + 2; i < argc; ++i) {
+        if(sock != -1) {
+            if(optind + 3 < argc)
+                printf("==> %s <==\n", argv[i]);
+
+            if(run_remote(sock, command, path, argv[i]) == -1) {
+                fprintf(stderr, "%s: %s: %s\n", argv[i], path, strerror(errno));
+                errors++;
+                if(errno == EPIPE || errno == EPROTO)
+                    break;
+            }
+            continue;
+        }
+
+        struct vfs *vfs = use_index ? index_open_image(argv[i], stderr) : vfs_open(argv[i]);
+        if(!vfs) {
+            fprintf(stderr, "%s: %s\n", argv[i], errno == EINVAL ? "Unknown filesystem" : strerror(errno));
+            errors++;
+            continue;
+        }
+
+        if(optind + 3 < argc)
+            printf("==> %s (%s) <==\n", argv[i], vfs->driver->name);
+
+        if(run_command(command, path, vfs) == -1) {
+            fprintf(stderr, "%s: %s: %s\n", argv[i], path, strerror(errno));
+            errors++;
+        }
+
+        vfs_close(vfs);
+    }
+
+    if(sock != -1)
+        close(sock);
+    return errors ? EXIT_FAILURE : 0;
+}
+
+
+int build_index(const char *path) {
+    struct vfs *vfs = vfs_open(path);
+    if(!vfs) {
+        fprintf(stderr, "%s: %s\n", path, errno == EINVAL ? "Unknown filesystem" : strerror(errno));
+        return -1;
+    }
+
+    char index_path[PATH_MAX];
+    snprintf(index_path, sizeof(index_path), "%s%s", path, INDEX_SUFFIX);
+
+    unsigned long errors;
+    int result = index_build(vfs, index_path, &errors);
+    if(result == -1)
+        fprintf(stderr, "%s: Can't build index: %s\n", index_path, strerror(errno));
+    else
+        printf("%s: %s index, %lu unreadable entries\n", index_path, vfs->driver->name, errors);
+
+    vfs_close(vfs);
+    return result;
+}
+
+
+int run_command(const char *command, const char *path, struct vfs *vfs) {
+    vfs_node node;
+    if(vfs_lookup(vfs, path, &node) == -1)
+        return -1;
+
+    if(!strcmp(command, "ls"))
+        return print_directory(vfs, node);
+    if(!strcmp(command, "tree"))
+        return print_tree(vfs, node, "");
+    if(!strcmp(command, "cat"))
+        return print_file(vfs, node);
+    if(!strcmp(command, "stat"))
+        return print_stat(vfs, node, path);
+
+    errno = EINVAL;
+    return -1;
+}
+
+
+int run_remote(int sock, const char *command, const char *path, const char *image) {
+    if(!strcmp(command, "ls"))
+        return remote_directory(sock, image, path, 0);
+    if(!strcmp(command, "tree"))
+        return remote_directory(sock, image, path, 1);
+    if(!strcmp(command, "cat"))
+        return remote_file(sock, image, path);
+    if(!strcmp(command, "stat"))
+        return remote_stat(sock, image, path);
+
+    errno = EINVAL;
+    return -1;
+}
+
+
+char get_type_char(mode_t mode) {
+    switch(mode & S_IFMT) {
+        case S_IFDIR:  return 'd';
+        case S_IFREG:  return '-';
+        case S_IFLNK:  return 'l';
+        case S_IFCHR:  return 'c';
+        case S_IFBLK:  return 'b';
+        case S_IFIFO:  return 'p';
+        case S_IFSOCK: return 's';
+        default:       return '?';
+    }
+}
+
+
+int print_directory(struct vfs *vfs, vfs_node node) {
+    struct vfs_dir *dir = vfs_opendir(vfs, node);
+    if(!dir)
+        return -1;
+
+    struct vfs_dirent entry;
+    while(vfs_readdir(dir, &entry)) {
+        struct vfs_stat st;
+        if(vfs_stat(vfs, entry.node, &st) == -1) {
+            printf("?          %10s %s\n", "?", entry.name);
+            continue;
+        }
+
+        print_entry(&st, entry.name);
+    }
+
+    vfs_closedir(dir);
+    return 0;
+}
+
+
+//  Prints paths relative to the start directory, depth first
+int print_tree(struct vfs *vfs, vfs_node node, const char *path) {
+    struct vfs_dir *dir = vfs_opendir(vfs, node);
+    if(!dir)
+        return -1;
+
+    struct vfs_dirent entry;
+    while(vfs_readdir(dir, &entry)) {
+        char child_path[PATH_MAX];
+        snprintf(child_path, sizeof(child_path), "%s/%s", path, entry.name);
+        printf("%s%s\n", child_path, entry.type == S_IFDIR ? "/" : "");
+
+        if(entry.type == S_IFDIR && print_tree(vfs, entry.node, child_path) == -1)
+            fprintf(stderr, "%s: %s\n", child_path, strerror(errno));
+    }
+
+    vfs_closedir(dir);
+    return 0;
+}
+
+
+int print_file(struct vfs *vfs, vfs_node node) {
+    static char chunk[READ_CHUNK];
+    off_t offset = 0;
+    ssize_t read;
+
+    while((read = vfs_pread(vfs, node, chunk, READ_CHUNK, offset)) > 0) {
+        fwrite(chunk, 1, read, stdout);
+        offset += read;
+    }
+
+    return read == -1 ? -1 : 0;
+}
+
+
+int print_stat(struct vfs *vfs, vfs_node node, const char *path) {
+    struct vfs_stat st;
+    if(vfs_stat(vfs, node, &st) == -1)
+        return -1;
+
+    print_stat_fields(&st, vfs->driver->name, path);
+    return 0;
+}
+
+
+void print_entry(struct vfs_stat *st, const char *name) {
+    printf("%c%04o %10lu %10lld %s\n", get_type_char(st->mode), st->mode & 07777,
+           st->node, (long long)st->size, name);
+}
+
+
+void print_stat_fields(struct vfs_stat *st, const char *fs, const char *path) {
+    char times[3][32];
+    time_t values[3] = {st->atime, st->mtime, st->ctime};
+    for(int i = 0; i < 3; ++i)
+        strftime(times[i], sizeof(times[i]), "%Y-%m-%d %H:%M:%S", localtime(&values[i]));
+
+    printf("  Path: %s\n", path);
+    printf("  Node: %lu (%s)\n", st->node, fs);
+    printf("  Type: %c  Mode: %04o  Links: %lu\n", get_type_char(st->mode), st->mode & 07777,
+           (unsigned long)st->nlink);
+    printf("  Size: %lld\n", (long long)st->size);
+    printf("Access: %s\nModify: %s\nChange: %s\n", times[0], times[1], times[2]);
+}
+
+
+void remote_to_stat(struct imgfsd_stat *in, struct vfs_stat *st) {
+    st->node = in->node;
+    st->mode = in->mode;
+    st->nlink = in->nlink;
+    st->size = in->size;
+    st->atime = in->atime;
+    st->mtime = in->mtime;
+    st->ctime = in->ctime;
+}
+
+
+//  Sends one request and reads the header of its response. Returns -1
+//  with the errno of the daemon, EPIPE or EPROTO if the connection broke.
+int remote_request(int sock, enum imgfsd_op op, const char *image, const char *path,
+                   uint64_t length, struct imgfsd_response *response) {
+    static uint64_t tag = 0;
+    if(imgfsd_send_request(sock, op, image, path, 0, length, ++tag) == -1 ||
+       imgfsd_read_full(sock, response, sizeof(struct imgfsd_response)) != 1) {
+        errno = EPIPE;
+        return -1;
+    }
+
+    if(response->tag != tag) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    if(response->status) {
+        errno = response->status;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void *remote_call(int sock, enum imgfsd_op op, const char *image, const char *path, uint64_t *length) {
+    struct imgfsd_response response;
+    if(remote_request(sock, op, image, path, 0, &response) == -1)
+        return NULL;
+
+    void *payload = malloc(response.length + 1);
+    if(!payload)
+        err_exit("Can't allocate memory for response");
+
+    if(imgfsd_read_full(sock, payload, response.length) == -1) {
+        free(payload);
+        errno = EPIPE;
+        return NULL;
+    }
+
+    *length = response.length;
+    return payload;
+}
+
+
+int remote_directory(int sock, const char *image, const char *path, int recursive) {
+    uint64_t length;
+    char *payload = (char *)remote_call(sock, IMGFSD_LIST, image, path, &length);
+    if(!payload)
+        return -1;
+
+    for(uint64_t pos = 0; pos + sizeof(struct imgfsd_entry) <= length; ) {
+        struct imgfsd_entry entry;
+        memcpy(&entry, payload + pos, sizeof(struct imgfsd_entry));
+        pos += sizeof(struct imgfsd_entry);
+        if(entry.name_len > length - pos)
+            break;
+
+        char child_path[PATH_MAX];
+        const char *name = payload + pos;
+        pos += entry.name_len;
+
+        struct vfs_stat st;
+        remote_to_stat(&entry.st, &st);
+        if(!recursive) {
+            char name_buf[VFS_NAME_MAX];
+            snprintf(name_buf, sizeof(name_buf), "%.*s", (int)entry.name_len, name);
+            print_entry(&st, name_buf);
+            continue;
+        }
+
+        snprintf(child_path, sizeof(child_path), "%s/%.*s", strcmp(path, "/") ? path : "", (int)entry.name_len, name);
+        printf("%s%s\n", child_path, S_ISDIR(st.mode) ? "/" : "");
+        if(S_ISDIR(st.mode) && remote_directory(sock, image, child_path, 1) == -1) {
+            fprintf(stderr, "%s: %s\n", child_path, strerror(errno));
+            if(errno == EPIPE || errno == EPROTO)
+                break;
+        }
+    }
+
+    free(payload);
+    return 0;
+}
+
+
+//  The whole file comes in one response, it is copied out by chunks
+int remote_file(int sock, const char *image, const char *path) {
+    static char chunk[READ_CHUNK];
+    struct imgfsd_response response;
+    if(remote_request(sock, IMGFSD_READ, image, path, UINT64_MAX, &response) == -1)
+        return -1;
+
+    for(uint64_t done = 0; done < response.length; ) {
+        size_t part = response.length - done < READ_CHUNK ? response.length - done : READ_CHUNK;
+        if(imgfsd_read_full(sock, chunk, part) != 1) {
+            errno = EPIPE;
+            return -1;
+        }
+        fwrite(chunk, 1, part, stdout);
+        done += part;
+    }
+
+    return 0;
+}
+
+
+int remote_stat(int sock, const char *image, const char *path) {
+    uint64_t length;
+    struct imgfsd_stat *payload = (struct imgfsd_stat *)remote_call(sock, IMGFSD_STAT, image, path, &length);
+    if(!payload)
+        return -1;
+
+    struct vfs_stat st;
+    if(length >= sizeof(struct imgfsd_stat))
+        remote_to_stat(payload, &st);
+    free(payload);
+
+    if(length < sizeof(struct imgfsd_stat)) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    print_stat_fields(&st, "imgfsd", path);
+    return 0;
+}
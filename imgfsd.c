@@ -0,0 +1,423 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "vfs.h"
+#include "index.h"
+#include "imgfsd.h"
+
+
+#define SERVE_THREADS   8
+#define LISTEN_BACKLOG  128
+#define ZERO_CHUNK      (64 * 1024)         //  Holes are sent from zeros
+#define READ_CHUNK      (64 * 1024)         //  Files without extents are sent by pieces
+#define LIST_INIT       4096
+#define IDLE_TIMEOUT    30                  //  Seconds, then a silent client is dropped
+
+
+//  Images are sorted by name, so requests find them by binary search
+struct served_image {
+    const char *name;
+    struct vfs *vfs;
+};
+
+
+struct server {
+    int listen_fd;
+    struct served_image *images;
+    int image_count;
+    int idle_timeout;                       //  0 waits for ever
+};
+
+
+static const char *socket_path;
+
+
+int compare_images(const void *a, const void *b);
+struct vfs *find_image(struct server *server, const char *name);
+
+void *serve_worker(void *arg);
+int serve_connection(struct server *server, int conn);
+int serve_request(struct server *server, int conn, struct imgfsd_request *request, const char *image, const char *path);
+int send_response(int conn, uint64_t tag, int status, const void *payload, uint64_t length);
+int send_error(int conn, uint64_t tag);
+int send_stat(int conn, struct imgfsd_request *request, struct vfs *vfs, vfs_node node);
+int send_list(int conn, struct imgfsd_request *request, struct vfs *vfs, vfs_node node);
+int send_file(int conn, struct imgfsd_request *request, struct vfs *vfs, vfs_node node);
+int send_read(int conn, struct imgfsd_request *request, struct vfs *vfs, vfs_node node, off_t offset, uint64_t length);
+
+void fill_stat(struct imgfsd_stat *out, struct vfs_stat *st);
+void stop_server(int sig);
+
+
+//  Every worker accepts connections on its own and serves one at a time,
+//  requests of a connection are answered in order. A connection that is
+//  idle for -t seconds is closed, so clients can't hold all workers.
+int main(int argc, char *argv[])
+{
+    int threads = SERVE_THREADS;
+    int idle_timeout = IDLE_TIMEOUT;
+    int use_index = 0;
+
+    int opt;
+    while((opt = getopt(argc, argv, "j:it:")) != -1) {
+        if(opt == 'j')
+            threads = atoi(optarg);
+        else if(opt == 'i')
+            use_index = 1;
+        else if(opt == 't')
+            idle_timeout = atoi(optarg);
+        else
+            optind = argc + 1;
+    }
+
+    if(optind + 2 > argc || threads < 1 || idle_timeout < 0) {
+        fprintf(stderr, "Usage: %s [-j THREADS] [-i] [-t IDLE_SECONDS] SOCKET IMAGE...\n", argv[0]);
+        return 1;
+    }
+
+    struct server server;
+    server.idle_timeout = idle_timeout;
+    server.image_count = argc - optind - 1;
+    server.images = (struct served_image *)calloc(server.image_count, sizeof(struct served_image));
+    if(!server.images)
+        err_exit("Can't allocate memory for images");
+
+    for(int i = 0; i < server.image_count; ++i) {
+        server.images[i].name = argv[optind + 1 + i];
+        //  Images are kept open for the whole run, so caches stay warm
+        server.images[i].vfs = use_index ? index_open_image(server.images[i].name, stderr)
+                                         : vfs_open(server.images[i].name);
+        if(!server.images[i].vfs) {
+            fprintf(stderr, "%s: %s\n", server.images[i].name, errno == EINVAL ? "Unknown filesystem" : strerror(errno));
+            return 1;
+        }
+    }
+    qsort(server.images, server.image_count, sizeof(struct served_image), compare_images);
+
+    struct sockaddr_un addr;
+    socket_path = argv[optind];
+    if(imgfsd_address(socket_path, &addr) == -1)
+        err_exit("Wrong socket path");
+
+    server.listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(server.listen_fd == -1)
+        err_exit("Can't create socket");
+
+    unlink(socket_path);
+    if(bind(server.listen_fd, (struct sockaddr *)&addr, sizeof(struct sockaddr_un)) == -1 ||
+       listen(server.listen_fd, LISTEN_BACKLOG) == -1)
+        err_exit("Can't listen on socket");
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, stop_server);
+    signal(SIGTERM, stop_server);
+    fprintf(stderr, "Serving %d images on %s with %d threads\n", server.image_count, socket_path, threads);
+
+    pthread_t *workers = (pthread_t *)malloc(threads * sizeof(pthread_t));
+    if(!workers)
+        err_exit("Can't allocate memory for threads");
+
+    for(int i = 0; i < threads; ++i)
+        if(pthread_create(&workers[i], NULL, serve_worker, &server))
+            err_exit("Can't create thread");
+
+    for(int i = 0; i < threads; ++i)
+        pthread_join(workers[i], NULL);
+
+    return 0;
+}
+
+
+int compare_images(const void *a, const void *b) {
+    return strcmp(((const struct served_image *)a)->name, ((const struct served_image *)b)->name);
+}
+
+
+struct vfs *find_image(struct server *server, const char *name) {
+    struct served_image key = {.name = name};
+    struct served_image *found = (struct served_image *)bsearch(&key, server->images, server->image_count,
+                                                                sizeof(struct served_image), compare_images);
+    return found ? found->vfs : NULL;
+}
+
+
+void stop_server(int sig) {
+    (void)sig;
+    unlink(socket_path);
+    _exit(0);
+}
+
+
+void *serve_worker(void *arg) {
+    struct server *server = (struct server *)arg;
+
+    while(1) {
+        int conn = accept(server->listen_fd, NULL, NULL);
+        if(conn == -1) {
+            if(errno != EINTR && errno != ECONNABORTED)
+                perror("Can't accept connection");
+            continue;
+        }
+
+        //  Reads and writes time out alike: a client that stops reading
+        //  a response holds the worker as well
+        struct timeval timeout = {.tv_sec = server->idle_timeout};
+        if(setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(struct timeval)) == -1 ||
+           setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(struct timeval)) == -1)
+            perror("Can't set connection timeout");
+
+        serve_connection(server, conn);
+        close(conn);
+    }
+
+    return NULL;
+}
+
+
+//  Serves requests until the client closes the connection. Protocol
+//  errors close it, errors of a request are sent in its response.
+int serve_connection(struct server *server, int conn) {
+    static __thread char image[IMGFSD_NAME_MAX + 1];
+    static __thread char path[IMGFSD_NAME_MAX + 1];
+    struct imgfsd_request request;
+
+    int got;
+    while((got = imgfsd_read_full(conn, &request, sizeof(struct imgfsd_request))) == 1) {
+        if(request.magic != IMGFSD_MAGIC || request.image_len > IMGFSD_NAME_MAX || request.path_len > IMGFSD_NAME_MAX)
+            return -1;
+
+        //  End of file inside a request is broken, not closed
+        if(imgfsd_read_full(conn, image, request.image_len) != 1 ||
+           imgfsd_read_full(conn, path, request.path_len) != 1)
+            return -1;
+
+        image[request.image_len] = '\0';
+        path[request.path_len] = '\0';
+        if(serve_request(server, conn, &request, image, path) == -1)
+            return -1;
+    }
+
+    return got;
+}
+
+
+//  Returns -1 only if the connection is broken
+int serve_request(struct server *server, int conn, struct imgfsd_request *request, const char *image, const char *path) {
+    struct vfs *vfs = find_image(server, image);
+    if(!vfs)
+        return send_response(conn, request->tag, ENOENT, NULL, 0);
+
+    vfs_node node;
+    if(vfs_lookup(vfs, path, &node) == -1)
+        return send_error(conn, request->tag);
+
+    switch(request->op) {
+        case IMGFSD_STAT:
+            return send_stat(conn, request, vfs, node);
+        case IMGFSD_LIST:
+            return send_list(conn, request, vfs, node);
+        case IMGFSD_READ:
+            return send_file(conn, request, vfs, node);
+        default:
+            return send_response(conn, request->tag, EINVAL, NULL, 0);
+    }
+}
+
+
+//  Header and payload go in one write
+int send_response(int conn, uint64_t tag, int status, const void *payload, uint64_t length) {
+    struct imgfsd_response response = {.tag = tag, .status = status, .length = length};
+    struct iovec iov[2] = {
+        {.iov_base = &response, .iov_len = sizeof(struct imgfsd_response)},
+        {.iov_base = (void *)payload, .iov_len = payload ? length : 0}
+    };
+
+    ssize_t total = iov[0].iov_len + iov[1].iov_len;
+    ssize_t sent = writev(conn, iov, 2);
+    if(sent == total)
+        return 0;
+    if(sent == -1)
+        return -1;
+
+    //  Short write, the rest goes the slow way
+    if(sent < (ssize_t)sizeof(struct imgfsd_response))
+        return imgfsd_write_full(conn, (char *)&response + sent, sizeof(struct imgfsd_response) - sent) == -1 ||
+               imgfsd_write_full(conn, payload, iov[1].iov_len) == -1 ? -1 : 0;
+
+    sent -= sizeof(struct imgfsd_response);
+    return imgfsd_write_full(conn, (const char *)payload + sent, iov[1].iov_len - sent);
+}
+
+
+//  Errors of reading the image come back from the drivers with errno;
+//  one that left no errno still fails the request
+int send_error(int conn, uint64_t tag) {
+    return send_response(conn, tag, errno ? errno : EIO, NULL, 0);
+}
+
+
+void fill_stat(struct imgfsd_stat *out, struct vfs_stat *st) {
+    out->node = st->node;
+    out->mode = st->mode;
+    out->nlink = st->nlink;
+    out->size = st->size;
+    out->atime = st->atime;
+    out->mtime = st->mtime;
+    out->ctime = st->ctime;
+}
+
+
+int send_stat(int conn, struct imgfsd_request *request, struct vfs *vfs, vfs_node node) {
+    struct vfs_stat st;
+    if(vfs_stat(vfs, node, &st) == -1)
+        return send_error(conn, request->tag);
+
+    struct imgfsd_stat out;
+    fill_stat(&out, &st);
+    return send_response(conn, request->tag, 0, &out, sizeof(struct imgfsd_stat));
+}
+
+
+int send_list(int conn, struct imgfsd_request *request, struct vfs *vfs, vfs_node node) {
+    struct vfs_dir *dir = vfs_opendir(vfs, node);
+    if(!dir)
+        return send_error(conn, request->tag);
+
+    size_t size = 0;
+    size_t capacity = LIST_INIT;
+    char *payload = (char *)malloc(capacity);
+    if(!payload)
+        err_exit("Can't allocate memory for listing");
+
+    struct vfs_dirent entry;
+    while(vfs_readdir(dir, &entry)) {
+        struct vfs_stat st;
+        if(vfs_stat(vfs, entry.node, &st) == -1)
+            continue;
+
+        size_t name_len = strlen(entry.name);
+        while(size + sizeof(struct imgfsd_entry) + name_len > capacity) {
+            capacity *= 2;
+            payload = (char *)realloc(payload, capacity);
+            if(!payload)
+                err_exit("Can't allocate memory for listing");
+        }
+
+        struct imgfsd_entry out;
+        memset(&out, 0, sizeof(struct imgfsd_entry));
+        fill_stat(&out.st, &st);
+        out.name_len = name_len;
+        memcpy(payload + size, &out, sizeof(struct imgfsd_entry));
+        memcpy(payload + size + sizeof(struct imgfsd_entry), entry.name, name_len);
+        size += sizeof(struct imgfsd_entry) + name_len;
+    }
+    vfs_closedir(dir);
+
+    int result = send_response(conn, request->tag, 0, payload, size);
+    free(payload);
+    return result;
+}
+
+
+//  Extents go from the image to the socket with sendfile, without a copy
+//  to user space; holes are sent from a zero buffer. Files without
+//  extents (symlinks kept in the inode) are read with vfs_pread.
+int send_file(int conn, struct imgfsd_request *request, struct vfs *vfs, vfs_node node) {
+    static const char zeros[ZERO_CHUNK];
+    struct vfs_stat st;
+    if(vfs_stat(vfs, node, &st) == -1)
+        return send_error(conn, request->tag);
+
+    if(S_ISDIR(st.mode))
+        return send_response(conn, request->tag, EISDIR, NULL, 0);
+
+    off_t offset = request->offset;
+    uint64_t length = 0;
+    if(request->offset < (uint64_t)st.size)
+        length = request->length < st.size - request->offset ? request->length : st.size - request->offset;
+
+    struct vfs_extent extent;
+    if(length && vfs_map(vfs, node, offset, &extent) == -1)
+        return send_read(conn, request, vfs, node, offset, length);
+
+    //  Length is promised in the header, so extents are mapped before it
+    //  and only failures of the socket or the image file close the connection
+    off_t end = offset + length;
+    for(off_t pos = offset; pos < end; pos = extent.offset + extent.length)
+        if(vfs_map(vfs, node, pos, &extent) != 1)
+            return send_error(conn, request->tag);
+
+    if(send_response(conn, request->tag, 0, NULL, length) == -1)
+        return -1;
+
+    while(offset < end) {
+        if(vfs_map(vfs, node, offset, &extent) != 1)
+            return -1;
+
+        off_t part = extent.offset + extent.length - offset;
+        if(part > end - offset)
+            part = end - offset;
+
+        if(!extent.image_offset) {
+            if(imgfsd_write_full(conn, zeros, part < ZERO_CHUNK ? part : ZERO_CHUNK) == -1)
+                return -1;
+            offset += part < ZERO_CHUNK ? part : ZERO_CHUNK;
+            continue;
+        }
+
+        off_t image_offset = extent.image_offset + (offset - extent.offset);
+        while(part > 0) {
+            ssize_t sent = sendfile(conn, vfs->img->fd, &image_offset, part);
+            if(sent == -1 && errno == EINTR)
+                continue;
+            if(sent <= 0)
+                return -1;
+            part -= sent;
+            offset += sent;
+        }
+    }
+
+    return 0;
+}
+
+
+//  Read by pieces through one buffer of the thread. The first piece is
+//  read before the header, so a file that can't be read gets an error
+//  and a short one is answered with what was read.
+int send_read(int conn, struct imgfsd_request *request, struct vfs *vfs, vfs_node node, off_t offset, uint64_t length) {
+    static __thread char chunk[READ_CHUNK];
+    size_t len = length < READ_CHUNK ? length : READ_CHUNK;
+    ssize_t read = vfs_pread(vfs, node, chunk, len, offset);
+    if(read == -1)
+        return send_error(conn, request->tag);
+    if((size_t)read < len)
+        return send_response(conn, request->tag, 0, chunk, read);
+
+    if(send_response(conn, request->tag, 0, NULL, length) == -1 || imgfsd_write_full(conn, chunk, read) == -1)
+        return -1;
+
+    uint64_t done = read;
+    while(done < length) {
+        len = length - done < READ_CHUNK ? length - done : READ_CHUNK;
+        if(vfs_pread(vfs, node, chunk, len, offset + done) != (ssize_t)len ||
+           imgfsd_write_full(conn, chunk, len) == -1)
+            return -1;
+        done += len;
+    }
+
+    return 0;
+}
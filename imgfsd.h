@@ -0,0 +1,159 @@
+#ifndef IMGFSD_H
+#define IMGFSD_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+
+//  Protocol of imgfsd, in host byte order as the socket is local.
+//  Request is the header, image name and path; response is the header
+//  and length bytes of payload. Requests may be pipelined, responses of
+//  one connection come in request order and carry the request tag.
+#define IMGFSD_MAGIC        0x44534649      //  "IFSD"
+#define IMGFSD_NAME_MAX     4096            //  Image name and path, each
+
+enum imgfsd_op {
+    IMGFSD_STAT = 1,                        //  Payload is struct imgfsd_stat
+    IMGFSD_LIST,                            //  Entries: struct imgfsd_stat, name_len, name
+    IMGFSD_READ                             //  File bytes, fewer at the end of file
+};
+
+
+struct imgfsd_request {
+    uint32_t magic;
+    uint32_t op;
+    uint32_t image_len;
+    uint32_t path_len;
+    uint64_t offset;
+    uint64_t length;
+    uint64_t tag;
+};
+
+
+struct imgfsd_response {
+    uint64_t tag;
+    int32_t status;                         //  0 or errno
+    uint32_t reserved;
+    uint64_t length;
+};
+
+
+struct imgfsd_stat {
+    uint64_t node;
+    uint32_t mode;
+    uint32_t nlink;
+    int64_t size;
+    int64_t atime;
+    int64_t mtime;
+    int64_t ctime;
+};
+
+
+struct imgfsd_entry {
+    struct imgfsd_stat st;
+    uint32_t name_len;                      //  Name follows, not null terminated
+    uint32_t reserved;
+};
+
+
+//  Returns 1 if all len bytes are read, 0 at the end of stream, -1 on error
+//  or on the end of stream in the middle
+static inline int imgfsd_read_full(int fd, void *buf, size_t len) {
+    size_t done = 0;
+    while(done < len) {
+        ssize_t got = read(fd, (char *)buf + done, len - done);
+        if(got == -1 && errno == EINTR)
+            continue;
+        if(got == 0 && done == 0)
+            return 0;
+        if(got <= 0) {
+            if(got == 0)
+                errno = EPIPE;
+            return -1;
+        }
+        done += got;
+    }
+
+    return 1;
+}
+
+
+static inline int imgfsd_write_full(int fd, const void *buf, size_t len) {
+    size_t done = 0;
+    while(done < len) {
+        ssize_t sent = write(fd, (const char *)buf + done, len - done);
+        if(sent == -1 && errno == EINTR)
+            continue;
+        if(sent == -1)
+            return -1;
+        done += sent;
+    }
+
+    return 0;
+}
+
+
+static inline int imgfsd_address(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+
+static inline int imgfsd_connect(const char *path) {
+    struct sockaddr_un addr;
+    if(imgfsd_address(path, &addr) == -1)
+        return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd == -1)
+        return -1;
+
+    if(connect(fd, (struct sockaddr *)&addr, sizeof(struct sockaddr_un)) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+
+static inline int imgfsd_send_request(int fd, enum imgfsd_op op, const char *image, const char *path,
+                                      uint64_t offset, uint64_t length, uint64_t tag) {
+    struct imgfsd_request request = {
+        .magic = IMGFSD_MAGIC,
+        .op = op,
+        .image_len = strlen(image),
+        .path_len = strlen(path),
+        .offset = offset,
+        .length = length,
+        .tag = tag
+    };
+
+    if(request.image_len > IMGFSD_NAME_MAX || request.path_len > IMGFSD_NAME_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    if(imgfsd_write_full(fd, &request, sizeof(struct imgfsd_request)) == -1 ||
+       imgfsd_write_full(fd, image, request.image_len) == -1 ||
+       imgfsd_write_full(fd, path, request.path_len) == -1)
+        return -1;
+
+    return 0;
+}
+
+#endif  //  IMGFSD_H
@@ -0,0 +1,811 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "image.h"
+#include "vfs.h"
+
+
+#define INDEX_MAGIC         0x58444E49      //  "INDX"
+#define INDEX_VERSION       1
+#define INDEX_SUFFIX        ".idx"
+#define INDEX_META_BYTES    4096            //  Boot sector, FSInfo or ext2 superblock
+#define INDEX_NONE          0xFFFFFFFF
+#define INDEX_INIT          256
+#define INDEX_ALIGN         8
+
+#ifndef err_exit
+#define err_exit(msg)    do {                    \
+                             perror(msg);        \
+                             exit(EXIT_FAILURE); \
+                         } while (0)
+#endif
+
+
+//  Sidecar file, in host byte order:
+//      header, records, extents, path hash, strings
+//  Records are in breadth first order, so children of a directory are
+//  consecutive. Record 0 is the root, its path is "/".
+struct index_header {
+    uint32_t magic;
+    uint32_t version;
+    char fs[8];                             //  Driver name
+    uint32_t fold_case;
+
+    //  Image the index was built from
+    uint64_t image_size;
+    int64_t image_mtime_sec;
+    int64_t image_mtime_nsec;
+    uint64_t meta_hash;                     //  FNV-1a of the first INDEX_META_BYTES
+
+    uint32_t record_count;
+    uint32_t extent_count;
+    uint32_t hash_size;                     //  Power of two
+    uint32_t reserved;
+    uint64_t records_offset;
+    uint64_t extents_offset;
+    uint64_t hash_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+};
+
+
+struct index_record {
+    uint64_t node;                          //  Filesystem node, see vfs.h
+    int64_t size;
+    int64_t atime;
+    int64_t mtime;
+    int64_t ctime;
+    uint32_t mode;
+    uint32_t nlink;
+
+    uint32_t parent;
+    uint32_t first_child;
+    uint32_t child_count;
+    uint32_t first_extent;                  //  Data extents only, holes are gaps
+    uint32_t extent_count;
+    uint32_t path;                          //  Offsets in strings
+    uint32_t name;
+    uint32_t target;                        //  Symlink target, size bytes long
+};
+
+
+struct index_extent {
+    uint64_t offset;
+    uint64_t image_offset;
+    uint64_t length;
+};
+
+
+//  Mapped sidecar. Header sections are checked on open, record fields on
+//  access, so a damaged index fails lookups instead of faulting.
+struct image_index {
+    struct image *file;
+    struct image *img;                      //  File data is read from here
+    const struct index_header *header;
+    const struct index_record *records;
+    const struct index_extent *extents;
+    const uint32_t *hash;
+    const char *strings;
+};
+
+
+struct index_builder {
+    struct vfs *vfs;
+    struct index_record *records;
+    uint32_t count;
+    uint32_t capacity;
+
+    struct index_extent *extents;
+    uint32_t extent_count;
+    uint32_t extent_capacity;
+
+    char *strings;
+    size_t strings_size;
+    size_t strings_capacity;
+};
+
+
+struct index_dir {
+    struct image_index *index;
+    uint32_t next;
+    uint32_t end;
+};
+
+
+static inline uint64_t index_hash_bytes(uint64_t hash, const void *data, size_t len, int fold_case) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    for(size_t i = 0; i < len; ++i) {
+        unsigned char c = bytes[i];
+        hash ^= fold_case && c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+        hash *= 1099511628211ull;
+    }
+
+    return hash;
+}
+
+
+static inline uint64_t index_hash_path(const char *path, int fold_case) {
+    return index_hash_bytes(14695981039346656037ull, path, strlen(path), fold_case);
+}
+
+
+//  Hash of the image start, changes with any boot sector or superblock
+//  write (mount count, write time, free counters)
+static inline int index_meta_hash(struct image *img, uint64_t *hash) {
+    unsigned char meta[INDEX_META_BYTES];
+    memset(meta, 0, sizeof(meta));
+    size_t len = img->size < INDEX_META_BYTES ? img->size : INDEX_META_BYTES;
+    if(image_pread(img, meta, len, 0) != (ssize_t)len)
+        return -1;
+
+    *hash = index_hash_bytes(14695981039346656037ull, meta, sizeof(meta), 0);
+    return 0;
+}
+
+
+//  Removes empty and "." components and the trailing slash, "/" stays
+static inline int index_normalize_path(const char *path, char *out, size_t size) {
+    size_t len = 0;
+    while(*path) {
+        size_t part = strcspn(path, "/");
+        if(part && !(part == 1 && path[0] == '.')) {
+            if(len + part + 2 > size) {
+                errno = ENAMETOOLONG;
+                return -1;
+            }
+            out[len++] = '/';
+            memcpy(out + len, path, part);
+            len += part;
+        }
+
+        path += part;
+        path += *path == '/';
+    }
+
+    if(len == 0)
+        out[len++] = '/';
+    out[len] = '\0';
+    return 0;
+}
+
+
+static inline void *index_grow(void *array, uint32_t *capacity, uint32_t count, size_t size) {
+    if(count < *capacity)
+        return array;
+
+    *capacity = *capacity ? *capacity * 2 : INDEX_INIT;
+    array = realloc(array, (size_t)*capacity * size);
+    if(!array)
+        err_exit("Can't allocate memory for index");
+
+    return array;
+}
+
+
+static inline uint32_t index_add_string(struct index_builder *builder, const char *str, size_t len) {
+    while(builder->strings_size + len + 1 > builder->strings_capacity) {
+        builder->strings_capacity = builder->strings_capacity ? builder->strings_capacity * 2 : INDEX_INIT * 16;
+        builder->strings = (char *)realloc(builder->strings, builder->strings_capacity);
+        if(!builder->strings)
+            err_exit("Can't allocate memory for index");
+    }
+
+    uint32_t offset = builder->strings_size;
+    memcpy(builder->strings + offset, str, len);
+    builder->strings[offset + len] = '\0';
+    builder->strings_size += len + 1;
+    return offset;
+}
+
+
+static inline int index_add_extents(struct index_builder *builder, struct index_record *record) {
+    record->first_extent = builder->extent_count;
+    struct vfs_extent extent;
+    off_t offset = 0;
+    int found;
+
+    while((found = vfs_map(builder->vfs, record->node, offset, &extent)) == 1) {
+        offset = extent.offset + extent.length;
+        if(!extent.image_offset)
+            continue;
+
+        builder->extents = (struct index_extent *)index_grow(builder->extents, &builder->extent_capacity,
+                                                             builder->extent_count, sizeof(struct index_extent));
+        struct index_extent *last = record->extent_count ? &builder->extents[builder->extent_count - 1] : NULL;
+        if(last && last->offset + last->length == (uint64_t)extent.offset &&
+           last->image_offset + last->length == (uint64_t)extent.image_offset) {
+            last->length += extent.length;
+            continue;
+        }
+
+        builder->extents[builder->extent_count].offset = extent.offset;
+        builder->extents[builder->extent_count].image_offset = extent.image_offset;
+        builder->extents[builder->extent_count].length = extent.length;
+        builder->extent_count++;
+        record->extent_count++;
+    }
+
+    return found;
+}
+
+
+//  Appends record of the node, its path is parent path and name
+static inline int index_add_record(struct index_builder *builder, uint32_t parent, vfs_node node, const char *name) {
+    struct vfs_stat st;
+    if(vfs_stat(builder->vfs, node, &st) == -1)
+        return -1;
+
+    builder->records = (struct index_record *)index_grow(builder->records, &builder->capacity,
+                                                         builder->count, sizeof(struct index_record));
+    struct index_record *record = &builder->records[builder->count];
+    memset(record, 0, sizeof(struct index_record));
+    record->node = node;
+    record->size = st.size;
+    record->atime = st.atime;
+    record->mtime = st.mtime;
+    record->ctime = st.ctime;
+    record->mode = st.mode;
+    record->nlink = st.nlink;
+    record->parent = parent;
+    record->first_child = INDEX_NONE;
+    record->target = INDEX_NONE;
+
+    if(parent == INDEX_NONE) {
+        record->path = index_add_string(builder, "/", 1);
+        record->name = record->path + 1;
+    } else {
+        char path[PATH_MAX];
+        const char *parent_path = builder->strings + builder->records[parent].path;
+        int len = snprintf(path, sizeof(path), "%s/%s", parent == 0 ? "" : parent_path, name);
+        if(len >= (int)sizeof(path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        record->path = index_add_string(builder, path, len);
+        record->name = record->path + len - strlen(name);
+    }
+
+    if(S_ISREG(st.mode) && index_add_extents(builder, record) == -1)
+        return -1;
+
+    if(S_ISLNK(st.mode) && st.size < PATH_MAX) {
+        char target[PATH_MAX];
+        if(vfs_pread(builder->vfs, node, target, st.size, 0) != st.size)
+            return -1;
+        record->target = index_add_string(builder, target, st.size);
+    }
+
+    builder->count++;
+    return 0;
+}
+
+
+static inline uint32_t *index_build_hash(struct index_builder *builder, uint32_t *hash_size) {
+    *hash_size = 1;
+    while(*hash_size < 2 * builder->count)
+        *hash_size *= 2;
+
+    uint32_t *hash = (uint32_t *)malloc((size_t)*hash_size * sizeof(uint32_t));
+    if(!hash)
+        err_exit("Can't allocate memory for index");
+    memset(hash, 0xFF, (size_t)*hash_size * sizeof(uint32_t));
+
+    for(uint32_t i = 0; i < builder->count; ++i) {
+        uint64_t key = index_hash_path(builder->strings + builder->records[i].path, builder->vfs->driver->fold_case);
+        uint32_t slot = key & (*hash_size - 1);
+        while(hash[slot] != INDEX_NONE)
+            slot = (slot + 1) & (*hash_size - 1);
+        hash[slot] = i;
+    }
+
+    return hash;
+}
+
+
+static inline int index_write(int fd, const void *data, size_t len, uint64_t *offset) {
+    static const char zeros[INDEX_ALIGN];
+    size_t pad = (INDEX_ALIGN - *offset % INDEX_ALIGN) % INDEX_ALIGN;
+    if(pad && write(fd, zeros, pad) != (ssize_t)pad)
+        return -1;
+
+    *offset += pad;
+    const char *bytes = (const char *)data;
+    size_t done = 0;
+    while(done < len) {
+        ssize_t written = write(fd, bytes + done, len - done);
+        if(written == -1)
+            return -1;
+        done += written;
+    }
+
+    *offset += len;
+    return 0;
+}
+
+
+//  Walks the whole tree breadth first and writes the sidecar through a
+//  temporary file, so readers never map a half written index. Entries
+//  that can't be read are reported and left out.
+static inline int index_build(struct vfs *vfs, const char *index_path, unsigned long *errors) {
+    struct index_builder builder;
+    memset(&builder, 0, sizeof(struct index_builder));
+    builder.vfs = vfs;
+    *errors = 0;
+
+    if(index_add_record(&builder, INDEX_NONE, vfs_root(vfs), "") == -1)
+        return -1;
+
+    for(uint32_t i = 0; i < builder.count; ++i) {
+        if(!S_ISDIR(builder.records[i].mode))
+            continue;
+
+        struct vfs_dir *dir = vfs_opendir(vfs, builder.records[i].node);
+        if(!dir) {
+            fprintf(stderr, "%s: %s\n", builder.strings + builder.records[i].path, strerror(errno));
+            (*errors)++;
+            continue;
+        }
+
+        uint32_t first = builder.count;
+        struct vfs_dirent entry;
+        while(vfs_readdir(dir, &entry)) {
+            if(index_add_record(&builder, i, entry.node, entry.name) == -1) {
+                fprintf(stderr, "%s/%s: %s\n", builder.strings + builder.records[i].path, entry.name, strerror(errno));
+                (*errors)++;
+            }
+        }
+        vfs_closedir(dir);
+
+        builder.records[i].first_child = first;
+        builder.records[i].child_count = builder.count - first;
+    }
+
+    struct index_header header;
+    memset(&header, 0, sizeof(struct index_header));
+    struct stat image_stat;
+    if(fstat(vfs->img->fd, &image_stat) == -1 || index_meta_hash(vfs->img, &header.meta_hash) == -1)
+        return -1;
+
+    header.magic = INDEX_MAGIC;
+    header.version = INDEX_VERSION;
+    strncpy(header.fs, vfs->driver->name, sizeof(header.fs) - 1);
+    header.fold_case = vfs->driver->fold_case;
+    header.image_size = image_stat.st_size;
+    header.image_mtime_sec = image_stat.st_mtim.tv_sec;
+    header.image_mtime_nsec = image_stat.st_mtim.tv_nsec;
+    header.record_count = builder.count;
+    header.extent_count = builder.extent_count;
+    uint32_t *hash = index_build_hash(&builder, &header.hash_size);
+
+    uint64_t offset = sizeof(struct index_header);
+    header.records_offset = offset;
+    header.extents_offset = header.records_offset + (uint64_t)builder.count * sizeof(struct index_record);
+    header.hash_offset = header.extents_offset + (uint64_t)builder.extent_count * sizeof(struct index_extent);
+    header.strings_offset = header.hash_offset + (uint64_t)header.hash_size * sizeof(uint32_t);
+    header.strings_offset += (INDEX_ALIGN - header.strings_offset % INDEX_ALIGN) % INDEX_ALIGN;
+    header.strings_size = builder.strings_size;
+
+    char tmp_path[PATH_MAX + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", index_path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int result = fd == -1 ? -1 : 0;
+
+    offset = 0;
+    if(result == 0 &&
+       (index_write(fd, &header, sizeof(struct index_header), &offset) == -1 ||
+        index_write(fd, builder.records, (size_t)builder.count * sizeof(struct index_record), &offset) == -1 ||
+        index_write(fd, builder.extents, (size_t)builder.extent_count * sizeof(struct index_extent), &offset) == -1 ||
+        index_write(fd, hash, (size_t)header.hash_size * sizeof(uint32_t), &offset) == -1 ||
+        index_write(fd, builder.strings, builder.strings_size, &offset) == -1))
+        result = -1;
+
+    if(fd != -1 && close(fd) == -1)
+        result = -1;
+    if(result == 0 && rename(tmp_path, index_path) == -1)
+        result = -1;
+    if(result == -1 && fd != -1)
+        unlink(tmp_path);
+
+    free(hash);
+    free(builder.records);
+    free(builder.extents);
+    free(builder.strings);
+    return result;
+}
+
+
+static inline int index_section_ok(struct image_index *index, uint64_t offset, uint64_t count, size_t size) {
+    uint64_t file_size = index->file->size;
+    return offset % INDEX_ALIGN == 0 && offset <= file_size && count <= (file_size - offset) / size;
+}
+
+
+//  Returns 0 if the sidecar matches the image, -1 with EINVAL if it is
+//  damaged and ESTALE if it was built from another image
+static inline int index_check(struct image_index *index) {
+    const struct index_header *header = index->header;
+    if(index->file->size < (off_t)sizeof(struct index_header) || header->magic != INDEX_MAGIC ||
+       header->version != INDEX_VERSION || header->record_count == 0 ||
+       (header->hash_size & (header->hash_size - 1)) || header->hash_size < header->record_count ||
+       !index_section_ok(index, header->records_offset, header->record_count, sizeof(struct index_record)) ||
+       !index_section_ok(index, header->extents_offset, header->extent_count, sizeof(struct index_extent)) ||
+       !index_section_ok(index, header->hash_offset, header->hash_size, sizeof(uint32_t)) ||
+       !index_section_ok(index, header->strings_offset, header->strings_size, 1) ||
+       header->strings_size == 0 || index->file->map[header->strings_offset + header->strings_size - 1] != '\0') {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct stat image_stat;
+    uint64_t meta_hash;
+    if(fstat(index->img->fd, &image_stat) == -1 || index_meta_hash(index->img, &meta_hash) == -1)
+        return -1;
+
+    if(header->image_size != (uint64_t)image_stat.st_size || header->image_mtime_sec != image_stat.st_mtim.tv_sec ||
+       header->image_mtime_nsec != image_stat.st_mtim.tv_nsec || header->meta_hash != meta_hash) {
+        errno = ESTALE;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static inline const char *index_string(struct image_index *index, uint32_t offset) {
+    return offset < index->header->strings_size ? index->strings + offset : "";
+}
+
+
+static inline const struct index_record *index_get_record(struct image_index *index, vfs_node node) {
+    if(node >= index->header->record_count) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    return &index->records[node];
+}
+
+
+//  Directory record with its children in the record table; the index
+//  file is not trusted
+static inline const struct index_record *index_get_dir(struct image_index *index, vfs_node node) {
+    const struct index_record *record = index_get_record(index, node);
+    if(!record)
+        return NULL;
+
+    if(!S_ISDIR(record->mode)) {
+        errno = ENOTDIR;
+        return NULL;
+    }
+
+    if(record->child_count && (record->first_child >= index->header->record_count ||
+                               record->child_count > index->header->record_count - record->first_child)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return record;
+}
+
+
+static inline int index_vfs_stat(void *fs, vfs_node node, struct vfs_stat *st) {
+    const struct index_record *record = index_get_record((struct image_index *)fs, node);
+    if(!record)
+        return -1;
+
+    memset(st, 0, sizeof(struct vfs_stat));
+    st->node = record->node;
+    st->mode = record->mode;
+    st->size = record->size;
+    st->nlink = record->nlink;
+    st->atime = record->atime;
+    st->mtime = record->mtime;
+    st->ctime = record->ctime;
+    return 0;
+}
+
+
+//  One hash probe for the whole path
+static inline int index_vfs_lookup_path(void *fs, const char *path, vfs_node *node) {
+    struct image_index *index = (struct image_index *)fs;
+    char normalized[PATH_MAX];
+    if(index_normalize_path(path, normalized, sizeof(normalized)) == -1)
+        return -1;
+
+    int fold_case = index->header->fold_case;
+    uint32_t mask = index->header->hash_size - 1;
+    uint32_t slot = index_hash_path(normalized, fold_case) & mask;
+    for(uint32_t probes = 0; probes <= mask && index->hash[slot] != INDEX_NONE; ++probes) {
+        uint32_t found = index->hash[slot];
+        if(found < index->header->record_count) {
+            const char *candidate = index_string(index, index->records[found].path);
+            if(!(fold_case ? strcasecmp(candidate, normalized) : strcmp(candidate, normalized))) {
+                *node = found;
+                return 0;
+            }
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    errno = ENOENT;
+    return -1;
+}
+
+
+static inline int index_vfs_lookup(void *fs, vfs_node dir, const char *name, size_t len, vfs_node *node) {
+    struct image_index *index = (struct image_index *)fs;
+    const struct index_record *record = index_get_dir(index, dir);
+    if(!record)
+        return -1;
+
+    for(uint32_t i = 0; i < record->child_count; ++i) {
+        const char *child = index_string(index, index->records[record->first_child + i].name);
+        if(strlen(child) == len &&
+           !(index->header->fold_case ? strncasecmp(child, name, len) : strncmp(child, name, len))) {
+            *node = record->first_child + i;
+            return 0;
+        }
+    }
+
+    errno = ENOENT;
+    return -1;
+}
+
+
+static inline void *index_vfs_opendir(void *fs, vfs_node node) {
+    struct image_index *index = (struct image_index *)fs;
+    const struct index_record *record = index_get_dir(index, node);
+    if(!record)
+        return NULL;
+
+    struct index_dir *dir = (struct index_dir *)malloc(sizeof(struct index_dir));
+    if(!dir)
+        err_exit("Can't allocate memory for dir iterator");
+
+    dir->index = index;
+    dir->next = record->child_count ? record->first_child : 0;
+    dir->end = dir->next + record->child_count;
+    return dir;
+}
+
+
+static inline int index_vfs_readdir(void *dir, struct vfs_dirent *entry) {
+    struct index_dir *idir = (struct index_dir *)dir;
+    if(idir->next == idir->end)
+        return 0;
+
+    const struct index_record *record = &idir->index->records[idir->next];
+    entry->node = idir->next++;
+    entry->type = record->mode & S_IFMT;
+    snprintf(entry->name, sizeof(entry->name), "%s", index_string(idir->index, record->name));
+    return 1;
+}
+
+
+static inline void index_vfs_closedir(void *dir) {
+    free(dir);
+}
+
+
+//  Finds the first extent ending after offset by binary search
+static inline const struct index_extent *index_find_extent(struct image_index *index, const struct index_record *record,
+                                                           off_t offset, const struct index_extent **end) {
+    if(record->first_extent > index->header->extent_count ||
+       record->extent_count > index->header->extent_count - record->first_extent) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    const struct index_extent *first = index->extents + record->first_extent;
+    size_t low = 0, high = record->extent_count;
+    while(low < high) {
+        size_t mid = (low + high) / 2;
+        if(first[mid].offset + first[mid].length <= (uint64_t)offset)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    *end = first + record->extent_count;
+    return first + low;
+}
+
+
+//  Gaps between extents are holes. Each extent is one read of the image.
+static inline ssize_t index_vfs_pread(void *fs, vfs_node node, void *buf, size_t len, off_t offset) {
+    struct image_index *index = (struct image_index *)fs;
+    const struct index_record *record = index_get_record(index, node);
+    if(!record)
+        return -1;
+
+    if(S_ISDIR(record->mode)) {
+        errno = EISDIR;
+        return -1;
+    }
+
+    if(offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(offset >= record->size)
+        return 0;
+    if(len > (size_t)(record->size - offset))
+        len = record->size - offset;
+
+    unsigned char *out = (unsigned char *)buf;
+    if(S_ISLNK(record->mode) && record->target != INDEX_NONE) {
+        if((uint64_t)record->size >= index->header->strings_size ||
+           record->target >= index->header->strings_size - record->size) {
+            errno = EINVAL;
+            return -1;
+        }
+        memcpy(out, index_string(index, record->target) + offset, len);
+        return len;
+    }
+
+    const struct index_extent *end;
+    const struct index_extent *extent = index_find_extent(index, record, offset, &end);
+    if(!extent)
+        return -1;
+
+    size_t done = 0;
+    while(done < len) {
+        off_t pos = offset + done;
+        if(extent == end || extent->offset > (uint64_t)pos) {
+            size_t hole = extent == end ? len - done : extent->offset - pos;
+            if(hole > len - done)
+                hole = len - done;
+            memset(out + done, 0, hole);
+            done += hole;
+            continue;
+        }
+
+        size_t run = extent->offset + extent->length - pos;
+        if(run > len - done)
+            run = len - done;
+
+        if(image_pread(index->img, out + done, run, extent->image_offset + (pos - extent->offset)) != (ssize_t)run) {
+            errno = EIO;
+            break;
+        }
+        done += run;
+        extent++;
+    }
+
+    return done ? (ssize_t)done : -1;
+}
+
+
+static inline int index_vfs_map(void *fs, vfs_node node, off_t offset, struct vfs_extent *extent) {
+    struct image_index *index = (struct image_index *)fs;
+    const struct index_record *record = index_get_record(index, node);
+    if(!record)
+        return -1;
+
+    if(!S_ISREG(record->mode)) {
+        errno = S_ISDIR(record->mode) ? EISDIR : ENODATA;
+        return -1;
+    }
+
+    if(offset >= record->size)
+        return 0;
+
+    const struct index_extent *end;
+    const struct index_extent *found = index_find_extent(index, record, offset, &end);
+    if(!found)
+        return -1;
+
+    if(found != end && found->offset <= (uint64_t)offset) {
+        extent->offset = found->offset;
+        extent->image_offset = found->image_offset;
+        extent->length = found->length;
+        return 1;
+    }
+
+    //  Hole up to the next extent
+    extent->offset = found == index->extents + record->first_extent ? 0 : found[-1].offset + found[-1].length;
+    extent->image_offset = 0;
+    extent->length = (found == end ? (uint64_t)record->size : found->offset) - extent->offset;
+    return 1;
+}
+
+
+static inline void index_vfs_unmount(void *fs) {
+    struct image_index *index = (struct image_index *)fs;
+    image_close(index->file);
+    free(index);
+}
+
+
+static const struct vfs_driver index_driver = {
+    .name = "index", .root = 0, .unmount = index_vfs_unmount,
+    .stat = index_vfs_stat, .lookup = index_vfs_lookup, .lookup_path = index_vfs_lookup_path,
+    .opendir = index_vfs_opendir, .readdir = index_vfs_readdir, .closedir = index_vfs_closedir,
+    .pread = index_vfs_pread, .map = index_vfs_map
+};
+
+
+//  Serves the image from its sidecar: nodes are record numbers, file data
+//  is read from the image. Returns NULL with ENOENT if there is no index,
+//  ESTALE or EINVAL if it can't be used; then vfs_open() is the fallback.
+static inline struct vfs *index_vfs_open(const char *path, const char *index_path) {
+    struct image *file = image_open(index_path, IMAGE_MMAP);
+    if(!file)
+        return NULL;
+
+    //  The mapping couldn't be watched, image_open() already said why
+    if(!file->map && file->size > 0) {
+        image_close(file);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    struct image *img = image_open(path, get_image_mode());
+    if(!img) {
+        image_close(file);
+        return NULL;
+    }
+
+    struct image_index *index = (struct image_index *)calloc(1, sizeof(struct image_index));
+    struct vfs *vfs = (struct vfs *)malloc(sizeof(struct vfs));
+    if(!index || !vfs)
+        err_exit("Can't allocate memory for index");
+
+    index->file = file;
+    index->img = img;
+    index->header = (const struct index_header *)file->map;
+    if(file->size >= (off_t)sizeof(struct index_header)) {
+        index->records = (const struct index_record *)(file->map + index->header->records_offset);
+        index->extents = (const struct index_extent *)(file->map + index->header->extents_offset);
+        index->hash = (const uint32_t *)(file->map + index->header->hash_offset);
+        index->strings = (const char *)(file->map + index->header->strings_offset);
+    }
+
+    if(index_check(index) == -1) {
+        int error = errno;
+        image_close(file);
+        image_close(img);
+        free(index);
+        free(vfs);
+        errno = error;
+        return NULL;
+    }
+
+    image_advise(img, 0, 0, IMAGE_RANDOM);
+    vfs->img = img;
+    vfs->driver = &index_driver;
+    vfs->fs = index;
+    return vfs;
+}
+
+//  Opens the image through IMAGE.idx if it is up to date and through its
+//  filesystem otherwise; why the index is not used is reported to log
+static inline struct vfs *index_open_image(const char *path, FILE *log) {
+    char index_path[PATH_MAX];
+    if(snprintf(index_path, sizeof(index_path), "%s%s", path, INDEX_SUFFIX) < (int)sizeof(index_path)) {
+        struct vfs *vfs = index_vfs_open(path, index_path);
+        if(vfs)
+            return vfs;
+
+        if(errno != ENOENT)
+            fprintf(log, "%s: %s, reading the image\n", index_path,
+                    errno == ESTALE ? "Index is out of date" : errno == EINVAL ? "Index is damaged" : strerror(errno));
+    }
+
+    return vfs_open(path);
+}
+
+#endif  //  INDEX_H
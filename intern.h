@@ -0,0 +1,124 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#ifndef err_exit
+#define err_exit(msg)    do {                    \
+                             perror(msg);        \
+                             exit(EXIT_FAILURE); \
+                         } while (0)
+#endif
+
+
+//  Interned strings: each distinct string is stored once, null terminated,
+//  in one growing arena and gets a dense id, so callers keep per string
+//  data in plain arrays indexed by id. Lookup is an open addressing hash
+//  of ids; nothing is allocated per string.
+struct intern {
+    char *data;
+    size_t len;
+    size_t cap;
+
+    size_t *offset;                         //  Of each id in data
+    uint32_t *hash;                         //  Of each id, for growing
+    uint32_t count;
+    uint32_t id_cap;
+
+    uint32_t *slots;                        //  id + 1, 0 for free
+    uint32_t mask;
+};
+
+
+//  FNV-1a
+static inline uint32_t intern_hash(const char *str, size_t len) {
+    uint32_t hash = 2166136261u;
+    for(size_t i = 0; i < len; ++i) {
+        hash ^= (unsigned char)str[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+
+static inline void intern_grow(struct intern *table) {
+    uint32_t slots = table->slots ? (table->mask + 1) * 2 : 1024;
+    free(table->slots);
+    table->slots = (uint32_t *)calloc(slots, sizeof(uint32_t));
+    if(!table->slots)
+        err_exit("Can't allocate memory for string table");
+
+    table->mask = slots - 1;
+    for(uint32_t id = 0; id < table->count; ++id) {
+        uint32_t slot = table->hash[id] & table->mask;
+        while(table->slots[slot])
+            slot = (slot + 1) & table->mask;
+        table->slots[slot] = id + 1;
+    }
+}
+
+
+static inline const char *intern_get(struct intern *table, uint32_t id) {
+    return table->data + table->offset[id];
+}
+
+
+//  Id of the string, added if it is new
+static inline uint32_t intern_add(struct intern *table, const char *str, size_t len) {
+    if(!table->slots)
+        intern_grow(table);
+
+    uint32_t hash = intern_hash(str, len);
+    uint32_t slot = hash & table->mask;
+    for(; table->slots[slot]; slot = (slot + 1) & table->mask) {
+        uint32_t id = table->slots[slot] - 1;
+        const char *known = table->data + table->offset[id];
+        if(table->hash[id] == hash && !strncmp(known, str, len) && !known[len])
+            return id;
+    }
+
+    if(table->len + len + 1 > table->cap) {
+        while(table->len + len + 1 > table->cap)
+            table->cap = table->cap ? table->cap * 2 : 64 * 1024;
+        table->data = (char *)realloc(table->data, table->cap);
+        if(!table->data)
+            err_exit("Can't allocate memory for string table");
+    }
+
+    if(table->count == table->id_cap) {
+        table->id_cap = table->id_cap ? table->id_cap * 2 : 1024;
+        table->offset = (size_t *)realloc(table->offset, table->id_cap * sizeof(size_t));
+        table->hash = (uint32_t *)realloc(table->hash, table->id_cap * sizeof(uint32_t));
+        if(!table->offset || !table->hash)
+            err_exit("Can't allocate memory for string table");
+    }
+
+    uint32_t id = table->count++;
+    table->offset[id] = table->len;
+    table->hash[id] = hash;
+    memcpy(table->data + table->len, str, len);
+    table->data[table->len + len] = '\0';
+    table->len += len + 1;
+
+    table->slots[slot] = id + 1;
+    if(table->count * 2 > table->mask + 1)
+        intern_grow(table);
+
+    return id;
+}
+
+
+static inline void intern_free(struct intern *table) {
+    free(table->data);
+    free(table->offset);
+    free(table->hash);
+    free(table->slots);
+    memset(table, 0, sizeof(struct intern));
+}
+
+#endif  //  INTERN_H
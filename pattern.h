@@ -0,0 +1,454 @@
+#ifndef PATTERN_H
+#define PATTERN_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+
+#define PATTERN_INIT        64
+#define PATTERN_HASH_INIT   128             //  Twice the patterns at least
+#define GLOB_MAX_TOKENS     63              //  States of a glob fit one word
+#define CLASS_BYTES         32
+#define CHARS               256
+
+#ifndef err_exit
+#define err_exit(msg)    do {                    \
+                             perror(msg);        \
+                             exit(EXIT_FAILURE); \
+                         } while (0)
+#endif
+
+
+//  Patterns with '/' are matched against the full path from the root,
+//  others against the name only. Case of ASCII letters is ignored, as
+//  FAT does.
+enum glob_op {
+    GLOB_CHAR,
+    GLOB_ANY,                   //  ?
+    GLOB_STAR,                  //  *, never matches '/'
+    GLOB_STARS,                 //  **, matches anything
+    GLOB_CLASS                  //  [a-z], [!a-z]
+};
+
+
+struct glob_token {
+    enum glob_op op;
+    unsigned char c;
+    unsigned char class[CLASS_BYTES];
+};
+
+
+struct pattern {
+    char *text;                             //  As given, for reports
+    char *key;                              //  Case folded, exact patterns only
+    int path;
+    int found;
+
+    //  Globs only, exact patterns live in the hash
+    struct glob_token *tokens;
+    int token_count;
+    int suffix_len;                         //  Literal tokens at the end
+    uint64_t *accept;                       //  Tokens taking each char
+    uint64_t stars;                         //  Star tokens
+};
+
+
+//  Exact patterns are found with one hash lookup per name, globs run as
+//  NFAs with a bit per token, all states are advanced at once.
+struct pattern_set {
+    struct pattern *patterns;
+    int count;
+    int capacity;
+
+    int *hash;                              //  Exact patterns, -1 is empty
+    unsigned hash_size;
+    int exact_names;
+    int exact_paths;
+
+    int *globs;
+    int glob_count;
+};
+
+
+static inline unsigned char pattern_fold(unsigned char c) {
+    return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+
+//  FNV-1a of the folded string
+static inline uint32_t pattern_hash(const char *str, size_t len) {
+    uint32_t hash = 2166136261u;
+    for(size_t i = 0; i < len; ++i) {
+        hash ^= pattern_fold(str[i]);
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+
+static inline int pattern_equal(const char *folded, const char *str, size_t len) {
+    for(size_t i = 0; i < len; ++i)
+        if(folded[i] != (char)pattern_fold(str[i]))
+            return 0;
+
+    return folded[len] == '\0';
+}
+
+
+static inline void pattern_set_init(struct pattern_set *set) {
+    memset(set, 0, sizeof(struct pattern_set));
+    set->hash_size = PATTERN_HASH_INIT;
+    set->hash = (int *)malloc(set->hash_size * sizeof(int));
+    if(!set->hash)
+        err_exit("Can't allocate memory for pattern hash");
+
+    for(unsigned i = 0; i < set->hash_size; ++i)
+        set->hash[i] = -1;
+}
+
+
+static inline void pattern_set_fini(struct pattern_set *set) {
+    for(int i = 0; i < set->count; ++i) {
+        free(set->patterns[i].text);
+        free(set->patterns[i].key);
+        free(set->patterns[i].tokens);
+        free(set->patterns[i].accept);
+    }
+
+    free(set->patterns);
+    free(set->hash);
+    free(set->globs);
+}
+
+
+static inline void pattern_hash_insert(struct pattern_set *set, int index) {
+    const char *key = set->patterns[index].key;
+    unsigned slot = pattern_hash(key, strlen(key)) & (set->hash_size - 1);
+    while(set->hash[slot] != -1)
+        slot = (slot + 1) & (set->hash_size - 1);
+
+    set->hash[slot] = index;
+}
+
+
+//  Returns exact pattern equal to str, or -1
+static inline int pattern_hash_find(struct pattern_set *set, const char *str, size_t len) {
+    unsigned slot = pattern_hash(str, len) & (set->hash_size - 1);
+    while(set->hash[slot] != -1) {
+        if(pattern_equal(set->patterns[set->hash[slot]].key, str, len))
+            return set->hash[slot];
+        slot = (slot + 1) & (set->hash_size - 1);
+    }
+
+    return -1;
+}
+
+
+static inline void pattern_hash_grow(struct pattern_set *set) {
+    free(set->hash);
+    set->hash_size *= 2;
+    set->hash = (int *)malloc(set->hash_size * sizeof(int));
+    if(!set->hash)
+        err_exit("Can't allocate memory for pattern hash");
+
+    for(unsigned i = 0; i < set->hash_size; ++i)
+        set->hash[i] = -1;
+    for(int i = 0; i < set->count; ++i)
+        if(set->patterns[i].key)
+            pattern_hash_insert(set, i);
+}
+
+
+static inline void class_add(unsigned char *class, unsigned char c) {
+    class[c / 8] |= 1 << c % 8;
+    c = c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c;
+    class[c / 8] |= 1 << c % 8;
+}
+
+
+static inline int class_has(const unsigned char *class, unsigned char c) {
+    return class[c / 8] >> c % 8 & 1;
+}
+
+
+//  Parses [...] starting after '['. Returns length of the class body
+//  with ']', 0 if it is not closed, then '[' is a plain char.
+static inline size_t glob_parse_class(const char *text, struct glob_token *token) {
+    size_t i = 0;
+    int negate = text[i] == '!' || text[i] == '^';
+    if(negate)
+        i++;
+
+    memset(token->class, 0, CLASS_BYTES);
+    do {
+        if(!text[i])
+            return 0;
+
+        unsigned char from = pattern_fold(text[i]);
+        if(text[i + 1] == '-' && text[i + 2] && text[i + 2] != ']') {
+            unsigned char to = pattern_fold(text[i + 2]);
+            for(unsigned c = from; c <= to; ++c)
+                class_add(token->class, c);
+            i += 3;
+        } else {
+            class_add(token->class, from);
+            i++;
+        }
+    } while(text[i] != ']');
+
+    if(negate)
+        for(int b = 0; b < CLASS_BYTES; ++b)
+            token->class[b] = ~token->class[b];
+
+    token->op = GLOB_CLASS;
+    return i + 1;
+}
+
+
+static inline int glob_step(const struct glob_token *token, unsigned char c) {
+    switch(token->op) {
+    case GLOB_CHAR:
+        return token->c == pattern_fold(c);
+    case GLOB_CLASS:
+        return c != '/' && class_has(token->class, c);
+    case GLOB_STAR:
+    case GLOB_ANY:
+        return c != '/';
+    default:
+        return 1;
+    }
+}
+
+
+//  Returns 0 if text has no wildcards and -1 if it is too long.
+//  Escaped chars are taken literally.
+static inline int glob_compile(struct pattern *pattern, const char *text) {
+    if(!strpbrk(text, "*?[\\"))
+        return 0;
+
+    pattern->tokens = (struct glob_token *)calloc(strlen(text), sizeof(struct glob_token));
+    if(!pattern->tokens)
+        err_exit("Can't allocate memory for glob");
+
+    int n = 0;
+    for(size_t i = 0; text[i]; ++i) {
+        if(n == GLOB_MAX_TOKENS) {
+            errno = E2BIG;
+            return -1;
+        }
+
+        struct glob_token *token = &pattern->tokens[n++];
+        size_t class_len;
+        if(text[i] == '*') {
+            token->op = text[i + 1] == '*' ? GLOB_STARS : GLOB_STAR;
+            while(text[i + 1] == '*')
+                i++;
+        } else if(text[i] == '?')
+            token->op = GLOB_ANY;
+        else if(text[i] == '[' && (class_len = glob_parse_class(text + i + 1, token)))
+            i += class_len;
+        else {
+            if(text[i] == '\\' && text[i + 1])
+                i++;
+            token->op = GLOB_CHAR;
+            token->c = pattern_fold(text[i]);
+        }
+    }
+
+    //  Bit i of accept[c] is set if token i takes char c
+    pattern->accept = (uint64_t *)calloc(CHARS, sizeof(uint64_t));
+    if(!pattern->accept)
+        err_exit("Can't allocate memory for glob");
+
+    for(int i = 0; i < n; ++i) {
+        for(unsigned c = 0; c < CHARS; ++c)
+            if(glob_step(&pattern->tokens[i], c))
+                pattern->accept[c] |= (uint64_t)1 << i;
+        if(pattern->tokens[i].op == GLOB_STAR || pattern->tokens[i].op == GLOB_STARS)
+            pattern->stars |= (uint64_t)1 << i;
+    }
+
+    //  Literal tail rejects most names before the NFA runs
+    pattern->token_count = n;
+    while(pattern->suffix_len < n && pattern->tokens[n - 1 - pattern->suffix_len].op == GLOB_CHAR)
+        pattern->suffix_len++;
+
+    return 1;
+}
+
+
+//  Adds pattern to the set, exact duplicates are added once. Patterns
+//  with '/' get a leading one and lose trailing ones. Returns -1 for a
+//  glob longer than GLOB_MAX_TOKENS.
+static inline int pattern_add(struct pattern_set *set, const char *text) {
+    size_t len = strlen(text);
+    while(len > 1 && text[len - 1] == '/')
+        len--;
+    if(!len)
+        return 0;
+
+    int path = memchr(text, '/', len) != NULL;
+    char *normal = (char *)malloc(len + 2);
+    if(!normal)
+        err_exit("Can't allocate memory for pattern");
+
+    size_t n = 0;
+    if(path && text[0] != '/')
+        normal[n++] = '/';
+    memcpy(normal + n, text, len);
+    normal[n + len] = '\0';
+
+    if(pattern_hash_find(set, normal, n + len) != -1) {
+        free(normal);
+        return 0;
+    }
+
+    if(set->count == set->capacity) {
+        set->capacity = set->capacity ? set->capacity * 2 : PATTERN_INIT;
+        set->patterns = (struct pattern *)realloc(set->patterns, set->capacity * sizeof(struct pattern));
+        set->globs = (int *)realloc(set->globs, set->capacity * sizeof(int));
+        if(!set->patterns || !set->globs)
+            err_exit("Can't allocate memory for patterns");
+    }
+
+    struct pattern *pattern = &set->patterns[set->count];
+    memset(pattern, 0, sizeof(struct pattern));
+    pattern->path = path;
+    pattern->text = normal;
+
+    int glob = glob_compile(pattern, normal);
+    if(glob == -1) {
+        free(pattern->tokens);
+        free(pattern->accept);
+        free(normal);
+        return -1;
+    }
+
+    if(glob) {
+        set->globs[set->glob_count++] = set->count++;
+        return 0;
+    }
+
+    pattern->key = strdup(normal);
+    if(!pattern->key)
+        err_exit("Can't allocate memory for pattern");
+    for(char *c = pattern->key; *c; ++c)
+        *c = pattern_fold(*c);
+
+    set->count++;
+    set->exact_paths += path;
+    set->exact_names += !path;
+    if(2 * set->count > (int)set->hash_size)
+        pattern_hash_grow(set);
+    else
+        pattern_hash_insert(set, set->count - 1);
+
+    return 0;
+}
+
+
+//  Reads patterns one per line, "-" is stdin
+static inline int pattern_add_file(struct pattern_set *set, const char *file) {
+    FILE *in = strcmp(file, "-") ? fopen(file, "r") : stdin;
+    if(!in)
+        return -1;
+
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    int ret = 0;
+    while((len = getline(&line, &size, in)) != -1) {
+        while(len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if(len && pattern_add(set, line) == -1) {
+            fprintf(stderr, "Bad pattern: %s\n", line);
+            ret = -1;
+        }
+    }
+
+    free(line);
+    if(in != stdin)
+        fclose(in);
+    return ret;
+}
+
+
+//  Bit i is set when the first i tokens matched. Stars also match
+//  nothing, so the state after a star is added along with it.
+static inline uint64_t glob_closure(const struct pattern *pattern, uint64_t states) {
+    uint64_t add;
+    while((add = (states & pattern->stars) << 1) & ~states)
+        states |= add;
+
+    return states;
+}
+
+
+//  All states of the NFA are advanced at once, stars keep their state
+static inline int glob_match(const struct pattern *pattern, const char *str, size_t len) {
+    size_t tail = pattern->suffix_len;
+    if(tail > len)
+        return 0;
+    for(size_t i = 0; i < tail; ++i)
+        if(pattern->tokens[pattern->token_count - tail + i].c != pattern_fold(str[len - tail + i]))
+            return 0;
+
+    uint64_t states = glob_closure(pattern, 1);
+    for(size_t pos = 0; pos < len && states; ++pos) {
+        uint64_t taken = states & pattern->accept[(unsigned char)str[pos]];
+        states = glob_closure(pattern, taken << 1 | (taken & pattern->stars));
+    }
+
+    return states >> pattern->token_count & 1;
+}
+
+
+static inline void pattern_found(struct pattern *pattern) {
+    __atomic_store_n(&pattern->found, 1, __ATOMIC_RELAXED);
+}
+
+
+//  Returns 1 if any pattern matches full path or the name at its end.
+//  alias is another name of the entry (FAT short name) or NULL. Safe to
+//  call from several threads, matched patterns are marked as found.
+static inline int pattern_match(struct pattern_set *set, const char *path, const char *name, const char *alias) {
+    size_t path_len = strlen(path);
+    size_t name_len = strlen(name);
+    size_t alias_len = alias ? strlen(alias) : 0;
+    int matched = 0;
+    int index;
+
+    if(set->exact_paths && (index = pattern_hash_find(set, path, path_len)) != -1) {
+        pattern_found(&set->patterns[index]);
+        matched = 1;
+    }
+
+    //  Name and alias may be two exact patterns, both are found
+    if(set->exact_names && (index = pattern_hash_find(set, name, name_len)) != -1) {
+        pattern_found(&set->patterns[index]);
+        matched = 1;
+    }
+    if(set->exact_names && alias && (index = pattern_hash_find(set, alias, alias_len)) != -1) {
+        pattern_found(&set->patterns[index]);
+        matched = 1;
+    }
+
+    for(int i = 0; i < set->glob_count; ++i) {
+        struct pattern *pattern = &set->patterns[set->globs[i]];
+        int hit = pattern->path ? glob_match(pattern, path, path_len)
+                                : glob_match(pattern, name, name_len) ||
+                                  (alias && glob_match(pattern, alias, alias_len));
+        if(hit) {
+            pattern_found(pattern);
+            matched = 1;
+        }
+    }
+
+    return matched;
+}
+
+#endif  //  PATTERN_H
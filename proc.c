@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
@@ -5,66 +6,338 @@
 #include <string.h>
 
 #include <sys/types.h>
-#include <dirent.h>
 
+#include "procfs.h"
+#include "proc_tree.h"
+#include "intern.h"
 
-int main() {
-	DIR* directory = NULL;
-	DIR* proc_directory = NULL;
 
-	struct dirent* dir_contence = NULL;
-	struct dirent* proc_contence = NULL;
+#define FD_TARGETS 20			//Targets printed by default
+#define FD_LINK_MAX 4096
+
+
+enum fd_type {
+	FD_FILE,
+	FD_SOCKET,
+	FD_PIPE,
+	FD_ANON,
+	FD_OTHER,
+	FD_TYPES
+};
+
+static const char *fd_type_name[FD_TYPES] = {"files", "sockets", "pipes", "anon", "other"};
+
+
+struct tree_print {
+	long page_kb;
+	long ticks;
+};
+
+
+//Descriptors of one target over all processes
+struct fd_target {
+	uint32_t fds;
+	uint32_t processes;
+	pid_t last;			//Process counted last, so each counts once
+};
+
+
+//State of a descriptor scan: one fd directory buffer, one link buffer
+//and one string table for all processes, whatever their fd counts
+struct fd_scan {
+	struct proc_dir fd_dir;
+	struct proc_reader reader;
+	int info;
+	char link[FD_LINK_MAX];
+
+	struct intern targets;
+	struct fd_target *target;
+	uint32_t target_cap;
+
+	size_t processes;
+	size_t unreadable;
+	size_t fds;
+	size_t types[FD_TYPES];
+};
+
+
+//Thread lines go in braces, as in pstree; processes carry subtree sums
+void print_node(struct proc_node *node, int depth, void *arg) {
+	struct tree_print *print = (struct tree_print *)arg;
+
+	if(node->thread) {
+		printf("%*s{%d} %s %c  cpu %.2f s\n", depth * 2, "", node->pid, node->comm, node->state,
+		       (double)node->cpu / print->ticks);
+		return;
+	}
+
+	printf("%*s%d %s %c  rss %lld KB  cpu %.2f s  subtree %u tasks  rss %lld KB  cpu %.2f s\n",
+	       depth * 2, "", node->pid, node->comm, node->state,
+	       node->rss * print->page_kb, (double)node->cpu / print->ticks,
+	       node->tree_tasks, node->tree_rss * print->page_kb, (double)node->tree_cpu / print->ticks);
+}
+
+
+int print_tree(int proc_fd, int threads, pid_t root_pid) {
+	struct proc_tree tree = {0};
+	struct tree_print print = {
+		.page_kb = sysconf(_SC_PAGESIZE) / 1024,
+		.ticks = sysconf(_SC_CLK_TCK)
+	};
+
+	proc_tree_scan(&tree, proc_fd, threads);
+	proc_tree_build(&tree);
+
+	uint32_t root = tree.count;
+	if(root_pid) {
+		root = proc_tree_find(&tree, root_pid);
+		if(root == PROC_TREE_NONE) {
+			fprintf(stderr, "No process %d\n", root_pid);
+			proc_tree_free(&tree);
+			return ESRCH;
+		}
+	}
+
+	proc_tree_walk(&tree, root, print_node, &print);
+	proc_tree_free(&tree);
+	return 0;
+}
+
+
+enum fd_type fd_classify(const char *link) {
+	if(link[0] == '/')
+		return FD_FILE;
+	if(!strncmp(link, "socket:", 7))
+		return FD_SOCKET;
+	if(!strncmp(link, "pipe:", 5))
+		return FD_PIPE;
+	if(!strncmp(link, "anon_inode:", 11))
+		return FD_ANON;
+	return FD_OTHER;
+}
+
+
+//Ids of new targets come right after the known ones
+void count_target(struct fd_scan *scan, pid_t pid, const char *link, size_t len) {
+	uint32_t known = scan->targets.count;
+	uint32_t id = intern_add(&scan->targets, link, len);
+	if(id == known) {
+		if(id == scan->target_cap) {
+			scan->target_cap = scan->target_cap ? scan->target_cap * 2 : 1024;
+			scan->target = (struct fd_target *)realloc(scan->target, scan->target_cap * sizeof(struct fd_target));
+			if(!scan->target)
+				err_exit("Can't allocate memory for targets");
+		}
+		memset(&scan->target[id], 0, sizeof(struct fd_target));
+	}
+
+	struct fd_target *target = &scan->target[id];
+	++target->fds;
+	if(target->last != pid) {
+		target->last = pid;
+		++target->processes;
+	}
+}
+
+
+//Position and octal flags of one descriptor from fdinfo
+void print_fd_info(struct fd_scan *scan, const char *fd) {
+	char file[32] = "fdinfo/";
+	char buf[4096];
+	long long pos = 0;
+
+	strncat(file, fd, sizeof(file) - 8);
+	if(proc_read(&scan->reader, file, buf, sizeof(buf)) == -1) {
+		printf("\t%s -> %s\n", fd, scan->link);
+		return;
+	}
+
+	proc_parse_key(buf, "pos:", &pos);
+	const char *flags = strstr(buf, "flags:");
+	printf("\t%s -> %s  pos %lld  flags 0%llo\n", fd, scan->link, pos,
+	       flags ? strtoull(flags + 6, NULL, 8) : 0ULL);
+}
+
+
+//Descriptors of one process with getdents64 and readlinkat. Every fd
+//costs one readlinkat, fdinfo one read more; counting is O(1) per fd.
+void scan_fds(struct fd_scan *scan, pid_t pid) {
+	char file[32] = "fd/";
+	char comm[PROC_COMM_MAX + 1];
+	size_t counts[FD_TYPES] = {0};
+	size_t fds = 0;
+
+	proc_reader_pid(&scan->reader, pid);
+	if(proc_dir_open(&scan->fd_dir, scan->reader.proc_fd, proc_reader_path(&scan->reader, "fd")) == -1) {
+		if(errno != ENOENT)
+			++scan->unreadable;
+		return;
+	}
+
+	if(proc_read(&scan->reader, "comm", comm, sizeof(comm)) == -1)
+		comm[0] = '\0';
+	comm[strcspn(comm, "\n")] = '\0';
+	if(scan->info)
+		printf("%d %s\n", pid, comm);
+
+	struct proc_dirent *entry;
+	while((entry = proc_dir_next(&scan->fd_dir))) {
+		if(entry->name[0] == '.')
+			continue;
+
+		strncpy(file + 3, entry->name, sizeof(file) - 4);
+		ssize_t len = proc_readlink(&scan->reader, file, scan->link, sizeof(scan->link));
+		if(len == -1)
+			continue;		//Closed since the listing
+
+		++fds;
+		++counts[fd_classify(scan->link)];
+		count_target(scan, pid, scan->link, len);
+		if(scan->info)
+			print_fd_info(scan, entry->name);
+	}
+	proc_dir_close(&scan->fd_dir);
+
+	printf("%d %s  fds %zu", pid, comm, fds);
+	for(int i = 0; i < FD_TYPES; ++i) {
+		printf("  %s %zu", fd_type_name[i], counts[i]);
+		scan->types[i] += counts[i];
+	}
+	printf("\n");
+
+	scan->fds += fds;
+	++scan->processes;
+}
+
+
+struct fd_scan *sort_scan;
+
+int compare_targets(const void *a, const void *b) {
+	const struct fd_target *first = &sort_scan->target[*(const uint32_t *)a];
+	const struct fd_target *second = &sort_scan->target[*(const uint32_t *)b];
+	if(first->fds != second->fds)
+		return first->fds < second->fds ? 1 : -1;
+	return *(const uint32_t *)a < *(const uint32_t *)b ? -1 : 1;
+}
+
+
+int print_fds(int proc_fd, int info, pid_t only_pid, size_t top) {
+	struct fd_scan scan = {.fd_dir = {.fd = -1}, .info = info};
+	struct proc_dir directory = {.fd = -1};
+	proc_reader_init(&scan.reader, proc_fd);
+
+	if(only_pid)
+		scan_fds(&scan, only_pid);
+	else {
+		if(proc_dir_open(&directory, proc_fd, ".") == -1) {
+			perror("Couldn't open '/proc'\n");
+			return errno;
+		}
+
+		pid_t PID;
+		while((PID = proc_next_pid(&directory)))
+			scan_fds(&scan, PID);
+		proc_dir_free(&directory);
+	}
+
+	printf("\n%zu processes, %zu unreadable, %zu descriptors:", scan.processes, scan.unreadable, scan.fds);
+	for(int i = 0; i < FD_TYPES; ++i)
+		printf("  %s %zu", fd_type_name[i], scan.types[i]);
+	printf("\n");
+
+	uint32_t *order = (uint32_t *)malloc((scan.targets.count + 1) * sizeof(uint32_t));
+	if(!order)
+		err_exit("Can't allocate memory for targets");
+	for(uint32_t i = 0; i < scan.targets.count; ++i)
+		order[i] = i;
+	sort_scan = &scan;
+	qsort(order, scan.targets.count, sizeof(uint32_t), compare_targets);
+
+	for(uint32_t i = 0; i < scan.targets.count && i < top; ++i)
+		printf("%8u fds %6u processes  %s\n", scan.target[order[i]].fds, scan.target[order[i]].processes,
+		       intern_get(&scan.targets, order[i]));
+
+	free(order);
+	free(scan.target);
+	intern_free(&scan.targets);
+	proc_dir_free(&scan.fd_dir);
+	return 0;
+}
+
+
+int main(int argc, char *argv[]) {
+	struct proc_dir directory = {.fd = -1};
+	struct proc_reader reader;
 	char exec[5] = "exe";
+	int tree = 0, threads = 0, fds = 0, info = 0;
+	size_t top = FD_TARGETS;
+	pid_t root_pid = 0;
+
+	int opt;
+	while((opt = getopt(argc, argv, "tTp:fin:")) != -1) {
+		if(opt == 't')
+			tree = 1;
+		else if(opt == 'T')
+			tree = threads = 1;
+		else if(opt == 'p')
+			root_pid = atoi(optarg);
+		else if(opt == 'f')
+			fds = 1;
+		else if(opt == 'i')
+			fds = info = 1;
+		else if(opt == 'n')
+			top = atol(optarg);
+		else {
+			fprintf(stderr, "Usage: %s [-t] [-T] [-p PID]\n"
+			                "       %s -f [-i] [-n TARGETS] [-p PID]\n", argv[0], argv[0]);
+			return EINVAL;
+		}
+	}
 
-	directory = opendir("/proc");
-	if(!directory) {
+	int proc_fd = proc_open_root();
+	if(fds) {
+		int ret = print_fds(proc_fd, info, root_pid, top);
+		close(proc_fd);
+		return ret;
+	}
+
+	if(tree || root_pid) {
+		int ret = print_tree(proc_fd, threads, root_pid);
+		close(proc_fd);
+		return ret;
+	}
+
+	if(proc_dir_open(&directory, proc_fd, ".") == -1) {
 		perror("Couldn't open '/proc'\n");
 		return errno;
 	}
+	proc_reader_init(&reader, proc_fd);
+
+	pid_t PID;
+	while((PID = proc_next_pid(&directory))) {
+		printf("Proc: %d\n", PID);
 
-	do {
-		errno = 0;
-		if((dir_contence = readdir(directory))) {
-			int PID = atoi(dir_contence->d_name);
-			if(PID == 0) 
-				continue;
-			
-			printf("Proc: %d\n", PID);
-
-			//Process internals
-			char dest[100] = "/proc/";
-			strcat(dest, dir_contence->d_name);
-			proc_directory = opendir(dest);
-			if(proc_directory == NULL) {
-				perror("Couldn't open '/proc/[PID]'\n");
-				return errno;
-			}
-
-			strcat(dest, "/exe");
-			do {
-				errno = 0;
-				if((proc_contence = readdir(proc_directory)) != NULL) {
-					if(strcmp(proc_contence->d_name, exec) != 0) 
-						continue;
-
-					printf("	exe is found!\n");
-					
-					char buf[1024];
-					ssize_t result = readlink(dest, buf, 1023);
-					printf("%zd\n", result);
-					if(result == -1) {
-						perror("Problem with link!\n");
-						return errno;
-					}
-				}
-			} while (proc_contence);
-
-			(void)closedir(proc_directory);
-			proc_directory = NULL;
-			proc_contence = NULL;
+		//Process internals: exe is read straight, without listing '/proc/[PID]'
+		proc_reader_pid(&reader, PID);
+		char buf[1024];
+		ssize_t result = proc_readlink(&reader, exec, buf, sizeof(buf));
+		if(result == -1 && (errno == ENOENT || errno == ESRCH))
+			continue;
+
+		printf("	exe is found!\n");
+		printf("%zd\n", result);
+		if(result == -1) {
+			perror("Problem with link!\n");
+			return errno;
 		}
-	} while (dir_contence);
+	}
+
+	if(errno) {
+		perror("Couldn't read '/proc'\n");
+		return errno;
+	}
 
-	(void)closedir(directory);
+	proc_dir_free(&directory);
+	close(proc_fd);
 	return 0;
 }
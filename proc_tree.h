@@ -0,0 +1,261 @@
+#ifndef PROC_TREE_H
+#define PROC_TREE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#include "procfs.h"
+
+
+#define PROC_TREE_NONE      UINT32_MAX
+
+
+//  Process or thread. Threads hang under their process; their CPU time
+//  and memory are already counted in the process, so subtree sums skip
+//  them.
+struct proc_node {
+    pid_t pid;
+    pid_t ppid;
+    int thread;
+    char state;
+    long long rss;                          //  Pages
+    long long cpu;                          //  Ticks
+    long long tree_rss;                     //  Sums over the subtree
+    long long tree_cpu;
+    uint32_t tree_tasks;
+    char comm[PROC_COMM_MAX];
+};
+
+
+//  Parent to children index in CSR form: children of node i are
+//  child[first[i]] .. child[first[i + 1] - 1], in listing order. Node
+//  count is a virtual root holding the nodes without a listed parent.
+//  Everything is in a handful of arrays, no allocation per node.
+struct proc_tree {
+    struct proc_node *node;
+    uint32_t count;
+    uint32_t cap;
+
+    uint32_t *first;                        //  count + 2 offsets
+    uint32_t *child;                        //  count entries
+    uint32_t *order;                        //  Nodes parents first, for sums and walks
+    uint32_t *hash;                         //  PID to node, open addressing
+    uint32_t hash_mask;
+};
+
+
+static inline struct proc_node *proc_tree_add(struct proc_tree *tree) {
+    if(tree->count == tree->cap) {
+        tree->cap = tree->cap ? tree->cap * 2 : 4096;
+        tree->node = (struct proc_node *)realloc(tree->node, tree->cap * sizeof(struct proc_node));
+        if(!tree->node)
+            err_exit("Can't allocate memory for process tree");
+    }
+
+    return &tree->node[tree->count++];
+}
+
+
+//  Node of stat in buf, 0 if the line is damaged
+static inline int proc_tree_parse(struct proc_node *node, const char *buf, pid_t pid, int thread) {
+    struct proc_stat stat;
+    if(proc_parse_stat(buf, &stat, PROC_STAT_RSS) == -1)
+        return 0;
+
+    node->pid = pid;
+    node->ppid = stat.ppid;
+    node->thread = thread;
+    node->state = stat.state;
+    node->rss = thread ? 0 : stat.rss;
+    node->cpu = stat.utime + stat.stime;
+    proc_parse_comm(buf, node->comm, PROC_COMM_MAX);
+    return 1;
+}
+
+
+//  One pass over /proc reading stat of every process and, with threads,
+//  of every thread other than the main one from /proc/PID/task. Exited
+//  tasks are left out.
+static inline void proc_tree_scan(struct proc_tree *tree, int proc_fd, int threads) {
+    struct proc_dir proc_dir = {.fd = -1};
+    struct proc_dir task_dir = {.fd = -1};
+    struct proc_reader reader;
+    char buf[1024];
+    char task[PROC_PATH_MAX];
+    pid_t pid;
+
+    tree->count = 0;
+    proc_reader_init(&reader, proc_fd);
+    if(proc_dir_open(&proc_dir, proc_fd, ".") == -1)
+        err_exit("Can't open \"" PROC_ROOT "\"");
+
+    while((pid = proc_next_pid(&proc_dir))) {
+        proc_reader_pid(&reader, pid);
+        if(proc_read(&reader, "stat", buf, sizeof(buf)) == -1)
+            continue;
+        if(!proc_tree_parse(proc_tree_add(tree), buf, pid, 0)) {
+            --tree->count;
+            continue;
+        }
+
+        if(!threads)
+            continue;
+
+        memcpy(task, reader.path, reader.prefix);
+        memcpy(task + reader.prefix, "task", 5);
+        if(proc_dir_open(&task_dir, proc_fd, task) == -1)
+            continue;
+
+        pid_t tid;
+        while((tid = proc_next_pid(&task_dir))) {
+            if(tid == pid)
+                continue;
+
+            proc_reader_task(&reader, pid, tid);
+            if(proc_read(&reader, "stat", buf, sizeof(buf)) == -1)
+                continue;
+            if(!proc_tree_parse(proc_tree_add(tree), buf, tid, 1))
+                --tree->count;
+            else
+                tree->node[tree->count - 1].ppid = pid;
+        }
+        proc_dir_close(&task_dir);
+    }
+
+    if(errno)
+        err_exit("Can't read \"" PROC_ROOT "\"");
+    proc_dir_free(&proc_dir);
+    proc_dir_free(&task_dir);
+}
+
+
+static inline uint32_t proc_tree_slot(struct proc_tree *tree, pid_t pid) {
+    return ((uint32_t)pid * 2654435761u) & tree->hash_mask;
+}
+
+
+//  Node index of pid, PROC_TREE_NONE if it isn't listed
+static inline uint32_t proc_tree_find(struct proc_tree *tree, pid_t pid) {
+    for(uint32_t slot = proc_tree_slot(tree, pid); tree->hash[slot] != PROC_TREE_NONE;
+        slot = (slot + 1) & tree->hash_mask)
+        if(tree->node[tree->hash[slot]].pid == pid)
+            return tree->hash[slot];
+
+    return PROC_TREE_NONE;
+}
+
+
+//  Builds the index of the scanned nodes in O(N): parents are looked up
+//  in the hash, children are counted, placed by prefix sums, then nodes
+//  are ordered parents first and summed up children first
+static inline void proc_tree_build(struct proc_tree *tree) {
+    uint32_t count = tree->count;
+    uint32_t slots = 2;
+    while(slots < count * 2)
+        slots *= 2;
+
+    tree->hash_mask = slots - 1;
+    tree->hash = (uint32_t *)realloc(tree->hash, slots * sizeof(uint32_t));
+    tree->first = (uint32_t *)realloc(tree->first, (count + 2) * sizeof(uint32_t));
+    tree->child = (uint32_t *)realloc(tree->child, (count + 1) * sizeof(uint32_t));
+    tree->order = (uint32_t *)realloc(tree->order, (count + 1) * sizeof(uint32_t));
+    if(!tree->hash || !tree->first || !tree->child || !tree->order)
+        err_exit("Can't allocate memory for process tree");
+
+    memset(tree->hash, 0xff, slots * sizeof(uint32_t));
+    for(uint32_t i = 0; i < count; ++i) {
+        uint32_t slot = proc_tree_slot(tree, tree->node[i].pid);
+        while(tree->hash[slot] != PROC_TREE_NONE)
+            slot = (slot + 1) & tree->hash_mask;
+        tree->hash[slot] = i;
+    }
+
+    //  Parent of each node goes to order for now
+    memset(tree->first, 0, (count + 2) * sizeof(uint32_t));
+    for(uint32_t i = 0; i < count; ++i) {
+        uint32_t parent = tree->node[i].ppid ? proc_tree_find(tree, tree->node[i].ppid) : PROC_TREE_NONE;
+        if(parent == PROC_TREE_NONE || parent == i)
+            parent = count;
+        tree->order[i] = parent;
+        ++tree->first[parent + 1];
+    }
+
+    for(uint32_t i = 0; i <= count; ++i)
+        tree->first[i + 1] += tree->first[i];
+
+    //  first[i] is moved to the end of i's children while filling, then back
+    for(uint32_t i = 0; i < count; ++i)
+        tree->child[tree->first[tree->order[i]]++] = i;
+    for(uint32_t i = count; i > 0; --i)
+        tree->first[i] = tree->first[i - 1];
+    tree->first[0] = 0;
+
+    //  Breadth first from the virtual root, then sums in reverse
+    uint32_t head = 0, tail = 0;
+    tree->order[tail++] = count;
+    while(head < tail) {
+        uint32_t parent = tree->order[head++];
+        for(uint32_t c = tree->first[parent]; c < tree->first[parent + 1]; ++c)
+            tree->order[tail++] = tree->child[c];
+    }
+
+    for(uint32_t i = 0; i < count; ++i) {
+        struct proc_node *node = &tree->node[i];
+        node->tree_rss = node->rss;
+        node->tree_cpu = node->thread ? 0 : node->cpu;
+        node->tree_tasks = 1;
+    }
+
+    for(uint32_t i = tail - 1; i > 0; --i) {
+        uint32_t index = tree->order[i];
+        for(uint32_t c = tree->first[index]; c < tree->first[index + 1]; ++c) {
+            struct proc_node *child = &tree->node[tree->child[c]];
+            tree->node[index].tree_rss += child->tree_rss;
+            tree->node[index].tree_cpu += child->tree_cpu;
+            tree->node[index].tree_tasks += child->tree_tasks;
+        }
+    }
+}
+
+
+//  Depth first walk of the subtree of root, count for the whole forest.
+//  Visits parents before children, children in listing order.
+static inline void proc_tree_walk(struct proc_tree *tree, uint32_t root,
+                                  void (*visit)(struct proc_node *node, int depth, void *arg), void *arg) {
+    uint32_t *stack = (uint32_t *)malloc((tree->count + 1) * 2 * sizeof(uint32_t));
+    if(!stack)
+        err_exit("Can't allocate memory for process tree walk");
+
+    size_t top = 0;
+    stack[top++] = root;
+    stack[top++] = 0;
+    while(top) {
+        int depth = stack[--top];
+        uint32_t index = stack[--top];
+        if(index != tree->count)
+            visit(&tree->node[index], depth++, arg);
+
+        for(uint32_t c = tree->first[index + 1]; c > tree->first[index]; --c) {
+            stack[top++] = tree->child[c - 1];
+            stack[top++] = depth;
+        }
+    }
+
+    free(stack);
+}
+
+
+static inline void proc_tree_free(struct proc_tree *tree) {
+    free(tree->node);
+    free(tree->first);
+    free(tree->child);
+    free(tree->order);
+    free(tree->hash);
+    memset(tree, 0, sizeof(struct proc_tree));
+}
+
+#endif  //  PROC_TREE_H
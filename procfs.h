@@ -0,0 +1,383 @@
+#ifndef PROCFS_H
+#define PROCFS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+
+#define PROC_ROOT           "/proc"
+#define PROC_DENTS_SIZE     (256 * 1024)    //  getdents64 buffer, a few thousand entries
+#define PROC_PATH_MAX       64              //  "PID/task/TID/" and a file name
+#define PROC_COMM_MAX       16              //  TASK_COMM_LEN of the kernel
+
+#ifndef err_exit
+#define err_exit(msg)    do {                    \
+                             perror(msg);        \
+                             exit(EXIT_FAILURE); \
+                         } while (0)
+#endif
+
+
+//  Record of getdents64, glibc doesn't declare it
+struct proc_dirent {
+    uint64_t ino;
+    int64_t off;
+    unsigned short reclen;
+    unsigned char type;
+    char name[];
+};
+
+
+//  Directory read with raw getdents64 into one large buffer, so a /proc
+//  listing takes a syscall per few thousand entries
+struct proc_dir {
+    int fd;
+    char *buf;
+    size_t pos;
+    size_t len;
+};
+
+
+//  Files of one process are opened relative to the /proc descriptor as
+//  "PID/file": one openat per file, no per process directory descriptor
+//  and no path formatting beyond the PID prefix
+struct proc_reader {
+    int proc_fd;
+    char path[PROC_PATH_MAX];
+    size_t prefix;                          //  Length of "PID/"
+};
+
+
+//  Numbers of /proc/PID/stat fields, from 1
+enum proc_stat_field {
+    PROC_STAT_STATE = 3,
+    PROC_STAT_PPID = 4,
+    PROC_STAT_UTIME = 14,
+    PROC_STAT_STIME = 15,
+    PROC_STAT_NICE = 19,
+    PROC_STAT_THREADS = 20,
+    PROC_STAT_START = 22,
+    PROC_STAT_VSIZE = 23,
+    PROC_STAT_RSS = 24
+};
+
+
+//  Fields of /proc/PID/stat that follow the command; times are in clock
+//  ticks, start since boot
+struct proc_stat {
+    char state;
+    long long ppid;
+    long long utime;
+    long long stime;
+    long long nice;
+    long long threads;
+    long long start;
+    long long vsize;                        //  Bytes
+    long long rss;                          //  Pages
+};
+
+
+//  /proc/PID/statm, in pages
+struct proc_statm {
+    long long size;
+    long long resident;
+    long long shared;
+};
+
+
+static inline int proc_dir_open(struct proc_dir *dir, int dirfd, const char *path) {
+    dir->fd = openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(dir->fd == -1)
+        return -1;
+
+    if(!dir->buf && !(dir->buf = (char *)malloc(PROC_DENTS_SIZE)))
+        err_exit("Can't allocate memory for directory buffer");
+
+    dir->pos = dir->len = 0;
+    return 0;
+}
+
+
+//  Keeps the buffer for the next proc_dir_open
+static inline void proc_dir_close(struct proc_dir *dir) {
+    if(dir->fd != -1)
+        close(dir->fd);
+    dir->fd = -1;
+}
+
+
+static inline void proc_dir_free(struct proc_dir *dir) {
+    proc_dir_close(dir);
+    free(dir->buf);
+    dir->buf = NULL;
+}
+
+
+//  Returns NULL at the end or on error, errno tells them apart
+static inline struct proc_dirent *proc_dir_next(struct proc_dir *dir) {
+    if(dir->pos == dir->len) {
+        long got = syscall(SYS_getdents64, dir->fd, dir->buf, PROC_DENTS_SIZE);
+        if(got <= 0) {
+            errno = got ? errno : 0;
+            return NULL;
+        }
+
+        dir->pos = 0;
+        dir->len = got;
+    }
+
+    struct proc_dirent *entry = (struct proc_dirent *)(dir->buf + dir->pos);
+    dir->pos += entry->reclen;
+    return entry;
+}
+
+
+//  Decimal name of a process or thread directory; 0 for anything else
+static inline pid_t proc_parse_pid(const char *name) {
+    pid_t pid = 0;
+    if(*name < '1' || *name > '9')
+        return 0;
+
+    for(; *name; ++name) {
+        if(*name < '0' || *name > '9')
+            return 0;
+        pid = pid * 10 + (*name - '0');
+    }
+
+    return pid;
+}
+
+
+//  Returns the next PID of the listing, 0 at the end
+static inline pid_t proc_next_pid(struct proc_dir *dir) {
+    struct proc_dirent *entry;
+    while((entry = proc_dir_next(dir))) {
+        pid_t pid = proc_parse_pid(entry->name);
+        if(pid)
+            return pid;
+    }
+
+    return 0;
+}
+
+
+static inline void proc_reader_init(struct proc_reader *reader, int proc_fd) {
+    reader->proc_fd = proc_fd;
+    reader->prefix = 0;
+}
+
+
+//  Decimal pid at p, returns its length
+static inline size_t proc_put_pid(char *p, pid_t pid) {
+    char digits[16];
+    size_t len = 0;
+    do {
+        digits[len++] = '0' + pid % 10;
+        pid /= 10;
+    } while(pid);
+
+    for(size_t i = 0; i < len; ++i)
+        p[i] = digits[len - 1 - i];
+    return len;
+}
+
+
+//  Following reads go to the files of pid
+static inline void proc_reader_pid(struct proc_reader *reader, pid_t pid) {
+    size_t len = proc_put_pid(reader->path, pid);
+    reader->path[len] = '/';
+    reader->prefix = len + 1;
+}
+
+
+//  Following reads go to the files of thread tid of process pid
+static inline void proc_reader_task(struct proc_reader *reader, pid_t pid, pid_t tid) {
+    proc_reader_pid(reader, pid);
+    memcpy(reader->path + reader->prefix, "task/", 5);
+    reader->prefix += 5;
+    reader->prefix += proc_put_pid(reader->path + reader->prefix, tid);
+    reader->path[reader->prefix++] = '/';
+}
+
+
+static inline const char *proc_reader_path(struct proc_reader *reader, const char *file) {
+    size_t len = strlen(file);
+    if(reader->prefix + len >= PROC_PATH_MAX)
+        len = PROC_PATH_MAX - 1 - reader->prefix;
+
+    memcpy(reader->path + reader->prefix, file, len);
+    reader->path[reader->prefix + len] = '\0';
+    return reader->path;
+}
+
+
+//  Reads up to size - 1 bytes of the file with one read and terminates
+//  them; proc files are generated whole on the first read. Returns the
+//  length or -1, ENOENT and ESRCH mean the process has exited.
+static inline ssize_t proc_read(struct proc_reader *reader, const char *file, char *buf, size_t size) {
+    int fd = openat(reader->proc_fd, proc_reader_path(reader, file), O_RDONLY | O_CLOEXEC);
+    if(fd == -1)
+        return -1;
+
+    ssize_t len = read(fd, buf, size - 1);
+    close(fd);
+    if(len == -1)
+        return -1;
+
+    buf[len] = '\0';
+    return len;
+}
+
+
+//  Link target, terminated
+static inline ssize_t proc_readlink(struct proc_reader *reader, const char *file, char *buf, size_t size) {
+    ssize_t len = readlinkat(reader->proc_fd, proc_reader_path(reader, file), buf, size - 1);
+    if(len == -1)
+        return -1;
+
+    buf[len] = '\0';
+    return len;
+}
+
+
+//  Owner of the process directory, the effective UID of the process:
+//  one fstatat, no file is opened
+static inline int proc_owner(struct proc_reader *reader, uid_t *uid) {
+    struct stat st;
+    if(fstatat(reader->proc_fd, proc_reader_path(reader, "."), &st, 0) == -1)
+        return -1;
+
+    *uid = st.st_uid;
+    return 0;
+}
+
+
+//  Number at p, fields are separated by single spaces
+static inline const char *proc_parse_number(const char *p, long long *value) {
+    int negative = *p == '-';
+    p += negative;
+
+    long long number = 0;
+    for(; *p >= '0' && *p <= '9'; ++p)
+        number = number * 10 + (*p - '0');
+
+    *value = negative ? -number : number;
+    return p;
+}
+
+
+//  The command may hold spaces and parentheses, so fields are counted from
+//  its last ')'. Fields after last are not looked at, fields in between
+//  that struct proc_stat doesn't keep are skipped without being parsed.
+//  Returns -1 with EINVAL if the line is cut short.
+static inline int proc_parse_stat(const char *buf, struct proc_stat *stat, int last) {
+    const char *p = strrchr(buf, ')');
+    if(!p || p[1] != ' ' || !p[2]) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(stat, 0, sizeof(struct proc_stat));
+    stat->state = p[2];
+    p += 3;
+    for(int field = PROC_STAT_STATE + 1; field <= last; ++field) {
+        if(*p != ' ') {
+            errno = EINVAL;
+            return -1;
+        }
+
+        long long *value;
+        switch(field) {
+            case PROC_STAT_PPID:    value = &stat->ppid;        break;
+            case PROC_STAT_UTIME:   value = &stat->utime;       break;
+            case PROC_STAT_STIME:   value = &stat->stime;       break;
+            case PROC_STAT_NICE:    value = &stat->nice;        break;
+            case PROC_STAT_THREADS: value = &stat->threads;     break;
+            case PROC_STAT_START:   value = &stat->start;       break;
+            case PROC_STAT_VSIZE:   value = &stat->vsize;       break;
+            case PROC_STAT_RSS:     value = &stat->rss;         break;
+            default:                value = NULL;               break;
+        }
+
+        if(value)
+            p = proc_parse_number(p + 1, value);
+        else
+            for(++p; *p && *p != ' '; ++p)
+                ;
+    }
+
+    return 0;
+}
+
+
+static inline int proc_parse_statm(const char *buf, struct proc_statm *statm) {
+    long long *fields[] = {&statm->size, &statm->resident, &statm->shared};
+    const char *p = buf;
+    for(size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i) {
+        if(*p < '0' || *p > '9') {
+            errno = EINVAL;
+            return -1;
+        }
+        p = proc_parse_number(p, fields[i]);
+        p += *p == ' ';
+    }
+
+    return 0;
+}
+
+
+//  First number of the line that starts with key, as in "Uid:" of status
+//  or "btime " of /proc/stat. Returns -1 with ENOENT if there is no line.
+static inline int proc_parse_key(const char *buf, const char *key, long long *value) {
+    size_t len = strlen(key);
+    for(const char *line = buf; *line; ) {
+        if(!strncmp(line, key, len)) {
+            const char *p = line + len;
+            while(*p == ' ' || *p == '\t')
+                ++p;
+            proc_parse_number(p, value);
+            return 0;
+        }
+
+        line = strchr(line, '\n');
+        if(!line)
+            break;
+        ++line;
+    }
+
+    errno = ENOENT;
+    return -1;
+}
+
+
+//  Command between the parentheses of a stat line, cut to size - 1
+static inline void proc_parse_comm(const char *buf, char *comm, size_t size) {
+    const char *begin = strchr(buf, '(');
+    const char *end = strrchr(buf, ')');
+    size_t len = begin && end > begin ? end - begin - 1 : 0;
+    if(len >= size)
+        len = size - 1;
+
+    if(len)
+        memcpy(comm, begin + 1, len);
+    comm[len] = '\0';
+}
+
+
+static inline int proc_open_root() {
+    int fd = open(PROC_ROOT, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd == -1)
+        err_exit("Can't open \"" PROC_ROOT "\"");
+
+    return fd;
+}
+
+#endif  //  PROCFS_H
@@ -1,79 +1,1626 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <errno.h>
-#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <regex.h>
+#include <pwd.h>
+#include <sys/resource.h>
 #include <sys/types.h>
-#include <unistd.h>
-#include <errno.h>
 #include <string.h>
 
+#include "procfs.h"
+#include "intern.h"
+#include "ps_ring.h"
 
-#define PROC "/proc/"
-#define EXE "/exe"
-#define COMM "/comm"
+
+#define EXE "exe"
+#define COMM "comm"
+#define STAT "stat"
+#define STATM "statm"
+#define STATUS "status"
+#define CGROUP "cgroup"
+#define IO "io"
+#define ROLLUP "smaps_rollup"
+#define NS "ns/"
 #define INDENT 10
+#define FRAME_MIN 4096
+#define CLEAR_SCREEN "\033[H\033[2J"
+#define CHUNK_PIDS 64                       //  PIDs a worker takes at a time
+#define MAX_THREADS 8
+#define MAX_COLUMNS 32
+#define DEFAULT_COLUMNS "pid,cmd"
+#define HISTORY 60                          //  Samples kept per watched process
+#define MEMORY_EVERY 10                     //  Rounds between smaps_rollup reads
+#define SNAPSHOT_TIMEOUT_MS 2000            //  Then chunks stuck in D state are skipped
+
+#define SOURCE_STAT 1                       //  Files a column is read from
+#define SOURCE_STATM 2
+#define SOURCE_STATUS 4
+#define SOURCE_CMD 8
+#define SOURCE_OWNER 16                     //  fstatat of /proc/PID, no file opened
+#define SOURCE_CGROUP 32
+
+
+enum column {
+    COLUMN_PID,
+    COLUMN_PPID,
+    COLUMN_STATE,
+    COLUMN_UTIME,
+    COLUMN_STIME,
+    COLUMN_NICE,
+    COLUMN_THREADS,
+    COLUMN_START,
+    COLUMN_VSZ,
+    COLUMN_RSS,
+    COLUMN_SHR,
+    COLUMN_UID,
+    COLUMN_SWAP,
+    COLUMN_CMD,
+    COLUMN_COUNT
+};
+
+
+struct column_info {
+    const char *name;                       //  For -o
+    const char *header;
+    int width;
+    int source;
+    int field;                              //  Last stat field it needs
+};
+
+
+static const struct column_info column_info[COLUMN_COUNT] = {
+    [COLUMN_PID]     = {"pid",     "PID",   INDENT, 0,             0},
+    [COLUMN_PPID]    = {"ppid",    "PPID",  INDENT, SOURCE_STAT,   PROC_STAT_PPID},
+    [COLUMN_STATE]   = {"state",   "S",     3,      SOURCE_STAT,   PROC_STAT_STATE},
+    [COLUMN_UTIME]   = {"utime",   "UTIME", INDENT, SOURCE_STAT,   PROC_STAT_UTIME},
+    [COLUMN_STIME]   = {"stime",   "STIME", INDENT, SOURCE_STAT,   PROC_STAT_STIME},
+    [COLUMN_NICE]    = {"nice",    "NI",    4,      SOURCE_STAT,   PROC_STAT_NICE},
+    [COLUMN_THREADS] = {"threads", "NLWP",  6,      SOURCE_STAT,   PROC_STAT_THREADS},
+    [COLUMN_START]   = {"start",   "START", 7,      SOURCE_STAT,   PROC_STAT_START},
+    [COLUMN_VSZ]     = {"vsz",     "VSZ",   12,     SOURCE_STAT,   PROC_STAT_VSIZE},
+    [COLUMN_RSS]     = {"rss",     "RSS",   INDENT, SOURCE_STAT,   PROC_STAT_RSS},
+    [COLUMN_SHR]     = {"shr",     "SHR",   INDENT, SOURCE_STATM,  0},
+    [COLUMN_UID]     = {"uid",     "UID",   7,      SOURCE_STATUS, 0},
+    [COLUMN_SWAP]    = {"swap",    "SWAP",  INDENT, SOURCE_STATUS, 0},
+    [COLUMN_CMD]     = {"cmd",     "CMD",   INDENT, SOURCE_CMD,    0}
+};
+
+
+//  Columns of a snapshot and what has to be read for them: only the files
+//  of the requested columns are opened, stat is parsed up to stat_last
+struct format {
+    enum column column[MAX_COLUMNS];
+    int count;
+    int sources;
+    int stat_last;
+    long ticks;
+    long page_kb;
+    time_t boot;
+    struct tm today;
+};
+
+
+//  Predicates on processes, by the files they need. The planner in
+//  filter_process checks them from the cheapest source on and reads a
+//  file only for processes that pass everything before it.
+struct filter {
+    int sources;
+    uid_t uid;                              //  SOURCE_OWNER
+    pid_t ppid;                             //  SOURCE_STAT, 0 for any
+    const char *states;
+    int has_name;
+    regex_t name;                           //  Of comm
+    const char *cgroup;                     //  SOURCE_CGROUP, part of the path
+};
+
+
+//  Fields of one process for a snapshot line, on the worker's stack.
+//  loaded has the sources read so far, filters and columns share them.
+struct process {
+    pid_t pid;
+    int loaded;
+    char comm[PROC_COMM_MAX];
+    struct proc_stat stat;
+    struct proc_statm statm;
+    long long uid;
+    long long swap;                         //  KB
+    char cmd[1024];
+    char cgroup[4096];                      //  Whole file, a line per hierarchy
+};
+
+
+//  Process seen by the refresh mode. Samples of a round are in PID order,
+//  as /proc lists them, so the previous round is searched by bisection.
+struct sample {
+    pid_t pid;
+    pid_t ppid;
+    char state;
+    unsigned long long start;               //  Tells a reused PID apart
+    unsigned long long cpu;                 //  utime + stime
+    long long rss;
+    long long rss_delta;
+    double cpu_percent;
+    char *cmd;                              //  Read once per process
+    uint32_t cmd_offset;                    //  In the export string table
+    uint32_t cmd_generation;                //  Of cmd_offset, 0 before any export
+};
+
+
+struct samples {
+    struct sample *items;
+    size_t count;
+    size_t cap;
+};
+
+
+//  One sample of a watched process; memory is in KB and is carried over
+//  between rounds that don't read smaps_rollup
+struct point {
+    double time;
+    long long rchar;
+    long long wchar;
+    long long read_bytes;
+    long long write_bytes;
+    long long pss;
+    long long swap;
+};
+
+
+//  Process of the sampler. The inode of its /proc entry tells a reused
+//  PID apart without a read. Filters are checked once, when a process is
+//  first seen; io and smaps_rollup of selected ones stay open and are
+//  read again with pread at offset 0, one syscall per file and round.
+struct watch {
+    pid_t pid;
+    unsigned long long start;               //  Tells a reused PID apart
+    int selected;
+    int io_fd;                              //  -1 when not open
+    int rollup_fd;
+    int no_rollup;                          //  Not permitted
+    char comm[PROC_COMM_MAX];
+    struct point *ring;                     //  history samples, oldest at head
+    uint32_t head;
+    uint32_t count;
+};
+
 
+struct watches {
+    struct watch *items;
+    size_t count;
+    size_t cap;
+};
 
-ssize_t read_exe(const char *pid, char *cmd, ssize_t len)
+
+//  Totals of one cgroup or namespace
+struct group_total {
+    uint32_t processes;
+    long long cpu;                          //  Ticks
+    long long rss;                          //  Pages
+};
+
+
+//  Cgroups or namespaces of the grouping mode. Names are interned, so the
+//  totals are a plain array indexed by name id and a process costs one
+//  hash lookup per table, no allocation.
+struct groups {
+    struct intern names;
+    struct group_total *total;
+    uint32_t cap;
+};
+
+
+//  Text of one redraw, written with a single write
+struct frame {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+
+//  Binary output of refresh rounds, see ps_ring.h. A sample keeps the
+//  offset of its command from round to round, so only new processes
+//  are looked up in the string table.
+struct export {
+    int stream;                             //  Messages to stdout, not a ring file
+    struct ps_ring ring;
+    struct intern strings;
+    uint32_t generation;
+    size_t published;                       //  String bytes written so far
+    uint64_t sequence;
+    struct ps_record *records;
+    size_t cap;
+    struct frame out;
+};
+
+
+//  Output of one chunk of PIDs
+struct chunk {
+    int done;
+    size_t finished;                        //  PIDs whose lines are in out, under lock
+    int cut;                                //  Timed out, out is no longer appended to
+    struct frame out;
+};
+
+
+//  PIDs of one listing, processed in chunks by a worker pool. Chunks are
+//  emitted in order, so output keeps PID order whatever finishes first.
+struct pass {
+    int proc_fd;
+    pid_t *pids;
+    size_t count;
+    size_t cap;
+
+    struct chunk *chunk;
+    size_t chunks;
+    size_t chunk_cap;
+    size_t next;                            //  Next chunk for workers, taken atomically
+    pthread_mutex_t lock;
+    pthread_cond_t progress;
+
+    void (*work)(struct pass *pass, struct proc_reader *reader, size_t index, struct frame *out);
+    const struct format *format;            //  Snapshots
+    const struct filter *filter;
+    int stat_last;                          //  Last stat field for columns and filters
+
+    struct samples *prev;                   //  Refresh rounds
+    struct samples *cur;
+    double elapsed;
+    long ticks;
+
+    struct watches *watch_prev;             //  Sampler rounds
+    struct watches *watch_cur;
+    uint32_t history;
+    int memory;                             //  smaps_rollup is read this round
+    double now;
+
+    struct groups *cgroups;                 //  Grouping, under lock
+    struct groups *namespaces;
+    const char *ns_file;
+};
+
+
+ssize_t read_exe(struct proc_reader *reader, char *cmd, size_t len)
 {
-    char exe_path[1024];
-    sprintf(exe_path, "%s%s%s", PROC, pid, EXE);
+    return proc_readlink(reader, EXE, cmd, len);
+}
+
+//  Kernel threads have no exe, comm is their name with a newline
+ssize_t read_comm(struct proc_reader *reader, char *cmd, size_t len)
+{
+    ssize_t cmd_len = proc_read(reader, COMM, cmd, len);
+    if(cmd_len > 0 && cmd[cmd_len - 1] == '\n')
+        cmd[--cmd_len] = '\0';
 
-    return readlink(exe_path, cmd, len);
+    return cmd_len;
 }
 
-ssize_t read_comm(const char *pid, char *cmd)
+ssize_t read_cmd(struct proc_reader *reader, char *cmd, size_t len)
 {
-    char comm_path[1024];
-    sprintf(comm_path, "%s%s%s", PROC, pid, COMM);
+    ssize_t cmd_len = read_exe(reader, cmd, len);
+    if(cmd_len == -1)
+        cmd_len = read_comm(reader, cmd, len);
 
-    FILE *comm = fopen(comm_path, "r");
-    if(!comm) {
-        return -1;
+    return cmd_len;
+}
+
+int exited(void)
+{
+    return errno == ENOENT || errno == ESRCH;
+}
+
+void frame_printf(struct frame *frame, const char *format, ...)
+{
+    while(1) {
+        va_list args;
+        va_start(args, format);
+        int len = vsnprintf(frame->data + frame->len, frame->cap - frame->len, format, args);
+        va_end(args);
+
+        if(frame->len + len < frame->cap) {
+            frame->len += len;
+            return;
+        }
+
+        frame->cap = frame->cap ? frame->cap * 2 : FRAME_MIN;
+        frame->data = (char *)realloc(frame->data, frame->cap);
+        if(!frame->data)
+            err_exit("Can't allocate memory for output");
+    }
+}
+
+void frame_append(struct frame *frame, const void *data, size_t len)
+{
+    if(frame->len + len > frame->cap) {
+        while(frame->len + len > frame->cap)
+            frame->cap = frame->cap ? frame->cap * 2 : FRAME_MIN;
+        frame->data = (char *)realloc(frame->data, frame->cap);
+        if(!frame->data)
+            err_exit("Can't allocate memory for output");
+    }
+
+    memcpy(frame->data + frame->len, data, len);
+    frame->len += len;
+}
+
+void frame_write(struct frame *frame)
+{
+    size_t done = 0;
+    while(done < frame->len) {
+        ssize_t ret = write(STDOUT_FILENO, frame->data + done, frame->len - done);
+        if(ret == -1 && errno == EINTR)
+            continue;
+        if(ret == -1)
+            err_exit("Can't write output");
+        done += ret;
+    }
+
+    frame->len = 0;
+}
+
+void samples_reserve(struct samples *samples, size_t count)
+{
+    if(count <= samples->cap)
+        return;
+
+    samples->cap = count;
+    samples->items = (struct sample *)realloc(samples->items, samples->cap * sizeof(struct sample));
+    if(!samples->items)
+        err_exit("Can't allocate memory for samples");
+}
+
+double seconds_since(struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void pass_init(struct pass *pass, int proc_fd)
+{
+    memset(pass, 0, sizeof(struct pass));
+    pass->proc_fd = proc_fd;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pass->progress, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&pass->lock, NULL);
+}
+
+void pass_free(struct pass *pass)
+{
+    for(size_t i = 0; i < pass->chunk_cap; ++i)
+        free(pass->chunk[i].out.data);
+    free(pass->chunk);
+    free(pass->pids);
+    pthread_cond_destroy(&pass->progress);
+    pthread_mutex_destroy(&pass->lock);
+}
+
+//  Only the listing is serial: one getdents64 per few thousand PIDs
+void pass_list(struct pass *pass)
+{
+    struct proc_dir proc_dir = {.fd = -1};
+    if(proc_dir_open(&proc_dir, pass->proc_fd, ".") == -1)
+        err_exit("Can't open \"/proc\"");
+
+    struct proc_dirent *entry;
+    pass->count = 0;
+    while((entry = proc_dir_next(&proc_dir))) {
+        pid_t pid = proc_parse_pid(entry->name);
+        if(!pid)
+            continue;
+
+        if(pass->count == pass->cap) {
+            pass->cap = pass->cap ? pass->cap * 2 : 4096;
+            pass->pids = (pid_t *)realloc(pass->pids, pass->cap * sizeof(pid_t));
+            if(!pass->pids)
+                err_exit("Can't allocate memory for PIDs");
+        }
+        pass->pids[pass->count++] = pid;
+    }
+
+    if(errno)
+        err_exit("Can't read \"/proc\"");
+    proc_dir_free(&proc_dir);
+
+    pass->chunks = (pass->count + CHUNK_PIDS - 1) / CHUNK_PIDS;
+    if(pass->chunks > pass->chunk_cap) {
+        pass->chunk = (struct chunk *)realloc(pass->chunk, pass->chunks * sizeof(struct chunk));
+        if(!pass->chunk)
+            err_exit("Can't allocate memory for chunks");
+        memset(pass->chunk + pass->chunk_cap, 0, (pass->chunks - pass->chunk_cap) * sizeof(struct chunk));
+        pass->chunk_cap = pass->chunks;
+    }
+
+    for(size_t i = 0; i < pass->chunks; ++i) {
+        pass->chunk[i].done = 0;
+        pass->chunk[i].finished = 0;
+        pass->chunk[i].cut = 0;
+    }
+    pass->next = 0;
+}
+
+//  Lines are made in a buffer of the worker and moved to the chunk under
+//  lock, so a chunk cut at the timeout is written up to its last whole line
+void pass_chunk(struct pass *pass, struct proc_reader *reader, size_t chunk)
+{
+    struct chunk *part = &pass->chunk[chunk];
+    struct frame line = {0};
+    size_t end = (chunk + 1) * CHUNK_PIDS < pass->count ? (chunk + 1) * CHUNK_PIDS : pass->count;
+    for(size_t i = chunk * CHUNK_PIDS; i < end; ++i) {
+        pass->work(pass, reader, i, &line);
+
+        //  Passes without output don't take the lock per PID
+        if(!line.len) {
+            __atomic_store_n(&part->finished, part->finished + 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        pthread_mutex_lock(&pass->lock);
+        if(!part->cut)
+            frame_append(&part->out, line.data, line.len);
+        part->finished++;
+        pthread_mutex_unlock(&pass->lock);
+        line.len = 0;
     }
-    fscanf(comm, "%s", cmd);
-    fclose(comm);
+    free(line.data);
 
-    return strlen(cmd);
+    pthread_mutex_lock(&pass->lock);
+    part->done = 1;
+    pthread_cond_broadcast(&pass->progress);
+    pthread_mutex_unlock(&pass->lock);
 }
 
-int main(void)
+void *pass_worker(void *arg)
 {
-    DIR *proc_dir = opendir(PROC);
-    if(!proc_dir) {
-        perror("Can't open \"/proc\"");
-        exit(-1);
+    struct pass *pass = (struct pass *)arg;
+    struct proc_reader reader;
+    proc_reader_init(&reader, pass->proc_fd);
+
+    while(1) {
+        size_t chunk = __atomic_fetch_add(&pass->next, 1, __ATOMIC_RELAXED);
+        if(chunk >= pass->chunks)
+            break;
+        pass_chunk(pass, &reader, chunk);
     }
 
-    int width1 = INDENT, width2 = INDENT;
-    printf("%-*s%-*s\n", width1, "PID", width2, "CMD");
+    return NULL;
+}
+
+//  Runs work for every listed PID and writes chunk outputs in order. With
+//  a timeout, chunks not done by then are written up to the PIDs finished
+//  and the rest is skipped: a process stuck in D state holds up its worker
+//  only, never the snapshot. Returns the number of skipped PIDs; their
+//  workers are left running, the pass can't be used again.
+size_t pass_run(struct pass *pass, int threads, long timeout_ms, int output)
+{
+    if(threads <= 1 && !timeout_ms) {
+        struct proc_reader reader;
+        proc_reader_init(&reader, pass->proc_fd);
+        for(size_t i = 0; i < pass->chunks; ++i) {
+            pass_chunk(pass, &reader, i);
+            if(output)
+                frame_write(&pass->chunk[i].out);
+        }
+        return 0;
+    }
 
-    while(1)
-    {
-        struct dirent *curr_dir = readdir(proc_dir);
-        if(!curr_dir)
+    pthread_t workers[MAX_THREADS];
+    int started = 0;
+    for(; started < threads; ++started)
+        if(pthread_create(&workers[started], NULL, pass_worker, pass))
             break;
+    if(!started)
+        err_exit("Can't start workers");
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += timeout_ms % 1000 * 1000000;
+    if(deadline.tv_nsec >= 1000000000) {
+        ++deadline.tv_sec;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    size_t skipped = 0;
+    pthread_mutex_lock(&pass->lock);
+    for(size_t i = 0; i < pass->chunks; ++i) {
+        while(!pass->chunk[i].done) {
+            if(!timeout_ms)
+                pthread_cond_wait(&pass->progress, &pass->lock);
+            else if(pthread_cond_timedwait(&pass->progress, &pass->lock, &deadline) == ETIMEDOUT)
+                break;
+        }
+
+        if(!pass->chunk[i].done) {
+            size_t end = (i + 1) * CHUNK_PIDS < pass->count ? (i + 1) * CHUNK_PIDS : pass->count;
+            pass->chunk[i].cut = 1;
+            skipped += end - i * CHUNK_PIDS - __atomic_load_n(&pass->chunk[i].finished, __ATOMIC_RELAXED);
+        }
+
+        pthread_mutex_unlock(&pass->lock);
+        if(output)
+            frame_write(&pass->chunk[i].out);
+        pthread_mutex_lock(&pass->lock);
+    }
+    pthread_mutex_unlock(&pass->lock);
+
+    for(int i = 0; i < started; ++i) {
+        if(skipped)
+            pthread_detach(workers[i]);
+        else
+            pthread_join(workers[i], NULL);
+    }
+
+    return skipped;
+}
+
+//  Returns 1 if the process has exited and is to be left out
+int read_failed(pid_t pid)
+{
+    if(exited())
+        return 1;
+
+    fprintf(stderr, "%d: %s\n", pid, strerror(errno));
+    exit(-1);
+}
+
+//  Reads and parses one source unless it is loaded already. Returns -1
+//  if the process has exited or its file is damaged.
+int process_load(struct proc_reader *reader, struct process *process, int source, int stat_last)
+{
+    char buf[4096];
+
+    if(process->loaded & source)
+        return 0;
+
+    if(source == SOURCE_STAT) {
+        if(proc_read(reader, STAT, buf, sizeof(buf)) == -1 && read_failed(process->pid))
+            return -1;
+        if(proc_parse_stat(buf, &process->stat, stat_last) == -1)
+            return -1;
+        proc_parse_comm(buf, process->comm, sizeof(process->comm));
+    } else if(source == SOURCE_STATM) {
+        if(proc_read(reader, STATM, buf, sizeof(buf)) == -1 && read_failed(process->pid))
+            return -1;
+        if(proc_parse_statm(buf, &process->statm) == -1)
+            return -1;
+    } else if(source == SOURCE_STATUS) {
+        if(proc_read(reader, STATUS, buf, sizeof(buf)) == -1 && read_failed(process->pid))
+            return -1;
+        if(proc_parse_key(buf, "Uid:", &process->uid) == -1)
+            return -1;
+        if(proc_parse_key(buf, "VmSwap:", &process->swap) == -1)
+            process->swap = 0;              //  Kernel threads have no memory
+    } else if(source == SOURCE_CMD) {
+        if(read_cmd(reader, process->cmd, sizeof(process->cmd)) == -1 && read_failed(process->pid))
+            return -1;
+    } else if(source == SOURCE_CGROUP) {
+        if(proc_read(reader, CGROUP, process->cgroup, sizeof(process->cgroup)) == -1 && read_failed(process->pid))
+            return -1;
+    }
+
+    process->loaded |= source;
+    return 0;
+}
+
+//  Returns 1 if the process passes the filter. Sources go from the
+//  cheapest: the owner costs an fstatat, stat a read that columns reuse,
+//  cgroup a read of its own.
+int filter_process(const struct filter *filter, struct proc_reader *reader, struct process *process, int stat_last)
+{
+    if(!filter->sources)
+        return 1;
+
+    if(filter->sources & SOURCE_OWNER) {
+        uid_t uid;
+        if(proc_owner(reader, &uid) == -1 && read_failed(process->pid))
+            return 0;
+        if(uid != filter->uid)
+            return 0;
+    }
+
+    if(filter->sources & SOURCE_STAT) {
+        if(process_load(reader, process, SOURCE_STAT, stat_last) == -1)
+            return 0;
+        if(filter->ppid && process->stat.ppid != filter->ppid)
+            return 0;
+        if(filter->states && !strchr(filter->states, process->stat.state))
+            return 0;
+        if(filter->has_name && regexec(&filter->name, process->comm, 0, NULL, 0))
+            return 0;
+    }
+
+    if(filter->sources & SOURCE_CGROUP) {
+        if(process_load(reader, process, SOURCE_CGROUP, stat_last) == -1)
+            return 0;
+        if(!strstr(process->cgroup, filter->cgroup))
+            return 0;
+    }
+
+    return 1;
+}
+
+struct sample *find_sample(struct samples *samples, pid_t pid)
+{
+    size_t low = 0, high = samples->count;
+    while(low < high) {
+        size_t mid = (low + high) / 2;
+        if(samples->items[mid].pid < pid)
+            low = mid + 1;
+        else
+            high = mid;
+    }
 
-        int curr_PID = atoi(curr_dir->d_name);
-        if(!curr_PID)
+    return low < samples->count && samples->items[low].pid == pid ? &samples->items[low] : NULL;
+}
+
+//  Stat of every process, exe and comm only of new ones. A matched
+//  sample of the previous round gives its command away; each PID is in
+//  one chunk, so workers never touch the same sample. Commands of D state
+//  processes come from stat, as exe could block on their memory map.
+void refresh_work(struct pass *pass, struct proc_reader *reader, size_t index, struct frame *out)
+{
+    (void)out;
+    struct process process;
+    struct sample *sample = &pass->cur->items[index];
+    pid_t pid = pass->pids[index];
+
+    sample->pid = 0;
+    process.pid = pid;
+    process.loaded = 0;
+    proc_reader_pid(reader, pid);
+    if(!filter_process(pass->filter, reader, &process, pass->stat_last) ||
+       process_load(reader, &process, SOURCE_STAT, pass->stat_last) == -1)
+        return;
+
+    sample->ppid = process.stat.ppid;
+    sample->state = process.stat.state;
+    sample->start = process.stat.start;
+    sample->cpu = process.stat.utime + process.stat.stime;
+    sample->rss = process.stat.rss;
+    sample->rss_delta = 0;
+    sample->cpu_percent = 0;
+
+    struct sample *last = find_sample(pass->prev, pid);
+    if(last && last->start == sample->start) {
+        sample->cmd = last->cmd;
+        sample->cmd_offset = last->cmd_offset;
+        sample->cmd_generation = last->cmd_generation;
+        last->cmd = NULL;
+        sample->rss_delta = sample->rss - last->rss;
+        if(pass->elapsed > 0)
+            sample->cpu_percent = (sample->cpu - last->cpu) * 100.0 / pass->ticks / pass->elapsed;
+    } else {
+        if(process.stat.state == 'D')
+            strcpy(process.cmd, process.comm);
+        else if(read_cmd(reader, process.cmd, sizeof(process.cmd)) == -1)
+            process.cmd[0] = '\0';
+        sample->cmd = strdup(process.cmd);
+        if(!sample->cmd)
+            err_exit("Can't allocate memory for command");
+        sample->cmd_generation = 0;
+    }
+
+    sample->pid = pid;
+}
+
+//  One round: samples are filled in listing order, then exited processes
+//  are dropped and commands nobody took are freed
+void sample_round(struct pass *pass, int threads, struct samples *prev, struct samples *cur)
+{
+    pass_list(pass);
+
+    samples_reserve(cur, pass->count);
+    pass->prev = prev;
+    pass->cur = cur;
+    pass->work = refresh_work;
+    pass_run(pass, threads, 0, 0);
+
+    cur->count = 0;
+    for(size_t i = 0; i < pass->count; ++i)
+        if(cur->items[i].pid)
+            cur->items[cur->count++] = cur->items[i];
+
+    for(size_t i = 0; i < prev->count; ++i)
+        free(prev->items[i].cmd);
+    prev->count = 0;
+}
+
+void draw_round(struct frame *frame, struct samples *cur, double sample_ms, long page_kb, int tty)
+{
+    double total = 0;
+    for(size_t i = 0; i < cur->count; ++i)
+        total += cur->items[i].cpu_percent;
+
+    if(tty)
+        frame_printf(frame, CLEAR_SCREEN);
+    frame_printf(frame, "%zu processes, %.1f%% CPU, sampled in %.2f ms\n",
+                 cur->count, total, sample_ms);
+    frame_printf(frame, "%-*s%7s%12s%10s  %s\n", INDENT, "PID", "CPU%", "RSS", "dRSS", "CMD");
+
+    for(size_t i = 0; i < cur->count; ++i) {
+        struct sample *sample = &cur->items[i];
+        frame_printf(frame, "%-*d%7.1f%12lld%+10lld  %s\n", INDENT, sample->pid, sample->cpu_percent,
+                     sample->rss * page_kb, sample->rss_delta * page_kb, sample->cmd);
+    }
+
+    if(!tty)
+        frame_printf(frame, "\n");
+}
+
+void export_open(struct export *export, const char *path)
+{
+    memset(export, 0, sizeof(struct export));
+    export->generation = 1;
+    export->stream = !strcmp(path, "-");
+    if(!export->stream && ps_ring_create(&export->ring, path, PS_RING_SIZE, PS_STRINGS_SIZE) == -1)
+        err_exit("Can't create ring file");
+}
+
+void export_close(struct export *export)
+{
+    if(!export->stream)
+        ps_ring_close(&export->ring);
+    intern_free(&export->strings);
+    free(export->records);
+    free(export->out.data);
+}
+
+void export_commands(struct export *export, struct samples *cur)
+{
+    for(size_t i = 0; i < cur->count; ++i) {
+        struct sample *sample = &cur->items[i];
+        if(sample->cmd_generation == export->generation)
             continue;
 
+        uint32_t id = intern_add(&export->strings, sample->cmd, strlen(sample->cmd));
+        sample->cmd_offset = export->strings.offset[id];
+        sample->cmd_generation = export->generation;
+    }
+}
 
-        char cmd[1024];
-        ssize_t cmd_len = read_exe(curr_dir->d_name, cmd, sizeof(cmd)-1);
-        if(cmd_len == -1) {
-            cmd_len = read_comm(curr_dir->d_name, cmd);
-            if(cmd_len == -1) {
-                perror(curr_dir->d_name);
-                exit(-1);
-            }
+//  Commands new since the last round go out first, then the frame. A
+//  full string table is mostly commands of exited processes: it is
+//  started over as a new generation with the commands of this round.
+void export_round(struct export *export, struct samples *cur, long page_kb)
+{
+    export_commands(export, cur);
+    if(export->strings.len > PS_STRINGS_SIZE) {
+        intern_free(&export->strings);
+        ++export->generation;
+        export->published = 0;
+        export_commands(export, cur);
+        if(export->strings.len > PS_STRINGS_SIZE) {
+            errno = ENOSPC;
+            err_exit("Can't export commands");
         }
+    }
+
+    const char *fresh = export->strings.data + export->published;
+    size_t fresh_len = export->strings.len - export->published;
+    if(export->stream && fresh_len) {
+        struct ps_message message = {PS_MESSAGE_STRINGS, 0, sizeof(uint64_t) + fresh_len};
+        uint64_t offset = export->published;
+        frame_append(&export->out, &message, sizeof(message));
+        frame_append(&export->out, &offset, sizeof(offset));
+        frame_append(&export->out, fresh, fresh_len);
+    } else if(!export->stream &&
+              ps_ring_strings(&export->ring, fresh, export->published, fresh_len, export->generation) == -1)
+        err_exit("Can't export commands");
+    export->published = export->strings.len;
+
+    if(cur->count > export->cap) {
+        export->cap = cur->count;
+        export->records = (struct ps_record *)realloc(export->records, export->cap * sizeof(struct ps_record));
+        if(!export->records)
+            err_exit("Can't allocate memory for records");
+    }
+
+    for(size_t i = 0; i < cur->count; ++i) {
+        struct sample *sample = &cur->items[i];
+        struct ps_record *record = &export->records[i];
+        memset(record, 0, sizeof(struct ps_record));
+        record->pid = sample->pid;
+        record->ppid = sample->ppid;
+        record->cmd = sample->cmd_offset;
+        record->cpu = sample->cpu_percent * 100 + 0.5;
+        record->cpu_ticks = sample->cpu;
+        record->rss = sample->rss * page_kb;
+        record->state = sample->state;
+    }
 
-        cmd[cmd_len] = '\0';
-        printf("%-*d%-*s\n", width1, curr_PID, width2, cmd);
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    struct ps_frame frame = {
+        .magic = PS_FRAME_MAGIC,
+        .count = cur->count,
+        .length = ps_frame_length(cur->count),
+        .sequence = export->sequence++,
+        .time = now.tv_sec * 1000000000LL + now.tv_nsec,
+        .generation = export->generation
+    };
+
+    if(!export->stream) {
+        if(ps_ring_append(&export->ring, &frame, export->records) == -1)
+            err_exit("Can't export snapshot");
+        return;
     }
 
+    struct ps_message message = {PS_MESSAGE_SNAPSHOT, 0, frame.length};
+    frame_append(&export->out, &message, sizeof(message));
+    frame_append(&export->out, &frame, sizeof(frame));
+    frame_append(&export->out, export->records, cur->count * sizeof(struct ps_record));
+    frame_write(&export->out);
+}
+
+//  Sleeps what is left of delay seconds since start
+void pause_round(struct timespec *start, double delay)
+{
+    double left = delay - seconds_since(start);
+    if(left <= 0)
+        return;
+
+    struct timespec pause = {.tv_sec = (time_t)left, .tv_nsec = (left - (time_t)left) * 1e9};
+    while(nanosleep(&pause, &pause) == -1 && errno == EINTR)
+        ;
+}
+
+//  Redraws or, with an export path, exports every delay seconds, rounds
+//  times or until killed when 0
+void refresh(int proc_fd, int threads, const struct filter *filter, double delay, long rounds,
+             const char *export_path)
+{
+    struct export export;
+    struct pass pass;
+    struct samples samples[2] = {{0}};
+    struct frame frame = {0};
+    long ticks = sysconf(_SC_CLK_TCK);
+    long page_kb = sysconf(_SC_PAGESIZE) / 1024;
+    int tty = isatty(STDOUT_FILENO);
+
+    pass_init(&pass, proc_fd);
+    pass.ticks = ticks;
+    pass.filter = filter;
+    pass.stat_last = PROC_STAT_RSS;
+    if(export_path)
+        export_open(&export, export_path);
+
+    struct timespec last = {0};
+    for(long round = 0; !rounds || round < rounds; ++round) {
+        struct samples *prev = &samples[(round + 1) % 2];
+        struct samples *cur = &samples[round % 2];
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        pass.elapsed = round ? seconds_since(&last) : 0;
+        last = start;
+
+        sample_round(&pass, threads, prev, cur);
+
+        if(export_path)
+            export_round(&export, cur, page_kb);
+        else {
+            draw_round(&frame, cur, seconds_since(&start) * 1000, page_kb, tty);
+            frame_write(&frame);
+        }
+
+        if(rounds && round + 1 == rounds)
+            break;
+
+        pause_round(&start, delay);
+    }
+
+    if(export_path)
+        export_close(&export);
+    pass_free(&pass);
+    free(frame.data);
+    for(int i = 0; i < 2; ++i) {
+        for(size_t j = 0; j < samples[i].count; ++j)
+            free(samples[i].items[j].cmd);
+        free(samples[i].items);
+    }
+}
+
+void watch_release(struct watch *watch)
+{
+    if(watch->io_fd != -1)
+        close(watch->io_fd);
+    if(watch->rollup_fd != -1)
+        close(watch->rollup_fd);
+    free(watch->ring);
+    watch->io_fd = watch->rollup_fd = -1;
+    watch->ring = NULL;
+}
+
+//  Reads a kept open file again from the start. When descriptors run out
+//  the file is opened for this read only.
+ssize_t read_kept(struct proc_reader *reader, int *fd, const char *file, char *buf, size_t size)
+{
+    if(*fd == -1) {
+        *fd = openat(reader->proc_fd, proc_reader_path(reader, file), O_RDONLY | O_CLOEXEC);
+        if(*fd == -1)
+            return errno == EMFILE || errno == ENFILE ? proc_read(reader, file, buf, size) : -1;
+    }
+
+    ssize_t len = pread(*fd, buf, size - 1, 0);
+    if(len == -1)
+        return -1;
+
+    buf[len] = '\0';
+    return len;
+}
+
+//  Appends a sample, dropping the oldest one when the ring is full.
+//  Returns 0 if the process has exited.
+int watch_sample(struct pass *pass, struct proc_reader *reader, struct watch *watch)
+{
+    char buf[4096];
+    struct point point = {.time = pass->now};
+
+    if(read_kept(reader, &watch->io_fd, IO, buf, sizeof(buf)) == -1) {
+        if(errno != EACCES)
+            return 0;
+        //  Not permitted: kept, with zero I/O points
+    } else {
+        proc_parse_key(buf, "rchar:", &point.rchar);
+        proc_parse_key(buf, "wchar:", &point.wchar);
+        proc_parse_key(buf, "read_bytes:", &point.read_bytes);
+        proc_parse_key(buf, "write_bytes:", &point.write_bytes);
+    }
+
+    if(watch->count) {
+        struct point *last = &watch->ring[(watch->head + watch->count - 1) % pass->history];
+        point.pss = last->pss;
+        point.swap = last->swap;
+    }
+
+    if((pass->memory || !watch->count) && !watch->no_rollup) {
+        if(read_kept(reader, &watch->rollup_fd, ROLLUP, buf, sizeof(buf)) == -1) {
+            if(errno != EACCES)
+                return 0;
+            watch->no_rollup = 1;
+        } else {
+            proc_parse_key(buf, "Pss:", &point.pss);
+            proc_parse_key(buf, "Swap:", &point.swap);
+        }
+    }
+
+    if(watch->count == pass->history) {
+        watch->head = (watch->head + 1) % pass->history;
+        --watch->count;
+    }
+    watch->ring[(watch->head + watch->count++) % pass->history] = point;
+    return 1;
+}
+
+struct watch *find_watch(struct watches *watches, pid_t pid)
+{
+    size_t low = 0, high = watches->count;
+    while(low < high) {
+        size_t mid = (low + high) / 2;
+        if(watches->items[mid].pid < pid)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low < watches->count && watches->items[low].pid == pid ? &watches->items[low] : NULL;
+}
+
+//  A known process, the same PID with the same start time, takes over
+//  its watch from the previous round; a new one is filtered once and, if
+//  selected, gets its files and ring
+void sampler_work(struct pass *pass, struct proc_reader *reader, size_t index, struct frame *out)
+{
+    (void)out;
+    struct watch *watch = &pass->watch_cur->items[index];
+    pid_t pid = pass->pids[index];
+    struct watch *last = find_watch(pass->watch_prev, pid);
+    struct process process = {.pid = pid};
+
+    proc_reader_pid(reader, pid);
+    if(process_load(reader, &process, SOURCE_STAT, PROC_STAT_START) == -1)
+        return;
+
+    if(last && last->start == (unsigned long long)process.stat.start) {
+        *watch = *last;
+        last->io_fd = last->rollup_fd = -1;
+        last->ring = NULL;
+    } else {
+        memset(watch, 0, sizeof(struct watch));
+        watch->start = process.stat.start;
+        watch->io_fd = watch->rollup_fd = -1;
+        watch->selected = filter_process(pass->filter, reader, &process, PROC_STAT_START);
+
+        if(watch->selected) {
+            strcpy(watch->comm, process.comm);
+            watch->ring = (struct point *)malloc(pass->history * sizeof(struct point));
+            if(!watch->ring)
+                err_exit("Can't allocate memory for history");
+        }
+    }
+
+    watch->pid = pid;
+    if(watch->selected && !watch_sample(pass, reader, watch)) {
+        watch_release(watch);
+        watch->pid = 0;
+    }
+}
+
+void sampler_round(struct pass *pass, int threads, struct watches *prev, struct watches *cur)
+{
+    pass_list(pass);
+
+    if(cur->cap < pass->count) {
+        cur->cap = pass->count;
+        cur->items = (struct watch *)realloc(cur->items, cur->cap * sizeof(struct watch));
+        if(!cur->items)
+            err_exit("Can't allocate memory for watches");
+    }
+    for(size_t i = 0; i < pass->count; ++i)
+        cur->items[i].pid = 0;
+
+    pass->watch_prev = prev;
+    pass->watch_cur = cur;
+    pass->work = sampler_work;
+    pass_run(pass, threads, 0, 0);
+
+    cur->count = 0;
+    for(size_t i = 0; i < pass->count; ++i)
+        if(cur->items[i].pid)
+            cur->items[cur->count++] = cur->items[i];
+
+    for(size_t i = 0; i < prev->count; ++i)
+        watch_release(&prev->items[i]);
+    prev->count = 0;
+}
+
+//  Sample back steps before the newest
+struct point *watch_point(struct watch *watch, uint32_t history, uint32_t back)
+{
+    return &watch->ring[(watch->head + watch->count - 1 - back) % history];
+}
+
+double per_second(long long delta, double seconds)
+{
+    return seconds > 0 ? delta / seconds : 0;
+}
+
+void draw_sampler(struct frame *frame, struct watches *cur, uint32_t history, double sample_ms, int tty)
+{
+    size_t selected = 0;
+    for(size_t i = 0; i < cur->count; ++i)
+        selected += cur->items[i].selected;
+
+    if(tty)
+        frame_printf(frame, CLEAR_SCREEN);
+    frame_printf(frame, "%zu of %zu processes, sampled in %.2f ms\n", selected, cur->count, sample_ms);
+    frame_printf(frame, "%-*s%12s%12s%12s%12s%12s%10s%12s%10s  %s\n", INDENT, "PID", "RCHAR/s", "WCHAR/s",
+                 "READ/s", "WRITE/s", "PSS", "PSS/s", "SWAP", "SWAP/s", "COMM");
+
+    for(size_t i = 0; i < cur->count; ++i) {
+        struct watch *watch = &cur->items[i];
+        if(!watch->selected || !watch->count)
+            continue;
+
+        //  I/O over the last interval, memory trends over the history
+        struct point *last = watch_point(watch, history, 0);
+        struct point *before = watch_point(watch, history, watch->count > 1);
+        struct point *first = watch_point(watch, history, watch->count - 1);
+        double interval = last->time - before->time;
+        double span = last->time - first->time;
+        frame_printf(frame, "%-*d%12.0f%12.0f%12.0f%12.0f%12lld%+10.1f%12lld%+10.1f  %s\n", INDENT, watch->pid,
+                     per_second(last->rchar - before->rchar, interval),
+                     per_second(last->wchar - before->wchar, interval),
+                     per_second(last->read_bytes - before->read_bytes, interval),
+                     per_second(last->write_bytes - before->write_bytes, interval),
+                     last->pss, per_second(last->pss - first->pss, span),
+                     last->swap, per_second(last->swap - first->swap, span), watch->comm);
+    }
+
+    if(!tty)
+        frame_printf(frame, "\n");
+}
+
+//  Every delay seconds samples I/O of the selected processes, and memory
+//  every memory_every rounds; rounds times or until killed when 0
+void sampler(int proc_fd, int threads, const struct filter *filter, double delay, long rounds,
+             uint32_t history, int memory_every)
+{
+    struct pass pass;
+    struct watches watches[2] = {{0}};
+    struct frame frame = {0};
+    int tty = isatty(STDOUT_FILENO);
+
+    //  Two descriptors per watched process
+    struct rlimit limit;
+    if(!getrlimit(RLIMIT_NOFILE, &limit) && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    pass_init(&pass, proc_fd);
+    pass.filter = filter;
+    pass.history = history;
+
+    for(long round = 0; !rounds || round < rounds; ++round) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        pass.now = start.tv_sec + start.tv_nsec / 1e9;
+        pass.memory = round % memory_every == 0;
+
+        struct watches *cur = &watches[round % 2];
+        sampler_round(&pass, threads, &watches[(round + 1) % 2], cur);
+
+        draw_sampler(&frame, cur, history, seconds_since(&start) * 1000, tty);
+        frame_write(&frame);
+
+        if(rounds && round + 1 == rounds)
+            break;
+        pause_round(&start, delay);
+    }
+
+    pass_free(&pass);
+    free(frame.data);
+    for(int i = 0; i < 2; ++i) {
+        for(size_t j = 0; j < watches[i].count; ++j)
+            watch_release(&watches[i].items[j]);
+        free(watches[i].items);
+    }
+}
+
+//  Path in the unified hierarchy, or in the first one listed on cgroup v1
+//  hosts. Returns its length.
+size_t cgroup_path(const char *buf, const char **path)
+{
+    *path = NULL;
+    for(const char *line = buf; *line; line += strcspn(line, "\n"), line += *line == '\n') {
+        const char *colon = strchr(line, ':');
+        if(!colon || !(colon = strchr(colon + 1, ':')))
+            break;
+        if(!*path || !strncmp(line, "0::", 3))
+            *path = colon + 1;
+    }
+
+    if(!*path)
+        *path = "?";
+    return strcspn(*path, "\n");
+}
+
+//  Ids of new names come right after the known ones
+void group_add(struct groups *groups, const char *name, size_t len, const struct proc_stat *stat)
+{
+    uint32_t known = groups->names.count;
+    uint32_t id = intern_add(&groups->names, name, len);
+    if(id == known) {
+        if(id == groups->cap) {
+            groups->cap = groups->cap ? groups->cap * 2 : 256;
+            groups->total = (struct group_total *)realloc(groups->total, groups->cap * sizeof(struct group_total));
+            if(!groups->total)
+                err_exit("Can't allocate memory for groups");
+        }
+        memset(&groups->total[id], 0, sizeof(struct group_total));
+    }
+
+    struct group_total *total = &groups->total[id];
+    ++total->processes;
+    total->cpu += stat->utime + stat->stime;
+    total->rss += stat->rss;
+}
+
+//  Files are read in parallel into the worker's stack, only the two
+//  lookups and sums are under the lock. Namespaces of processes that
+//  can't be traced are unreadable and go to one group.
+void group_work(struct pass *pass, struct proc_reader *reader, size_t index, struct frame *out)
+{
+    (void)out;
+    struct process process;
+    char ns[64];
+    const char *path;
+
+    process.pid = pass->pids[index];
+    process.loaded = 0;
+    proc_reader_pid(reader, process.pid);
+    if(!filter_process(pass->filter, reader, &process, pass->stat_last) ||
+       process_load(reader, &process, SOURCE_STAT, pass->stat_last) == -1 ||
+       process_load(reader, &process, SOURCE_CGROUP, pass->stat_last) == -1)
+        return;
+
+    ssize_t ns_len = proc_readlink(reader, pass->ns_file, ns, sizeof(ns));
+    if(ns_len == -1) {
+        if(exited())
+            return;
+        ns_len = strlen(strcpy(ns, "?"));
+    }
+    size_t path_len = cgroup_path(process.cgroup, &path);
+
+    pthread_mutex_lock(&pass->lock);
+    group_add(pass->cgroups, path, path_len, &process.stat);
+    group_add(pass->namespaces, ns, ns_len, &process.stat);
+    pthread_mutex_unlock(&pass->lock);
+}
+
+struct groups *sort_groups;
+
+int compare_groups(const void *a, const void *b)
+{
+    const struct group_total *first = &sort_groups->total[*(const uint32_t *)a];
+    const struct group_total *second = &sort_groups->total[*(const uint32_t *)b];
+    if(first->rss != second->rss)
+        return first->rss < second->rss ? 1 : -1;
+    return *(const uint32_t *)a < *(const uint32_t *)b ? -1 : 1;
+}
+
+//  Groups by RSS, largest first
+void draw_groups(struct frame *frame, struct groups *groups, const char *title, long ticks, long page_kb)
+{
+    uint32_t *order = (uint32_t *)malloc((groups->names.count + 1) * sizeof(uint32_t));
+    if(!order)
+        err_exit("Can't allocate memory for groups");
+    for(uint32_t i = 0; i < groups->names.count; ++i)
+        order[i] = i;
+    sort_groups = groups;
+    qsort(order, groups->names.count, sizeof(uint32_t), compare_groups);
+
+    frame_printf(frame, "%*s%12s%12s  %s\n", INDENT, "PROCS", "CPU", "RSS", title);
+    for(uint32_t i = 0; i < groups->names.count; ++i) {
+        struct group_total *total = &groups->total[order[i]];
+        frame_printf(frame, "%*u%12.2f%12lld  %s\n", INDENT, total->processes, (double)total->cpu / ticks,
+                     total->rss * page_kb, intern_get(&groups->names, order[i]));
+    }
+
+    free(order);
+}
+
+void groups_free(struct groups *groups)
+{
+    intern_free(&groups->names);
+    free(groups->total);
+}
+
+//  Process counts, CPU seconds and RSS in KB per cgroup and per namespace
+//  of the given type, in one pass over the processes picked by filters
+int group(int proc_fd, int threads, const struct filter *filter, const char *namespace)
+{
+    struct pass pass;
+    struct groups cgroups = {0}, namespaces = {0};
+    struct frame frame = {0};
+    char ns_file[32];
+    char self[48];
+    char title[48];
+    struct stat st;
+
+    snprintf(ns_file, sizeof(ns_file), NS "%s", namespace);
+    snprintf(self, sizeof(self), "self/%s", ns_file);
+    if(fstatat(proc_fd, self, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+        fprintf(stderr, "Unknown namespace %s\n", namespace);
+        return 1;
+    }
+
+    pass_init(&pass, proc_fd);
+    pass_list(&pass);
+    pass.work = group_work;
+    pass.filter = filter;
+    pass.stat_last = PROC_STAT_RSS;
+    pass.cgroups = &cgroups;
+    pass.namespaces = &namespaces;
+    pass.ns_file = ns_file;
+    pass_run(&pass, threads, 0, 0);
+
+    uint32_t processes = 0;
+    for(uint32_t i = 0; i < cgroups.names.count; ++i)
+        processes += cgroups.total[i].processes;
+
+    long ticks = sysconf(_SC_CLK_TCK);
+    long page_kb = sysconf(_SC_PAGESIZE) / 1024;
+    snprintf(title, sizeof(title), "%s NAMESPACE", namespace);
+    frame_printf(&frame, "%u processes in %u cgroups and %u %s namespaces\n\n", processes,
+                 cgroups.names.count, namespaces.names.count, namespace);
+    draw_groups(&frame, &cgroups, "CGROUP", ticks, page_kb);
+    frame_printf(&frame, "\n");
+    draw_groups(&frame, &namespaces, title, ticks, page_kb);
+    frame_write(&frame);
+
+    free(frame.data);
+    groups_free(&cgroups);
+    groups_free(&namespaces);
+    pass_free(&pass);
+    return 0;
+}
+
+//  Columns are comma separated names of column_info
+int format_init(struct format *format, const char *spec)
+{
+    memset(format, 0, sizeof(struct format));
+    format->stat_last = PROC_STAT_STATE;
+
+    while(*spec) {
+        size_t len = strcspn(spec, ",");
+        int column = 0;
+        while(column < COLUMN_COUNT &&
+              (strlen(column_info[column].name) != len || strncmp(column_info[column].name, spec, len)))
+            ++column;
+        if(column == COLUMN_COUNT || format->count == MAX_COLUMNS)
+            return -1;
+
+        format->column[format->count++] = column;
+        format->sources |= column_info[column].source;
+        if(column_info[column].field > format->stat_last)
+            format->stat_last = column_info[column].field;
+
+        spec += len;
+        spec += *spec == ',';
+    }
+
+    if(!format->count)
+        return -1;
+
+    //  Stat is read before cmd, exe of a D state process could block on its memory map
+    if(format->sources & SOURCE_CMD)
+        format->sources |= SOURCE_STAT;
+
+    struct timespec real, boot;
+    clock_gettime(CLOCK_REALTIME, &real);
+    clock_gettime(CLOCK_BOOTTIME, &boot);
+    format->boot = real.tv_sec - boot.tv_sec;
+    format->ticks = sysconf(_SC_CLK_TCK);
+    format->page_kb = sysconf(_SC_PAGESIZE) / 1024;
+    localtime_r(&real.tv_sec, &format->today);
+    return 0;
+}
+
+void format_header(struct frame *out, const struct format *format)
+{
+    for(int i = 0; i < format->count; ++i) {
+        const struct column_info *info = &column_info[format->column[i]];
+        frame_printf(out, "%-*s", info->width, info->header);
+    }
+    frame_printf(out, "\n");
+}
+
+//  Time of day for processes started today, as ps does, date otherwise
+void format_start(char *buf, size_t size, const struct format *format, long long start)
+{
+    time_t started = format->boot + start / format->ticks;
+    struct tm tm;
+    localtime_r(&started, &tm);
+
+    if(tm.tm_year == format->today.tm_year && tm.tm_yday == format->today.tm_yday)
+        strftime(buf, size, "%H:%M", &tm);
+    else
+        strftime(buf, size, "%b%d", &tm);
+}
+
+void format_process(struct frame *out, const struct format *format, struct process *process)
+{
+    char start[16];
+
+    for(int i = 0; i < format->count; ++i) {
+        enum column column = format->column[i];
+        int width = column_info[column].width;
+        switch(column) {
+            case COLUMN_PID:
+                frame_printf(out, "%-*d", width, process->pid);
+                break;
+            case COLUMN_PPID:
+                frame_printf(out, "%-*lld", width, process->stat.ppid);
+                break;
+            case COLUMN_STATE:
+                frame_printf(out, "%-*c", width, process->stat.state);
+                break;
+            case COLUMN_UTIME:
+                frame_printf(out, "%-*.2f", width, (double)process->stat.utime / format->ticks);
+                break;
+            case COLUMN_STIME:
+                frame_printf(out, "%-*.2f", width, (double)process->stat.stime / format->ticks);
+                break;
+            case COLUMN_NICE:
+                frame_printf(out, "%-*lld", width, process->stat.nice);
+                break;
+            case COLUMN_THREADS:
+                frame_printf(out, "%-*lld", width, process->stat.threads);
+                break;
+            case COLUMN_START:
+                format_start(start, sizeof(start), format, process->stat.start);
+                frame_printf(out, "%-*s", width, start);
+                break;
+            case COLUMN_VSZ:
+                frame_printf(out, "%-*lld", width, process->stat.vsize / 1024);
+                break;
+            case COLUMN_RSS:
+                frame_printf(out, "%-*lld", width, process->stat.rss * format->page_kb);
+                break;
+            case COLUMN_SHR:
+                frame_printf(out, "%-*lld", width, process->statm.shared * format->page_kb);
+                break;
+            case COLUMN_UID:
+                frame_printf(out, "%-*lld", width, process->uid);
+                break;
+            case COLUMN_SWAP:
+                frame_printf(out, "%-*lld", width, process->swap);
+                break;
+            case COLUMN_CMD:
+                frame_printf(out, "%-*s", width, process->cmd);
+                break;
+            default:
+                break;
+        }
+    }
+    frame_printf(out, "\n");
+}
+
+//  Filters first, then the files of the requested columns that filters
+//  haven't read, each with one read into the stack. Exited processes are
+//  left out.
+void snapshot_work(struct pass *pass, struct proc_reader *reader, size_t index, struct frame *out)
+{
+    const struct format *format = pass->format;
+    struct process process;
+
+    process.pid = pass->pids[index];
+    process.loaded = 0;
+    proc_reader_pid(reader, process.pid);
+    if(!filter_process(pass->filter, reader, &process, pass->stat_last))
+        return;
+
+    for(int source = SOURCE_STAT; source <= SOURCE_CMD; source <<= 1) {
+        if(!(format->sources & source))
+            continue;
+
+        //  Stat is always read first, see format_init()
+        if(source == SOURCE_CMD && (process.loaded & SOURCE_STAT) && process.stat.state == 'D') {
+            strcpy(process.cmd, process.comm);
+            process.loaded |= SOURCE_CMD;
+            continue;
+        }
+
+        if(process_load(reader, &process, source, pass->stat_last) == -1)
+            return;
+    }
+
+    format_process(out, format, &process);
+}
+
+//  Name or number
+int parse_user(const char *user, uid_t *uid)
+{
+    char *end;
+    long number = strtol(user, &end, 10);
+    if(*user && !*end && number >= 0) {
+        *uid = number;
+        return 0;
+    }
+
+    struct passwd *pw = getpwnam(user);
+    if(!pw)
+        return -1;
+
+    *uid = pw->pw_uid;
     return 0;
 }
 
+int usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-j THREADS] [-o COLUMNS] [-t MS | -d SECONDS [-n ROUNDS]]\n"
+                    "          [-u USER] [-P PPID] [-s STATES] [-C REGEX] [-g CGROUP]\n"
+                    "       %s -S SECONDS [-n ROUNDS] [-H SAMPLES] [-m ROUNDS] [filters]\n"
+                    "       %s -b FILE|- [-d SECONDS [-n ROUNDS]] [-j THREADS] [filters]\n"
+                    "       %s -G NAMESPACE [-j THREADS] [filters]\n"
+                    "Columns: pid,ppid,state,utime,stime,nice,threads,start,vsz,rss,shr,uid,swap,cmd\n", name, name, name, name);
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    double delay = 0;
+    long rounds = 0;
+    const char *columns = DEFAULT_COLUMNS;
+    struct filter filter = {0};
+    double interval = 0;
+    long history = HISTORY;
+    long memory_every = MEMORY_EVERY;
+    long timeout_ms = SNAPSHOT_TIMEOUT_MS;
+    const char *export_path = NULL;
+    const char *namespace = NULL;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cpus < MAX_THREADS ? cpus : MAX_THREADS;
+
+    int opt;
+    while((opt = getopt(argc, argv, "d:n:j:t:o:u:P:s:C:g:S:H:m:b:G:")) != -1) {
+        if(opt == 'd')
+            delay = atof(optarg);
+        else if(opt == 'n')
+            rounds = atol(optarg);
+        else if(opt == 'j')
+            threads = atoi(optarg);
+        else if(opt == 't' && (timeout_ms = atol(optarg)) >= 0)
+            ;
+        else if(opt == 'o')
+            columns = optarg;
+        else if(opt == 'u' && parse_user(optarg, &filter.uid) == 0)
+            filter.sources |= SOURCE_OWNER;
+        else if(opt == 'P' && (filter.ppid = atoi(optarg)) > 0)
+            filter.sources |= SOURCE_STAT;
+        else if(opt == 's') {
+            filter.states = optarg;
+            filter.sources |= SOURCE_STAT;
+        } else if(opt == 'C' && !regcomp(&filter.name, optarg, REG_EXTENDED | REG_NOSUB)) {
+            filter.has_name = 1;
+            filter.sources |= SOURCE_STAT;
+        } else if(opt == 'S')
+            interval = atof(optarg);
+        else if(opt == 'H' && (history = atol(optarg)) > 1)
+            ;
+        else if(opt == 'm' && (memory_every = atol(optarg)) > 0)
+            ;
+        else if(opt == 'g') {
+            filter.cgroup = optarg;
+            filter.sources |= SOURCE_CGROUP;
+        } else if(opt == 'b')
+            export_path = optarg;
+        else if(opt == 'G')
+            namespace = optarg;
+        else
+            return usage(argv[0]);
+    }
+
+    struct format format;
+    if(optind < argc || format_init(&format, columns) == -1)
+        return usage(argv[0]);
+
+    if(threads < 1)
+        threads = 1;
+    if(threads > MAX_THREADS)
+        threads = MAX_THREADS;
+
+    int proc_fd = proc_open_root();
+    if(namespace) {
+        int ret = group(proc_fd, threads, &filter, namespace);
+        close(proc_fd);
+        return ret;
+    }
+
+    if(interval > 0) {
+        sampler(proc_fd, threads, &filter, interval, rounds, history, memory_every);
+        close(proc_fd);
+        return 0;
+    }
+
+    //  Without a delay one frame is exported, with no CPU percentages
+    if(delay > 0 || export_path) {
+        refresh(proc_fd, threads, &filter, delay, delay > 0 ? rounds : 1, export_path);
+        close(proc_fd);
+        return 0;
+    }
+
+    struct pass pass;
+    struct frame header = {0};
+    pass_init(&pass, proc_fd);
+    pass_list(&pass);
+    pass.work = snapshot_work;
+    pass.format = &format;
+    pass.filter = &filter;
+    pass.stat_last = format.stat_last > PROC_STAT_PPID ? format.stat_last : PROC_STAT_PPID;
+
+    format_header(&header, &format);
+    frame_write(&header);
+    free(header.data);
+
+    size_t skipped = pass_run(&pass, threads, timeout_ms, 1);
+    if(skipped) {
+        fprintf(stderr, "%zu processes skipped after %ld ms\n", skipped, timeout_ms);
+        exit(2);                            //  Stuck workers still use the pass
+    }
+
+    pass_free(&pass);
+    close(proc_fd);
+    return 0;
+}
@@ -0,0 +1,295 @@
+#ifndef PS_RING_H
+#define PS_RING_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+
+//  Binary snapshots of ps for monitoring agents, in host byte order.
+//  Commands are interned: a record holds the offset of its command in a
+//  string table that only grows, so each command is sent once however
+//  many snapshots name it. When the table is reset its generation grows.
+//
+//  Ring file: header, string region, then a ring of frames. The writer
+//  publishes strings_len and head with release stores after the bytes;
+//  readers copy a frame and check that writing hasn't gone past it, and
+//  copy a command and check that its generation is still the current one.
+//  Stream: messages of struct ps_message and length bytes of payload.
+#define PS_RING_MAGIC       0x474e5250      //  "PRNG"
+#define PS_RING_VERSION     1
+#define PS_FRAME_MAGIC      0x4d415246      //  "FRAM"
+#define PS_FRAME_PAD        0x44415046      //  "FPAD", rest of the ring is unused
+#define PS_RING_HEADER_SIZE 4096
+#define PS_RING_SIZE        (64 * 1024 * 1024)
+#define PS_STRINGS_SIZE     (16 * 1024 * 1024)
+
+
+struct ps_ring_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t strings_offset;
+    uint64_t strings_cap;
+    uint64_t ring_offset;
+    uint64_t ring_cap;
+
+    uint64_t strings_len;                   //  Published string bytes
+    uint32_t generation;                    //  Of the string table
+    uint32_t reserved;
+    uint64_t head;                          //  Bytes ever written to the ring
+    uint64_t writing;                       //  End of the bytes being written
+    uint64_t last;                          //  Start of the newest frame, in head units
+    uint64_t sequence;                      //  Frames written
+};
+
+
+//  Snapshot: frame and count records; both are multiples of 8 bytes
+struct ps_frame {
+    uint32_t magic;
+    uint32_t count;
+    uint64_t length;
+    uint64_t sequence;
+    int64_t time;                           //  CLOCK_REALTIME, ns
+    uint32_t generation;                    //  Of the strings the records use
+    uint32_t reserved;
+};
+
+
+struct ps_record {
+    int32_t pid;
+    int32_t ppid;
+    uint32_t cmd;                           //  Offset in the string table
+    uint32_t cpu;                           //  Hundredths of a percent of one CPU
+    uint64_t cpu_ticks;                     //  utime + stime
+    uint64_t rss;                           //  KB
+    uint8_t state;
+    uint8_t reserved[7];
+};
+
+
+enum ps_message_type {
+    PS_MESSAGE_STRINGS = 1,                 //  uint64_t offset, then bytes; offset 0 resets
+    PS_MESSAGE_SNAPSHOT                     //  struct ps_frame and records
+};
+
+
+struct ps_message {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t length;
+};
+
+
+struct ps_ring {
+    int fd;
+    unsigned char *map;
+    size_t size;
+    struct ps_ring_header *header;
+};
+
+
+static inline uint64_t ps_frame_length(uint32_t count) {
+    return sizeof(struct ps_frame) + (uint64_t)count * sizeof(struct ps_record);
+}
+
+
+static inline int ps_ring_create(struct ps_ring *ring, const char *path, uint64_t ring_cap, uint64_t strings_cap) {
+    ring->size = PS_RING_HEADER_SIZE + strings_cap + ring_cap;
+    ring->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(ring->fd == -1)
+        return -1;
+
+    if(ftruncate(ring->fd, ring->size) == -1) {
+        close(ring->fd);
+        return -1;
+    }
+
+    ring->map = (unsigned char *)mmap(NULL, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0);
+    if(ring->map == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+
+    ring->header = (struct ps_ring_header *)ring->map;
+    ring->header->version = PS_RING_VERSION;
+    ring->header->strings_offset = PS_RING_HEADER_SIZE;
+    ring->header->strings_cap = strings_cap;
+    ring->header->ring_offset = PS_RING_HEADER_SIZE + strings_cap;
+    ring->header->ring_cap = ring_cap;
+    ring->header->generation = 1;
+    __atomic_store_n(&ring->header->magic, PS_RING_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+
+//  Maps a ring file read only, for readers. Returns -1 with EINVAL if it
+//  is not a ring file or its regions are not inside it.
+static inline int ps_ring_attach(struct ps_ring *ring, const char *path) {
+    struct stat st;
+    ring->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(ring->fd == -1)
+        return -1;
+
+    if(fstat(ring->fd, &st) == -1 || st.st_size < PS_RING_HEADER_SIZE) {
+        close(ring->fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    ring->size = st.st_size;
+    ring->map = (unsigned char *)mmap(NULL, ring->size, PROT_READ, MAP_SHARED, ring->fd, 0);
+    if(ring->map == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+
+    ring->header = (struct ps_ring_header *)ring->map;
+    struct ps_ring_header *header = ring->header;
+    if(__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != PS_RING_MAGIC || header->version != PS_RING_VERSION ||
+       header->strings_offset < PS_RING_HEADER_SIZE || header->strings_offset > ring->size ||
+       header->strings_cap > ring->size - header->strings_offset ||
+       header->ring_offset < PS_RING_HEADER_SIZE || header->ring_offset > ring->size ||
+       !header->ring_cap || header->ring_cap > ring->size - header->ring_offset) {
+        munmap(ring->map, ring->size);
+        close(ring->fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static inline void ps_ring_close(struct ps_ring *ring) {
+    munmap(ring->map, ring->size);
+    close(ring->fd);
+}
+
+
+//  Publishes string table bytes from offset on; a new generation starts
+//  the region over. Returns -1 with ENOSPC if they don't fit.
+static inline int ps_ring_strings(struct ps_ring *ring, const char *data, uint64_t offset, uint64_t len,
+                                  uint32_t generation) {
+    struct ps_ring_header *header = ring->header;
+    if(offset + len > header->strings_cap) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    //  The new generation is seen before any byte that overwrites the old one
+    if(generation != header->generation) {
+        __atomic_store_n(&header->strings_len, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&header->generation, generation, __ATOMIC_RELEASE);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+
+    memcpy(ring->map + header->strings_offset + offset, data, len);
+    __atomic_store_n(&header->strings_len, offset + len, __ATOMIC_RELEASE);
+    return 0;
+}
+
+
+//  Appends a frame of count records, wrapping to the start of the ring
+//  when it doesn't fit before the end. Returns -1 with EMSGSIZE if the
+//  frame is larger than the ring.
+static inline int ps_ring_append(struct ps_ring *ring, struct ps_frame *frame, const struct ps_record *records) {
+    struct ps_ring_header *header = ring->header;
+    frame->length = ps_frame_length(frame->count);
+    frame->magic = PS_FRAME_MAGIC;
+    if(frame->length > header->ring_cap) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    uint64_t head = header->head;
+    uint64_t pos = head % header->ring_cap;
+    uint64_t skip = pos + frame->length > header->ring_cap ? header->ring_cap - pos : 0;
+
+    //  Readers see writing move before any byte of the ring changes
+    __atomic_store_n(&header->writing, head + skip + frame->length, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    unsigned char *base = ring->map + header->ring_offset;
+    if(skip) {
+        if(skip >= sizeof(uint32_t))
+            *(uint32_t *)(base + pos) = PS_FRAME_PAD;
+        head += skip;
+        pos = 0;
+    }
+
+    frame->sequence = header->sequence;
+    memcpy(base + pos, frame, sizeof(struct ps_frame));
+    memcpy(base + pos + sizeof(struct ps_frame), records, frame->length - sizeof(struct ps_frame));
+
+    __atomic_store_n(&header->last, head, __ATOMIC_RELEASE);
+    __atomic_store_n(&header->head, head + frame->length, __ATOMIC_RELEASE);
+    __atomic_store_n(&header->sequence, header->sequence + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+
+//  Copies the newest frame to buf. Returns its length, 0 if there is none
+//  yet, -1 with EAGAIN if the writer overwrote it meanwhile or ENOBUFS
+//  if it is larger than size.
+static inline ssize_t ps_ring_latest(struct ps_ring *ring, void *buf, size_t size) {
+    struct ps_ring_header *header = ring->header;
+    if(!__atomic_load_n(&header->sequence, __ATOMIC_ACQUIRE))
+        return 0;
+
+    uint64_t last = __atomic_load_n(&header->last, __ATOMIC_ACQUIRE);
+    const unsigned char *frame = ring->map + header->ring_offset + last % header->ring_cap;
+    uint64_t length = ((const struct ps_frame *)frame)->length;
+    if(length > header->ring_cap - last % header->ring_cap) {
+        errno = EAGAIN;
+        return -1;
+    }
+    if(length > size) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    memcpy(buf, frame, length);
+
+    //  The copy is done before writing is read again
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if(__atomic_load_n(&header->writing, __ATOMIC_RELAXED) - last > header->ring_cap) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    return length;
+}
+
+
+//  Copies the command of a record in a ring file to buf, cut to size.
+//  Returns -1 with ESTALE if the string table has moved on to another
+//  generation before the copy was done, as the bytes may be torn then.
+static inline int ps_ring_string(struct ps_ring *ring, uint32_t generation, uint32_t offset, char *buf, size_t size) {
+    struct ps_ring_header *header = ring->header;
+    uint64_t len = __atomic_load_n(&header->strings_len, __ATOMIC_ACQUIRE);
+    if(__atomic_load_n(&header->generation, __ATOMIC_ACQUIRE) != generation || offset >= len || !size) {
+        errno = ESTALE;
+        return -1;
+    }
+
+    size_t copy = len - offset < size - 1 ? len - offset : size - 1;
+    memcpy(buf, ring->map + header->strings_offset + offset, copy);
+    buf[copy] = '\0';
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if(__atomic_load_n(&header->generation, __ATOMIC_RELAXED) != generation) {
+        errno = ESTALE;
+        return -1;
+    }
+
+    return 0;
+}
+
+#endif  //  PS_RING_H
@@ -0,0 +1,117 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include "ps_ring.h"
+
+
+#define READ_TRIES  100                     //  Frames or commands overwritten meanwhile
+#define RETRY_US    1000
+#define CMD_MAX     1024
+#define INDENT      10
+
+
+int read_snapshot(struct ps_ring *ring, struct ps_frame *frame, size_t size, char **text, size_t *text_len);
+int print_records(struct ps_ring *ring, struct ps_frame *frame, FILE *out);
+
+
+//  Prints the newest snapshot of a ring file written by ps -b FILE, the
+//  way a monitoring agent reads it: nothing is printed until the frame
+//  and all its commands are copied and still valid.
+int main(int argc, char *argv[])
+{
+    if(argc != 2) {
+        fprintf(stderr, "Usage: %s FILE\n", argv[0]);
+        return 1;
+    }
+
+    struct ps_ring ring;
+    if(ps_ring_attach(&ring, argv[1]) == -1) {
+        perror("Can't attach to ring file");
+        return 1;
+    }
+
+    size_t size = ring.header->ring_cap;
+    struct ps_frame *frame = (struct ps_frame *)malloc(size);
+    if(!frame) {
+        perror("Can't allocate memory for frame");
+        return 1;
+    }
+
+    char *text = NULL;
+    size_t text_len = 0;
+    int found = read_snapshot(&ring, frame, size, &text, &text_len);
+    if(found == -1)
+        perror("Can't read snapshot");
+    else if(!found)
+        fprintf(stderr, "No snapshot yet\n");
+    else
+        fwrite(text, 1, text_len, stdout);
+
+    free(text);
+    free(frame);
+    ps_ring_close(&ring);
+    return found != 1;
+}
+
+
+//  Returns 1 and the snapshot printed into *text, 0 if there is none yet.
+//  A frame or a command overwritten while it was copied is read again.
+int read_snapshot(struct ps_ring *ring, struct ps_frame *frame, size_t size, char **text, size_t *text_len)
+{
+    for(int tries = 0; tries < READ_TRIES; ++tries) {
+        ssize_t length = ps_ring_latest(ring, frame, size);
+        if(length == 0)
+            return 0;
+        if(length == -1 && errno != EAGAIN)
+            return -1;
+
+        if(length > 0) {
+            free(*text);
+            FILE *out = open_memstream(text, text_len);
+            if(!out)
+                return -1;
+
+            int done = print_records(ring, frame, out);
+            int error = errno;
+            if(fclose(out) == EOF)
+                return -1;
+            if(done == 0)
+                return 1;
+            if(error != ESTALE) {
+                errno = error;
+                return -1;
+            }
+        }
+
+        //  The writer is between the new string table and the frame that uses it
+        usleep(RETRY_US);
+    }
+
+    errno = EAGAIN;
+    return -1;
+}
+
+
+int print_records(struct ps_ring *ring, struct ps_frame *frame, FILE *out)
+{
+    const struct ps_record *records = (const struct ps_record *)(frame + 1);
+    char cmd[CMD_MAX];
+
+    fprintf(out, "Snapshot %" PRIu64 ", %u processes\n", frame->sequence, frame->count);
+    fprintf(out, "%-*s%-*s%-3s%8s%12s  %s\n", INDENT, "PID", INDENT, "PPID", "S", "CPU%", "RSS", "CMD");
+    for(uint32_t i = 0; i < frame->count; ++i) {
+        if(ps_ring_string(ring, frame->generation, records[i].cmd, cmd, sizeof(cmd)) == -1)
+            return -1;
+
+        fprintf(out, "%-*d%-*d%-3c%8.2f%12" PRIu64 "  %s\n", INDENT, records[i].pid, INDENT, records[i].ppid,
+                records[i].state, records[i].cpu / 100.0, records[i].rss, cmd);
+    }
+
+    return 0;
+}
@@ -0,0 +1,640 @@
+#ifndef VFS_H
+#define VFS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "image.h"
+#include "fat.h"
+#include "ext2.h"
+
+
+#define VFS_NAME_MAX        FAT_NAME_MAX    //  Longest of FAT and ext2 names
+#define VFS_DIR_MODE        0755            //  FAT has no permissions
+#define VFS_FILE_MODE       0644
+#define VFS_WRITE_BITS      0222
+
+#define FAT_ROOT_NODE       1               //  Boot sector holds no entries
+
+#ifndef err_exit
+#define err_exit(msg)    do {                    \
+                             perror(msg);        \
+                             exit(EXIT_FAILURE); \
+                         } while (0)
+#endif
+
+
+//  Node is a number unique in the image: inode number for ext2, offset of
+//  the directory entry in 32 byte units for FAT
+typedef unsigned long vfs_node;
+
+
+struct vfs_stat {
+    vfs_node node;
+    mode_t mode;                            //  S_IFMT type and permissions
+    off_t size;
+    nlink_t nlink;
+    time_t atime;
+    time_t mtime;
+    time_t ctime;
+};
+
+
+//  Run of the file stored contiguously in the image, image_offset is 0
+//  for holes
+struct vfs_extent {
+    off_t offset;
+    off_t image_offset;
+    off_t length;
+};
+
+
+struct vfs_dirent {
+    vfs_node node;
+    mode_t type;                            //  S_IFMT bits, 0 if unknown
+    char name[VFS_NAME_MAX];
+};
+
+
+//  Driver callbacks get fs returned by mount, which returns NULL with errno
+//  if the image passed probe but can't be read. Directory readers skip "."
+//  and "..", lookup compares names as the filesystem does. lookup_path
+//  may be NULL, then paths are resolved by components.
+struct vfs_driver {
+    const char *name;
+    int fold_case;                          //  Names compare ignoring ASCII case
+    int (*probe)(struct image *img);
+    void *(*mount)(struct image *img);
+    void (*unmount)(void *fs);
+    vfs_node root;
+
+    int (*stat)(void *fs, vfs_node node, struct vfs_stat *st);
+    int (*lookup)(void *fs, vfs_node dir, const char *name, size_t len, vfs_node *node);
+    int (*lookup_path)(void *fs, const char *path, vfs_node *node);
+    void *(*opendir)(void *fs, vfs_node node);
+    int (*readdir)(void *dir, struct vfs_dirent *entry);
+    void (*closedir)(void *dir);
+    ssize_t (*pread)(void *fs, vfs_node node, void *buf, size_t len, off_t offset);
+    int (*map)(void *fs, vfs_node node, off_t offset, struct vfs_extent *extent);
+};
+
+
+struct vfs {
+    struct image *img;
+    const struct vfs_driver *driver;
+    void *fs;
+};
+
+
+struct vfs_dir {
+    const struct vfs_driver *driver;
+    void *dir;
+};
+
+
+//  FAT driver. Short entries are read again on every call, they are in
+//  cached clusters or in the mapping anyway.
+
+struct fat_vfs_dir {
+    struct fs_info *info;
+    struct dir_iter *iter;
+    struct lfn_buf lfn;
+};
+
+
+static inline void *fat_vfs_mount(struct image *img) {
+    return get_fs_info(img);
+}
+
+
+static inline void fat_vfs_unmount(void *fs) {
+    free_fs_info((struct fs_info *)fs);
+}
+
+
+static inline int fat_vfs_get_dentry(struct fs_info *info, vfs_node node, struct msdos_dir_entry *dentry) {
+    off_t offset = (off_t)node * sizeof(struct msdos_dir_entry);
+    if(node <= FAT_ROOT_NODE || offset < info->root_offset ||
+       offset >= get_cluster_offset(info, info->cluster_count + FAT_START_ENT)) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    if(image_pread(info->img, dentry, sizeof(struct msdos_dir_entry), offset) != sizeof(struct msdos_dir_entry)) {
+        errno = EIO;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static inline int fat_vfs_stat(void *fs, vfs_node node, struct vfs_stat *st) {
+    memset(st, 0, sizeof(struct vfs_stat));
+    st->node = node;
+    st->nlink = 1;
+    if(node == FAT_ROOT_NODE) {
+        st->mode = S_IFDIR | VFS_DIR_MODE;
+        return 0;
+    }
+
+    struct msdos_dir_entry dentry;
+    if(fat_vfs_get_dentry((struct fs_info *)fs, node, &dentry) == -1)
+        return -1;
+
+    st->mode = dentry.attr & ATTR_DIR ? S_IFDIR | VFS_DIR_MODE : S_IFREG | VFS_FILE_MODE;
+    if(dentry.attr & ATTR_RO)
+        st->mode &= ~VFS_WRITE_BITS;
+
+    st->size = dentry.attr & ATTR_DIR ? 0 : __le32_to_cpu(dentry.size);
+    st->mtime = get_fat_time(__le16_to_cpu(dentry.date), __le16_to_cpu(dentry.time));
+    st->atime = get_fat_time(__le16_to_cpu(dentry.adate), 0);
+    st->ctime = get_fat_time(__le16_to_cpu(dentry.cdate), __le16_to_cpu(dentry.ctime));
+    return 0;
+}
+
+
+static inline void *fat_vfs_opendir(void *fs, vfs_node node) {
+    struct fs_info *info = (struct fs_info *)fs;
+    struct dir_iter *iter;
+    if(node == FAT_ROOT_NODE) {
+        iter = open_root_dir(info);
+    } else {
+        struct msdos_dir_entry dentry;
+        if(fat_vfs_get_dentry(info, node, &dentry) == -1)
+            return NULL;
+
+        if(!(dentry.attr & ATTR_DIR) || (dentry.attr & ATTR_VOLUME)) {
+            errno = ENOTDIR;
+            return NULL;
+        }
+        iter = open_dir(&dentry, info);
+    }
+
+    struct fat_vfs_dir *dir = (struct fat_vfs_dir *)malloc(sizeof(struct fat_vfs_dir));
+    if(!dir)
+        err_exit("Can't allocate memory for dir iterator");
+
+    dir->info = info;
+    dir->iter = iter;
+    lfn_reset(&dir->lfn);
+    return dir;
+}
+
+
+//  Returns the next short entry with its name and node, skipping deleted
+//  entries, LFN slots, dot entries and volume labels
+static inline struct msdos_dir_entry *fat_vfs_next(struct fat_vfs_dir *dir, char *name, vfs_node *node) {
+    struct msdos_dir_entry *dentry;
+    while((dentry = get_next_dentry(dir->iter)) && dentry->name[0] != 0x00) {
+        if(dentry->name[0] == DELETED_FLAG) {
+            lfn_reset(&dir->lfn);
+            continue;
+        }
+
+        if(dentry->attr == ATTR_EXT) {
+            lfn_add_slot(&dir->lfn, (struct msdos_dir_slot *)dentry);
+            continue;
+        }
+
+        if(dentry->name[0] == '.' || (dentry->attr & ATTR_VOLUME)) {
+            lfn_reset(&dir->lfn);
+            continue;
+        }
+
+        struct dir_iter *iter = dir->iter;
+        off_t base = iter->cluster ? get_cluster_offset(dir->info, iter->cluster) : dir->info->root_offset;
+        *node = (base + iter->offset * sizeof(struct msdos_dir_entry)) / sizeof(struct msdos_dir_entry);
+        get_dentry_name(dentry, &dir->lfn, name);
+        return dentry;
+    }
+
+    return NULL;
+}
+
+
+static inline int fat_vfs_readdir(void *dir, struct vfs_dirent *entry) {
+    struct msdos_dir_entry *dentry = fat_vfs_next((struct fat_vfs_dir *)dir, entry->name, &entry->node);
+    if(!dentry)
+        return 0;
+
+    entry->type = dentry->attr & ATTR_DIR ? S_IFDIR : S_IFREG;
+    return 1;
+}
+
+
+static inline void fat_vfs_closedir(void *dir) {
+    close_dir(((struct fat_vfs_dir *)dir)->iter);
+    free(dir);
+}
+
+
+//  Both long and short names match, case is ignored
+static inline int fat_vfs_lookup(void *fs, vfs_node node, const char *name, size_t len, vfs_node *found) {
+    struct fat_vfs_dir *dir = (struct fat_vfs_dir *)fat_vfs_opendir(fs, node);
+    if(!dir)
+        return -1;
+
+    char entry_name[FAT_NAME_MAX];
+    char short_name[MSDOS_NAME + 2];
+    struct msdos_dir_entry *dentry;
+    int result = -1;
+    while((dentry = fat_vfs_next(dir, entry_name, found))) {
+        if((strlen(entry_name) == len && !strncasecmp(entry_name, name, len)) ||
+           (get_short_name(dentry, short_name) == (int)len && !strncasecmp(short_name, name, len))) {
+            result = 0;
+            break;
+        }
+    }
+
+    fat_vfs_closedir(dir);
+    if(result == -1)
+        errno = ENOENT;
+    return result;
+}
+
+
+static inline ssize_t fat_vfs_pread(void *fs, vfs_node node, void *buf, size_t len, off_t offset) {
+    struct msdos_dir_entry dentry;
+    if(node == FAT_ROOT_NODE) {
+        errno = EISDIR;
+        return -1;
+    }
+
+    if(fat_vfs_get_dentry((struct fs_info *)fs, node, &dentry) == -1)
+        return -1;
+
+    if(dentry.attr & ATTR_DIR) {
+        errno = EISDIR;
+        return -1;
+    }
+
+    struct file_iter *fiter = open_file(&dentry, (struct fs_info *)fs);
+    ssize_t read = fat_pread(fiter, buf, len, offset);
+    close_file(fiter);
+    return read;
+}
+
+
+static inline int fat_vfs_map(void *fs, vfs_node node, off_t offset, struct vfs_extent *extent) {
+    struct fs_info *info = (struct fs_info *)fs;
+    struct msdos_dir_entry dentry;
+    if(node == FAT_ROOT_NODE) {
+        errno = EISDIR;
+        return -1;
+    }
+
+    if(fat_vfs_get_dentry(info, node, &dentry) == -1)
+        return -1;
+
+    if(dentry.attr & ATTR_DIR) {
+        errno = EISDIR;
+        return -1;
+    }
+
+    off_t size = __le32_to_cpu(dentry.size);
+    if(offset >= size)
+        return 0;
+
+    unsigned long length = (size + info->cluster_size - 1) / info->cluster_size;
+    unsigned long pos = offset / info->cluster_size;
+    unsigned cluster = get_chain_cluster(info, get_dentry_start(&dentry, info), length, pos);
+    if(!cluster) {
+        errno = EIO;                        //  Chain is shorter than the file
+        return -1;
+    }
+
+    extent->offset = (off_t)pos * info->cluster_size;
+    extent->image_offset = get_cluster_offset(info, cluster);
+    extent->length = info->cluster_size;
+
+    unsigned next;
+    while(extent->offset + extent->length < size && (next = get_fat_entry(info, cluster)) == cluster + 1 &&
+          !fat_is_last(info, next)) {
+        extent->length += info->cluster_size;
+        cluster = next;
+    }
+
+    if(extent->length > size - extent->offset)
+        extent->length = size - extent->offset;
+    return 1;
+}
+
+
+//  ext2 driver, nodes are inode numbers
+
+//  Directory entry file types of the "filetype" feature
+static const mode_t ext2_vfs_types[] = {
+    0, S_IFREG, S_IFDIR, S_IFCHR, S_IFBLK, S_IFIFO, S_IFSOCK, S_IFLNK
+};
+
+
+static inline void *ext2_vfs_mount(struct image *img) {
+    return ext2_get_info(img);
+}
+
+
+static inline void ext2_vfs_unmount(void *fs) {
+    ext2_free_info((struct ext2_info *)fs);
+}
+
+
+static inline int ext2_vfs_get_inode(struct ext2_info *info, vfs_node node, struct ext2_inode *inode) {
+    if(node > info->inodes_count) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    return ext2_read_inode(info, node, inode) ? 0 : -1;
+}
+
+
+static inline int ext2_vfs_stat(void *fs, vfs_node node, struct vfs_stat *st) {
+    struct ext2_inode inode;
+    if(ext2_vfs_get_inode((struct ext2_info *)fs, node, &inode) == -1)
+        return -1;
+
+    memset(st, 0, sizeof(struct vfs_stat));
+    st->node = node;
+    st->mode = inode.i_mode;
+    st->size = ext2_inode_size(&inode);
+    st->nlink = inode.i_links_count;
+    st->atime = inode.i_atime;
+    st->mtime = inode.i_mtime;
+    st->ctime = inode.i_ctime;
+    return 0;
+}
+
+
+static inline int ext2_vfs_lookup(void *fs, vfs_node node, const char *name, size_t len, vfs_node *found) {
+    struct ext2_inode inode;
+    if(ext2_vfs_get_inode((struct ext2_info *)fs, node, &inode) == -1)
+        return -1;
+
+    if((inode.i_mode & EXT2_S_IFMT) != EXT2_S_IFDIR) {
+        errno = ENOTDIR;
+        return -1;
+    }
+
+    *found = ext2_lookup((struct ext2_info *)fs, node, name, len);
+    if(!*found) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static inline void *ext2_vfs_opendir(void *fs, vfs_node node) {
+    if(node == 0 || node > ((struct ext2_info *)fs)->inodes_count) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    return ext2_open_dir((struct ext2_info *)fs, node);
+}
+
+
+static inline int ext2_vfs_readdir(void *dir, struct vfs_dirent *entry) {
+    struct ext2_dir_entry_2 *dentry;
+    while((dentry = ext2_next_dentry((struct ext2_dir_iter *)dir))) {
+        if((dentry->name_len == 1 && dentry->name[0] == '.') ||
+           (dentry->name_len == 2 && !strncmp(dentry->name, "..", 2)))
+            continue;
+
+        entry->node = dentry->inode;
+        entry->type = dentry->file_type < sizeof(ext2_vfs_types) / sizeof(mode_t) ? ext2_vfs_types[dentry->file_type] : 0;
+        memcpy(entry->name, dentry->name, dentry->name_len);
+        entry->name[dentry->name_len] = '\0';
+        return 1;
+    }
+
+    return 0;
+}
+
+
+static inline void ext2_vfs_closedir(void *dir) {
+    ext2_close_dir((struct ext2_dir_iter *)dir);
+}
+
+
+static inline ssize_t ext2_vfs_pread(void *fs, vfs_node node, void *buf, size_t len, off_t offset) {
+    struct ext2_inode inode;
+    if(ext2_vfs_get_inode((struct ext2_info *)fs, node, &inode) == -1)
+        return -1;
+
+    if((inode.i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR) {
+        errno = EISDIR;
+        return -1;
+    }
+
+    return ext2_pread((struct ext2_info *)fs, &inode, buf, len, offset);
+}
+
+
+//  Fast symlinks keep their target in the inode, they have no extents
+static inline int ext2_vfs_map(void *fs, vfs_node node, off_t offset, struct vfs_extent *extent) {
+    struct ext2_info *info = (struct ext2_info *)fs;
+    struct ext2_inode inode;
+    if(ext2_vfs_get_inode(info, node, &inode) == -1)
+        return -1;
+
+    if((inode.i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR) {
+        errno = EISDIR;
+        return -1;
+    }
+
+    off_t size = ext2_inode_size(&inode);
+    if((inode.i_mode & EXT2_S_IFMT) == EXT2_S_IFLNK && size < (off_t)FAST_SYMLINK_MAX && !inode.i_blocks) {
+        errno = ENODATA;
+        return -1;
+    }
+
+    if(offset >= size)
+        return 0;
+
+    unsigned long idx = offset / info->block_size;
+    unsigned first = ext2_get_block(info, &inode, idx);
+    if(first >= info->blocks_count) {
+        errno = EIO;
+        return -1;
+    }
+
+    //  Holes are extended over following holes, data over following blocks
+    unsigned last = first;
+    extent->offset = (off_t)idx * info->block_size;
+    extent->image_offset = (off_t)first * info->block_size;
+    extent->length = info->block_size;
+    while(extent->offset + extent->length < size) {
+        unsigned next = ext2_get_block(info, &inode, ++idx);
+        if(first ? next != last + 1 || next >= info->blocks_count : next != 0)
+            break;
+
+        extent->length += info->block_size;
+        last = next;
+    }
+
+    if(extent->length > size - extent->offset)
+        extent->length = size - extent->offset;
+    return 1;
+}
+
+
+//  Probed in order, FAT first: ext2 images have no boot signature, while
+//  the ext2 magic offset of a FAT image may hold anything
+static const struct vfs_driver vfs_drivers[] = {
+    {
+        .name = "fat", .fold_case = 1, .probe = fat_probe, .mount = fat_vfs_mount, .unmount = fat_vfs_unmount,
+        .root = FAT_ROOT_NODE, .stat = fat_vfs_stat, .lookup = fat_vfs_lookup,
+        .opendir = fat_vfs_opendir, .readdir = fat_vfs_readdir, .closedir = fat_vfs_closedir,
+        .pread = fat_vfs_pread, .map = fat_vfs_map
+    },
+    {
+        .name = "ext2", .probe = ext2_probe, .mount = ext2_vfs_mount, .unmount = ext2_vfs_unmount,
+        .root = EXT2_ROOT_INO, .stat = ext2_vfs_stat, .lookup = ext2_vfs_lookup,
+        .opendir = ext2_vfs_opendir, .readdir = ext2_vfs_readdir, .closedir = ext2_vfs_closedir,
+        .pread = ext2_vfs_pread, .map = ext2_vfs_map
+    }
+};
+
+
+//  Mounts the first driver that recognizes the image, which then belongs
+//  to the vfs. Returns NULL with EINVAL for unknown images and with the
+//  error of the driver if it can't mount it, closing the image.
+static inline struct vfs *vfs_mount(struct image *img) {
+    for(size_t i = 0; i < sizeof(vfs_drivers) / sizeof(struct vfs_driver); ++i) {
+        if(!vfs_drivers[i].probe(img))
+            continue;
+
+        void *fs = vfs_drivers[i].mount(img);
+        if(!fs) {
+            int error = errno;
+            image_close(img);
+            errno = error;
+            return NULL;
+        }
+
+        struct vfs *vfs = (struct vfs *)malloc(sizeof(struct vfs));
+        if(!vfs)
+            err_exit("Can't allocate memory for vfs");
+
+        vfs->img = img;
+        vfs->driver = &vfs_drivers[i];
+        vfs->fs = fs;
+        image_advise(img, 0, 0, IMAGE_RANDOM);
+        return vfs;
+    }
+
+    image_close(img);
+    errno = EINVAL;
+    return NULL;
+}
+
+
+//  Opens the image with the backend of IMAGE_BACKEND
+static inline struct vfs *vfs_open(const char *path) {
+    struct image *img = image_open(path, get_image_mode());
+    if(!img)
+        return NULL;
+
+    return vfs_mount(img);
+}
+
+
+static inline void vfs_close(struct vfs *vfs) {
+    vfs->driver->unmount(vfs->fs);
+    image_close(vfs->img);
+    free(vfs);
+}
+
+
+static inline vfs_node vfs_root(struct vfs *vfs) {
+    return vfs->driver->root;
+}
+
+
+//  Path is taken from the root, empty and "." components are skipped.
+//  Returns -1 with ENOENT or ENOTDIR if there is no such path.
+static inline int vfs_lookup(struct vfs *vfs, const char *path, vfs_node *node) {
+    if(vfs->driver->lookup_path)
+        return vfs->driver->lookup_path(vfs->fs, path, node);
+
+    *node = vfs->driver->root;
+    while(*path) {
+        size_t len = strcspn(path, "/");
+        if(len && !(len == 1 && path[0] == '.') &&
+           vfs->driver->lookup(vfs->fs, *node, path, len, node) == -1)
+            return -1;
+
+        path += len;
+        path += *path == '/';
+    }
+
+    return 0;
+}
+
+
+static inline int vfs_stat(struct vfs *vfs, vfs_node node, struct vfs_stat *st) {
+    return vfs->driver->stat(vfs->fs, node, st);
+}
+
+
+//  Returns NULL with ENOTDIR if the node is not a directory
+static inline struct vfs_dir *vfs_opendir(struct vfs *vfs, vfs_node node) {
+    void *dir = vfs->driver->opendir(vfs->fs, node);
+    if(!dir)
+        return NULL;
+
+    struct vfs_dir *vdir = (struct vfs_dir *)malloc(sizeof(struct vfs_dir));
+    if(!vdir)
+        err_exit("Can't allocate memory for dir iterator");
+
+    vdir->driver = vfs->driver;
+    vdir->dir = dir;
+    return vdir;
+}
+
+
+//  Returns 1 and fills the entry, 0 at the end of the directory
+static inline int vfs_readdir(struct vfs_dir *dir, struct vfs_dirent *entry) {
+    return dir->driver->readdir(dir->dir, entry);
+}
+
+
+static inline void vfs_closedir(struct vfs_dir *dir) {
+    dir->driver->closedir(dir->dir);
+    free(dir);
+}
+
+
+//  Reads like pread: fewer bytes at the end of the file, 0 past it.
+//  Symlink data is its target, holes read as zeros.
+static inline ssize_t vfs_pread(struct vfs *vfs, vfs_node node, void *buf, size_t len, off_t offset) {
+    return vfs->driver->pread(vfs->fs, node, buf, len, offset);
+}
+
+//  Returns 1 and the extent holding offset, 0 past the end of the file.
+//  Extents past the end of a truncated image are read errors.
+static inline int vfs_map(struct vfs *vfs, vfs_node node, off_t offset, struct vfs_extent *extent) {
+    if(offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int found = vfs->driver->map(vfs->fs, node, offset, extent);
+    if(found == 1 && extent->image_offset && extent->image_offset + extent->length > vfs->img->size) {
+        errno = EIO;
+        return -1;
+    }
+
+    return found;
+}
+
+#endif  //  VFS_H